@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Tiny benchmark harness, every result is printed as one json object per line
+// so runs can be diffed or loaded by a script:
+//
+//   {"suite":"ring_buffer","case":"byte","ops":1048576,"ns_per_op":1.9,...}
+//
+// Each case is run Repeats times and the fastest run is reported, which is the
+// most repeatable number on a desktop that is doing other things. Anything
+// random is seeded with a fixed value so runs see the same inputs.
+namespace bench
+{
+
+static constexpr int Repeats = 7;
+static constexpr uint32_t Seed = 0x4C494E4B;
+
+// Keeps the compiler from optimizing away a value that is otherwise unused
+template <typename T>
+inline void DoNotOptimize(T const& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void ClobberMemory()
+{
+    asm volatile("" : : : "memory");
+}
+
+// Time stamp counter, on x86 this ticks at the nominal clock rate so it is
+// close to cycles. Returns 0 where there is no such counter.
+inline uint64_t Cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+using Metrics = std::initializer_list<std::pair<const char*, double>>;
+
+inline void Report(const char* suite, const char* name, Metrics metrics)
+{
+    std::printf("{\"suite\":\"%s\",\"case\":\"%s\"", suite, name);
+    for (const auto& [key, value] : metrics)
+    {
+        std::printf(",\"%s\":%.6g", key, value);
+    }
+    std::printf("}\n");
+    std::fflush(stdout);
+}
+
+// Runs fn, which must do ops operations moving bytes_per_op bytes each, and
+// reports the fastest of the repeats. Returns its ns per op for comparisons.
+template <typename Fn>
+double Run(const char* suite,
+         const char* name,
+         const uint64_t ops,
+         const uint64_t bytes_per_op,
+         Fn&& fn)
+{
+    double best_ns = 0;
+    uint64_t best_cycles = 0;
+    for (int i = 0; i < Repeats; ++i)
+    {
+        const uint64_t start_cycles = Cycles();
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        ClobberMemory();
+        const auto end = std::chrono::steady_clock::now();
+        const uint64_t end_cycles = Cycles();
+
+        const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (i == 0 || ns < best_ns)
+        {
+            best_ns = ns;
+            best_cycles = end_cycles - start_cycles;
+        }
+    }
+
+    const double total_bytes = static_cast<double>(bytes_per_op) * ops;
+    const double ns_per_op = best_ns / ops;
+    Report(suite, name,
+           {
+               {"ops", static_cast<double>(ops)},
+               {"ns_per_op", ns_per_op},
+               {"ops_per_s", 1e9 / ns_per_op},
+               {"mb_per_s", total_bytes ? total_bytes / (best_ns / 1e9) / 1e6 : 0},
+               {"cycles_per_byte", total_bytes ? best_cycles / total_bytes : 0},
+           });
+    return ns_per_op;
+}
+
+} // namespace bench
+
+// One function per suite, the list lives in main.cc
+void BenchRingBuffer();
+void BenchSerialHandler();
+void BenchLinkPackets();
+void BenchBlockPool();
+void BenchLinkedQueue();
+void BenchSwappingBuffer();
+void BenchArenaQueue();
+void BenchTxClasses();
+void BenchFlowControl();
+void BenchLinkRate();
+void BenchLinkStats();
+void BenchLinkLatency();
+void BenchLinkSim();
+void BenchCobs();
+void BenchSerialPacket();
+void BenchLinkSchema();
+void BenchCompactFrames();
+void BenchAudioCodec();
+void BenchAdpcm();
@@ -0,0 +1,25 @@
+#pragma once
+
+// Host stand-in for the ui and net loggers, the shared code only needs
+// Logger::Log. Messages are counted rather than printed so they do not skew
+// the timings or the json output.
+class Logger
+{
+public:
+    enum class Level
+    {
+        Error,
+        Warn,
+        Info,
+        Debug,
+        Raw
+    };
+
+    static inline unsigned long num_logs = 0;
+
+    template <typename... T>
+    static void Log(Level, const char*, const T&...)
+    {
+        ++num_logs;
+    }
+};
@@ -0,0 +1,515 @@
+#include "audio_codec.hh"
+#include "bench.hh"
+#include "constants.hh"
+#include "link_packet_t.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+// The IMA ADPCM option for ptt audio. The codes are checked against the
+// reference coder run over the whole stream, frames are checked to decode on
+// their own, then the quality is measured against A-law on speech like, swept
+// and noise signals and the cost of a frame each way is timed against A-law.
+static constexpr const char* Suite_Name = "adpcm";
+static constexpr uint32_t Num_Frames = 20000;
+static constexpr uint32_t Frame_Samples = constants::Audio_Phonic_Sz;
+static constexpr uint32_t Signal_Frames = 250;
+static constexpr double Sample_Rate = static_cast<double>(constants::SampleRates::_8khz);
+
+// The reference encoder and decoder from the IMA recommended practices, the
+// state carried across the whole stream
+static constexpr std::array<int32_t, 89> Reference_Steps = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+static constexpr std::array<int32_t, 16> Reference_Index = {-1, -1, -1, -1, 2, 4, 6, 8,
+                                                            -1, -1, -1, -1, 2, 4, 6, 8};
+
+struct ReferenceState
+{
+    int32_t valprev = 0;
+    int32_t index = 0;
+};
+
+static uint8_t ReferenceEncode(const int16_t sample, ReferenceState& state)
+{
+    int32_t step = Reference_Steps[state.index];
+    int32_t diff = sample - state.valprev;
+    const int32_t sign = diff < 0 ? 8 : 0;
+    if (sign)
+    {
+        diff = -diff;
+    }
+
+    int32_t delta = 0;
+    int32_t vpdiff = step >> 3;
+    if (diff >= step)
+    {
+        delta = 4;
+        diff -= step;
+        vpdiff += step;
+    }
+    step >>= 1;
+    if (diff >= step)
+    {
+        delta |= 2;
+        diff -= step;
+        vpdiff += step;
+    }
+    step >>= 1;
+    if (diff >= step)
+    {
+        delta |= 1;
+        vpdiff += step;
+    }
+
+    state.valprev += sign ? -vpdiff : vpdiff;
+    state.valprev = std::clamp<int32_t>(state.valprev, -32768, 32767);
+
+    delta |= sign;
+    state.index = std::clamp<int32_t>(state.index + Reference_Index[delta], 0, 88);
+    return delta;
+}
+
+static int16_t ReferenceDecode(const uint8_t delta, ReferenceState& state)
+{
+    const int32_t step = Reference_Steps[state.index];
+    int32_t vpdiff = step >> 3;
+    if (delta & 4)
+    {
+        vpdiff += step;
+    }
+    if (delta & 2)
+    {
+        vpdiff += step >> 1;
+    }
+    if (delta & 1)
+    {
+        vpdiff += step >> 2;
+    }
+
+    state.valprev += delta & 8 ? -vpdiff : vpdiff;
+    state.valprev = std::clamp<int32_t>(state.valprev, -32768, 32767);
+    state.index = std::clamp<int32_t>(state.index + Reference_Index[delta], 0, 88);
+    return state.valprev;
+}
+
+// Voiced speech, harmonics of a wandering pitch shaped by three formants and
+// a syllable rate envelope
+static std::vector<int16_t> Voiced(const size_t count, const double peak)
+{
+    static constexpr std::array<double, 3> Formants = {700, 1200, 2500};
+    std::vector<double> signal(count);
+    double phase = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const double t = i / Sample_Rate;
+        const double pitch = 120 + 20 * std::sin(2 * M_PI * 1.5 * t);
+        phase += 2 * M_PI * pitch / Sample_Rate;
+
+        double value = 0;
+        for (int harmonic = 1; harmonic * pitch < 3400; ++harmonic)
+        {
+            double gain = 0;
+            for (const double formant : Formants)
+            {
+                const double distance = (harmonic * pitch - formant) / 150;
+                gain += std::exp(-distance * distance);
+            }
+            value += (gain + 0.05) / harmonic * std::sin(harmonic * phase);
+        }
+        signal[i] = value * (0.55 + 0.45 * std::sin(2 * M_PI * 4 * t));
+    }
+
+    const double max = std::abs(*std::max_element(signal.begin(), signal.end(),
+                                                  [](double a, double b)
+                                                  { return std::abs(a) < std::abs(b); }));
+    std::vector<int16_t> samples(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        samples[i] = std::lround(signal[i] / max * peak);
+    }
+    return samples;
+}
+
+// A sweep over the speech band, 100 Hz to 3.4 kHz and back every second
+static std::vector<int16_t> Chirp(const size_t count, const double peak)
+{
+    std::vector<int16_t> samples(count);
+    double phase = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const double t = std::fmod(i / Sample_Rate, 1.0);
+        const double frequency = 100 + 3300 * (t < 0.5 ? t * 2 : (1 - t) * 2);
+        phase += 2 * M_PI * frequency / Sample_Rate;
+        samples[i] = std::lround(std::sin(phase) * peak);
+    }
+    return samples;
+}
+
+// White noise, the worst case for a coder that predicts from the last sample
+static std::vector<int16_t> Noise(const size_t count, const double peak)
+{
+    std::mt19937 rng(bench::Seed);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+    std::vector<int16_t> samples(count);
+    for (int16_t& sample : samples)
+    {
+        sample = std::lround(uniform(rng) * peak);
+    }
+    return samples;
+}
+
+// Codes samples as the ui does, frame after frame with the state carried
+static std::vector<uint8_t> EncodeFrames(const std::vector<int16_t>& samples)
+{
+    const size_t frames = samples.size() / Frame_Samples;
+    std::vector<uint8_t> coded(frames * constants::Audio_Adpcm_Sz);
+    AudioCodec::AdpcmState state;
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+        AudioCodec::AdpcmEncode(
+            reinterpret_cast<const uint16_t*>(samples.data()) + frame * Frame_Samples,
+            Frame_Samples, coded.data() + frame * constants::Audio_Adpcm_Sz,
+            constants::Audio_Adpcm_Sz, false, state);
+    }
+    return coded;
+}
+
+static void BenchExact()
+{
+    // Every frame of a long stream against the reference
+    std::vector<int16_t> samples = Voiced(Frame_Samples * Signal_Frames, 20000);
+    const std::vector<int16_t> noise = Noise(Frame_Samples * Signal_Frames, 32767);
+    samples.insert(samples.end(), noise.begin(), noise.end());
+    const std::vector<uint8_t> coded = EncodeFrames(samples);
+    const size_t frames = samples.size() / Frame_Samples;
+
+    ReferenceState encoder;
+    ReferenceState decoder;
+    uint32_t header_failures = 0;
+    uint32_t code_failures = 0;
+    uint32_t decode_failures = 0;
+    uint16_t decoded[Frame_Samples];
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+        const uint8_t* const bytes = coded.data() + frame * constants::Audio_Adpcm_Sz;
+        const int16_t predictor = static_cast<int16_t>(bytes[0] | bytes[1] << 8);
+        header_failures += predictor != encoder.valprev || bytes[2] != encoder.index;
+
+        // Each frame decoded alone, with nothing from the ones before it
+        decode_failures += !AudioCodec::AdpcmDecode(bytes, constants::Audio_Adpcm_Sz, decoded,
+                                                    Frame_Samples, false);
+        for (uint32_t i = 0; i < Frame_Samples; ++i)
+        {
+            const uint8_t code = ReferenceEncode(samples[frame * Frame_Samples + i], encoder);
+            const uint8_t packed =
+                (bytes[constants::Adpcm_Header_Sz + i / 2] >> ((i & 1) * 4)) & 0x0F;
+            code_failures += packed != code;
+            decode_failures += static_cast<int16_t>(decoded[i]) != ReferenceDecode(code, decoder);
+        }
+    }
+
+    bench::Report(Suite_Name, "reference_exact",
+                  {
+                      {"frames", static_cast<double>(frames)},
+                      {"header_failures", static_cast<double>(header_failures)},
+                      {"code_failures", static_cast<double>(code_failures)},
+                      {"decode_failures", static_cast<double>(decode_failures)},
+                      {"ok", static_cast<double>(header_failures == 0 && code_failures == 0
+                                                 && decode_failures == 0)},
+                  });
+}
+
+// Full scale steps and alternation drive the predictor into its clamps and
+// the step index to both ends of the table
+static void BenchExtremes()
+{
+    std::vector<int16_t> samples(Frame_Samples * 8);
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const size_t part = i / Frame_Samples;
+        if (part < 2)
+        {
+            samples[i] = i & 1 ? INT16_MIN : INT16_MAX;
+        }
+        else if (part < 4)
+        {
+            samples[i] = (i / 40) & 1 ? INT16_MIN : INT16_MAX;
+        }
+        else if (part < 6)
+        {
+            samples[i] = 0;
+        }
+        else
+        {
+            samples[i] = i & 1 ? 1 : -1;
+        }
+    }
+
+    const std::vector<uint8_t> coded = EncodeFrames(samples);
+    ReferenceState encoder;
+    ReferenceState decoder;
+    uint32_t failures = 0;
+    int32_t max_index = 0;
+    int32_t min_value = 0;
+    int32_t max_value = 0;
+    uint16_t decoded[Frame_Samples];
+    for (size_t frame = 0; frame < samples.size() / Frame_Samples; ++frame)
+    {
+        const uint8_t* const bytes = coded.data() + frame * constants::Audio_Adpcm_Sz;
+        failures += !AudioCodec::AdpcmDecode(bytes, constants::Audio_Adpcm_Sz, decoded,
+                                             Frame_Samples, false);
+        for (uint32_t i = 0; i < Frame_Samples; ++i)
+        {
+            const uint8_t code = ReferenceEncode(samples[frame * Frame_Samples + i], encoder);
+            const int16_t expected = ReferenceDecode(code, decoder);
+            failures += static_cast<int16_t>(decoded[i]) != expected;
+            max_index = std::max(max_index, decoder.index);
+            min_value = std::min<int32_t>(min_value, expected);
+            max_value = std::max<int32_t>(max_value, expected);
+        }
+    }
+
+    // Frames that are short, or whose header cannot have come from an
+    // encoder, are turned away. A short frame decodes only what it holds.
+    uint8_t bad[constants::Audio_Adpcm_Sz] = {0, 0, 89};
+    const bool bad_index = !AudioCodec::AdpcmDecode(bad, sizeof(bad), decoded, Frame_Samples,
+                                                    false);
+    const bool short_header = !AudioCodec::AdpcmDecode(bad, constants::Adpcm_Header_Sz - 1,
+                                                       decoded, Frame_Samples, false);
+    std::fill(std::begin(decoded), std::end(decoded), 0x5A5A);
+    bad[2] = 0;
+    AudioCodec::AdpcmDecode(bad, constants::Adpcm_Header_Sz + 5, decoded, Frame_Samples, false);
+    const bool short_data = decoded[9] != 0x5A5A && decoded[10] == 0x5A5A;
+
+    // Stereo in is mixed down and mono out is spread to both sides, as A-law
+    std::vector<uint16_t> stereo(constants::Audio_Buffer_Sz);
+    for (size_t i = 0; i < stereo.size(); ++i)
+    {
+        stereo[i] = static_cast<uint16_t>(samples[i / 2] / 2);
+    }
+    std::vector<uint16_t> mono(Frame_Samples);
+    for (size_t i = 0; i < mono.size(); ++i)
+    {
+        mono[i] = static_cast<uint16_t>(stereo[i * 2] + stereo[i * 2 + 1]);
+    }
+    uint8_t from_stereo[constants::Audio_Adpcm_Sz];
+    uint8_t from_mono[constants::Audio_Adpcm_Sz];
+    AudioCodec::AdpcmState stereo_state;
+    AudioCodec::AdpcmState mono_state;
+    const size_t written =
+        AudioCodec::AdpcmEncode(stereo.data(), stereo.size(), from_stereo, sizeof(from_stereo),
+                                true, stereo_state);
+    AudioCodec::AdpcmEncode(mono.data(), mono.size(), from_mono, sizeof(from_mono), false,
+                            mono_state);
+    uint16_t played[constants::Audio_Buffer_Sz];
+    AudioCodec::AdpcmDecode(from_stereo, sizeof(from_stereo), played, constants::Audio_Buffer_Sz,
+                            true);
+    AudioCodec::AdpcmDecode(from_mono, sizeof(from_mono), decoded, Frame_Samples, false);
+    uint32_t stereo_failures = written != constants::Audio_Adpcm_Sz
+                             || !std::equal(std::begin(from_stereo), std::end(from_stereo),
+                                            std::begin(from_mono));
+    for (uint32_t i = 0; i < Frame_Samples; ++i)
+    {
+        stereo_failures += played[i * 2] != decoded[i] || played[i * 2 + 1] != decoded[i];
+    }
+
+    bench::Report(Suite_Name, "extremes",
+                  {
+                      {"failures", static_cast<double>(failures)},
+                      {"max_index", static_cast<double>(max_index)},
+                      {"min_value", static_cast<double>(min_value)},
+                      {"max_value", static_cast<double>(max_value)},
+                      {"bad_index", static_cast<double>(bad_index)},
+                      {"short_header", static_cast<double>(short_header)},
+                      {"short_data", static_cast<double>(short_data)},
+                      {"stereo_failures", static_cast<double>(stereo_failures)},
+                      {"ok", static_cast<double>(failures == 0 && max_index == 88
+                                                 && min_value == INT16_MIN
+                                                 && max_value == INT16_MAX && bad_index
+                                                 && short_header && short_data
+                                                 && stereo_failures == 0)},
+                  });
+}
+
+// Bytes on the net link for a frame of each, chunk header and channel id in
+static void BenchSize()
+{
+    link_packet_t alaw;
+    link_packet_t adpcm;
+    ui_net_link::WriteAudioHeader(ui_net_link::Channel_Id::Ptt, false, alaw);
+    ui_net_link::WriteAudioHeader(ui_net_link::Channel_Id::Ptt, false, adpcm,
+                                  ui_net_link::MessageType::MediaAdpcm);
+
+    // Ai requests stay A-law whatever they are asked for
+    link_packet_t ai;
+    ui_net_link::WriteAudioHeader(ui_net_link::Channel_Id::Ptt_Ai, false, ai,
+                                  ui_net_link::MessageType::MediaAdpcm);
+
+    ui_net_link::Chunk chunk;
+    std::span<const uint8_t> data;
+    const bool read = ui_net_link::ReadChunk<ui_net_link::ChunkSchema>(
+        std::span<const uint8_t>(adpcm.payload.data(), adpcm.length), chunk, data);
+
+    bench::Report(Suite_Name, "size",
+                  {
+                      {"alaw_frame", static_cast<double>(constants::Audio_Phonic_Sz)},
+                      {"adpcm_frame", static_cast<double>(constants::Audio_Adpcm_Sz)},
+                      {"alaw_packet", static_cast<double>(alaw.length)},
+                      {"adpcm_packet", static_cast<double>(adpcm.length)},
+                      {"ai_packet", static_cast<double>(ai.length)},
+                      {"adpcm_kbps", constants::Audio_Adpcm_Sz * 8.0
+                                         / constants::Audio_Time_Length_ms},
+                      {"alaw_kbps", constants::Audio_Phonic_Sz * 8.0
+                                        / constants::Audio_Time_Length_ms},
+                      {"ok", static_cast<double>(
+                                 read && chunk.type == ui_net_link::MessageType::MediaAdpcm
+                                 && data.size() == constants::Audio_Adpcm_Sz
+                                 && alaw.length - adpcm.length
+                                        == constants::Audio_Phonic_Sz - constants::Audio_Adpcm_Sz
+                                 && ai.length == ui_net_link::Chunk_Offset
+                                                      + ui_net_link::AIRequestSchema::Size
+                                                      + constants::Audio_Phonic_Sz)},
+                  });
+}
+
+static double Snr(const std::vector<int16_t>& samples, const std::vector<int16_t>& decoded)
+{
+    double signal = 0;
+    double noise = 0;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const double error = static_cast<double>(samples[i]) - decoded[i];
+        signal += static_cast<double>(samples[i]) * samples[i];
+        noise += error * error;
+    }
+    return 10 * std::log10(signal / std::max(noise, 1.0));
+}
+
+// Quality of both codecs on the same signal, at a loud, a normal and a quiet
+// level below full scale
+static void BenchSnr(const char* name,
+                     std::vector<int16_t> (*make)(size_t, double),
+                     const double min_adpcm_snr)
+{
+    static constexpr std::array<double, 3> Levels_Db = {-6, -20, -40};
+    for (const double level : Levels_Db)
+    {
+        const std::vector<int16_t> samples =
+            make(Frame_Samples * Signal_Frames, 32767 * std::pow(10, level / 20));
+
+        std::vector<int16_t> alaw(samples.size());
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            alaw[i] = AudioCodec::ALawExpand(AudioCodec::ALawCompand(samples[i]));
+        }
+
+        const std::vector<uint8_t> coded = EncodeFrames(samples);
+        std::vector<int16_t> adpcm(samples.size());
+        for (size_t frame = 0; frame < Signal_Frames; ++frame)
+        {
+            AudioCodec::AdpcmDecode(coded.data() + frame * constants::Audio_Adpcm_Sz,
+                                    constants::Audio_Adpcm_Sz,
+                                    reinterpret_cast<uint16_t*>(adpcm.data())
+                                        + frame * Frame_Samples,
+                                    Frame_Samples, false);
+        }
+
+        const double alaw_snr = Snr(samples, alaw);
+        const double adpcm_snr = Snr(samples, adpcm);
+        const std::string case_name =
+            std::string("snr_") + name + "_" + std::to_string(static_cast<int>(-level)) + "db";
+        bench::Report(Suite_Name, case_name.c_str(),
+                      {
+                          {"level_db", level},
+                          {"alaw_snr_db", alaw_snr},
+                          {"adpcm_snr_db", adpcm_snr},
+                          {"ok", static_cast<double>(adpcm_snr >= min_adpcm_snr)},
+                      });
+    }
+}
+
+// A frame each way through the interface the ui calls, stereo samples from
+// the audio chip to mono codes and back, next to A-law doing the same
+static void BenchFrames()
+{
+    const std::vector<int16_t> voiced = Voiced(constants::Audio_Buffer_Sz, 16000);
+    const std::vector<uint16_t> pcm(voiced.begin(), voiced.end());
+    uint8_t alaw[constants::Audio_Phonic_Sz];
+    uint8_t adpcm[constants::Audio_Adpcm_Sz];
+    uint16_t played[constants::Audio_Buffer_Sz];
+
+    bench::Run(Suite_Name, "frame_alaw_compand", Num_Frames, sizeof(uint16_t) * pcm.size(),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       AudioCodec::ALawCompand(pcm.data(), constants::Audio_Buffer_Sz, alaw,
+                                               constants::Audio_Phonic_Sz, true, constants::Stereo);
+                       bench::DoNotOptimize(alaw);
+                       bench::ClobberMemory();
+                   }
+               });
+
+    AudioCodec::AdpcmState state;
+    bench::Run(Suite_Name, "frame_adpcm_encode", Num_Frames, sizeof(uint16_t) * pcm.size(),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       AudioCodec::AdpcmEncode(pcm.data(), constants::Audio_Buffer_Sz, adpcm,
+                                               constants::Audio_Adpcm_Sz, true, state);
+                       bench::DoNotOptimize(adpcm);
+                       bench::ClobberMemory();
+                   }
+               });
+
+    bench::Run(Suite_Name, "frame_alaw_expand", Num_Frames, sizeof(alaw),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       AudioCodec::ALawExpand(alaw, constants::Audio_Phonic_Sz, played,
+                                              constants::Audio_Buffer_Sz, constants::Stereo, true);
+                       bench::DoNotOptimize(played);
+                       bench::ClobberMemory();
+                   }
+               });
+
+    bench::Run(Suite_Name, "frame_adpcm_decode", Num_Frames, sizeof(adpcm),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       AudioCodec::AdpcmDecode(adpcm, constants::Audio_Adpcm_Sz, played,
+                                               constants::Audio_Buffer_Sz, true);
+                       bench::DoNotOptimize(played);
+                       bench::ClobberMemory();
+                   }
+               });
+}
+
+void BenchAdpcm()
+{
+    BenchExact();
+    BenchExtremes();
+    BenchSize();
+
+    // ADPCM keeps about 18 dB whatever the level, which A-law only beats
+    // where its segments are fine enough. Noise cannot be predicted at all.
+    BenchSnr("voiced", Voiced, 15);
+    BenchSnr("chirp", Chirp, 15);
+    BenchSnr("noise", Noise, 12);
+
+    BenchFrames();
+}
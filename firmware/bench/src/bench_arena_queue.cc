@@ -0,0 +1,147 @@
+#include "arena_queue.hh"
+#include "bench.hh"
+#include "link_packet_t.hh"
+#include <deque>
+#include <random>
+#include <vector>
+
+static constexpr const char* Suite_Name = "arena_queue";
+static constexpr uint32_t Buff_Size = 2048;
+static constexpr uint32_t Num_Ops = 200000;
+
+// Ack, ping, compressed audio and a full packet
+static constexpr uint32_t Payload_Sizes[] = {0, 10, 167, link_packet_t::Payload_Size};
+
+static uint32_t RandomFrameSize(std::mt19937& rng)
+{
+    return link_packet_t::Header_Size + Payload_Sizes[rng() % std::size(Payload_Sizes)];
+}
+
+// Random pushes and pops of mixed sizes checked against a deque, every record
+// has to come back whole and in order however it wrapped
+static void CheckMixedSizes()
+{
+    std::mt19937 rng(bench::Seed);
+    uint8_t storage[Buff_Size];
+    ArenaQueue queue(storage, Buff_Size);
+    std::deque<std::vector<uint8_t>> model;
+
+    uint32_t pushed = 0;
+    uint32_t rejected = 0;
+    uint32_t wraps = 0;
+    uint32_t mismatched = 0;
+    const uint8_t* last_record = nullptr;
+
+    for (uint32_t i = 0; i < Num_Ops; ++i)
+    {
+        if (rng() % 2)
+        {
+            const uint32_t size = RandomFrameSize(rng);
+            uint8_t* record = queue.Reserve(size);
+            if (!record)
+            {
+                ++rejected;
+                continue;
+            }
+
+            if (last_record && record < last_record)
+            {
+                ++wraps;
+            }
+            last_record = record;
+
+            std::vector<uint8_t>& expected = model.emplace_back(size);
+            for (uint8_t& byte : expected)
+            {
+                byte = rng();
+            }
+            std::memcpy(record, expected.data(), size);
+            queue.Commit();
+            ++pushed;
+        }
+        else if (!model.empty())
+        {
+            const std::span<uint8_t> front = queue.Front();
+            if (front.size() != model.front().size()
+                || std::memcmp(front.data(), model.front().data(), front.size()) != 0)
+            {
+                ++mismatched;
+            }
+            queue.Pop();
+            model.pop_front();
+        }
+    }
+
+    bench::Report(Suite_Name, "mixed_sizes",
+                  {
+                      {"pushed", static_cast<double>(pushed)},
+                      {"rejected", static_cast<double>(rejected)},
+                      {"wraps", static_cast<double>(wraps)},
+                      {"mismatched", static_cast<double>(mismatched)},
+                      {"left", static_cast<double>(queue.Count() - model.size())},
+                  });
+}
+
+// How many packets of each size the same memory holds as a queue and as
+// fixed link_packet_t slots
+static void ReportCapacity()
+{
+    uint8_t storage[Buff_Size];
+    ArenaQueue queue(storage, Buff_Size);
+
+    for (const uint32_t payload_size : Payload_Sizes)
+    {
+        queue.Clear();
+        uint32_t held = 0;
+        while (queue.Reserve(link_packet_t::Header_Size + payload_size))
+        {
+            queue.Commit();
+            ++held;
+        }
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "capacity_%u", payload_size);
+        bench::Report(Suite_Name, name,
+                      {
+                          {"bytes", static_cast<double>(Buff_Size)},
+                          {"queued", static_cast<double>(held)},
+                          {"slots", static_cast<double>(Buff_Size / sizeof(link_packet_t))},
+                      });
+    }
+}
+
+void BenchArenaQueue()
+{
+    CheckMixedSizes();
+    ReportCapacity();
+
+    // Steady state of a link, a few packets in flight of mixed sizes
+    std::mt19937 rng(bench::Seed);
+    std::vector<uint32_t> sizes(Num_Ops);
+    uint64_t total_bytes = 0;
+    for (uint32_t& size : sizes)
+    {
+        size = RandomFrameSize(rng);
+        total_bytes += size;
+    }
+
+    uint8_t storage[Buff_Size];
+    ArenaQueue queue(storage, Buff_Size);
+    bench::Run(Suite_Name, "reserve_commit_pop", Num_Ops, total_bytes / Num_Ops,
+               [&]
+               {
+                   for (const uint32_t size : sizes)
+                   {
+                       while (!queue.Reserve(size))
+                       {
+                           queue.Pop();
+                       }
+                       queue.Commit();
+                       if (queue.Count() > 2)
+                       {
+                           bench::DoNotOptimize(queue.Front().data());
+                           queue.Pop();
+                       }
+                   }
+               });
+}
@@ -0,0 +1,270 @@
+#include "audio_codec.hh"
+#include "bench.hh"
+#include "constants.hh"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// The A-law codec the ui runs on every audio frame. Every sample and every
+// code is checked against the ITU-T G.191 reference, for both ways of
+// companding, then each is timed against the segment loop and arithmetic
+// expand it replaced, alone and through the frame interface the ui calls.
+static constexpr const char* Suite_Name = "audio_codec";
+static constexpr uint32_t Num_Frames = 20000;
+static constexpr uint32_t Frame_Samples = constants::Audio_Phonic_Sz;
+static constexpr uint32_t Sample_Frames = 64;
+
+// alaw_compress and alaw_expand from the G.191 software tools library, one
+// sample at a time
+static uint8_t ReferenceCompress(const int16_t sample)
+{
+    // 1's complement for negative samples, 0 <= ix < 2048
+    int16_t ix = sample < 0 ? (~sample) >> 4 : sample >> 4;
+    if (ix > 15)
+    {
+        int16_t iexp = 1;
+        while (ix > 16 + 15)
+        {
+            ix >>= 1;
+            ++iexp;
+        }
+        ix -= 16;
+        ix += iexp << 4;
+    }
+    if (sample >= 0)
+    {
+        ix |= 0x0080;
+    }
+    return ix ^ 0x0055;
+}
+
+static int16_t ReferenceExpand(const uint8_t code)
+{
+    int16_t ix = code ^ 0x0055;
+    ix &= 0x007F;
+    const int16_t iexp = ix >> 4;
+    int16_t mant = ix & 0x000F;
+    if (iexp > 0)
+    {
+        mant = mant + 16;
+    }
+    mant = (mant << 4) + 0x0008;
+    if (iexp > 1)
+    {
+        mant = mant << (iexp - 1);
+    }
+    return code > 127 ? mant : -mant;
+}
+
+// Compand and expand as they were, kept to compare against
+static uint8_t LoopCompand(const uint16_t u_sample)
+{
+    int16_t sample = u_sample;
+    int16_t exponent = 0;
+    uint16_t mantissa = 0;
+    uint16_t sign = 0;
+
+    if (sample >= 0)
+    {
+        sign = 0x80;
+    }
+    else
+    {
+        sample = -(sample + 1);
+    }
+
+    int i = 0;
+    for (; i < 7; ++i)
+    {
+        if ((sample << i) & 0x4000)
+        {
+            break;
+        }
+    }
+
+    exponent = 7 - i;
+    if (exponent == 0)
+    {
+        mantissa = (sample >> 4) & 0x0F;
+    }
+    else
+    {
+        mantissa = (sample >> (exponent + 3)) & 0x0F;
+        exponent <<= 4;
+    }
+
+    return (sign + exponent + mantissa) ^ 0x55;
+}
+
+static uint16_t ArithmeticExpand(uint8_t sample)
+{
+    sample ^= 0xD5;
+    const uint16_t sign = (sample & 0x80);
+    const uint8_t exponent = (sample & 0x70) >> 4;
+    uint16_t mantissa = (sample & 0x0F) << 1;
+    if (exponent == 0)
+    {
+        mantissa = (mantissa + 0x0001) << 3;
+    }
+    else
+    {
+        mantissa = (mantissa + 0x0021) << (exponent + 2);
+    }
+    return sign ? -mantissa : mantissa;
+}
+
+static void BenchExact()
+{
+    uint32_t clz_failures = 0;
+    uint32_t lut_failures = 0;
+    uint32_t compand_failures = 0;
+    uint32_t loop_failures = 0;
+    for (uint32_t i = 0; i <= UINT16_MAX; ++i)
+    {
+        const uint16_t sample = i;
+        const uint8_t expected = ReferenceCompress(static_cast<int16_t>(sample));
+        clz_failures += AudioCodec::ALawCompandClz(sample) != expected;
+        lut_failures += AudioCodec::ALawCompandLut(sample) != expected;
+        compand_failures += AudioCodec::ALawCompand(sample) != expected;
+        loop_failures += LoopCompand(sample) != expected;
+    }
+
+    bench::Report(Suite_Name, "compand_exact",
+                  {
+                      {"samples", UINT16_MAX + 1.0},
+                      {"clz_failures", static_cast<double>(clz_failures)},
+                      {"lut_failures", static_cast<double>(lut_failures)},
+                      {"compand_failures", static_cast<double>(compand_failures)},
+                      {"loop_failures", static_cast<double>(loop_failures)},
+                      {"ok", static_cast<double>(clz_failures == 0 && lut_failures == 0
+                                                 && compand_failures == 0)},
+                  });
+
+    // Every code also comes back as itself when companded again
+    uint32_t expand_failures = 0;
+    uint32_t arithmetic_failures = 0;
+    uint32_t round_trip_failures = 0;
+    for (uint32_t code = 0; code <= UINT8_MAX; ++code)
+    {
+        const uint16_t expected = ReferenceExpand(code);
+        const uint16_t expanded = AudioCodec::ALawExpand(code);
+        expand_failures += expanded != expected;
+        arithmetic_failures += ArithmeticExpand(code) != expected;
+        round_trip_failures += AudioCodec::ALawCompand(expanded) != code;
+    }
+
+    bench::Report(Suite_Name, "expand_exact",
+                  {
+                      {"codes", UINT8_MAX + 1.0},
+                      {"expand_failures", static_cast<double>(expand_failures)},
+                      {"arithmetic_failures", static_cast<double>(arithmetic_failures)},
+                      {"round_trip_failures", static_cast<double>(round_trip_failures)},
+                      {"ok", static_cast<double>(expand_failures == 0
+                                                 && round_trip_failures == 0)},
+                  });
+}
+
+// Samples spread over every segment, speech spends most of its time in the
+// low ones where the loop takes longest
+static std::vector<uint16_t> Samples(const size_t count)
+{
+    std::mt19937 rng(bench::Seed);
+    std::vector<uint16_t> samples(count);
+    for (uint16_t& sample : samples)
+    {
+        const int16_t magnitude = (rng() & 0x7FFF) >> (rng() % 15);
+        sample = rng() & 1 ? magnitude : -magnitude;
+    }
+    return samples;
+}
+
+template <typename Fn>
+static void BenchCompand(const char* name, Fn&& compand)
+{
+    // Enough different frames that the branches in the loop are not learned
+    const std::vector<uint16_t> samples = Samples(Frame_Samples * Sample_Frames);
+    uint8_t out[Frame_Samples];
+    bench::Run(Suite_Name, name, Num_Frames * Frame_Samples, sizeof(uint16_t),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       const uint16_t* in = samples.data() + frame % Sample_Frames * Frame_Samples;
+                       for (uint32_t i = 0; i < Frame_Samples; ++i)
+                       {
+                           out[i] = compand(in[i]);
+                       }
+                       bench::DoNotOptimize(out);
+                       bench::ClobberMemory();
+                   }
+               });
+}
+
+template <typename Fn>
+static void BenchExpand(const char* name, Fn&& expand)
+{
+    std::vector<uint8_t> codes(Frame_Samples);
+    for (uint32_t i = 0; i < Frame_Samples; ++i)
+    {
+        codes[i] = i * 97;
+    }
+    uint16_t out[Frame_Samples];
+    bench::Run(Suite_Name, name, Num_Frames * Frame_Samples, sizeof(uint8_t),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       for (uint32_t i = 0; i < Frame_Samples; ++i)
+                       {
+                           out[i] = expand(codes[i]);
+                       }
+                       bench::DoNotOptimize(out);
+                       bench::ClobberMemory();
+                   }
+               });
+}
+
+// One frame each way through the interface the ui calls, stereo samples from
+// the audio chip to mono codes and back
+static void BenchFrames()
+{
+    const std::vector<uint16_t> pcm = Samples(constants::Audio_Buffer_Sz);
+    uint8_t alaw[constants::Audio_Phonic_Sz];
+    uint16_t played[constants::Audio_Buffer_Sz];
+
+    bench::Run(Suite_Name, "frame_compand", Num_Frames, sizeof(uint16_t) * pcm.size(),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       AudioCodec::ALawCompand(pcm.data(), constants::Audio_Buffer_Sz, alaw,
+                                               constants::Audio_Phonic_Sz, true, constants::Stereo);
+                       bench::DoNotOptimize(alaw);
+                       bench::ClobberMemory();
+                   }
+               });
+
+    bench::Run(Suite_Name, "frame_expand", Num_Frames, sizeof(alaw),
+               [&]
+               {
+                   for (uint32_t frame = 0; frame < Num_Frames; ++frame)
+                   {
+                       AudioCodec::ALawExpand(alaw, constants::Audio_Phonic_Sz, played,
+                                              constants::Audio_Buffer_Sz, constants::Stereo, true);
+                       bench::DoNotOptimize(played);
+                       bench::ClobberMemory();
+                   }
+               });
+}
+
+void BenchAudioCodec()
+{
+    BenchExact();
+
+    BenchCompand("compand_loop", LoopCompand);
+    BenchCompand("compand_clz", AudioCodec::ALawCompandClz);
+    BenchCompand("compand_lut", AudioCodec::ALawCompandLut);
+    BenchExpand("expand_arithmetic", ArithmeticExpand);
+    BenchExpand("expand_table", [](const uint8_t code) { return AudioCodec::ALawExpand(code); });
+    BenchFrames();
+}
@@ -0,0 +1,238 @@
+#include "bench.hh"
+#include "block_pool.hh"
+#include "link_packet_t.hh"
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+static constexpr const char* Suite_Name = "block_pool";
+static constexpr uint32_t Num_Ops = 1 << 18;
+static constexpr uint16_t Num_Blocks = 16;
+
+// One moq object payload, what the track writer copies per frame
+using Payload = std::array<uint8_t, link_packet_t::Payload_Size>;
+
+// Counts the objects alive in a pool, so a block destroyed twice or never
+// shows up
+struct Counted
+{
+    static inline int live = 0;
+
+    explicit Counted(const uint32_t value) :
+        value(value)
+    {
+        ++live;
+    }
+
+    ~Counted()
+    {
+        --live;
+    }
+
+    uint32_t value;
+};
+
+static constexpr uint32_t Num_Thread_Ops = 200000;
+static constexpr uint16_t Num_Thread_Blocks = 3;
+
+// Exhaustion, handles giving their blocks back however they go, and moves
+template <bool Isr_Safe>
+static void CheckHandles(const char* name)
+{
+    using Pool = BlockPool<Counted, Num_Blocks, Isr_Safe>;
+    static Pool pool;
+    uint32_t cases = 0;
+    uint32_t failures = 0;
+    const auto check = [&](const bool ok, const char* what)
+    {
+        ++cases;
+        if (!ok)
+        {
+            ++failures;
+            std::printf("block pool %s: %s\n", name, what);
+        }
+    };
+
+    {
+        std::vector<typename Pool::Handle> all;
+        std::set<Counted*> blocks;
+        for (uint16_t i = 0; i < Num_Blocks; ++i)
+        {
+            all.push_back(pool.Acquire(i));
+            blocks.insert(all.back().Get());
+            check(all.back() && pool.Owns(all.back().Get()) && all.back()->value == i,
+                  "acquire");
+        }
+        check(blocks.size() == Num_Blocks, "distinct blocks");
+        check(pool.Available() == 0 && Counted::live == Num_Blocks, "all in use");
+
+        typename Pool::Handle none = pool.Acquire(0u);
+        check(!none && none.Get() == nullptr, "exhausted pool gives an empty handle");
+        check(pool.Available() == 0 && Counted::live == Num_Blocks, "nothing taken when empty");
+
+        all.back().Reset();
+        check(!all.back() && pool.Available() == 1 && Counted::live == Num_Blocks - 1, "reset");
+        all.back().Reset();
+        check(pool.Available() == 1, "second reset does nothing");
+
+        all.pop_back();
+        check(pool.Available() == 1, "destroying an empty handle does nothing");
+        all.pop_back();
+        check(pool.Available() == 2 && Counted::live == Num_Blocks - 2, "destroy");
+
+        typename Pool::Handle again = pool.Acquire(7u);
+        check(again && again->value == 7 && pool.Available() == 1, "acquire after release");
+    }
+    check(pool.Available() == Num_Blocks && Counted::live == 0, "all back after scope");
+
+    {
+        typename Pool::Handle first = pool.Acquire(1u);
+        Counted* block = first.Get();
+        typename Pool::Handle second(std::move(first));
+        check(!first && second.Get() == block && pool.Available() == Num_Blocks - 1,
+              "move construct");
+
+        typename Pool::Handle third = pool.Acquire(3u);
+        third = std::move(second);
+        check(!second && third.Get() == block && pool.Available() == Num_Blocks - 1
+                  && Counted::live == 1,
+              "move assign releases the old block");
+
+        first = std::move(first);
+        second.Reset();
+        check(pool.Available() == Num_Blocks - 1, "moved from handles release nothing");
+    }
+    check(pool.Available() == Num_Blocks && Counted::live == 0, "moved block back once");
+
+    bench::Report(Suite_Name, name,
+                  {
+                      {"cases", static_cast<double>(cases)},
+                      {"failures", static_cast<double>(failures)},
+                      {"ok", static_cast<double>(failures == 0)},
+                  });
+}
+
+// Two threads acquiring and releasing from a pool with fewer blocks than they
+// want between them, each stamps its block and checks nobody else has it
+static void CheckIsrSafeThreads()
+{
+    static BlockPool<std::atomic<uint32_t>, Num_Thread_Blocks, true> pool;
+    std::atomic<uint32_t> shared_blocks(0);
+    std::atomic<uint32_t> acquired(0);
+
+    const auto worker = [&](const uint32_t id)
+    {
+        for (uint32_t i = 0; i < Num_Thread_Ops; ++i)
+        {
+            auto first = pool.Acquire(0u);
+            auto second = pool.Acquire(0u);
+            for (auto* handle : {&first, &second})
+            {
+                if (!*handle)
+                {
+                    continue;
+                }
+                acquired.fetch_add(1, std::memory_order_relaxed);
+                const uint32_t stamp = id << 24 | (i & 0xFFFFFF);
+                if ((*handle)->exchange(stamp) != 0 || (*handle)->exchange(0) != stamp)
+                {
+                    shared_blocks.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+    };
+
+    std::thread other(worker, 1);
+    worker(2);
+    other.join();
+
+    std::set<void*> blocks;
+    {
+        decltype(pool.Acquire(0u)) all[Num_Thread_Blocks + 1];
+        for (auto& handle : all)
+        {
+            handle = pool.Acquire(0u);
+            if (handle)
+            {
+                blocks.insert(handle.Get());
+            }
+        }
+    }
+    const bool ok = shared_blocks == 0 && blocks.size() == Num_Thread_Blocks
+                 && pool.Available() == Num_Thread_Blocks;
+
+    bench::Report(Suite_Name, "isr_safe_threads",
+                  {
+                      {"acquired", static_cast<double>(acquired)},
+                      {"shared_blocks", static_cast<double>(shared_blocks)},
+                      {"blocks_after", static_cast<double>(blocks.size())},
+                      {"ok", static_cast<double>(ok)},
+                  });
+}
+
+// NOTE- The esp PSRAM heap is not available on a host, new/delete is the
+// closest stand in.
+void BenchBlockPool()
+{
+    CheckHandles<false>("handles");
+    CheckHandles<true>("handles_isr_safe");
+    CheckIsrSafeThreads();
+
+    // Keep a few blocks live at once like a short publish queue
+    static constexpr uint32_t In_Flight = 4;
+
+    {
+        static BlockPool<Payload, Num_Blocks> pool;
+        bench::Run(Suite_Name, "pool", Num_Ops, 0,
+                   [&]
+                   {
+                       BlockPool<Payload, Num_Blocks>::Handle live[In_Flight];
+                       for (uint32_t i = 0; i < Num_Ops; ++i)
+                       {
+                           live[i % In_Flight] = pool.Acquire();
+                           bench::DoNotOptimize(live[i % In_Flight].Get());
+                       }
+                   });
+    }
+    {
+        static BlockPool<Payload, Num_Blocks, true> pool;
+        bench::Run(Suite_Name, "pool_isr_safe", Num_Ops, 0,
+                   [&]
+                   {
+                       BlockPool<Payload, Num_Blocks, true>::Handle live[In_Flight];
+                       for (uint32_t i = 0; i < Num_Ops; ++i)
+                       {
+                           live[i % In_Flight] = pool.Acquire();
+                           bench::DoNotOptimize(live[i % In_Flight].Get());
+                       }
+                   });
+    }
+    bench::Run(Suite_Name, "new_delete", Num_Ops, 0,
+               [&]
+               {
+                   std::unique_ptr<Payload> live[In_Flight];
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       live[i % In_Flight] = std::make_unique<Payload>();
+                       bench::DoNotOptimize(live[i % In_Flight].get());
+                   }
+               });
+
+    // What the track writer did before, a vector assigned per frame
+    static constexpr uint32_t Frame_Size = 167;
+    uint8_t frame[Frame_Size] = {0};
+    bench::Run(Suite_Name, "vector_assign", Num_Ops, Frame_Size,
+               [&]
+               {
+                   std::vector<uint8_t> live[In_Flight];
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       live[i % In_Flight] = std::vector<uint8_t>(frame, frame + Frame_Size);
+                       bench::DoNotOptimize(live[i % In_Flight].data());
+                   }
+               });
+}
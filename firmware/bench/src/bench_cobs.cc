@@ -0,0 +1,457 @@
+#include "bench.hh"
+#include "cobs/cobs.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// COBS against the TLV framing it replaces on the ui to net link. Round trips
+// through the codec on the inputs that stress it, the codec and a loopback
+// link in both framings for speed and size on the wire, and a stream with
+// bytes damaged every so often to see how many frames each framing loses
+// before it finds its place again.
+static constexpr const char* Suite_Name = "cobs";
+static constexpr uint32_t Num_Frames = 20000;
+static constexpr uint32_t Buff_Size = 4096;
+static constexpr uint16_t Frame_Type = static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame);
+static constexpr size_t Max_Frame_Data =
+    SerialHandler::Max_Header_Size + link_packet_t::Payload_Size;
+
+// One damaged byte in about this many, and the sizes of the frames around it
+static constexpr uint32_t Error_Every = 4000;
+static constexpr uint32_t Min_Damaged_Size = 16;
+static constexpr uint32_t Max_Damaged_Size = 400;
+
+struct CobsEndStorage
+{
+    uint8_t rx_packet_storage[Buff_Size];
+    uint8_t tx_storage[Buff_Size];
+    uint8_t realtime_tx_storage[Buff_Size];
+    uint8_t rx_storage[Buff_Size];
+};
+
+// A link with no uart, what it transmits goes straight into the peer's rx
+// ring, its own for a loopback, or is recorded when there is no peer. Headers
+// carry a crc and only ui link types are accepted, as on the real link.
+class CobsEnd : private CobsEndStorage, public SerialHandler
+{
+public:
+    CobsEnd() :
+        SerialHandler(*rx_packet_storage,
+                      Buff_Size,
+                      *tx_storage,
+                      Buff_Size,
+                      *realtime_tx_storage,
+                      Buff_Size,
+                      *rx_storage,
+                      Buff_Size,
+                      Transmit,
+                      this),
+        peer(nullptr)
+    {
+        EnableHeaderCrc();
+        SetTypeLimits(ui_net_link::Type_Limits);
+    }
+
+    uint32_t Feed(const uint8_t* data, const uint32_t len)
+    {
+        return rx_ring.Write(data, std::min<uint32_t>(len, rx_ring.Free()));
+    }
+
+    bool Encoding() const
+    {
+        return tx_cobs && rx_cobs;
+    }
+
+    uint32_t RxWriteIdx() const
+    {
+        return rx_ring.WriteIdx();
+    }
+
+    bool InRxRing(const uint8_t* data) const
+    {
+        return data >= rx_storage && data < rx_storage + Buff_Size;
+    }
+
+    CobsEnd* peer;
+    std::vector<uint8_t> wire;
+
+private:
+    static void Transmit(void* arg)
+    {
+        CobsEnd* self = static_cast<CobsEnd*>(arg);
+        if (self->peer)
+        {
+            self->peer->Feed(self->tx_chunk.data(), self->tx_chunk.size());
+        }
+        else
+        {
+            self->wire.insert(self->wire.end(), self->tx_chunk.begin(), self->tx_chunk.end());
+        }
+        self->UpdateTx();
+    }
+};
+
+// Lets two ends offer and switch to COBS, true once both send and read it
+static bool Negotiate(CobsEnd& a, CobsEnd& b)
+{
+    a.peer = &b;
+    b.peer = &a;
+    a.EnableCobs();
+    b.EnableCobs();
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (CobsEnd* end : {&a, &b})
+        {
+            while (end->ReadView())
+            {
+                end->Release();
+            }
+        }
+    }
+    return a.Encoding() && b.Encoding();
+}
+
+static std::vector<uint8_t> Fill(const size_t size, const char* pattern, std::mt19937& rng)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        const uint8_t random = static_cast<uint8_t>(rng());
+        switch (pattern[0])
+        {
+        case 'z': // zeros
+            data[i] = 0;
+            break;
+        case 'f': // no zeros
+            data[i] = 0xFF;
+            break;
+        case 'r': // ramp, a zero every 256
+            data[i] = static_cast<uint8_t>(i);
+            break;
+        case 'n': // random without zeros
+            data[i] = random ? random : 1;
+            break;
+        case 's': // sparse zeros
+            data[i] = rng() % 300 == 0 ? 0 : (random ? random : 1);
+            break;
+        default:
+            data[i] = random;
+            break;
+        }
+    }
+    return data;
+}
+
+// Encodes data whole and in two parts, and decodes it whole, in two parts and
+// in place
+static bool RoundTrip(const std::vector<uint8_t>& data)
+{
+    const std::span<const uint8_t> in(data);
+    std::vector<uint8_t> encoded(cobs::MaxEncodedSize(data.size()));
+    const size_t size = cobs::Encode({in}, encoded.data());
+    if (size > encoded.size()
+        || std::find(encoded.begin(), encoded.begin() + size, cobs::Delimiter)
+               != encoded.begin() + size)
+    {
+        return false;
+    }
+    encoded.resize(size);
+
+    std::vector<uint8_t> split(cobs::MaxEncodedSize(data.size()));
+    for (const size_t at : {size_t{0}, data.size() / 3, data.size()})
+    {
+        const size_t split_size = cobs::Encode({in.first(at), in.subspan(at)}, split.data());
+        if (split_size != size || !std::equal(encoded.begin(), encoded.end(), split.begin()))
+        {
+            return false;
+        }
+    }
+
+    const std::span<const uint8_t> wire(encoded);
+    std::vector<uint8_t> out(size);
+    for (const size_t at : {size_t{0}, size_t{1}, size / 2, size - 1, size})
+    {
+        const size_t decoded = cobs::Decode({wire.first(at), wire.subspan(at)}, out.data());
+        if (decoded != data.size() || !std::equal(data.begin(), data.end(), out.begin()))
+        {
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> in_place = encoded;
+    const size_t decoded = cobs::Decode({in_place}, in_place.data());
+    return decoded == data.size() && std::equal(data.begin(), data.end(), in_place.begin());
+}
+
+static void BenchRoundTrips()
+{
+    std::mt19937 rng(bench::Seed);
+    uint32_t cases = 0;
+    uint32_t failures = 0;
+    double max_overhead = 0;
+
+    // Either side of where a block fills up, once and twice
+    const size_t sizes[] = {0, 1, 2, 253, 254, 255, 256, 507, 508, 509, 762, Max_Frame_Data};
+    for (const size_t size : sizes)
+    {
+        for (const char* pattern : {"zeros", "ff", "ramp", "nonzero", "sparse", "random"})
+        {
+            const std::vector<uint8_t> data = Fill(size, pattern, rng);
+            ++cases;
+            if (!RoundTrip(data))
+            {
+                ++failures;
+                std::printf("round trip failed, size %zu %s\n", size, pattern);
+            }
+
+            std::vector<uint8_t> encoded(cobs::MaxEncodedSize(size));
+            const double overhead = cobs::Encode({std::span<const uint8_t>(data)}, encoded.data());
+            max_overhead = std::max(max_overhead, overhead - size);
+        }
+    }
+
+    // Bad input decodes to nothing
+    const uint8_t truncated[] = {0x05, 0x11, 0x22};
+    const uint8_t zero_code[] = {0x02, 0x11, 0x00, 0x22};
+    uint8_t out[8];
+    cases += 3;
+    failures += cobs::Decode({}, out) != cobs::Invalid;
+    failures += cobs::Decode({truncated}, out) != cobs::Invalid;
+    failures += cobs::Decode({zero_code}, out) != cobs::Invalid;
+
+    bench::Report(Suite_Name, "round_trip",
+                  {
+                      {"cases", static_cast<double>(cases)},
+                      {"failures", static_cast<double>(failures)},
+                      {"max_overhead_bytes", max_overhead},
+                      {"ok", static_cast<double>(failures == 0)},
+                  });
+}
+
+static void BenchCodec(const uint32_t len)
+{
+    std::mt19937 rng(bench::Seed);
+    const std::vector<uint8_t> data = Fill(len, "random", rng);
+    std::vector<uint8_t> encoded(cobs::MaxEncodedSize(len));
+    std::vector<uint8_t> decoded(len);
+    const size_t size = cobs::Encode({std::span<const uint8_t>(data)}, encoded.data());
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "encode_%u", len);
+    bench::Run(Suite_Name, name, Num_Frames, len,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Frames; ++i)
+                   {
+                       bench::DoNotOptimize(
+                           cobs::Encode({std::span<const uint8_t>(data)}, encoded.data()));
+                   }
+               });
+
+    std::snprintf(name, sizeof(name), "decode_%u", len);
+    bench::Run(Suite_Name, name, Num_Frames, len,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Frames; ++i)
+                   {
+                       bench::DoNotOptimize(cobs::Decode(
+                           {std::span<const uint8_t>(encoded.data(), size)}, decoded.data()));
+                   }
+               });
+}
+
+// Frames written and read back through one end looped onto itself
+static void BenchLoopback(const uint32_t len, const bool cobs)
+{
+    CobsEnd end;
+    const bool negotiated = !cobs || Negotiate(end, end);
+    end.peer = &end;
+
+    std::mt19937 rng(bench::Seed);
+    const std::vector<uint8_t> payload = Fill(len, "random", rng);
+    uint32_t read = 0;
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%s_loopback_%u", cobs ? "cobs" : "tlv", len);
+    const uint32_t tx_bytes = end.GetStats().tx_bytes;
+    const uint32_t tx_frames = end.GetStats().tx_frames;
+    bench::Run(Suite_Name, name, Num_Frames, len,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Frames; ++i)
+                   {
+                       end.Write(Frame_Type, {payload});
+                       while (SerialHandler::PacketView view = end.ReadView())
+                       {
+                           read += view.length == len;
+                           end.Release();
+                       }
+                   }
+               });
+
+    const SerialHandler::Stats& stats = end.GetStats();
+    bench::Report(Suite_Name, name,
+                  {
+                      {"wire_bytes_per_frame", static_cast<double>(stats.tx_bytes - tx_bytes)
+                                                   / (stats.tx_frames - tx_frames)},
+                      {"ok", static_cast<double>(negotiated
+                                                 && read == Num_Frames * bench::Repeats)},
+                  });
+}
+
+// Payload bytes of a frame follow from its sequence number, so the receiver
+// can tell a frame that came through intact
+static uint8_t PayloadByte(const uint32_t seq, const size_t i)
+{
+    return static_cast<uint8_t>((seq * 2654435761u) >> ((i % 4) * 8)) ^ static_cast<uint8_t>(i);
+}
+
+// A long stream of frames of random sizes with a byte damaged every so often.
+// A frame counts as lost unless it is read back exactly as written.
+static uint32_t BenchDamage(const bool cobs, const uint32_t tlv_lost)
+{
+    CobsEnd tx;
+    CobsEnd rx;
+    const bool negotiated = !cobs || Negotiate(tx, rx);
+    tx.peer = nullptr;
+    rx.peer = nullptr;
+
+    std::mt19937 rng(bench::Seed);
+    std::uniform_int_distribution<uint32_t> size_of(Min_Damaged_Size, Max_Damaged_Size);
+    std::vector<uint8_t> payload;
+    for (uint32_t seq = 0; seq < Num_Frames; ++seq)
+    {
+        payload.resize(size_of(rng));
+        std::memcpy(payload.data(), &seq, sizeof(seq));
+        for (size_t i = sizeof(seq); i < payload.size(); ++i)
+        {
+            payload[i] = PayloadByte(seq, i);
+        }
+        tx.Write(Frame_Type, {payload});
+    }
+
+    std::uniform_int_distribution<uint32_t> gap(1, 2 * Error_Every);
+    std::vector<uint8_t> wire = tx.wire;
+    uint32_t errors = 0;
+    for (size_t at = gap(rng); at < wire.size(); at += gap(rng))
+    {
+        wire[at] ^= 1 + rng() % 255;
+        ++errors;
+    }
+
+    uint32_t intact = 0;
+    uint32_t damaged = 0;
+    size_t fed = 0;
+    while (fed < wire.size())
+    {
+        fed += rx.Feed(wire.data() + fed, wire.size() - fed);
+        while (SerialHandler::PacketView view = rx.ReadView())
+        {
+            uint32_t seq = UINT32_MAX;
+            bool ok = view.length >= sizeof(seq);
+            if (ok)
+            {
+                std::memcpy(&seq, view.payload.data(), sizeof(seq));
+            }
+            for (size_t i = sizeof(seq); ok && i < view.length; ++i)
+            {
+                ok = view.payload[i] == PayloadByte(seq, i);
+            }
+            (ok ? intact : damaged) += 1;
+            rx.Release();
+        }
+    }
+
+    const uint32_t lost = Num_Frames - intact;
+    const SerialHandler::Stats& stats = rx.GetStats();
+    bench::Report(Suite_Name, cobs ? "damaged_cobs" : "damaged_tlv",
+                  {
+                      {"wire_bytes", static_cast<double>(wire.size())},
+                      {"errors", static_cast<double>(errors)},
+                      {"lost", static_cast<double>(lost)},
+                      {"lost_per_error", static_cast<double>(lost) / std::max<uint32_t>(1, errors)},
+                      {"damaged_read", static_cast<double>(damaged)},
+                      {"sync_losses", static_cast<double>(stats.sync_losses)},
+                      {"header_errors", static_cast<double>(stats.header_errors)},
+                      {"ok", static_cast<double>(negotiated && (!cobs || lost <= tlv_lost))},
+                  });
+    return lost;
+}
+
+// A frame whose encoded bytes end just before, exactly at and just past the
+// end of the rx ring, the delimiter after them landing on either side. Only
+// the one that runs past the end has to be copied out of the ring.
+static void BenchRingBoundary()
+{
+    CobsEnd tx;
+    CobsEnd rx;
+    const bool negotiated = Negotiate(tx, rx);
+    tx.peer = nullptr;
+    rx.peer = nullptr;
+
+    std::mt19937 rng(bench::Seed);
+    const std::vector<uint8_t> payload = Fill(203, "random", rng);
+    tx.wire.clear();
+    tx.Write(Frame_Type, {payload});
+    const std::vector<uint8_t> wire = tx.wire;
+    const uint32_t encoded = wire.size() - 1;
+
+    uint32_t cases = 0;
+    uint32_t failures = 0;
+    for (const int32_t past_end : {-1, 0, 1})
+    {
+        // Empty frames to bring the write index to where the frame has to start
+        const uint32_t start = (Buff_Size - encoded + past_end) % Buff_Size;
+        const std::vector<uint8_t> pad((start - rx.RxWriteIdx()) % Buff_Size, cobs::Delimiter);
+        rx.Feed(pad.data(), pad.size());
+        while (rx.ReadView())
+        {
+            rx.Release();
+        }
+
+        ++cases;
+        rx.Feed(wire.data(), wire.size());
+        const SerialHandler::PacketView view = rx.ReadView();
+        const bool in_place = view && rx.InRxRing(view.payload.data());
+        const bool ok = view && view.length == payload.size()
+                     && std::equal(payload.begin(), payload.end(), view.payload.begin())
+                     && in_place == (past_end <= 0);
+        if (view)
+        {
+            rx.Release();
+        }
+        if (!ok)
+        {
+            ++failures;
+            std::printf("ring boundary failed, %d past the end\n", past_end);
+        }
+    }
+
+    bench::Report(Suite_Name, "ring_boundary",
+                  {
+                      {"cases", static_cast<double>(cases)},
+                      {"failures", static_cast<double>(failures)},
+                      {"ok", static_cast<double>(negotiated && failures == 0)},
+                  });
+}
+
+void BenchCobs()
+{
+    BenchRoundTrips();
+    BenchRingBoundary();
+
+    for (const uint32_t len : {64u, 203u, static_cast<uint32_t>(link_packet_t::Payload_Size)})
+    {
+        BenchCodec(len);
+        BenchLoopback(len, false);
+        BenchLoopback(len, true);
+    }
+
+    const uint32_t tlv_lost = BenchDamage(false, 0);
+    BenchDamage(true, tlv_lost);
+}
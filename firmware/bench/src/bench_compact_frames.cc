@@ -0,0 +1,510 @@
+#include "bench.hh"
+#include "constants.hh"
+#include "link_rate/link_rate.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+
+// Compact headers against the TLV and COBS frames they shrink on the ui to net
+// link. Bytes an audio frame takes on the wire and the time one takes through
+// a loopback in each framing, then frames of every type, length and sequence
+// number the header treats differently written and read back exactly, also
+// with a frame lost on the way, the framing starting over and only one end
+// able to read them.
+static constexpr const char* Suite_Name = "compact_frames";
+static constexpr uint32_t Num_Frames = 20000;
+static constexpr uint32_t Buff_Size = 4096;
+static constexpr uint16_t Audio_Type = static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame);
+static constexpr uint16_t Rate_Type = static_cast<uint16_t>(ui_net_link::UiToNet::LinkRate);
+
+// A ptt frame, the channel, the media chunk header, the audio and the
+// sequence number the link adds
+static constexpr size_t Audio_Frame_Size = ui_net_link::Chunk_Offset
+                                         + ui_net_link::ChunkSchema::Size
+                                         + constants::Audio_Phonic_Sz + ui_net_link::Audio_Seq_Size;
+
+// Bytes the link carries in one 20 ms audio period at the rate it starts at,
+// ten bits to a byte
+static constexpr double Period_Bytes = LinkRate::Rates[0] / 10.0 * 0.02;
+
+enum class Framing
+{
+    Tlv,
+    Cobs,
+    Compact,
+};
+
+static const char* FramingName(const Framing framing)
+{
+    switch (framing)
+    {
+    case Framing::Tlv:
+        return "tlv";
+    case Framing::Cobs:
+        return "cobs";
+    default:
+        return "compact";
+    }
+}
+
+struct CompactEndStorage
+{
+    uint8_t rx_packet_storage[Buff_Size];
+    uint8_t tx_storage[Buff_Size];
+    uint8_t realtime_tx_storage[Buff_Size];
+    uint8_t rx_storage[Buff_Size];
+};
+
+// A link with no uart. What it transmits is held until Pump, which hands it
+// to the peer's rx ring or records it when there is no peer, so frames can
+// back up behind one in flight and be aggregated. Headers carry a crc as on
+// the real link, and only ui link types are accepted unless it has no limits.
+class CompactEnd : private CompactEndStorage, public SerialHandler
+{
+public:
+    explicit CompactEnd(const bool limits = true) :
+        SerialHandler(*rx_packet_storage,
+                      Buff_Size,
+                      *tx_storage,
+                      Buff_Size,
+                      *realtime_tx_storage,
+                      Buff_Size,
+                      *rx_storage,
+                      Buff_Size,
+                      Transmit,
+                      this),
+        peer(nullptr),
+        wire_bytes(0),
+        pending(false)
+    {
+        EnableHeaderCrc();
+        if (limits)
+        {
+            SetTypeLimits(ui_net_link::Type_Limits);
+        }
+    }
+
+    uint32_t Feed(const uint8_t* data, const uint32_t len)
+    {
+        return rx_ring.Write(data, std::min<uint32_t>(len, rx_ring.Free()));
+    }
+
+    // Sends what is in flight and anything it starts, false when the peer has
+    // no room for it yet
+    bool Pump()
+    {
+        while (pending)
+        {
+            if (peer)
+            {
+                if (peer->rx_ring.Free() < tx_chunk.size())
+                {
+                    return false;
+                }
+                peer->Feed(tx_chunk.data(), tx_chunk.size());
+            }
+            else
+            {
+                wire.insert(wire.end(), tx_chunk.begin(), tx_chunk.end());
+            }
+            wire_bytes += tx_chunk.size();
+            pending = false;
+            UpdateTx();
+        }
+        return true;
+    }
+
+    bool Encoding() const
+    {
+        return tx_cobs && rx_cobs;
+    }
+
+    bool Compact() const
+    {
+        return tx_compact && rx_compact;
+    }
+
+    bool Idle() const
+    {
+        return !pending;
+    }
+
+    CompactEnd* peer;
+    std::vector<uint8_t> wire;
+    uint64_t wire_bytes;
+
+private:
+    static void Transmit(void* arg)
+    {
+        static_cast<CompactEnd*>(arg)->pending = true;
+    }
+
+    bool pending;
+};
+
+// A frame written and what it has to read back as
+struct SentFrame
+{
+    uint16_t type;
+    std::vector<uint8_t> payload;
+};
+
+// Frames read back in order against the frames written. One that is not the
+// next expected skips the ones before it as lost, one that matches none of
+// them is wrong.
+struct FrameLog
+{
+    std::deque<SentFrame> expected;
+    uint32_t read = 0;
+    uint32_t lost = 0;
+    uint32_t wrong = 0;
+
+    void Take(const uint16_t type, std::span<const uint8_t> payload)
+    {
+        ++read;
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            const SentFrame& frame = expected[i];
+            if (frame.type == type && frame.payload.size() == payload.size()
+                && std::equal(payload.begin(), payload.end(), frame.payload.begin()))
+            {
+                lost += i;
+                expected.erase(expected.begin(), expected.begin() + i + 1);
+                return;
+            }
+        }
+        ++wrong;
+    }
+
+    bool Exact() const
+    {
+        return expected.empty() && lost == 0 && wrong == 0;
+    }
+};
+
+// Moves everything in flight both ways and reads it, until nothing is left
+static void Exchange(CompactEnd& a, CompactEnd& b, FrameLog* log)
+{
+    for (int i = 0; i < 64; ++i)
+    {
+        a.Pump();
+        b.Pump();
+        bool read = false;
+        for (CompactEnd* end : {&a, &b})
+        {
+            while (const SerialHandler::PacketView view = end->ReadView())
+            {
+                if (log && end == &b)
+                {
+                    log->Take(view.type, view.payload);
+                }
+                end->Release();
+                read = true;
+            }
+        }
+        if (!read && a.Idle() && b.Idle())
+        {
+            return;
+        }
+    }
+}
+
+// Lets two ends offer and switch to the framing, true once both send and read
+// it both ways
+static bool Negotiate(CompactEnd& a, CompactEnd& b, const Framing framing)
+{
+    a.peer = &b;
+    b.peer = &a;
+    if (framing == Framing::Tlv)
+    {
+        return true;
+    }
+
+    for (CompactEnd* end : {&a, &b})
+    {
+        end->EnableCobs();
+        if (framing == Framing::Compact)
+        {
+            end->EnableCompactHeaders(ui_net_link::Seq_Types);
+        }
+    }
+    Exchange(a, b, nullptr);
+    return a.Encoding() && b.Encoding()
+        && (framing != Framing::Compact || (a.Compact() && b.Compact()));
+}
+
+// Payload bytes follow from the frame's number, so every frame is different
+static std::vector<uint8_t> Payload(const uint32_t num, const size_t size)
+{
+    std::vector<uint8_t> payload(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        payload[i] = static_cast<uint8_t>((num * 2654435761u) >> ((i % 4) * 8))
+                   ^ static_cast<uint8_t>(i);
+    }
+    std::memcpy(payload.data(), &num, std::min(size, sizeof(num)));
+    return payload;
+}
+
+// An audio frame ends in its sequence number
+static std::vector<uint8_t> AudioPayload(const uint32_t num, const size_t size, const uint16_t seq)
+{
+    std::vector<uint8_t> payload = Payload(num, size);
+    if (size >= sizeof(seq))
+    {
+        std::memcpy(payload.data() + size - sizeof(seq), &seq, sizeof(seq));
+    }
+    return payload;
+}
+
+static void Send(CompactEnd& end,
+                 FrameLog& log,
+                 const uint16_t type,
+                 std::vector<uint8_t> payload,
+                 const SerialHandler::TxClass tx_class = SerialHandler::TxClass::Bulk)
+{
+    end.Write(type, {payload}, tx_class);
+    log.expected.push_back({type, std::move(payload)});
+}
+
+// Audio frames, size bytes each, written and read back one at a time through
+// a loopback, for the bytes each takes on the wire and the time it takes
+static void BenchAudio(const Framing framing)
+{
+    CompactEnd end;
+    const bool negotiated = Negotiate(end, end, framing);
+
+    std::vector<uint8_t> payload = Payload(0, Audio_Frame_Size);
+    uint16_t seq = 0;
+    uint32_t read = 0;
+    const uint64_t wire_bytes = end.wire_bytes;
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%s_audio", FramingName(framing));
+    bench::Run(Suite_Name, name, Num_Frames, Audio_Frame_Size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Frames; ++i, ++seq)
+                   {
+                       std::memcpy(payload.data() + Audio_Frame_Size - sizeof(seq), &seq,
+                                   sizeof(seq));
+                       end.Write(Audio_Type, {payload}, SerialHandler::TxClass::Realtime);
+                       end.Pump();
+                       while (const SerialHandler::PacketView view = end.ReadView())
+                       {
+                           read += view.length == Audio_Frame_Size
+                                && std::memcmp(view.payload.data() + Audio_Frame_Size
+                                                   - sizeof(seq),
+                                               &seq, sizeof(seq))
+                                       == 0;
+                           end.Release();
+                       }
+                   }
+               });
+
+    const double per_frame =
+        static_cast<double>(end.wire_bytes - wire_bytes) / (Num_Frames * bench::Repeats);
+    bench::Report(Suite_Name, name,
+                  {
+                      {"payload_bytes", static_cast<double>(Audio_Frame_Size)},
+                      {"wire_bytes_per_frame", per_frame},
+                      {"overhead_bytes", per_frame - Audio_Frame_Size},
+                      {"slot_share", per_frame / Period_Bytes},
+                      {"ok", static_cast<double>(negotiated
+                                                 && read == Num_Frames * bench::Repeats)},
+                  });
+}
+
+// Every kind of header the encoder picks between, through two ends. Types in
+// the table and escaped, lengths either side of a varint byte, sequence
+// numbers wrapping through both bytes and jumping, and enough frames of one
+// length for the explicit header to come round again.
+static void BenchRoundTrip(const char* name, const bool limits, const bool flow)
+{
+    CompactEnd a(limits);
+    CompactEnd b(limits);
+    if (flow)
+    {
+        for (CompactEnd* end : {&a, &b})
+        {
+            end->SetTxDepth(SerialHandler::TxClass::Realtime, SerialHandler::Max_Tx_Frames);
+            end->EnableAggregation(3);
+            end->EnableFlowControl();
+        }
+    }
+    const bool negotiated = Negotiate(a, b, Framing::Compact);
+
+    FrameLog log;
+    uint32_t num = 0;
+    const size_t lengths[] = {0, 1, 2, 63, 64, 127, 128, 129, link_packet_t::Payload_Size};
+    for (const size_t length : lengths)
+    {
+        for (uint32_t i = 0; i < 3; ++i, ++num)
+        {
+            Send(a, log, Rate_Type, Payload(num, std::min<size_t>(length, 64)));
+            Send(a, log, Audio_Type, AudioPayload(num, length, num));
+            Exchange(a, b, &log);
+        }
+    }
+
+    // Through the low byte and the whole sequence number wrapping, with bursts
+    // that get aggregated when it is on
+    uint16_t seq = 0xFF00;
+    for (uint32_t i = 0; i < 8 * SerialHandler::Compact_Refresh; ++i)
+    {
+        seq += i % 100 == 99 ? 100 : 0;
+        for (int burst = 0; burst < (flow ? 3 : 1); ++burst, ++num)
+        {
+            Send(a, log, Audio_Type, AudioPayload(num, Audio_Frame_Size, seq++),
+                 SerialHandler::TxClass::Realtime);
+        }
+        Exchange(a, b, &log);
+    }
+
+    bench::Report(Suite_Name, name,
+                  {
+                      {"frames", static_cast<double>(log.read + log.lost + log.expected.size())},
+                      {"tx_frames", static_cast<double>(a.GetStats().tx_frames)},
+                      {"lost", static_cast<double>(log.lost + log.expected.size())},
+                      {"wrong", static_cast<double>(log.wrong)},
+                      {"header_errors", static_cast<double>(b.GetStats().header_errors)},
+                      {"ok", static_cast<double>(negotiated && log.Exact()
+                                                 && b.GetStats().header_errors == 0)},
+                  });
+}
+
+// Audio frames with the one at drop lost on the wire, after a length change
+// at Length_Change. Losing the frame that carries a new length costs the
+// frames up to the next explicit header, any other frame costs only itself,
+// and none are ever read back wrong.
+static void BenchLost(const char* name, const uint32_t drop, const uint32_t max_lost)
+{
+    static constexpr uint32_t Length_Change = 10;
+    static constexpr uint32_t Frames = 4 * SerialHandler::Compact_Refresh;
+
+    CompactEnd tx;
+    CompactEnd rx;
+    const bool negotiated = Negotiate(tx, rx, Framing::Compact);
+    tx.peer = nullptr;
+
+    FrameLog log;
+    for (uint32_t num = 0; num < Frames; ++num)
+    {
+        const size_t size = num < Length_Change ? Audio_Frame_Size : Audio_Frame_Size - 20;
+        Send(tx, log, Audio_Type, AudioPayload(num, size, num));
+        tx.Pump();
+    }
+
+    // Each frame ends in a delimiter
+    std::vector<uint8_t> wire;
+    uint32_t frame = 0;
+    for (const uint8_t byte : tx.wire)
+    {
+        if (frame != drop)
+        {
+            wire.push_back(byte);
+        }
+        frame += byte == cobs::Delimiter;
+    }
+
+    size_t fed = 0;
+    while (fed < wire.size())
+    {
+        fed += rx.Feed(wire.data() + fed, wire.size() - fed);
+        while (const SerialHandler::PacketView view = rx.ReadView())
+        {
+            log.Take(view.type, view.payload);
+            rx.Release();
+        }
+    }
+
+    bench::Report(Suite_Name, name,
+                  {
+                      {"frames", static_cast<double>(Frames)},
+                      {"lost", static_cast<double>(log.lost + log.expected.size())},
+                      {"wrong", static_cast<double>(log.wrong)},
+                      {"header_errors", static_cast<double>(rx.GetStats().header_errors)},
+                      {"ok", static_cast<double>(negotiated && log.expected.empty()
+                                                 && log.wrong == 0 && log.lost >= 1
+                                                 && log.lost <= max_lost)},
+                  });
+}
+
+// Either end going back to TLV mid stream, as after the link is lost, and
+// both switching to compact headers again with no frame lost on the way
+static void BenchReset()
+{
+    CompactEnd a;
+    CompactEnd b;
+    const bool negotiated = Negotiate(a, b, Framing::Compact);
+
+    FrameLog log;
+    uint32_t resets = 0;
+    for (uint32_t num = 0; num < 4 * SerialHandler::Compact_Refresh; ++num)
+    {
+        if (num % SerialHandler::Compact_Refresh == 25)
+        {
+            (resets++ % 2 ? b : a).ResetFraming();
+        }
+        Send(a, log, Audio_Type, AudioPayload(num, Audio_Frame_Size, num));
+        Exchange(a, b, &log);
+    }
+
+    bench::Report(Suite_Name, "reset",
+                  {
+                      {"resets", static_cast<double>(resets)},
+                      {"lost", static_cast<double>(log.lost + log.expected.size())},
+                      {"wrong", static_cast<double>(log.wrong)},
+                      {"ok", static_cast<double>(negotiated && log.Exact() && a.Compact()
+                                                 && b.Compact())},
+                  });
+}
+
+// Only one end reads compact headers, so both stay on plain COBS frames
+static void BenchOneSided()
+{
+    CompactEnd a;
+    CompactEnd b;
+    const bool negotiated = Negotiate(a, b, Framing::Cobs);
+    a.EnableCompactHeaders(ui_net_link::Seq_Types);
+    Exchange(a, b, nullptr);
+
+    FrameLog log;
+    const uint64_t wire_bytes = a.wire_bytes;
+    for (uint32_t num = 0; num < SerialHandler::Compact_Refresh; ++num)
+    {
+        Send(a, log, Audio_Type, AudioPayload(num, Audio_Frame_Size, num));
+        Exchange(a, b, &log);
+    }
+
+    const double per_frame =
+        static_cast<double>(a.wire_bytes - wire_bytes) / SerialHandler::Compact_Refresh;
+    bench::Report(Suite_Name, "one_sided",
+                  {
+                      {"wire_bytes_per_frame", per_frame},
+                      {"ok", static_cast<double>(negotiated && a.Encoding() && b.Encoding()
+                                                 && !a.Compact() && !b.Compact()
+                                                 && log.Exact())},
+                  });
+}
+
+void BenchCompactFrames()
+{
+    for (const Framing framing : {Framing::Tlv, Framing::Cobs, Framing::Compact})
+    {
+        BenchAudio(framing);
+    }
+
+    BenchRoundTrip("round_trip", true, false);
+    BenchRoundTrip("round_trip_escaped", false, false);
+    BenchRoundTrip("round_trip_aggregated", true, true);
+    BenchLost("lost_explicit", 10, SerialHandler::Compact_Refresh + 1);
+    BenchLost("lost_elided", 20, 1);
+    BenchReset();
+    BenchOneSided();
+}
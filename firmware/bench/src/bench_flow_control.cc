@@ -0,0 +1,250 @@
+#include "bench.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+// Simulated ui to net uart both ways with net sending more than the ui can
+// take for the whole run. Audio goes down every frame period and ai answers
+// come in bursts of full packets faster than the line rate, while the ui main
+// loop only reads between screen updates that keep it busy for a while. The
+// ui rx ring is the real one, so without flow control the uart runs into
+// bytes that have not been read yet.
+static constexpr const char* Suite_Name = "flow_control";
+static constexpr double Baud = 460800;
+static constexpr double Byte_Us = 10 * 1e6 / Baud;
+static constexpr double Duration_Us = 30e6;
+static constexpr double Drain_Us = 2e6;
+
+static constexpr uint32_t Ui_Rx_Buff_Size = 2048;
+static constexpr uint32_t Net_Rx_Buff_Size = 16384;
+static constexpr uint32_t Tx_Buff_Size = 8192;
+static constexpr uint32_t Realtime_Tx_Buff_Size = 2048;
+
+static constexpr double Audio_Period_Us = 20e3;
+static constexpr uint32_t Audio_Size = 200;
+static constexpr uint16_t Audio_Depth = 4;
+
+static constexpr double Ai_Period_Us = 100e3;
+static constexpr uint32_t Ai_Chunks = 8;
+
+// The ui reads every poll except while it is busy drawing
+static constexpr double Poll_Us = 1e3;
+static constexpr double Busy_Period_Us = 100e3;
+static constexpr double Busy_Us = 40e3;
+
+static constexpr uint16_t Bulk_Type = 0x0062;
+
+struct SimEndStorage
+{
+    explicit SimEndStorage(const uint32_t rx_size) :
+        rx_packet_storage(link_packet_t::Packet_Size),
+        tx_storage(Tx_Buff_Size),
+        realtime_tx_storage(Realtime_Tx_Buff_Size),
+        rx_storage(rx_size)
+    {
+    }
+
+    std::vector<uint8_t> rx_packet_storage;
+    std::vector<uint8_t> tx_storage;
+    std::vector<uint8_t> realtime_tx_storage;
+    std::vector<uint8_t> rx_storage;
+};
+
+// One end of the link, its transmit takes as long as the uart would and what
+// arrives past the free space of the rx ring is lost like a dma overrun
+class SimEnd : private SimEndStorage, public SerialHandler
+{
+public:
+    explicit SimEnd(const uint32_t rx_size) :
+        SimEndStorage(rx_size),
+        SerialHandler(*rx_packet_storage.data(),
+                      rx_packet_storage.size(),
+                      *tx_storage.data(),
+                      tx_storage.size(),
+                      *realtime_tx_storage.data(),
+                      realtime_tx_storage.size(),
+                      *rx_storage.data(),
+                      rx_storage.size(),
+                      Transmit,
+                      this)
+    {
+        EnableHeaderCrc();
+    }
+
+    void Complete(SimEnd& receiver)
+    {
+        const size_t stored = std::min<size_t>(tx_chunk.size(), receiver.rx_ring.Free());
+        receiver.rx_ring.Write(tx_chunk.data(), stored);
+        receiver.overrun_bytes += tx_chunk.size() - stored;
+        wire_bytes += tx_chunk.size();
+
+        done_at = std::numeric_limits<double>::infinity();
+        UpdateTx();
+    }
+
+    double now = 0;
+    double done_at = std::numeric_limits<double>::infinity();
+    uint64_t wire_bytes = 0;
+    uint64_t overrun_bytes = 0;
+
+private:
+    static void Transmit(void* arg)
+    {
+        SimEnd* self = static_cast<SimEnd*>(arg);
+        self->done_at = self->now + self->tx_chunk.size() * Byte_Us;
+    }
+};
+
+// Frames carry a sequence number and are filled with its low byte so a frame
+// put together from the wrong bytes shows up
+struct FrameCheck
+{
+    uint32_t next_seq = 0;
+    uint32_t received = 0;
+    uint32_t bogus = 0;
+
+    void Fill(uint8_t* payload, const uint32_t size)
+    {
+        const uint32_t seq = next_seq++;
+        std::memcpy(payload, &seq, sizeof(seq));
+        std::memset(payload + sizeof(seq), static_cast<uint8_t>(seq), size - sizeof(seq));
+    }
+
+    void Check(std::span<const uint8_t> payload)
+    {
+        uint32_t seq = 0;
+        bool intact = payload.size() >= sizeof(seq);
+        if (intact)
+        {
+            std::memcpy(&seq, payload.data(), sizeof(seq));
+            intact = seq < next_seq;
+        }
+        for (size_t i = sizeof(seq); intact && i < payload.size(); ++i)
+        {
+            intact = payload[i] == static_cast<uint8_t>(seq);
+        }
+        intact ? ++received : ++bogus;
+    }
+};
+
+static void Drain(SimEnd& end, FrameCheck& check)
+{
+    while (const SerialHandler::PacketView view = end.ReadView())
+    {
+        check.Check(view.payload);
+        end.Release();
+    }
+}
+
+static void Simulate(const char* name, const bool flow_control)
+{
+    SimEnd net(Net_Rx_Buff_Size);
+    SimEnd ui(Ui_Rx_Buff_Size);
+    net.SetTxDepth(SerialHandler::TxClass::Realtime, Audio_Depth);
+    ui.SetTxDepth(SerialHandler::TxClass::Realtime, Audio_Depth);
+    if (flow_control)
+    {
+        net.EnableFlowControl();
+        ui.EnableFlowControl();
+    }
+
+    FrameCheck down;
+    FrameCheck up;
+    uint64_t up_data_bytes = 0;
+
+    double next_audio = 0;
+    double next_ai = Ai_Period_Us / 2;
+    double next_poll = 0;
+
+    uint8_t payload[link_packet_t::Payload_Size] = {};
+    const uint32_t frame_overhead = link_packet_t::Sync_Word_Size + SerialHandler::Max_Header_Size;
+
+    while (true)
+    {
+        const double now = std::min({next_audio, next_ai, next_poll, net.done_at, ui.done_at});
+        if (now > Duration_Us + Drain_Us)
+        {
+            break;
+        }
+        net.now = now;
+        ui.now = now;
+        const bool offering = now < Duration_Us;
+
+        if (now == net.done_at)
+        {
+            net.Complete(ui);
+        }
+        else if (now == ui.done_at)
+        {
+            ui.Complete(net);
+        }
+        else if (now == next_poll)
+        {
+            // Net reads whenever its uart task hands it bytes
+            Drain(net, up);
+            if (std::fmod(now, Busy_Period_Us) >= Busy_Us)
+            {
+                Drain(ui, down);
+            }
+            next_poll += Poll_Us;
+        }
+        else if (now == next_audio)
+        {
+            if (offering)
+            {
+                down.Fill(payload, Audio_Size);
+                net.Write(static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame),
+                          {{payload, Audio_Size}}, SerialHandler::TxClass::Realtime);
+
+                up.Fill(payload, Audio_Size);
+                ui.Write(static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame),
+                         {{payload, Audio_Size}}, SerialHandler::TxClass::Realtime);
+                up_data_bytes += frame_overhead + Audio_Size;
+            }
+            next_audio += Audio_Period_Us;
+        }
+        else
+        {
+            for (uint32_t i = 0; offering && i < Ai_Chunks; ++i)
+            {
+                down.Fill(payload, link_packet_t::Payload_Size);
+                net.Write(Bulk_Type, {{payload, link_packet_t::Payload_Size}});
+            }
+            next_ai += Ai_Period_Us;
+        }
+    }
+
+    // Frames refused by the sender never made it onto the wire, everything
+    // else has to arrive once the link has drained
+    const uint32_t audio_drops = net.TxDrops(SerialHandler::TxClass::Realtime);
+    const uint32_t bulk_drops = net.TxDrops(SerialHandler::TxClass::Bulk);
+    const uint32_t lost = down.next_seq - audio_drops - bulk_drops - down.received;
+    const double up_sent = up.next_seq - ui.TxDrops(SerialHandler::TxClass::Realtime);
+
+    // What the credit frames going back up cost, as a share of the line
+    const double credit_bytes = ui.wire_bytes - up_data_bytes;
+    const double line_bytes = (Duration_Us + Drain_Us) / Byte_Us;
+    bench::Report(Suite_Name, name,
+                  {
+                      {"offered", static_cast<double>(down.next_seq)},
+                      {"audio_drops", static_cast<double>(audio_drops)},
+                      {"bulk_drops", static_cast<double>(bulk_drops)},
+                      {"received", static_cast<double>(down.received)},
+                      {"lost", static_cast<double>(lost)},
+                      {"bogus", static_cast<double>(down.bogus)},
+                      {"overrun_bytes", static_cast<double>(ui.overrun_bytes)},
+                      {"unsent", static_cast<double>(net.Unsent())},
+                      {"uplink_lost", up_sent - up.received},
+                      {"uplink_credit_pct_of_line", 100 * credit_bytes / line_bytes},
+                  });
+}
+
+void BenchFlowControl()
+{
+    Simulate("overload_no_credit", false);
+    Simulate("overload_credit", true);
+}
@@ -0,0 +1,344 @@
+#include "bench.hh"
+#include "link_latency/link_latency.hh"
+#include "link_packet_t.hh"
+#include "serial_handler/serial_handler.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+using link_latency::Histogram;
+
+// Continuous latency pings over a model of the ui to net link, checked
+// against the delays the model knows are true. The ping goes out the ui tx
+// queue, waits for net's link task to wake, is answered after a moment and
+// comes back through net's tx queue to a ui main loop that is sometimes busy.
+// Both uarts carry audio, which goes ahead of the pings. Net's clock has its
+// own offset and rate, so the one way times rest on the offset estimate.
+static constexpr const char* Suite_Name = "link_latency";
+static constexpr double Baud = 460800;
+static constexpr double Byte_Us = 10 * 1e6 / Baud;
+static constexpr double Duration_Us = 120e6;
+static constexpr uint32_t Period_Ms = 100;
+
+static constexpr double Frame_Overhead =
+    link_packet_t::Sync_Word_Size + SerialHandler::Max_Header_Size;
+static constexpr double Audio_Bytes = Frame_Overhead + 1 + 200 + 2;
+static constexpr double Ping_Bytes = Frame_Overhead + link_latency::Pong_Size;
+static constexpr double Audio_Period_Us = 20e3;
+static constexpr double Poll_Us = 1e3;
+
+// Net's link task wakes this long after bytes arrive and takes this long to
+// answer
+static constexpr double Max_Wake_Us = 2e3;
+static constexpr double Min_Answer_Us = 50;
+static constexpr double Max_Answer_Us = 500;
+
+// The offset comes from the quickest pings, which still spent a little time
+// on the link, and has to stay well inside the first histogram bucket
+static constexpr double Max_Mean_Error_Us = Histogram::Bucket_Base_Us * 2;
+
+struct Scenario
+{
+    const char* name;
+    bool audio_up;
+    // Net audio comes in bursts of this many frames every burst period, one
+    // frame every audio period when it is 1, none when 0
+    uint32_t down_burst;
+    double down_burst_period_us;
+    double net_ppm;
+    // The ui main loop does not read for busy_us out of every busy period
+    double busy_us;
+    double busy_period_us;
+};
+
+struct LineFrame
+{
+    bool ping;
+    std::vector<uint8_t> payload;
+};
+
+// One direction of the uart, audio goes ahead of anything else waiting
+struct Line
+{
+    double done = std::numeric_limits<double>::infinity();
+    std::deque<LineFrame> realtime;
+    std::deque<LineFrame> bulk;
+    LineFrame current;
+
+    void Queue(const double now, LineFrame frame)
+    {
+        (frame.ping ? bulk : realtime).push_back(std::move(frame));
+        Start(now);
+    }
+
+    void Start(const double now)
+    {
+        if (!std::isinf(done))
+        {
+            return;
+        }
+
+        std::deque<LineFrame>& queue = realtime.empty() ? bulk : realtime;
+        if (queue.empty())
+        {
+            return;
+        }
+
+        current = std::move(queue.front());
+        queue.pop_front();
+        done = now + (current.ping ? Ping_Bytes : Audio_Bytes) * Byte_Us;
+    }
+};
+
+// True times of one ping
+struct PingTimes
+{
+    double sent;
+    double net_rx;
+    double net_tx;
+};
+
+struct Errors
+{
+    double sum = 0;
+    double max = 0;
+    uint32_t count = 0;
+
+    void Add(const double error)
+    {
+        sum += std::abs(error);
+        max = std::max(max, std::abs(error));
+        ++count;
+    }
+
+    double Mean() const
+    {
+        return count ? sum / count : 0;
+    }
+};
+
+static void Simulate(const Scenario& scenario)
+{
+    std::mt19937 rng(bench::Seed);
+    std::uniform_real_distribution<double> wake(0, Max_Wake_Us);
+    std::uniform_real_distribution<double> answer(Min_Answer_Us, Max_Answer_Us);
+
+    // Net's clock starts far from ours and runs at its own rate
+    const double net_offset_us = 123456789;
+    const double net_rate = 1 + scenario.net_ppm * 1e-6;
+    auto ui_clock = [](const double t) { return static_cast<uint32_t>(static_cast<uint64_t>(t)); };
+    auto net_clock = [&](const double t)
+    { return static_cast<uint32_t>(static_cast<uint64_t>(net_offset_us + t * net_rate)); };
+
+    Line up;
+    Line down;
+    double now = 0;
+
+    struct Sender
+    {
+        Line* line;
+        double now;
+    } sender{&up, 0};
+
+    link_latency::LinkLatency latency(
+        [](void* arg, std::span<const uint8_t> payload)
+        {
+            Sender* self = static_cast<Sender*>(arg);
+            self->line->Queue(self->now, {true, {payload.begin(), payload.end()}});
+        },
+        &sender);
+    latency.SetPeriod(Period_Ms, 0);
+
+    std::map<uint16_t, PingTimes> truth;
+    uint16_t next_seq = 1;
+
+    // Pings net has read and will answer, by when it answers
+    struct Pending
+    {
+        double answer_at;
+        double read_at;
+        std::vector<uint8_t> ping;
+    };
+    std::deque<Pending> pending;
+    std::deque<std::pair<double, std::vector<uint8_t>>> waking;
+
+    // Pongs the ui has not read yet
+    std::deque<std::vector<uint8_t>> inbox;
+
+    Histogram true_up{};
+    Histogram true_down{};
+    Errors up_error;
+    Errors down_error;
+    uint32_t bucket_mismatch = 0;
+
+    double next_up_audio = scenario.audio_up ? Audio_Period_Us / 3 : Duration_Us;
+    const double down_period =
+        scenario.down_burst > 1 ? scenario.down_burst_period_us : Audio_Period_Us;
+    double next_down_audio = scenario.down_burst > 0 ? 0 : Duration_Us;
+    double next_poll = 0;
+
+    while (true)
+    {
+        const double wake_at = waking.empty() ? Duration_Us : waking.front().first;
+        const double answer_at = pending.empty() ? Duration_Us : pending.front().answer_at;
+        now = std::min({next_up_audio, next_down_audio, up.done, down.done, wake_at, answer_at,
+                        next_poll});
+        if (now >= Duration_Us)
+        {
+            break;
+        }
+        sender.now = now;
+
+        if (now == up.done)
+        {
+            up.done = std::numeric_limits<double>::infinity();
+            if (up.current.ping)
+            {
+                waking.push_back({now + wake(rng), std::move(up.current.payload)});
+            }
+            up.Start(now);
+        }
+        else if (now == down.done)
+        {
+            down.done = std::numeric_limits<double>::infinity();
+            if (down.current.ping)
+            {
+                inbox.push_back(std::move(down.current.payload));
+            }
+            down.Start(now);
+        }
+        else if (now == wake_at)
+        {
+            pending.push_back({now + answer(rng), now, std::move(waking.front().second)});
+            waking.pop_front();
+        }
+        else if (now == answer_at)
+        {
+            const Pending ping = std::move(pending.front());
+            pending.pop_front();
+
+            uint8_t pong[link_latency::Pong_Size];
+            link_latency::Answer(ping.ping, pong, net_clock(ping.read_at), net_clock(now));
+            uint16_t seq;
+            std::memcpy(&seq, pong, sizeof(seq));
+            truth[seq].net_rx = ping.read_at;
+            truth[seq].net_tx = now;
+            down.Queue(now, {true, {pong, pong + sizeof(pong)}});
+        }
+        else if (now == next_up_audio)
+        {
+            up.Queue(now, {false, {}});
+            next_up_audio += Audio_Period_Us;
+        }
+        else if (now == next_down_audio)
+        {
+            for (uint32_t i = 0; i < scenario.down_burst; ++i)
+            {
+                down.Queue(now, {false, {}});
+            }
+            next_down_audio += down_period;
+        }
+        else
+        {
+            // The ui main loop, reading and sending happen when it is not
+            // busy drawing
+            const bool busy = scenario.busy_us > 0
+                           && std::fmod(now, scenario.busy_period_us) < scenario.busy_us;
+            if (!busy)
+            {
+                while (!inbox.empty())
+                {
+                    const link_latency::LinkLatency::Report& report = latency.GetReport();
+                    const uint32_t ups = report.up.count;
+                    latency.Receive(inbox.front(), ui_clock(now));
+
+                    uint16_t seq;
+                    std::memcpy(&seq, inbox.front().data(), sizeof(seq));
+                    inbox.pop_front();
+
+                    if (report.up.count == ups)
+                    {
+                        continue;
+                    }
+
+                    const PingTimes& times = truth[seq];
+                    const double up_us = times.net_rx - times.sent;
+                    const double down_us = now - times.net_tx;
+                    up_error.Add(report.up.last_us - up_us);
+                    down_error.Add(report.down.last_us - down_us);
+                    true_up.Record(static_cast<uint32_t>(up_us));
+                    true_down.Record(static_cast<uint32_t>(down_us));
+
+                    bucket_mismatch += Histogram::Bucket(report.up.last_us)
+                                    != Histogram::Bucket(static_cast<uint32_t>(up_us));
+                    bucket_mismatch += Histogram::Bucket(report.down.last_us)
+                                    != Histogram::Bucket(static_cast<uint32_t>(down_us));
+                }
+
+                const uint32_t sent = latency.GetReport().sent;
+                latency.Poll(static_cast<uint32_t>(now / 1e3), ui_clock(now));
+                if (latency.GetReport().sent != sent)
+                {
+                    truth[next_seq++] = {now, 0, 0};
+                }
+            }
+            next_poll += Poll_Us;
+        }
+    }
+
+    const link_latency::LinkLatency::Report& report = latency.GetReport();
+    auto p = [](const Histogram& histogram, const double share)
+    { return static_cast<double>(histogram.Percentile(share)); };
+
+    // The percentiles are bucket edges, the estimate has to land the same
+    const bool ok = report.answered > 0 && p(report.up, 0.5) == p(true_up, 0.5)
+                 && p(report.up, 0.99) == p(true_up, 0.99)
+                 && p(report.down, 0.5) == p(true_down, 0.5)
+                 && p(report.down, 0.99) == p(true_down, 0.99)
+                 && up_error.Mean() < Max_Mean_Error_Us && down_error.Mean() < Max_Mean_Error_Us;
+
+    bench::Report(Suite_Name, scenario.name,
+                  {
+                      {"sent", static_cast<double>(report.sent)},
+                      {"answered", static_cast<double>(report.answered)},
+                      {"round_trip_p50_us", p(report.round_trip, 0.5)},
+                      {"round_trip_p99_us", p(report.round_trip, 0.99)},
+                      {"net_held_p99_us", p(report.net_held, 0.99)},
+                      {"up_p50_us", p(report.up, 0.5)},
+                      {"up_p50_true_us", p(true_up, 0.5)},
+                      {"up_p99_us", p(report.up, 0.99)},
+                      {"up_p99_true_us", p(true_up, 0.99)},
+                      {"down_p50_us", p(report.down, 0.5)},
+                      {"down_p50_true_us", p(true_down, 0.5)},
+                      {"down_p99_us", p(report.down, 0.99)},
+                      {"down_p99_true_us", p(true_down, 0.99)},
+                      {"up_err_mean_us", up_error.Mean()},
+                      {"up_err_max_us", up_error.max},
+                      {"down_err_mean_us", down_error.Mean()},
+                      {"down_err_max_us", down_error.max},
+                      {"bucket_mismatch_pct",
+                       100.0 * bucket_mismatch / std::max<uint32_t>(1, 2 * up_error.count)},
+                      {"ok", static_cast<double>(ok)},
+                  });
+}
+
+void BenchLinkLatency()
+{
+    const Scenario scenarios[] = {
+        {"idle", false, 0, 0, 0, 0, 0},
+        {"audio_both_ways", true, 1, 0, 0, 0, 0},
+        {"audio_drift_40ppm", true, 1, 0, 40, 0, 0},
+        {"net_bursts_drift_20ppm", true, 5, 100e3, -20, 0, 0},
+        {"ui_busy_drift_40ppm", true, 1, 0, 40, 40e3, 100e3},
+    };
+
+    for (const Scenario& scenario : scenarios)
+    {
+        Simulate(scenario);
+    }
+}
@@ -0,0 +1,79 @@
+#include "bench.hh"
+#include "serial_packet.hh"
+#include "ui_net_link.hh"
+#include <random>
+
+static constexpr const char* Suite_Name = "link_packets";
+static constexpr uint32_t Num_Ops = 200000;
+
+void BenchLinkPackets()
+{
+    std::mt19937 rng(bench::Seed);
+
+    ui_net_link::AudioObject audio;
+    audio.channel_id = ui_net_link::Channel_Id::Ptt;
+    for (auto& byte : audio.data)
+    {
+        byte = rng();
+    }
+
+    link_packet_t packet;
+    bench::Run(Suite_Name, "audio_serialize", Num_Ops, sizeof(audio.data),
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       ui_net_link::Serialize(audio, i & 1, packet);
+                       bench::DoNotOptimize(packet);
+                   }
+               });
+
+    ui_net_link::AudioObject out;
+    bench::Run(Suite_Name, "audio_deserialize", Num_Ops, sizeof(out.data),
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       ui_net_link::Deserialize(packet, out);
+                       bench::DoNotOptimize(out);
+                   }
+               });
+
+    static constexpr char Text[] = "the quick brown fox jumps over the lazy dog";
+    bench::Run(Suite_Name, "text_serialize", Num_Ops, sizeof(Text),
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       ui_net_link::Serialize(ui_net_link::Channel_Id::Chat, Text, sizeof(Text),
+                                              packet);
+                       bench::DoNotOptimize(packet);
+                   }
+               });
+
+    // Type, id and length header followed by a short message, like the
+    // legacy serial packets
+    static constexpr uint32_t Message_Size = 32;
+    bench::Run(Suite_Name, "serial_packet_set_get", Num_Ops, Message_Size + 5,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       SerialPacket serial_packet(0, Message_Size + 5);
+                       serial_packet.SetData(SerialPacket::Types::QMessage, 0, 1);
+                       serial_packet.SetData(i & 0xFFFF, 1, 2);
+                       serial_packet.SetData(Message_Size, 3, 2);
+                       for (uint32_t j = 0; j < Message_Size; ++j)
+                       {
+                           serial_packet.SetData(static_cast<uint8_t>(j), 5 + j, 1);
+                       }
+
+                       uint32_t sum = serial_packet.GetData<uint16_t>(1, 2);
+                       for (uint32_t j = 0; j < Message_Size; ++j)
+                       {
+                           sum += serial_packet.GetData<uint8_t>(5 + j, 1);
+                       }
+                       bench::DoNotOptimize(sum);
+                   }
+               });
+}
@@ -0,0 +1,278 @@
+#include "bench.hh"
+#include "link_rate/link_rate.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Both ends of the ui to net link running the rate negotiation over a
+// simulated uart. Each byte can come out with a bit flipped, at a bit error
+// rate that depends on the baud, and when the two ends are at different
+// rates the receiver only sees garbage. The ends are set up like the real
+// link, header crc, type limits and flow control.
+static constexpr const char* Suite_Name = "link_rate";
+static constexpr double Poll_Us = 1e3;
+static constexpr uint32_t Ui_Rx_Buff_Size = 2048;
+static constexpr uint32_t Net_Rx_Buff_Size = 16384;
+static constexpr uint32_t Tx_Buff_Size = 2048;
+
+struct RateEndStorage
+{
+    explicit RateEndStorage(const uint32_t rx_size) :
+        rx_packet_storage(link_packet_t::Packet_Size),
+        tx_storage(Tx_Buff_Size),
+        realtime_tx_storage(Tx_Buff_Size),
+        rx_storage(rx_size)
+    {
+    }
+
+    std::vector<uint8_t> rx_packet_storage;
+    std::vector<uint8_t> tx_storage;
+    std::vector<uint8_t> realtime_tx_storage;
+    std::vector<uint8_t> rx_storage;
+};
+
+// One end of the link with its negotiator. A baud change waits for the
+// transmitter to go idle, like the firmware's SetBaud waits for the uart.
+class RateEnd : private RateEndStorage, public SerialHandler
+{
+public:
+    RateEnd(const uint32_t rx_size,
+            const LinkRate::Role role,
+            const uint8_t supported,
+            const uint16_t tx_type,
+            const uint16_t rx_type) :
+        RateEndStorage(rx_size),
+        SerialHandler(*rx_packet_storage.data(),
+                      rx_packet_storage.size(),
+                      *tx_storage.data(),
+                      tx_storage.size(),
+                      *realtime_tx_storage.data(),
+                      realtime_tx_storage.size(),
+                      *rx_storage.data(),
+                      rx_storage.size(),
+                      Transmit,
+                      this),
+        link_rate(role, supported, Send, SetBaud, this),
+        tx_type(tx_type),
+        rx_type(rx_type)
+    {
+        EnableHeaderCrc();
+        SetTypeLimits(ui_net_link::Type_Limits);
+        EnableFlowControl();
+    }
+
+    template <typename Corrupt>
+    void Complete(RateEnd& receiver, Corrupt&& corrupt)
+    {
+        std::vector<uint8_t> bytes(tx_chunk.begin(), tx_chunk.end());
+        corrupt(bytes, chunk_baud, receiver.baud);
+        receiver.rx_ring.Write(bytes.data(), std::min<size_t>(bytes.size(), receiver.rx_ring.Free()));
+
+        done_at = std::numeric_limits<double>::infinity();
+        UpdateTx();
+        ApplyBaud();
+    }
+
+    // Hands the negotiation frames to the negotiator and drops the rest
+    void Read()
+    {
+        while (const PacketView view = ReadView())
+        {
+            if (view.type == rx_type && negotiate)
+            {
+                link_rate.Receive(view.payload, now / 1e3);
+            }
+            Release();
+        }
+        if (negotiate)
+        {
+            link_rate.Poll(now / 1e3);
+        }
+    }
+
+    LinkRate link_rate;
+    bool negotiate = true;
+    double now = 0;
+    double done_at = std::numeric_limits<double>::infinity();
+    uint32_t baud = LinkRate::Rates[0];
+
+private:
+    static void Transmit(void* arg)
+    {
+        RateEnd* self = static_cast<RateEnd*>(arg);
+        self->chunk_baud = self->baud;
+        self->done_at = self->now + self->tx_chunk.size() * 10 * 1e6 / self->baud;
+    }
+
+    static void Send(void* arg, std::span<const uint8_t> payload)
+    {
+        RateEnd* self = static_cast<RateEnd*>(arg);
+        self->Write(self->tx_type, {payload});
+    }
+
+    static void SetBaud(void* arg, const uint32_t baud)
+    {
+        RateEnd* self = static_cast<RateEnd*>(arg);
+        self->pending_baud = baud;
+        self->ApplyBaud();
+    }
+
+    void ApplyBaud()
+    {
+        if (pending_baud && std::isinf(done_at))
+        {
+            baud = pending_baud;
+            pending_baud = 0;
+        }
+    }
+
+    uint16_t tx_type;
+    uint16_t rx_type;
+    uint32_t chunk_baud = 0;
+    uint32_t pending_baud = 0;
+};
+
+// Bit error rate for each of LinkRate::Rates
+using ErrorRates = std::array<double, LinkRate::Num_Rates>;
+
+struct Scenario
+{
+    const char* name;
+    ErrorRates ber;
+    uint8_t net_rates;
+    bool net_negotiates;
+    // From fault_s on the error rates are fault_ber instead
+    double fault_s;
+    ErrorRates fault_ber;
+};
+
+static size_t RateIndex(const uint32_t baud)
+{
+    return std::find(std::begin(LinkRate::Rates), std::end(LinkRate::Rates), baud)
+         - std::begin(LinkRate::Rates);
+}
+
+static void Simulate(const Scenario& scenario, const double duration_s)
+{
+    std::mt19937 rng(bench::Seed);
+    std::uniform_real_distribution<double> chance(0, 1);
+    double now = 0;
+
+    // Each byte is ten bits on the wire, one of the eight data bits is
+    // flipped when any of them is hit
+    auto corrupt = [&](std::vector<uint8_t>& bytes, const uint32_t tx_baud, const uint32_t rx_baud)
+    {
+        if (tx_baud != rx_baud)
+        {
+            for (uint8_t& byte : bytes)
+            {
+                byte = rng();
+            }
+            return;
+        }
+
+        const ErrorRates& ber = now >= scenario.fault_s * 1e6 ? scenario.fault_ber : scenario.ber;
+        const double byte_error = 1 - std::pow(1 - ber[RateIndex(tx_baud)], 10);
+        for (uint8_t& byte : bytes)
+        {
+            if (byte_error > 0 && chance(rng) < byte_error)
+            {
+                byte ^= 1 << (rng() % 8);
+            }
+        }
+    };
+
+    RateEnd ui(Ui_Rx_Buff_Size, LinkRate::Role::Initiator, LinkRate::All_Rates,
+               static_cast<uint16_t>(ui_net_link::UiToNet::LinkRate),
+               static_cast<uint16_t>(ui_net_link::NetToUi::LinkRate));
+    RateEnd net(Net_Rx_Buff_Size, LinkRate::Role::Responder, scenario.net_rates,
+                static_cast<uint16_t>(ui_net_link::NetToUi::LinkRate),
+                static_cast<uint16_t>(ui_net_link::UiToNet::LinkRate));
+    net.negotiate = scenario.net_negotiates;
+
+    double next_poll = 0;
+    double settled_at = 0;
+    uint32_t last_ui_baud = ui.baud;
+    uint32_t last_net_baud = net.baud;
+
+    while (true)
+    {
+        now = std::min({next_poll, ui.done_at, net.done_at});
+        if (now > duration_s * 1e6)
+        {
+            break;
+        }
+        ui.now = now;
+        net.now = now;
+
+        if (now == ui.done_at)
+        {
+            ui.Complete(net, corrupt);
+        }
+        else if (now == net.done_at)
+        {
+            net.Complete(ui, corrupt);
+        }
+        else
+        {
+            ui.Read();
+            net.Read();
+            next_poll += Poll_Us;
+        }
+
+        if (ui.baud != last_ui_baud || net.baud != last_net_baud)
+        {
+            last_ui_baud = ui.baud;
+            last_net_baud = net.baud;
+            settled_at = now;
+        }
+    }
+
+    bench::Report(Suite_Name, scenario.name,
+                  {
+                      {"ui_baud", static_cast<double>(ui.baud)},
+                      {"net_baud", static_cast<double>(net.baud)},
+                      {"agreed", static_cast<double>(ui.baud == net.baud)},
+                      {"done", static_cast<double>(ui.link_rate.GetState()
+                                                   == LinkRate::State::Done)},
+                      {"settled_ms", settled_at / 1e3},
+                      {"fallbacks", static_cast<double>(ui.link_rate.Fallbacks())},
+                      {"losses", static_cast<double>(ui.link_rate.Losses())},
+                      {"audio_frame_us", 208 * 10 * 1e6 / ui.baud},
+                  });
+}
+
+void BenchLinkRate()
+{
+    static constexpr double Never = std::numeric_limits<double>::infinity();
+    static constexpr ErrorRates Clean = {0, 0, 0, 0, 0};
+
+    // Marginal only loses 2 Mbaud. Noisy loses 1.5 Mbaud as well: a burst
+    // there has a couple of thousand bytes on the wire both ways, and at
+    // 1e-3 some twenty of them come back damaged, well past the one
+    // damaged frame a rate is allowed.
+    static constexpr ErrorRates Marginal = {0, 0, 0, 1e-7, 1e-3};
+    static constexpr ErrorRates Noisy = {0, 1e-7, 1e-6, 1e-3, 1e-2};
+
+    // A cable that goes bad at the higher rates partway through
+    static constexpr ErrorRates Fault = {0, 1e-7, 1e-6, 5e-2, 5e-2};
+
+    const Scenario scenarios[] = {
+        {"clean", Clean, LinkRate::All_Rates, true, Never, Clean},
+        {"marginal", Marginal, LinkRate::All_Rates, true, Never, Clean},
+        {"noisy", Noisy, LinkRate::All_Rates, true, Never, Clean},
+        {"net_caps_921600", Clean, 0b00011, true, Never, Clean},
+        {"net_not_negotiating", Clean, LinkRate::All_Rates, false, Never, Clean},
+        {"fault_at_3s", Clean, LinkRate::All_Rates, true, 3, Fault},
+    };
+
+    for (const Scenario& scenario : scenarios)
+    {
+        Simulate(scenario, 12);
+    }
+}
@@ -0,0 +1,397 @@
+#include "bench.hh"
+#include "link_schema.hh"
+#include "ui_net_link.hh"
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// The ui to net link message schemas. Random field values round trip through
+// each schema, the schema serializers write the same bytes as the hand
+// written ones they replaced, random payloads go through the readers to check
+// that they never reach past what they were given, and the serializers are
+// timed against the hand written ones.
+static constexpr const char* Suite_Name = "link_schema";
+static constexpr uint32_t Num_Ops = 200000;
+static constexpr uint32_t Num_Cases = 20000;
+
+using namespace ui_net_link;
+
+// The offsets the hand written code used
+static_assert(ChunkSchema::Size == 6);
+static_assert(ChunkSchema::Offset<&Chunk::chunk_length> == 2);
+static_assert(AIRequestSchema::Size == 10);
+static_assert(AIRequestSchema::Offset<&AIRequestChunk::last_chunk> == 5);
+static_assert(AIResponseSchema::Size == 11);
+static_assert(AIResponseSchema::Offset<&AIResponseChunk::content_type> == 5);
+static_assert(AIResponseSchema::Offset<&AIResponseChunk::chunk_length> == 7);
+static_assert(ChatSchema::Size == 5);
+
+// Audio serialize as it was written out by hand, kept to compare against
+static void HandSerialize(const AudioObject& talk_frame, bool is_last, link_packet_t& packet)
+{
+    packet.type = static_cast<uint16_t>(UiToNet::AudioFrame);
+    packet.payload[0] = (uint8_t)talk_frame.channel_id;
+
+    uint32_t offset = 1;
+
+    static constexpr std::uint32_t audio_size = constants::Audio_Phonic_Sz;
+    if (talk_frame.channel_id == Channel_Id::Ptt)
+    {
+        packet.payload[offset] = static_cast<uint8_t>(MessageType::Media);
+        offset += sizeof(MessageType);
+
+        packet.payload[offset] = static_cast<uint8_t>(is_last);
+        offset += sizeof(bool);
+
+        memcpy(packet.payload.data() + offset, &audio_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+    }
+    else if (talk_frame.channel_id == Channel_Id::Ptt_Ai)
+    {
+        packet.payload[offset] = static_cast<uint8_t>(MessageType::AIRequest);
+        offset += sizeof(MessageType);
+
+        uint32_t request_id = 0;
+        memcpy(packet.payload.data() + offset, &request_id, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+
+        packet.payload[offset] = static_cast<uint8_t>(is_last);
+        offset += sizeof(bool);
+
+        memcpy(packet.payload.data() + offset, &audio_size, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+    }
+
+    packet.length = offset + constants::Audio_Phonic_Sz;
+
+    memcpy(packet.payload.data() + offset, talk_frame.data, constants::Audio_Phonic_Sz);
+
+    packet.is_ready = true;
+}
+
+// The response header the ui used to lay over the payload
+struct __attribute__((packed)) HandResponseHeader
+{
+    MessageType type;
+    std::uint32_t request_id;
+    ContentType content_type;
+    bool last_chunk;
+    std::uint32_t chunk_length;
+};
+
+// Counts the checks that failed and prints the first few
+class SchemaCheck
+{
+public:
+    explicit SchemaCheck(const char* name) :
+        name(name),
+        checks(0),
+        failed(0)
+    {
+    }
+
+    void operator()(const bool passed, const char* what)
+    {
+        ++checks;
+        if (passed)
+        {
+            return;
+        }
+
+        if (failed++ < 8)
+        {
+            std::printf("link_schema %s: %s\n", name, what);
+        }
+    }
+
+    void Report() const
+    {
+        bench::Report(Suite_Name, name,
+                      {{"checks", static_cast<double>(checks)},
+                       {"failed", static_cast<double>(failed)},
+                       {"ok", failed == 0 ? 1.0 : 0.0}});
+    }
+
+private:
+    const char* name;
+    uint32_t checks;
+    uint32_t failed;
+};
+
+static bool SamePayload(const link_packet_t& a, const link_packet_t& b)
+{
+    return a.type == b.type && a.length == b.length
+           && std::memcmp(a.payload.data(), b.payload.data(), a.length) == 0;
+}
+
+static void CheckRoundTrip(std::mt19937& rng)
+{
+    SchemaCheck check("round_trip");
+
+    for (uint32_t i = 0; i < Num_Cases; ++i)
+    {
+        uint8_t wire[AIResponseSchema::Size + 1];
+
+        AIResponseChunk response;
+        response.request_id = rng();
+        response.content_type = static_cast<ContentType>(rng() & 1);
+        response.last_chunk = rng();
+        response.chunk_length = rng();
+        check(AIResponseSchema::Write(response, wire) == AIResponseSchema::Size, "response size");
+
+        AIResponseChunk read;
+        check(AIResponseSchema::Read(wire, read), "response read");
+        check(read.type == response.type && read.request_id == response.request_id
+                  && read.content_type == response.content_type
+                  && read.last_chunk == response.last_chunk
+                  && read.chunk_length == response.chunk_length,
+              "response fields");
+        check(AIResponseSchema::Get<&AIResponseChunk::request_id>(wire) == response.request_id,
+              "response get");
+
+        HandResponseHeader hand;
+        std::memcpy(&hand, wire, sizeof(hand));
+        check(hand.request_id == response.request_id && hand.chunk_length == response.chunk_length
+                  && hand.content_type == response.content_type,
+              "response matches the packed struct");
+
+        // One byte short reads nothing
+        AIResponseChunk untouched;
+        check(!AIResponseSchema::Read(std::span<const uint8_t>(wire, AIResponseSchema::Size - 1),
+                                      untouched)
+                  && untouched.chunk_length == 0,
+              "short read");
+
+        AIRequestChunk request;
+        request.request_id = rng();
+        request.last_chunk = rng();
+        request.chunk_length = rng();
+        AIRequestSchema::Write(request, wire);
+        AIRequestSchema::Set<&AIRequestChunk::last_chunk>(wire, 0xA5);
+        AIRequestChunk request_read;
+        check(AIRequestSchema::Read(wire, request_read) && request_read.last_chunk == 0xA5
+                  && request_read.request_id == request.request_id
+                  && request_read.chunk_length == request.chunk_length,
+              "request fields");
+    }
+
+    // The serializers write what the hand written ones did, and the audio
+    // comes back out
+    AudioObject audio;
+    for (const Channel_Id channel : {Channel_Id::Ptt, Channel_Id::Ptt_Ai, Channel_Id::Chat})
+    {
+        for (const bool last : {false, true})
+        {
+            audio.channel_id = channel;
+            for (auto& byte : audio.data)
+            {
+                byte = rng();
+            }
+
+            link_packet_t schema;
+            link_packet_t hand;
+            Serialize(audio, last, schema);
+            HandSerialize(audio, last, hand);
+            check(SamePayload(schema, hand), "audio serialize");
+
+            // Other channels carry no chunk to find the audio in
+            AudioObject out;
+            if (channel != Channel_Id::Chat)
+            {
+                check(Deserialize(schema, out), "audio deserialize");
+                check(out.channel_id == channel
+                          && std::memcmp(out.data, audio.data, sizeof(audio.data)) == 0,
+                      "audio round trip");
+            }
+        }
+    }
+
+    static constexpr char Text[] = "the quick brown fox jumps over the lazy dog";
+    link_packet_t text;
+    Serialize(Channel_Id::Chat, Text, sizeof(Text), text);
+    ChatChunk chat;
+    std::span<const uint8_t> data;
+    check(ReadChunk<ChatSchema>(std::span<const uint8_t>(text.payload.data(), text.length), chat,
+                                data)
+              && data.size() == sizeof(Text) && std::memcmp(data.data(), Text, sizeof(Text)) == 0,
+          "text round trip");
+
+    // Text longer than a payload is cut to what fits
+    std::vector<char> long_text(link_packet_t::Payload_Size * 2, 'x');
+    Serialize(Channel_Id::Chat, long_text.data(), long_text.size(), text);
+    check(text.length == link_packet_t::Payload_Size, "long text");
+
+    check.Report();
+}
+
+// Random bytes of random lengths, every reader must either refuse them or
+// hand back data that lies inside them and matches the length it read
+static void CheckFuzz(std::mt19937& rng)
+{
+    SchemaCheck check("fuzz");
+
+    uint32_t accepted = 0;
+    link_packet_t packet;
+    for (uint32_t i = 0; i < Num_Cases; ++i)
+    {
+        const uint32_t len = rng() % (link_packet_t::Payload_Size + 1);
+        for (uint32_t j = 0; j < len; ++j)
+        {
+            packet.payload[j] = rng();
+        }
+
+        // Give one of the headers a length that fits now and then, so the
+        // readers accept as well as refuse
+        if (len >= Chunk_Offset + AIResponseSchema::Size && (rng() & 1))
+        {
+            uint8_t* const chunk = packet.payload.data() + Chunk_Offset;
+            const uint32_t room = len - Chunk_Offset;
+            switch (rng() % 4)
+            {
+            case 0:
+                ChunkSchema::Set<&Chunk::chunk_length>(
+                    chunk, rng() % (room - ChunkSchema::Size + 1));
+                break;
+            case 1:
+                AIRequestSchema::Set<&AIRequestChunk::chunk_length>(
+                    chunk, rng() % (room - AIRequestSchema::Size + 1));
+                break;
+            case 2:
+                AIResponseSchema::Set<&AIResponseChunk::chunk_length>(
+                    chunk, rng() % (room - AIResponseSchema::Size + 1));
+                break;
+            default:
+                ChatSchema::Set<&ChatChunk::chunk_length>(chunk,
+                                                          rng() % (room - ChatSchema::Size + 1));
+                break;
+            }
+        }
+        packet.length = len;
+
+        const std::span<const uint8_t> payload(packet.payload.data(), len);
+        const auto inside = [&](std::span<const uint8_t> data, const uint32_t chunk_length)
+        {
+            return data.data() >= payload.data()
+                   && data.data() + data.size() <= payload.data() + payload.size()
+                   && data.size() == chunk_length;
+        };
+
+        std::span<const uint8_t> data;
+        Chunk chunk;
+        if (ReadChunk<ChunkSchema>(payload, chunk, data))
+        {
+            ++accepted;
+            check(inside(data, chunk.chunk_length), "media data");
+        }
+
+        AIRequestChunk request;
+        if (ReadChunk<AIRequestSchema>(payload, request, data))
+        {
+            ++accepted;
+            check(inside(data, request.chunk_length), "request data");
+        }
+
+        AIResponseChunk response;
+        if (ReadChunk<AIResponseSchema>(payload, response, data))
+        {
+            ++accepted;
+            check(inside(data, response.chunk_length), "response data");
+        }
+
+        ChatChunk chat;
+        if (ReadChunk<ChatSchema>(payload, chat, data))
+        {
+            ++accepted;
+            check(inside(data, chat.chunk_length), "chat data");
+        }
+
+        AudioObject audio;
+        if (Deserialize(packet, audio))
+        {
+            ++accepted;
+        }
+    }
+
+    // Nothing accepted at all would mean the readers were never exercised
+    check(accepted > 0, "some accepted");
+    bench::Report(Suite_Name, "fuzz_accepted", {{"cases", static_cast<double>(accepted)}});
+    check.Report();
+}
+
+void BenchLinkSchema()
+{
+    std::mt19937 rng(bench::Seed);
+
+    CheckRoundTrip(rng);
+    CheckFuzz(rng);
+
+    AudioObject audio;
+    for (auto& byte : audio.data)
+    {
+        byte = rng();
+    }
+
+    link_packet_t packet;
+    for (const Channel_Id channel : {Channel_Id::Ptt, Channel_Id::Ptt_Ai})
+    {
+        audio.channel_id = channel;
+        const char* suffix = channel == Channel_Id::Ptt ? "media" : "ai_request";
+        char name[48];
+
+        std::snprintf(name, sizeof(name), "serialize_hand_%s", suffix);
+        bench::Run(Suite_Name, name, Num_Ops, sizeof(audio.data),
+                   [&]
+                   {
+                       for (uint32_t i = 0; i < Num_Ops; ++i)
+                       {
+                           HandSerialize(audio, i & 1, packet);
+                           bench::DoNotOptimize(packet);
+                       }
+                   });
+
+        std::snprintf(name, sizeof(name), "serialize_%s", suffix);
+        bench::Run(Suite_Name, name, Num_Ops, sizeof(audio.data),
+                   [&]
+                   {
+                       for (uint32_t i = 0; i < Num_Ops; ++i)
+                       {
+                           Serialize(audio, i & 1, packet);
+                           bench::DoNotOptimize(packet);
+                       }
+                   });
+    }
+
+    // Just the header, where any offset arithmetic left at run time would
+    // show the most
+    AIResponseChunk response;
+    response.chunk_length = constants::Audio_Phonic_Sz;
+    uint8_t wire[AIResponseSchema::Size];
+    AIResponseSchema::Write(response, wire);
+
+    bench::Run(Suite_Name, "response_header_hand", Num_Ops, sizeof(wire),
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       HandResponseHeader header;
+                       std::memcpy(&header, wire, sizeof(header));
+                       header.request_id += i;
+                       std::memcpy(wire, &header, sizeof(header));
+                       bench::ClobberMemory();
+                   }
+               });
+
+    bench::Run(Suite_Name, "response_header", Num_Ops, sizeof(wire),
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       AIResponseChunk header;
+                       AIResponseSchema::Read(wire, header);
+                       header.request_id += i;
+                       AIResponseSchema::Write(header, wire);
+                       bench::ClobberMemory();
+                   }
+               });
+}
@@ -0,0 +1,654 @@
+#include "bench.hh"
+#include "serial_handler/serial_handler.hh"
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Two SerialHandler ends talking over a real byte stream, a socketpair or a
+// pty pair, in wall clock time. Each end has a tx thread standing in for the
+// uart, which holds every chunk for as long as it takes on the wire at the
+// baud and can lose bytes, flip bits, garble bursts of the line and add
+// jitter, and an rx thread that reads the stream into the rx ring like the
+// uart interrupt does. The main thread is both ends' main loop and plays
+// traffic like the real link: audio at 50 fps both ways, mgmt style commands
+// that the far end answers and floods of log lines. Everything carries its
+// send time, so each flow reports loss and latency.
+//
+// This takes about two seconds a scenario. Add a scenario to try a change to
+// the link layer against a given line.
+static constexpr const char* Suite_Name = "link_sim";
+static constexpr auto Duration = std::chrono::seconds(2);
+static constexpr auto Drain = std::chrono::milliseconds(300);
+static constexpr auto Poll_Period = std::chrono::milliseconds(1);
+
+static constexpr uint32_t Rx_Buff_Size = 2048;
+static constexpr uint32_t Tx_Buff_Size = 2048;
+
+// Payload sizes like the real link's, audio is the channel, the frame and the
+// sequence number
+static constexpr size_t Audio_Size = 1 + 200 + 2;
+static constexpr size_t Command_Size = 16;
+static constexpr size_t Reply_Size = 32;
+static constexpr size_t Log_Size = 96;
+static constexpr auto Audio_Period = std::chrono::milliseconds(20);
+
+using Clock = std::chrono::steady_clock;
+
+enum class SimType : uint16_t
+{
+    Audio = 1,
+    Command,
+    Reply,
+    Log,
+};
+
+static constexpr link_type_limit_t Sim_Type_Limits[] = {
+    {static_cast<uint16_t>(SimType::Audio), Audio_Size},
+    {static_cast<uint16_t>(SimType::Command), Command_Size},
+    {static_cast<uint16_t>(SimType::Reply), Reply_Size},
+    {static_cast<uint16_t>(SimType::Log), Log_Size},
+};
+
+enum class Transport
+{
+    Socket,
+    Pty,
+};
+
+struct Faults
+{
+    // Chance that a byte is lost
+    double drop;
+    // Chance that any one bit is flipped
+    double ber;
+    // The line is noise for burst_ms out of every burst_every_ms, 0 for never
+    double burst_every_ms;
+    double burst_ms;
+    // Each chunk waits up to this long before it starts, like a uart task that
+    // is late to run
+    double jitter_us;
+};
+
+struct Traffic
+{
+    bool audio;
+    // The first end sends a command this often and the second answers, 0 for
+    // none
+    double command_every_ms;
+    // Log lines a second from the second end, past what the line can carry
+    // they back up and get dropped
+    double logs_per_s;
+};
+
+struct Scenario
+{
+    const char* name;
+    Transport transport;
+    uint32_t baud;
+    Faults faults;
+    Traffic traffic;
+    // Read through Read instead of ReadView, which queues every frame before
+    // it is handed out
+    bool queued_reads = false;
+};
+
+// What every payload starts with
+struct Probe
+{
+    uint32_t seq;
+    uint64_t sent_ns;
+};
+
+static uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch())
+        .count();
+}
+
+struct StreamEndStorage
+{
+    StreamEndStorage() :
+        rx_packet_storage(link_packet_t::Packet_Size),
+        tx_storage(Tx_Buff_Size),
+        realtime_tx_storage(Tx_Buff_Size),
+        rx_storage(Rx_Buff_Size)
+    {
+    }
+
+    std::vector<uint8_t> rx_packet_storage;
+    std::vector<uint8_t> tx_storage;
+    std::vector<uint8_t> realtime_tx_storage;
+    std::vector<uint8_t> rx_storage;
+};
+
+// One end of the link on one file descriptor of the pair, set up like the ui
+// to net link
+class StreamEnd : private StreamEndStorage, public SerialHandler
+{
+public:
+    StreamEnd(const int fd, const uint32_t baud, const Faults& faults, const uint32_t seed) :
+        SerialHandler(*rx_packet_storage.data(),
+                      rx_packet_storage.size(),
+                      *tx_storage.data(),
+                      tx_storage.size(),
+                      *realtime_tx_storage.data(),
+                      realtime_tx_storage.size(),
+                      *rx_storage.data(),
+                      rx_storage.size(),
+                      Transmit,
+                      this),
+        fd(fd),
+        byte_ns(10 * 1e9 / baud),
+        faults(faults),
+        rng(seed)
+    {
+        EnableHeaderCrc();
+        SetTypeLimits(Sim_Type_Limits);
+        SetTxDepth(TxClass::Realtime, 4);
+        EnableFlowControl();
+    }
+
+    void Start(const Clock::time_point start)
+    {
+        this->start = start;
+        line_free = start;
+        running = true;
+        tx_thread = std::thread(&StreamEnd::TxLoop, this);
+        rx_thread = std::thread(&StreamEnd::RxLoop, this);
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> _(tx_mux);
+            running = false;
+        }
+        tx_cv.notify_one();
+        tx_thread.join();
+        rx_thread.join();
+    }
+
+    // On a line that loses nothing the other end's count of the bytes it has
+    // sent is always ours plus the same offset, so the offset every credit
+    // frame sets should never move. Any move shrinks or grows the credit this
+    // end grants until the next credit frame. Called after every read.
+    void TrackCreditOffset()
+    {
+        if (!rx_synced)
+        {
+            return;
+        }
+
+        if (!offset_seen)
+        {
+            first_offset = rx_offset;
+            offset_seen = true;
+        }
+        const int32_t moved = static_cast<int32_t>(rx_offset - first_offset);
+        offset_moved = std::max(offset_moved, moved < 0 ? -moved : moved);
+    }
+
+    int32_t OffsetMoved() const
+    {
+        return offset_moved;
+    }
+
+    // Bytes this end may still send before it has to wait for credit
+    int32_t Headroom() const
+    {
+        return static_cast<int32_t>(peer_limit.load() - tx_sent.load());
+    }
+
+    uint32_t Window() const
+    {
+        return credit_window;
+    }
+
+    uint32_t overrun_events = 0;
+
+private:
+    static void Transmit(void* arg)
+    {
+        StreamEnd* self = static_cast<StreamEnd*>(arg);
+        {
+            std::lock_guard<std::mutex> _(self->tx_mux);
+            self->chunk_ready = true;
+        }
+        self->tx_cv.notify_one();
+    }
+
+    void TxLoop()
+    {
+        std::uniform_real_distribution<double> chance(0, 1);
+        std::uniform_real_distribution<double> jitter(0, faults.jitter_us * 1e3);
+        const double byte_error = 1 - std::pow(1 - faults.ber, 8);
+        std::vector<uint8_t> bytes;
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(tx_mux);
+                tx_cv.wait(lock, [this] { return chunk_ready || !running; });
+                if (!running)
+                {
+                    return;
+                }
+                chunk_ready = false;
+            }
+
+            // Holds the chunk until its last byte would be out on the wire
+            const Clock::time_point now = Clock::now();
+            const double wire_ns = tx_chunk.size() * byte_ns + jitter(rng);
+            line_free = std::max(line_free, now)
+                      + std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double, std::nano>(wire_ns));
+            std::this_thread::sleep_until(line_free);
+
+            const double at_ms =
+                std::chrono::duration<double, std::milli>(line_free - start).count();
+            const bool burst = faults.burst_every_ms > 0
+                            && std::fmod(at_ms, faults.burst_every_ms) < faults.burst_ms;
+
+            bytes.clear();
+            for (uint8_t byte : tx_chunk)
+            {
+                if (burst)
+                {
+                    byte = rng();
+                }
+                else if (byte_error > 0 && chance(rng) < byte_error)
+                {
+                    byte ^= 1 << (rng() % 8);
+                }
+
+                if (faults.drop == 0 || chance(rng) >= faults.drop)
+                {
+                    bytes.push_back(byte);
+                }
+            }
+            WriteAll(bytes);
+
+            UpdateTx();
+        }
+    }
+
+    void WriteAll(const std::vector<uint8_t>& bytes)
+    {
+        size_t written = 0;
+        while (written < bytes.size())
+        {
+            const ssize_t res = write(fd, bytes.data() + written, bytes.size() - written);
+            if (res < 0)
+            {
+                return;
+            }
+            written += res;
+        }
+    }
+
+    void RxLoop()
+    {
+        uint8_t buff[512];
+        while (running)
+        {
+            pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 10) <= 0)
+            {
+                continue;
+            }
+
+            const ssize_t res = read(fd, buff, sizeof(buff));
+            if (res <= 0)
+            {
+                continue;
+            }
+
+            // Like the uart interrupt, whatever the ring has no room for is
+            // lost
+            const size_t stored = std::min<size_t>(res, rx_ring.Free());
+            rx_ring.Write(buff, stored);
+            stats.rx_bytes += stored;
+            if (stored < static_cast<size_t>(res))
+            {
+                ++stats.rx_overruns;
+                ++overrun_events;
+            }
+        }
+    }
+
+    int fd;
+    double byte_ns;
+    Faults faults;
+    std::mt19937 rng;
+
+    std::thread tx_thread;
+    std::thread rx_thread;
+    std::mutex tx_mux;
+    std::condition_variable tx_cv;
+    bool chunk_ready = false;
+    std::atomic<bool> running = false;
+
+    Clock::time_point start;
+    Clock::time_point line_free;
+
+    bool offset_seen = false;
+    uint32_t first_offset = 0;
+    int32_t offset_moved = 0;
+};
+
+// One kind of traffic in one direction
+struct Flow
+{
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint64_t bytes = 0;
+    std::vector<double> latency_us;
+
+    void Receive(std::span<const uint8_t> payload)
+    {
+        if (payload.size() < sizeof(Probe))
+        {
+            return;
+        }
+
+        Probe probe;
+        std::memcpy(&probe, payload.data(), sizeof(probe));
+        latency_us.push_back((NowNs() - probe.sent_ns) / 1e3);
+        bytes += payload.size();
+        ++received;
+    }
+
+    double Percentile(const double share)
+    {
+        if (latency_us.empty())
+        {
+            return 0;
+        }
+        std::sort(latency_us.begin(), latency_us.end());
+        return latency_us[std::min<size_t>(latency_us.size() - 1, share * latency_us.size())];
+    }
+};
+
+static void Send(StreamEnd& end,
+                 const SimType type,
+                 const size_t size,
+                 Flow& flow,
+                 const SerialHandler::TxClass tx_class = SerialHandler::TxClass::Bulk)
+{
+    uint8_t payload[link_packet_t::Payload_Size] = {};
+    const Probe probe = {flow.sent++, NowNs()};
+    std::memcpy(payload, &probe, sizeof(probe));
+    end.Write(static_cast<uint16_t>(type), {{payload, size}}, tx_class);
+}
+
+// Opens the two ends of the line, false when the transport is not available
+static bool OpenPair(const Transport transport, int (&fds)[2])
+{
+    if (transport == Transport::Socket)
+    {
+        return socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+    }
+
+    const int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        return false;
+    }
+
+    const int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0)
+    {
+        close(master);
+        return false;
+    }
+
+    // Bytes have to pass through the line discipline untouched
+    termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    fds[0] = master;
+    fds[1] = slave;
+    return true;
+}
+
+// Hands each packet that has come in to fn, through ReadView or for queued
+// reads through Read
+template <typename Fn>
+static void ReceiveAll(StreamEnd& end, const bool queued, Fn&& fn)
+{
+    if (queued)
+    {
+        while (const link_packet_t* packet = end.Read())
+        {
+            fn(packet->type, std::span<const uint8_t>(packet->payload.data(), packet->length));
+        }
+        return;
+    }
+
+    while (const SerialHandler::PacketView view = end.ReadView())
+    {
+        fn(view.type, view.payload);
+        end.Release();
+    }
+}
+
+static void ReportFlow(const Scenario& scenario, const char* flow_name, Flow& flow)
+{
+    const std::string name = std::string(scenario.name) + "." + flow_name;
+    const double seconds = std::chrono::duration<double>(Duration).count();
+    bench::Report(Suite_Name, name.c_str(),
+                  {
+                      {"sent", static_cast<double>(flow.sent)},
+                      {"received", static_cast<double>(flow.received)},
+                      {"loss_pct", flow.sent ? 100.0 * (flow.sent - flow.received) / flow.sent : 0},
+                      {"kb_per_s", flow.bytes / seconds / 1e3},
+                      {"p50_us", flow.Percentile(0.5)},
+                      {"p99_us", flow.Percentile(0.99)},
+                      {"max_us", flow.Percentile(1)},
+                  });
+}
+
+static void Simulate(const Scenario& scenario)
+{
+    int fds[2];
+    if (!OpenPair(scenario.transport, fds))
+    {
+        bench::Report(Suite_Name, scenario.name, {{"unavailable", 1}});
+        return;
+    }
+
+    // a stands for the ui and b for net
+    StreamEnd a(fds[0], scenario.baud, scenario.faults, bench::Seed);
+    StreamEnd b(fds[1], scenario.baud, scenario.faults, bench::Seed + 1);
+
+    Flow audio_up;
+    Flow audio_down;
+    Flow command;
+    Flow logs;
+
+    const Traffic& traffic = scenario.traffic;
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + Duration;
+    Clock::time_point next_audio = start;
+    Clock::time_point next_command = start;
+    Clock::time_point next_log = start;
+    const auto command_period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::milli>(traffic.command_every_ms));
+    const auto log_period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(traffic.logs_per_s > 0 ? 1 / traffic.logs_per_s : 0));
+
+    a.Start(start);
+    b.Start(start);
+
+    for (Clock::time_point now = start; now < end + Drain; now = Clock::now())
+    {
+        ReceiveAll(a, scenario.queued_reads,
+                   [&](const uint16_t type, std::span<const uint8_t> payload)
+                   {
+                       switch (static_cast<SimType>(type))
+                       {
+                       case SimType::Audio:
+                           audio_down.Receive(payload);
+                           break;
+                       case SimType::Reply:
+                           command.Receive(payload);
+                           break;
+                       case SimType::Log:
+                           logs.Receive(payload);
+                           break;
+                       default:
+                           break;
+                       }
+                   });
+
+        ReceiveAll(b, scenario.queued_reads,
+                   [&](const uint16_t type, std::span<const uint8_t> payload)
+                   {
+                       if (type == static_cast<uint16_t>(SimType::Audio))
+                       {
+                           audio_up.Receive(payload);
+                       }
+                       else if (type == static_cast<uint16_t>(SimType::Command)
+                                && payload.size() >= sizeof(Probe))
+                       {
+                           // Answered with the command's own send time, so the
+                           // reply measures the round trip
+                           uint8_t reply[Reply_Size] = {};
+                           std::memcpy(reply, payload.data(), sizeof(Probe));
+                           b.Write(static_cast<uint16_t>(SimType::Reply), {reply});
+                       }
+                   });
+
+        a.TrackCreditOffset();
+        b.TrackCreditOffset();
+
+        if (now < end)
+        {
+            if (traffic.audio && now >= next_audio)
+            {
+                Send(a, SimType::Audio, Audio_Size, audio_up, SerialHandler::TxClass::Realtime);
+                Send(b, SimType::Audio, Audio_Size, audio_down, SerialHandler::TxClass::Realtime);
+                next_audio += Audio_Period;
+            }
+            if (traffic.command_every_ms > 0 && now >= next_command)
+            {
+                Send(a, SimType::Command, Command_Size, command);
+                next_command += command_period;
+            }
+            while (traffic.logs_per_s > 0 && now >= next_log)
+            {
+                Send(b, SimType::Log, Log_Size, logs);
+                next_log += log_period;
+            }
+        }
+
+        std::this_thread::sleep_for(Poll_Period);
+    }
+
+    const int32_t up_headroom = a.Headroom();
+    const int32_t down_headroom = b.Headroom();
+
+    a.Stop();
+    b.Stop();
+    close(fds[0]);
+    close(fds[1]);
+
+    const SerialHandler::Stats& a_stats = a.GetStats();
+    const SerialHandler::Stats& b_stats = b.GetStats();
+    const double seconds = std::chrono::duration<double>(Duration).count();
+    const double line_bytes_per_s = scenario.baud / 10.0;
+    const uint32_t tx_drops =
+        a_stats.tx_drops[0] + a_stats.tx_drops[1] + b_stats.tx_drops[0] + b_stats.tx_drops[1];
+    const std::string name = std::string(scenario.name) + ".link";
+    bench::Report(Suite_Name, name.c_str(),
+                  {
+                      {"baud", static_cast<double>(scenario.baud)},
+                      {"up_kb_per_s", a_stats.tx_bytes / seconds / 1e3},
+                      {"down_kb_per_s", b_stats.tx_bytes / seconds / 1e3},
+                      {"up_line_pct", 100 * a_stats.tx_bytes / seconds / line_bytes_per_s},
+                      {"down_line_pct", 100 * b_stats.tx_bytes / seconds / line_bytes_per_s},
+                      {"tx_drops", static_cast<double>(tx_drops)},
+                      {"tx_stalls", static_cast<double>(a_stats.tx_stalls + b_stats.tx_stalls)},
+                      {"header_errors",
+                       static_cast<double>(a_stats.header_errors + b_stats.header_errors)},
+                      {"sync_losses",
+                       static_cast<double>(a_stats.sync_losses + b_stats.sync_losses)},
+                      {"rx_overruns", static_cast<double>(a.overrun_events + b.overrun_events)},
+                  });
+
+    // Credit is only handed out again once half the window has moved, so
+    // more than half of it is left once the link has gone quiet
+    if (scenario.faults.drop == 0 && scenario.faults.ber == 0 && scenario.faults.burst_ms == 0)
+    {
+        const int32_t min_headroom = a.Window() / 2;
+        const std::string credit_name = std::string(scenario.name) + ".credit";
+        bench::Report(Suite_Name, credit_name.c_str(),
+                      {
+                          {"up_offset_moved", static_cast<double>(b.OffsetMoved())},
+                          {"down_offset_moved", static_cast<double>(a.OffsetMoved())},
+                          {"up_headroom", static_cast<double>(up_headroom)},
+                          {"down_headroom", static_cast<double>(down_headroom)},
+                          {"ok", static_cast<double>(b.OffsetMoved() == 0
+                                                     && a.OffsetMoved() == 0
+                                                     && up_headroom > min_headroom
+                                                     && down_headroom > min_headroom)},
+                      });
+    }
+
+    if (traffic.audio)
+    {
+        ReportFlow(scenario, "audio_up", audio_up);
+        ReportFlow(scenario, "audio_down", audio_down);
+    }
+    if (traffic.command_every_ms > 0)
+    {
+        ReportFlow(scenario, "command_rtt", command);
+    }
+    if (traffic.logs_per_s > 0)
+    {
+        ReportFlow(scenario, "logs", logs);
+    }
+}
+
+void BenchLinkSim()
+{
+    static constexpr Faults Clean = {0, 0, 0, 0, 0};
+    static constexpr Traffic Audio_Mgmt = {true, 20, 0};
+
+    // Well past what 460800 baud carries next to the audio
+    static constexpr Traffic Log_Flood = {true, 20, 2000};
+
+    const Scenario scenarios[] = {
+        {"clean_audio", Transport::Socket, 460800, Clean, {true, 0, 0}},
+        {"audio_mgmt", Transport::Socket, 460800, Clean, Audio_Mgmt},
+        {"log_flood", Transport::Socket, 460800, Clean, Log_Flood},
+        {"log_flood_921600", Transport::Socket, 921600, Clean, Log_Flood},
+        {"bit_flips_1e-5", Transport::Socket, 460800, {0, 1e-5, 0, 0, 0}, Audio_Mgmt},
+        {"byte_drops_1e-4", Transport::Socket, 460800, {1e-4, 0, 0, 0, 0}, Audio_Mgmt},
+        {"bursts_10ms_per_250ms", Transport::Socket, 460800, {0, 0, 250, 10, 0}, Audio_Mgmt},
+        {"jitter_2ms", Transport::Socket, 460800, {0, 0, 0, 0, 2000}, Audio_Mgmt},
+        {"pty_audio_mgmt", Transport::Pty, 460800, Clean, Audio_Mgmt},
+        {"log_flood_queued_reads", Transport::Socket, 460800, Clean, Log_Flood, true},
+    };
+
+    for (const Scenario& scenario : scenarios)
+    {
+        Simulate(scenario);
+    }
+}
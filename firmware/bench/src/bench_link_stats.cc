@@ -0,0 +1,413 @@
+#include "bench.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+// Checks the link counters and the audio sequence numbers against drops that
+// are put in on purpose. Net sends audio frames to the ui over a simulated
+// uart, with headers corrupted on the wire, frames refused by a shallow tx
+// queue and bytes lost to a full rx ring while the ui is not reading. What
+// the counters say is reported next to what was injected.
+static constexpr const char* Suite_Name = "link_stats";
+static constexpr double Baud = 460800;
+static constexpr double Byte_Us = 10 * 1e6 / Baud;
+static constexpr double Duration_Us = 20e6;
+static constexpr double Drain_Us = 1e6;
+static constexpr double Close_After_Us = 200e3;
+
+static constexpr uint32_t Rx_Buff_Size = 2048;
+static constexpr uint32_t Tx_Buff_Size = 4096;
+
+static constexpr double Audio_Period_Us = 20e3;
+static constexpr uint32_t Audio_Size = 200;
+static constexpr double Poll_Us = 1e3;
+
+// Not a byte of the sync word, so the search after a bad header skips the
+// payload in one go
+static constexpr uint8_t Fill_Byte = 0x55;
+
+struct StatsEndStorage
+{
+    StatsEndStorage() :
+        rx_packet_storage(link_packet_t::Packet_Size),
+        tx_storage(Tx_Buff_Size),
+        realtime_tx_storage(Tx_Buff_Size),
+        rx_storage(Rx_Buff_Size)
+    {
+    }
+
+    std::vector<uint8_t> rx_packet_storage;
+    std::vector<uint8_t> tx_storage;
+    std::vector<uint8_t> realtime_tx_storage;
+    std::vector<uint8_t> rx_storage;
+};
+
+// One end of the link, the receiving side counts what it takes in like the
+// net uart task does and drops what does not fit in the rx ring
+class StatsEnd : private StatsEndStorage, public SerialHandler
+{
+public:
+    StatsEnd() :
+        SerialHandler(*rx_packet_storage.data(),
+                      rx_packet_storage.size(),
+                      *tx_storage.data(),
+                      tx_storage.size(),
+                      *realtime_tx_storage.data(),
+                      realtime_tx_storage.size(),
+                      *rx_storage.data(),
+                      rx_storage.size(),
+                      Transmit,
+                      this)
+    {
+        EnableHeaderCrc();
+        SetTypeLimits(ui_net_link::Type_Limits);
+    }
+
+    // Corrupts the type of the frame starting in this chunk when asked to
+    void Complete(StatsEnd& receiver, bool& corrupt)
+    {
+        std::vector<uint8_t> bytes(tx_chunk.begin(), tx_chunk.end());
+        const bool frame_start =
+            bytes.size() > link_packet_t::Sync_Word_Size
+            && std::equal(link_packet_t::Sync_Word.begin(), link_packet_t::Sync_Word.end(),
+                          bytes.begin());
+        if (corrupt && frame_start)
+        {
+            bytes[link_packet_t::Sync_Word_Size] ^= 0xFF;
+            corrupt = false;
+            ++corrupted;
+        }
+
+        const size_t stored = std::min<size_t>(bytes.size(), receiver.rx_ring.Free());
+        receiver.rx_ring.Write(bytes.data(), stored);
+        receiver.stats.rx_bytes += stored;
+        if (stored < bytes.size())
+        {
+            ++receiver.stats.rx_overruns;
+            ++receiver.overrun_events;
+            receiver.lost_bytes += bytes.size() - stored;
+        }
+
+        done_at = std::numeric_limits<double>::infinity();
+        UpdateTx();
+    }
+
+    double now = 0;
+    double done_at = std::numeric_limits<double>::infinity();
+    uint32_t corrupted = 0;
+    uint32_t overrun_events = 0;
+    uint64_t lost_bytes = 0;
+
+private:
+    static void Transmit(void* arg)
+    {
+        StatsEnd* self = static_cast<StatsEnd*>(arg);
+        self->done_at = self->now + self->tx_chunk.size() * Byte_Us;
+    }
+};
+
+struct Scenario
+{
+    const char* name;
+    // Every this many frames one has its header corrupted, 0 for none
+    uint32_t corrupt_every;
+    // Audio frames written each period and how many may wait to be sent
+    uint32_t burst;
+    uint16_t depth;
+    // The ui stops reading for stall_us out of every stall_period_us, 0 for
+    // never. Without flow control the rx ring overruns.
+    double stall_us;
+    double stall_period_us;
+    bool flow_control;
+};
+
+using TypeCount = SerialHandler::Stats::TypeCount;
+
+static uint32_t TypeFrames(const TypeCount (&types)[SerialHandler::Max_Stat_Types],
+                           const uint16_t type)
+{
+    for (const TypeCount& entry : types)
+    {
+        if (entry.frames > 0 && entry.type == type)
+        {
+            return entry.frames;
+        }
+    }
+    return 0;
+}
+
+static void Simulate(const Scenario& scenario)
+{
+    StatsEnd net;
+    StatsEnd ui;
+    net.SetTxDepth(SerialHandler::TxClass::Realtime, scenario.depth);
+    if (scenario.flow_control)
+    {
+        net.EnableFlowControl();
+        ui.EnableFlowControl();
+    }
+
+    const uint16_t audio_type = static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame);
+    uint8_t payload[1 + Audio_Size];
+    payload[0] = 0;
+    std::memset(payload + 1, Fill_Byte, Audio_Size);
+
+    ui_net_link::AudioSeq tx_seq = 0;
+    ui_net_link::AudioSeqCheck rx_check;
+    uint32_t written = 0;
+
+    // Numbers of the frames that came through whole, told from the fill, to
+    // check the sequence counts against
+    std::vector<bool> intact;
+    bool corrupt = false;
+    bool closed = false;
+
+    double next_audio = 0;
+    double next_poll = 0;
+
+    while (true)
+    {
+        const double now = std::min({next_audio, next_poll, net.done_at, ui.done_at});
+        if (now > Duration_Us + Drain_Us)
+        {
+            break;
+        }
+        net.now = now;
+        ui.now = now;
+
+        if (now == net.done_at)
+        {
+            net.Complete(ui, corrupt);
+        }
+        else if (now == ui.done_at)
+        {
+            bool never = false;
+            ui.Complete(net, never);
+        }
+        else if (now == next_poll)
+        {
+            while (const SerialHandler::PacketView view = net.ReadView())
+            {
+                net.Release();
+            }
+
+            const bool stalled = scenario.stall_us > 0
+                              && std::fmod(now, scenario.stall_period_us) < scenario.stall_us
+                              && now < Duration_Us;
+            while (!stalled)
+            {
+                SerialHandler::PacketView view = ui.ReadView();
+                if (!view)
+                {
+                    break;
+                }
+                std::span<const uint8_t> data = view.payload;
+                if (data.size() == sizeof(payload) + sizeof(ui_net_link::AudioSeq)
+                    && std::equal(payload, payload + sizeof(payload), data.begin()))
+                {
+                    ui_net_link::AudioSeq seq;
+                    std::memcpy(&seq, data.data() + sizeof(payload), sizeof(seq));
+                    intact.resize(std::max<size_t>(intact.size(), seq + 1));
+                    intact[seq] = true;
+                }
+                rx_check.Take(data);
+                ui.Release();
+            }
+            next_poll += Poll_Us;
+        }
+        else
+        {
+            // A gap only shows once a later frame arrives, so one more goes
+            // out after the backlog has drained
+            const bool closing = !closed && now >= Duration_Us + Close_After_Us;
+            closed |= closing;
+            const uint32_t frames = now < Duration_Us ? scenario.burst : closing;
+            for (uint32_t i = 0; i < frames; ++i)
+            {
+                const ui_net_link::AudioSeq seq = tx_seq++;
+                net.Write(audio_type,
+                          {{payload, sizeof(payload)},
+                           {reinterpret_cast<const uint8_t*>(&seq), sizeof(seq)}},
+                          SerialHandler::TxClass::Realtime);
+                ++written;
+
+                if (scenario.corrupt_every > 0 && written % scenario.corrupt_every == 0)
+                {
+                    corrupt = true;
+                }
+            }
+            next_audio += Audio_Period_Us;
+        }
+    }
+
+    const SerialHandler::Stats& tx = net.GetStats();
+    const SerialHandler::Stats& rx = ui.GetStats();
+    const uint32_t tx_drops = tx.tx_drops[static_cast<size_t>(SerialHandler::TxClass::Realtime)];
+
+    // The sequence says a frame is missing exactly when it did not come
+    // through whole, up to the last one that did
+    const uint32_t lost = intact.size() - std::count(intact.begin(), intact.end(), true);
+
+    // Every frame that went missing was either refused by the tx queue or
+    // lost on the wire. Bytes lost to an overrun can leave frames made of the
+    // wrong bytes, which are passed over as misreads, so the link counts only
+    // add up exactly without one.
+    const bool exact = ui.overrun_events == 0;
+    const bool ok = rx.rx_bytes + ui.lost_bytes == tx.tx_bytes
+                 && rx.rx_overruns == ui.overrun_events
+                 && TypeFrames(tx.tx_types, audio_type) == written - tx_drops
+                 && rx_check.counts.missing == lost && rx_check.counts.restarts == 0
+                 && (!exact
+                     || (rx.header_errors == net.corrupted
+                         && rx_check.counts.missing == tx_drops + net.corrupted
+                         && rx_check.counts.frames == written - tx_drops - net.corrupted
+                         && TypeFrames(rx.rx_types, audio_type) == rx_check.counts.frames));
+
+    bench::Report(Suite_Name, scenario.name,
+                  {
+                      {"written", static_cast<double>(written)},
+                      {"tx_drops", static_cast<double>(tx_drops)},
+                      {"corrupted", static_cast<double>(net.corrupted)},
+                      {"overruns", static_cast<double>(ui.overrun_events)},
+                      {"rx_frames", static_cast<double>(rx.rx_frames)},
+                      {"header_errors", static_cast<double>(rx.header_errors)},
+                      {"sync_losses", static_cast<double>(rx.sync_losses)},
+                      {"rx_overruns", static_cast<double>(rx.rx_overruns)},
+                      {"seq_missing", static_cast<double>(rx_check.counts.missing)},
+                      {"seq_restarts", static_cast<double>(rx_check.counts.restarts)},
+                      {"seq_misreads", static_cast<double>(rx_check.counts.misreads)},
+                      {"lost", static_cast<double>(lost)},
+                      {"ok", static_cast<double>(ok)},
+                  });
+}
+
+// The sequence check on its own: a gap, a misread number, a restart and a gap
+// too long to count
+static void BenchSeqCheck()
+{
+    ui_net_link::AudioSeqCheck check;
+    auto take = [&](const ui_net_link::AudioSeq seq)
+    {
+        uint8_t bytes[1 + sizeof(seq)] = {};
+        std::memcpy(bytes + 1, &seq, sizeof(seq));
+        std::span<const uint8_t> payload(bytes);
+        check.Take(payload);
+    };
+
+    for (ui_net_link::AudioSeq seq = 0; seq < 100; ++seq)
+    {
+        // 10 frames lost from the middle
+        if (seq < 40 || seq >= 50)
+        {
+            take(seq);
+        }
+    }
+
+    // A frame of the wrong bytes, then on as if it never came
+    take(0x5555);
+    take(100);
+    take(101);
+
+    // The other end starts over
+    take(0);
+    take(1);
+    take(2);
+
+    // More lost than could be from the link, believed once it carries on
+    take(2000);
+    take(2001);
+
+    const ui_net_link::AudioSeqCheck::Counts& counts = check.counts;
+    bench::Report(Suite_Name, "seq_check",
+                  {
+                      {"frames", static_cast<double>(counts.frames)},
+                      {"missing", static_cast<double>(counts.missing)},
+                      {"restarts", static_cast<double>(counts.restarts)},
+                      {"misreads", static_cast<double>(counts.misreads)},
+                      {"ok", static_cast<double>(counts.frames == 98 && counts.missing == 10
+                                                 && counts.restarts == 2
+                                                 && counts.misreads == 1)},
+                  });
+}
+
+// The LinkStats reply as both chips build it. Every field has to come back
+// from the offset the schemas put it at, and the size is pinned so a change
+// to either struct shows up here before it reaches the mgmt tools.
+static void BenchStatsReply()
+{
+    using StatsSchema = SerialHandler::StatsSchema;
+    using CountsSchema = ui_net_link::AudioCountsSchema;
+    static_assert(1 + StatsSchema::Size + CountsSchema::Size == 189,
+                  "LinkStats reply changed, bump Link_Stats_Version");
+
+    // Every byte of the counters different, so a field read from the wrong
+    // place or the wrong size does not match
+    SerialHandler::Stats stats;
+    ui_net_link::AudioSeqCheck::Counts counts;
+    uint8_t* const stats_bytes = reinterpret_cast<uint8_t*>(&stats);
+    for (size_t i = 0; i < sizeof(stats); ++i)
+    {
+        stats_bytes[i] = static_cast<uint8_t>(i * 7 + 1);
+    }
+    counts = {0x01020304, 0x05060708, 0x090A0B0C, 0x0D0E0F10};
+
+    uint8_t reply[1 + StatsSchema::Size + CountsSchema::Size];
+    reply[0] = ui_net_link::Link_Stats_Version;
+    size_t size = 1;
+    size += StatsSchema::Write(stats, reply + size);
+    size += CountsSchema::Write(counts, reply + size);
+
+    SerialHandler::Stats stats_back;
+    ui_net_link::AudioSeqCheck::Counts counts_back;
+    const std::span<const uint8_t> body(reply + 1, size - 1);
+    const bool read = StatsSchema::Read(body, stats_back)
+                   && CountsSchema::Read(body.subspan(StatsSchema::Size), counts_back);
+
+    const uint8_t* const fields = reply + 1;
+    constexpr size_t Rx_Types_Offset = StatsSchema::Offset<&SerialHandler::Stats::rx_types>;
+    SerialHandler::Stats::TypeCount last_rx_type;
+    std::memcpy(&last_rx_type,
+                fields + Rx_Types_Offset + 7 * sizeof(last_rx_type),
+                sizeof(last_rx_type));
+
+    const bool ok =
+        size == sizeof(reply) && reply[0] == ui_net_link::Link_Stats_Version && read
+        && std::memcmp(&stats, &stats_back, sizeof(stats)) == 0
+        && std::memcmp(&counts, &counts_back, sizeof(counts)) == 0
+        && StatsSchema::Offset<&SerialHandler::Stats::tx_stalls> == 16
+        && StatsSchema::Get<&SerialHandler::Stats::tx_stalls>(fields) == stats.tx_stalls
+        && Rx_Types_Offset == 108 && last_rx_type.frames == stats.rx_types[7].frames
+        && CountsSchema::Get<&ui_net_link::AudioSeqCheck::Counts::misreads>(
+               fields + StatsSchema::Size)
+               == counts.misreads;
+
+    bench::Report(Suite_Name, "stats_reply",
+                  {
+                      {"version", static_cast<double>(reply[0])},
+                      {"size", static_cast<double>(size)},
+                      {"ok", static_cast<double>(ok)},
+                  });
+}
+
+void BenchLinkStats()
+{
+    BenchStatsReply();
+
+    const Scenario scenarios[] = {
+        {"clean", 0, 1, 4, 0, 0, true},
+        {"corrupt_headers", 37, 1, 4, 0, 0, true},
+        {"tx_depth_drops", 0, 6, 4, 0, 0, true},
+        {"corrupt_and_drops", 37, 6, 4, 0, 0, true},
+        {"rx_overrun", 0, 3, 8, 100e3, 400e3, false},
+    };
+
+    for (const Scenario& scenario : scenarios)
+    {
+        Simulate(scenario);
+    }
+    BenchSeqCheck();
+}
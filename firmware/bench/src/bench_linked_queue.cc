@@ -0,0 +1,184 @@
+#include "bench.hh"
+#include "linked_queue.hh"
+#include <cstdio>
+#include <deque>
+#include <random>
+
+static constexpr const char* Suite_Name = "linked_queue";
+static constexpr uint32_t Num_Ops = 1 << 20;
+static constexpr uint16_t Depth = 32;
+
+struct Frame
+{
+    uint32_t timestamp;
+    uint16_t length;
+    uint8_t channel;
+};
+
+// Keeps Depth items queued and pushes one, pops one per op
+template <typename Push, typename Pop>
+static void Steady(Push&& push, Pop&& pop)
+{
+    for (uint32_t i = 0; i < Depth; ++i)
+    {
+        push(Frame{i, 0, 0});
+    }
+    for (uint32_t i = 0; i < Num_Ops; ++i)
+    {
+        push(Frame{i, static_cast<uint16_t>(i), static_cast<uint8_t>(i)});
+        pop();
+    }
+    for (uint32_t i = 0; i < Depth; ++i)
+    {
+        pop();
+    }
+}
+
+static constexpr uint16_t Check_Nodes = 8;
+static constexpr uint32_t Check_Steps = 20000;
+
+// The static queue against a deque doing the same thing: FIFO order while the
+// free list is reused in a shuffled order, Enqueue refusing and counting at
+// capacity, and Clear giving every node back
+static void CheckStaticQueue()
+{
+    uint32_t cases = 0;
+    uint32_t failures = 0;
+    const auto check = [&](const bool ok, const char* what)
+    {
+        ++cases;
+        if (!ok)
+        {
+            ++failures;
+            std::printf("static linked queue: %s\n", what);
+        }
+    };
+
+    static StaticLinkedQueue<Frame, Check_Nodes> queue;
+    std::deque<uint32_t> expected;
+    std::mt19937 rng(bench::Seed);
+    uint32_t next = 0;
+    uint32_t rejected = 0;
+    bool order_ok = true;
+    for (uint32_t step = 0; step < Check_Steps; ++step)
+    {
+        // Runs of pushes and pops of random length, past full and empty
+        const uint32_t run = 1 + rng() % (Check_Nodes + 2);
+        const bool push = rng() % 2;
+        for (uint32_t i = 0; i < run; ++i)
+        {
+            if (push)
+            {
+                const bool queued = queue.Enqueue(Frame{next, 0, 0});
+                order_ok = order_ok && queued == (expected.size() < Check_Nodes);
+                if (queued)
+                {
+                    expected.push_back(next);
+                }
+                else
+                {
+                    ++rejected;
+                }
+                ++next;
+            }
+            else if (!expected.empty())
+            {
+                order_ok = order_ok && !queue.Empty()
+                        && queue.Front().timestamp == expected.front();
+                queue.Pop();
+                expected.pop_front();
+            }
+            else
+            {
+                queue.Pop();
+            }
+            order_ok = order_ok && queue.Size() == expected.size();
+        }
+    }
+    check(order_ok, "fifo order across node reuse");
+    check(rejected > 0 && queue.Overflows() == rejected, "overflows counted during reuse");
+
+    queue.Clear();
+    check(queue.Empty() && queue.Size() == 0, "clear empties");
+
+    const uint32_t overflows = queue.Overflows();
+    bool filled = true;
+    for (uint32_t i = 0; i < Check_Nodes; ++i)
+    {
+        filled = filled && queue.Enqueue(Frame{i, 0, 0});
+    }
+    check(filled && queue.Size() == Check_Nodes, "clear gives every node back");
+    check(queue.Overflows() == overflows, "filling to capacity is not an overflow");
+
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        check(!queue.Enqueue(Frame{Check_Nodes + i, 0, 0}), "enqueue refused at capacity");
+        check(queue.Overflows() == overflows + i + 1, "each refused enqueue counted");
+    }
+
+    bool kept = queue.Size() == Check_Nodes;
+    for (uint32_t i = 0; kept && i < Check_Nodes; ++i)
+    {
+        kept = !queue.Empty() && queue.Front().timestamp == i;
+        queue.Pop();
+    }
+    check(kept && queue.Empty(), "refused items leave the queue as it was");
+
+    bench::Report(Suite_Name, "static_checks",
+                  {
+                      {"cases", static_cast<double>(cases)},
+                      {"failures", static_cast<double>(failures)},
+                      {"rejected", static_cast<double>(rejected)},
+                      {"ok", static_cast<double>(failures == 0)},
+                  });
+}
+
+void BenchLinkedQueue()
+{
+    CheckStaticQueue();
+
+    {
+        LinkedQueue<Frame> queue;
+        bench::Run(Suite_Name, "linked_queue", Num_Ops, 0,
+                   [&]
+                   {
+                       Steady([&](Frame f) { queue.Enqueue(f); },
+                              [&]
+                              {
+                                  bench::DoNotOptimize(queue.Front().timestamp);
+                                  queue.Pop();
+                              });
+                   });
+    }
+    {
+        static StaticLinkedQueue<Frame, Depth + 1> queue;
+        bench::Run(Suite_Name, "static_linked_queue", Num_Ops, 0,
+                   [&]
+                   {
+                       Steady([&](Frame f) { queue.Enqueue(f); },
+                              [&]
+                              {
+                                  bench::DoNotOptimize(queue.Front().timestamp);
+                                  queue.Pop();
+                              });
+                   });
+        bench::Report(Suite_Name, "static_linked_queue_overflow",
+                      {
+                          {"overflows", static_cast<double>(queue.Overflows())},
+                          {"ok", static_cast<double>(queue.Overflows() == 0)},
+                      });
+    }
+    {
+        std::deque<Frame> queue;
+        bench::Run(Suite_Name, "std_deque", Num_Ops, 0,
+                   [&]
+                   {
+                       Steady([&](Frame f) { queue.push_back(f); },
+                              [&]
+                              {
+                                  bench::DoNotOptimize(queue.front().timestamp);
+                                  queue.pop_front();
+                              });
+                   });
+    }
+}
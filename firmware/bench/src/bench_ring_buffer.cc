@@ -0,0 +1,486 @@
+#include "bench.hh"
+#include "ring_buffer.hh"
+#include "static_ring_buffer.hh"
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <utility>
+
+static constexpr const char* Suite_Name = "ring_buffer";
+static constexpr uint32_t Num_Bytes = 1 << 20;
+static constexpr uint16_t Ring_Size = 2048;
+static constexpr uint16_t Chunk_Size = 64;
+
+// Each stress round moves more bytes than the 16 bit indices count, so they
+// wrap past 0xFFFF at least once whatever the ring size
+static constexpr uint32_t Stress_Rounds = 40;
+static constexpr uint32_t Stress_Bytes = 0x11000;
+static constexpr uint16_t Stress_Sizes[] = {1, 4, 61, 1024, RingBuffer<uint8_t>::Max_Size};
+
+static uint8_t source[Num_Bytes];
+static uint8_t sink[Num_Bytes];
+
+// The ring as it was before the indices went lock free, busy flag and all,
+// kept as a baseline for the byte and span cases
+template <typename T>
+class BusyFlagRing
+{
+public:
+    BusyFlagRing(const uint16_t size) :
+        size(size),
+        read_idx(0),
+        write_idx(0),
+        buffer(new T[size]{}),
+        busy(false)
+    {
+    }
+
+    ~BusyFlagRing()
+    {
+        delete[] buffer;
+    }
+
+    void Write(T d_in) noexcept
+    {
+        BusySet();
+        buffer[write_idx++] = std::move(d_in);
+
+        if (write_idx >= size)
+            write_idx = 0;
+
+        BusyReset();
+    }
+
+    void Write(T* input, const uint16_t count)
+    {
+        BusySet();
+
+        size_t input_off = 0;
+
+        // Buffer is nearly full so we need to wrap around to the front
+        if (write_idx + count >= size)
+        {
+            const uint16_t write_space = size - write_idx;
+            const uint16_t remaining = write_space < count ? write_space : count;
+
+            while (input_off < remaining)
+            {
+                buffer[write_idx++] = std::move(input[input_off++]);
+            }
+
+            write_idx = 0;
+        }
+
+        for (uint16_t i = input_off; i < count; ++i)
+        {
+            buffer[write_idx++] = std::move(input[i]);
+        }
+
+        BusyReset();
+    }
+
+    T Take() noexcept
+    {
+        BusySet();
+
+        T d_out = std::move(buffer[read_idx++]);
+
+        if (read_idx >= size)
+        {
+            read_idx = 0;
+        }
+
+        BusyReset();
+        return d_out;
+    }
+
+    uint16_t Unread() const
+    {
+        if (write_idx >= read_idx)
+        {
+            return write_idx - read_idx;
+        }
+        else
+        {
+            return size - read_idx + write_idx;
+        }
+    }
+
+private:
+    inline void BusySet()
+    {
+        if (busy)
+        {
+            while (true)
+            {
+            }
+        }
+        busy = true;
+    }
+
+    inline void BusyReset()
+    {
+        busy = false;
+    }
+
+    uint16_t size;
+    uint16_t read_idx;
+    uint16_t write_idx;
+    T* buffer;
+    bool busy;
+};
+
+// Fills and drains in steps of Chunk_Size so the ring wraps regularly
+template <typename Ring>
+static void ByteAtATime(Ring& ring)
+{
+    for (uint32_t i = 0; i < Num_Bytes; i += Chunk_Size)
+    {
+        for (uint16_t j = 0; j < Chunk_Size; ++j)
+        {
+            ring.Write(source[i + j]);
+        }
+        for (uint16_t j = 0; j < Chunk_Size; ++j)
+        {
+            ring.TryRead(sink[i + j]);
+        }
+    }
+}
+
+// The serial path before the span api, bytes go in byte at a time or as one
+// copy and always come out one Take at a time
+static void BusyFlagBytes(BusyFlagRing<uint8_t>& ring)
+{
+    for (uint32_t i = 0; i < Num_Bytes; i += Chunk_Size)
+    {
+        for (uint16_t j = 0; j < Chunk_Size; ++j)
+        {
+            ring.Write(source[i + j]);
+        }
+        for (uint16_t j = 0; j < Chunk_Size; ++j)
+        {
+            sink[i + j] = ring.Take();
+        }
+    }
+}
+
+static void BusyFlagBulk(BusyFlagRing<uint8_t>& ring)
+{
+    for (uint32_t i = 0; i < Num_Bytes; i += Chunk_Size)
+    {
+        ring.Write(source + i, Chunk_Size);
+        for (uint32_t j = i; ring.Unread() > 0; ++j)
+        {
+            sink[j] = ring.Take();
+        }
+    }
+}
+
+template <typename Ring>
+static void Bulk(Ring& ring)
+{
+    for (uint32_t i = 0; i < Num_Bytes; i += Chunk_Size)
+    {
+        ring.Write(source + i, Chunk_Size);
+
+        uint16_t read = 0;
+        std::span<uint8_t> data;
+        while (!(data = ring.ReadableSpan()).empty())
+        {
+            std::memcpy(sink + i + read, data.data(), data.size());
+            read += data.size();
+            ring.CommitRead(data.size());
+        }
+    }
+}
+
+// Producer and consumer on separate threads, like the uart task and the link
+// handler on the net side
+static void Threaded(RingBuffer<uint8_t>& ring)
+{
+    std::thread producer(
+        [&ring]
+        {
+            uint32_t written = 0;
+            while (written < Num_Bytes)
+            {
+                std::span<uint8_t> space = ring.WriteableSpan();
+                if (space.empty())
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                const uint32_t num = std::min<uint32_t>(space.size(), Num_Bytes - written);
+                std::memcpy(space.data(), source + written, num);
+                ring.CommitWrite(num);
+                written += num;
+            }
+        });
+
+    uint32_t read = 0;
+    while (read < Num_Bytes)
+    {
+        std::span<uint8_t> data = ring.ReadableSpan();
+        if (data.empty())
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        std::memcpy(sink + read, data.data(), data.size());
+        ring.CommitRead(data.size());
+        read += data.size();
+    }
+
+    producer.join();
+}
+
+// Runs one throughput case from a cleared sink and checks every byte came out
+// in order, returns its ns per byte
+template <typename Fn>
+static double RunChecked(const char* name, uint32_t& mismatches, Fn&& fn)
+{
+    std::memset(sink, 0, sizeof(sink));
+    const double ns = bench::Run(Suite_Name, name, Num_Bytes, 1, fn);
+    bench::DoNotOptimize(sink);
+    if (std::memcmp(source, sink, Num_Bytes) != 0)
+    {
+        ++mismatches;
+        std::printf("ring buffer %s mismatch\n", name);
+    }
+    return ns;
+}
+
+// Byte n of a stress round, an index off by any small amount reads a
+// different value
+static uint8_t StressByte(const uint32_t round, const uint32_t n)
+{
+    return static_cast<uint8_t>(((n + round) * 2654435761u) >> 24);
+}
+
+// Odd counts so that writes and reads rarely line up with the end of the ring
+// or with each other, up to twice the ring so some of them hit full or empty
+static uint16_t OddCount(std::mt19937& rng, const uint16_t size)
+{
+    const uint32_t max = std::min<uint32_t>(2u * size + 1, 0xFFFF);
+    return static_cast<uint16_t>(rng() % max | 1);
+}
+
+// Fills the ring to exactly full and drains it to exactly empty from wherever
+// its indices are, checking each edge
+static bool FullEmptyEdges(RingBuffer<uint8_t>& ring, const uint32_t round)
+{
+    const uint16_t size = ring.Size();
+    bool ok = ring.Unread() == 0 && ring.Free() == size;
+
+    uint16_t written = 0;
+    for (uint16_t i = 0; written < size && i < size; ++i)
+    {
+        written += ring.Write(StressByte(round, i));
+    }
+    ok = ok && written == size && ring.IsFull() && ring.Free() == 0;
+    ok = ok && !ring.Write(uint8_t{0}) && ring.WriteableSpan().empty();
+    ok = ok && ring.Write(source, 1) == 0;
+
+    uint16_t read = 0;
+    uint8_t byte;
+    while (ring.TryRead(byte))
+    {
+        ok = ok && byte == StressByte(round, read);
+        ++read;
+    }
+    ok = ok && read == size && ring.Unread() == 0 && ring.ReadableSpan().empty();
+    return ok && ring.Read(sink, 1) == 0;
+}
+
+// One round of a producer and a consumer thread moving Stress_Bytes through a
+// ring, each taking odd sized chunks through the span api on even rounds and
+// the copying calls on odd ones. The consumer checks every byte.
+static bool StressRound(RingBuffer<uint8_t>& ring,
+                        const uint32_t round,
+                        uint32_t& full_hits,
+                        uint32_t& empty_hits)
+{
+    const bool spans = round % 2 == 0;
+    std::atomic<uint32_t> producer_full(0);
+
+    std::thread producer(
+        [&]
+        {
+            std::mt19937 rng(bench::Seed + round);
+            uint8_t chunk[0xFFFF];
+            uint32_t written = 0;
+            while (written < Stress_Bytes)
+            {
+                const uint16_t want = std::min<uint32_t>(OddCount(rng, ring.Size()),
+                                                         Stress_Bytes - written);
+                if (ring.Free() == 0)
+                {
+                    producer_full.fetch_add(1, std::memory_order_relaxed);
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                if (spans)
+                {
+                    uint16_t num = 0;
+                    std::span<uint8_t> space;
+                    while (num < want && !(space = ring.WriteableSpan(num)).empty())
+                    {
+                        const uint16_t fill = std::min<uint32_t>(space.size(), want - num);
+                        for (uint16_t i = 0; i < fill; ++i)
+                        {
+                            space[i] = StressByte(round, written + num + i);
+                        }
+                        num += fill;
+                    }
+                    ring.CommitWrite(num);
+                    written += num;
+                }
+                else
+                {
+                    for (uint16_t i = 0; i < want; ++i)
+                    {
+                        chunk[i] = StressByte(round, written + i);
+                    }
+                    written += ring.Write(chunk, want);
+                }
+            }
+        });
+
+    std::mt19937 rng(bench::Seed ^ round);
+    uint8_t chunk[0xFFFF];
+    bool ok = true;
+    uint32_t read = 0;
+    while (read < Stress_Bytes)
+    {
+        const uint16_t want = OddCount(rng, ring.Size());
+        uint16_t num = 0;
+        if (spans)
+        {
+            std::span<uint8_t> data;
+            while (num < want && !(data = ring.ReadableSpan(num)).empty())
+            {
+                const uint16_t take = std::min<uint32_t>(data.size(), want - num);
+                for (uint16_t i = 0; i < take; ++i)
+                {
+                    ok = ok && data[i] == StressByte(round, read + num + i);
+                }
+                num += take;
+            }
+            ring.CommitRead(num);
+        }
+        else
+        {
+            num = ring.Read(chunk, want);
+            for (uint16_t i = 0; i < num; ++i)
+            {
+                ok = ok && chunk[i] == StressByte(round, read + i);
+            }
+        }
+
+        if (num == 0)
+        {
+            ++empty_hits;
+            std::this_thread::yield();
+        }
+        read += num;
+    }
+
+    producer.join();
+    full_hits += producer_full.load(std::memory_order_relaxed);
+    return ok && read == Stress_Bytes && ring.Unread() == 0;
+}
+
+static void BenchStress()
+{
+    uint32_t rounds = 0;
+    uint32_t failed_rounds = 0;
+    uint32_t full_hits = 0;
+    uint32_t empty_hits = 0;
+    for (const uint16_t size : Stress_Sizes)
+    {
+        RingBuffer<uint8_t> ring(size);
+        for (uint32_t i = 0; i < Stress_Rounds / std::size(Stress_Sizes); ++i, ++rounds)
+        {
+            const bool ok = FullEmptyEdges(ring, rounds)
+                         && StressRound(ring, rounds, full_hits, empty_hits)
+                         && FullEmptyEdges(ring, ~rounds);
+            if (!ok)
+            {
+                ++failed_rounds;
+                std::printf("ring buffer stress round %u failed, size %u\n", rounds, ring.Size());
+            }
+        }
+    }
+
+    bench::Report(Suite_Name, "spsc_stress",
+                  {
+                      {"rounds", static_cast<double>(rounds)},
+                      {"bytes_per_round", static_cast<double>(Stress_Bytes)},
+                      {"failed_rounds", static_cast<double>(failed_rounds)},
+                      {"full_hits", static_cast<double>(full_hits)},
+                      {"empty_hits", static_cast<double>(empty_hits)},
+                      {"ok", static_cast<double>(failed_rounds == 0 && full_hits > 0
+                                                 && empty_hits > 0)},
+                  });
+}
+
+void BenchRingBuffer()
+{
+    for (uint32_t i = 0; i < Num_Bytes; ++i)
+    {
+        source[i] = i * bench::Seed >> 24;
+    }
+
+    uint32_t mismatches = 0;
+    double busy_byte_ns;
+    double busy_bulk_ns;
+    double byte_ns;
+    double span_ns;
+    {
+        BusyFlagRing<uint8_t> ring(Ring_Size);
+        busy_byte_ns = RunChecked("busy_flag_byte", mismatches, [&] { BusyFlagBytes(ring); });
+    }
+    {
+        BusyFlagRing<uint8_t> ring(Ring_Size);
+        busy_bulk_ns = RunChecked("busy_flag_bulk", mismatches, [&] { BusyFlagBulk(ring); });
+    }
+    {
+        RingBuffer<uint8_t> ring(Ring_Size);
+        byte_ns = RunChecked("byte", mismatches, [&] { ByteAtATime(ring); });
+    }
+    {
+        StaticRingBuffer<uint8_t, Ring_Size> ring;
+        RunChecked("static_byte", mismatches, [&] { ByteAtATime(ring); });
+    }
+    {
+        RingBuffer<uint8_t> ring(Ring_Size);
+        span_ns = RunChecked("bulk_span", mismatches, [&] { Bulk(ring); });
+    }
+    {
+        StaticRingBuffer<uint8_t, Ring_Size> ring;
+        RunChecked("static_bulk_span", mismatches, [&] { Bulk(ring); });
+    }
+    {
+        RingBuffer<uint8_t> ring(Ring_Size);
+        RunChecked("spsc_threads", mismatches, [&] { Threaded(ring); });
+    }
+
+    bench::Report(Suite_Name, "verify",
+                  {
+                      {"mismatches", static_cast<double>(mismatches)},
+                      {"ok", static_cast<double>(mismatches == 0)},
+                  });
+
+    // Bytes per second of each path over the busy flag ring's byte at a time
+    // one, above 1 is faster
+    bench::Report(Suite_Name, "vs_busy_flag",
+                  {
+                      {"byte_speedup", busy_byte_ns / byte_ns},
+                      {"bulk_speedup", busy_byte_ns / busy_bulk_ns},
+                      {"span_speedup", busy_byte_ns / span_ns},
+                  });
+
+    BenchStress();
+}
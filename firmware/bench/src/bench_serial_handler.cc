@@ -0,0 +1,532 @@
+#include "bench.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <cstring>
+#include <random>
+#include <vector>
+
+static constexpr const char* Suite_Name = "serial_handler";
+static constexpr uint32_t Num_Packets = 20000;
+static constexpr uint32_t Buff_Size = 2048;
+static constexpr uint32_t Rx_Packet_Buff_Size = 2048;
+static constexpr uint16_t Num_Rx_Packets = 8;
+
+// Copies as much of the wire data into the rx ring as fits
+static uint32_t Feed(RingBuffer<uint8_t>& ring, const uint8_t* data, const uint32_t len)
+{
+    uint32_t fed = 0;
+    std::span<uint8_t> space;
+    while (fed < len && !(space = ring.WriteableSpan()).empty())
+    {
+        const uint32_t num = std::min<uint32_t>(space.size(), len - fed);
+        std::memcpy(space.data(), data + fed, num);
+        ring.CommitWrite(num);
+        fed += num;
+    }
+    return fed;
+}
+
+// Listed first as a base so the storage exists before SerialHandler uses it
+struct HostSerialStorage
+{
+    uint8_t rx_packet_storage[Rx_Packet_Buff_Size];
+    uint8_t tx_storage[Buff_Size];
+    uint8_t realtime_tx_storage[Buff_Size];
+    uint8_t rx_storage[Buff_Size];
+};
+
+// Where a HostSerial sends what it transmits
+enum class HostSink
+{
+    Record,
+    Loopback,
+    Discard
+};
+
+// A link with no uart, transmit either loops the bytes straight back into the
+// rx ring, records them so they can be replayed or drops them.
+class HostSerial : private HostSerialStorage, public SerialHandler
+{
+public:
+    HostSerial(const HostSink sink) :
+        SerialHandler(*rx_packet_storage,
+                      Rx_Packet_Buff_Size,
+                      *tx_storage,
+                      Buff_Size,
+                      *realtime_tx_storage,
+                      Buff_Size,
+                      *rx_storage,
+                      Buff_Size,
+                      Transmit,
+                      this),
+        sink(sink)
+    {
+    }
+
+    uint32_t Feed(const uint8_t* data, const uint32_t len)
+    {
+        return ::Feed(rx_ring, data, len);
+    }
+
+    std::vector<uint8_t> wire;
+
+private:
+    static void Transmit(void* arg)
+    {
+        HostSerial* self = static_cast<HostSerial*>(arg);
+        if (self->sink == HostSink::Loopback)
+        {
+            self->Feed(self->tx_chunk.data(), self->tx_chunk.size());
+        }
+        else if (self->sink == HostSink::Record)
+        {
+            self->wire.insert(self->wire.end(), self->tx_chunk.begin(), self->tx_chunk.end());
+        }
+        else
+        {
+            bench::DoNotOptimize(self->tx_chunk.data());
+        }
+        self->UpdateTx();
+    }
+
+    const HostSink sink;
+};
+
+// The byte at a time parser TLVRead used before the bulk copies, kept as a
+// baseline for the decode cases
+class BytewiseTlvReader
+{
+public:
+    BytewiseTlvReader() :
+        rx_ring(Buff_Size),
+        rx_packets(Num_Rx_Packets),
+        packet(&rx_packets.Write()),
+        bytes_read(0),
+        sync_matched(0)
+    {
+    }
+
+    uint32_t Feed(const uint8_t* data, const uint32_t len)
+    {
+        return ::Feed(rx_ring, data, len);
+    }
+
+    link_packet_t* Read()
+    {
+        auto packet_data = packet->WriteableData();
+
+        uint8_t byte;
+        while (rx_ring.TryRead(byte))
+        {
+            if (sync_matched < link_packet_t::Sync_Word_Size)
+            {
+                if (byte == packet->sync_word[sync_matched])
+                {
+                    ++sync_matched;
+                }
+                else
+                {
+                    sync_matched = byte == packet->sync_word[0];
+                    packet->is_ready = false;
+                }
+                continue;
+            }
+
+            packet_data[bytes_read++] = byte;
+            if (bytes_read < link_packet_t::Header_Size)
+            {
+                continue;
+            }
+
+            if (bytes_read >= packet->length + link_packet_t::Header_Size)
+            {
+                bytes_read = 0;
+                sync_matched = 0;
+
+                packet->is_ready = true;
+                packet = &rx_packets.Write();
+                packet_data = packet->WriteableData();
+            }
+            else if (bytes_read >= link_packet_t::Packet_Size)
+            {
+                packet->is_ready = false;
+                bytes_read = 0;
+                sync_matched = 0;
+            }
+        }
+
+        if (!rx_packets.Peek().is_ready)
+        {
+            return nullptr;
+        }
+
+        link_packet_t* p = &rx_packets.Read();
+        p->is_ready = false;
+        return p;
+    }
+
+private:
+    RingBuffer<uint8_t> rx_ring;
+    RingBuffer<link_packet_t> rx_packets;
+    link_packet_t* packet;
+    uint32_t bytes_read;
+    size_t sync_matched;
+};
+
+// Replays the wire in pieces about the size of a uart idle callback, small
+// enough that the rx packet slots never lap, returns the packets decoded
+template <typename Reader>
+static uint32_t Decode(Reader& reader, const std::vector<uint8_t>& wire)
+{
+    uint32_t decoded = 0;
+    uint32_t offset = 0;
+    while (offset < wire.size())
+    {
+        const uint32_t piece = std::min<uint32_t>(64, wire.size() - offset);
+        offset += reader.Feed(wire.data() + offset, piece);
+        while (link_packet_t* rx = reader.Read())
+        {
+            bench::DoNotOptimize(rx->length);
+            ++decoded;
+        }
+    }
+    return decoded;
+}
+
+// Same as Decode but reads views in place, counting any whose payload does
+// not match the packet that was sent
+static uint32_t DecodeViews(HostSerial& reader,
+                            const std::vector<uint8_t>& wire,
+                            const link_packet_t& sent,
+                            uint32_t& mismatched)
+{
+    uint32_t decoded = 0;
+    uint32_t offset = 0;
+    while (offset < wire.size())
+    {
+        const uint32_t piece = std::min<uint32_t>(64, wire.size() - offset);
+        offset += reader.Feed(wire.data() + offset, piece);
+        while (const SerialHandler::PacketView view = reader.ReadView())
+        {
+            if (view.length != sent.length
+                || std::memcmp(view.payload.data(), sent.payload.data(), view.length) != 0)
+            {
+                ++mismatched;
+            }
+            reader.Release();
+            ++decoded;
+        }
+    }
+    return decoded;
+}
+
+static void MakePacket(link_packet_t& packet, const uint32_t len, std::mt19937& rng)
+{
+    packet.type = 0x0061;
+    packet.length = len;
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        packet.payload[i] = rng();
+    }
+}
+
+static void BenchPacketSize(const uint32_t len)
+{
+    char name[32];
+    std::mt19937 rng(bench::Seed);
+
+    link_packet_t packet;
+    MakePacket(packet, len, rng);
+    const uint32_t wire_size = packet.PacketData().size();
+
+    // Encode only, bytes land in the tx ring and are recorded
+    {
+        HostSerial serial(HostSink::Record);
+        serial.wire.reserve(wire_size * Num_Packets);
+        std::snprintf(name, sizeof(name), "encode_%u", len);
+        bench::Run(Suite_Name, name, Num_Packets, wire_size,
+                   [&]
+                   {
+                       serial.wire.clear();
+                       for (uint32_t i = 0; i < Num_Packets; ++i)
+                       {
+                           serial.Write(packet);
+                       }
+                   });
+
+        // Decode only, replay the recorded stream
+        const std::vector<uint8_t> wire = serial.wire;
+        uint32_t decoded = 0;
+
+        HostSerial reader(HostSink::Record);
+        std::snprintf(name, sizeof(name), "decode_%u", len);
+        bench::Run(Suite_Name, name, Num_Packets, wire_size,
+                   [&] { decoded = Decode(reader, wire); });
+        if (decoded != Num_Packets)
+        {
+            bench::Report(Suite_Name, name, {{"decoded", static_cast<double>(decoded)}});
+        }
+
+        HostSerial view_reader(HostSink::Record);
+        uint32_t mismatched = 0;
+        std::snprintf(name, sizeof(name), "decode_view_%u", len);
+        bench::Run(Suite_Name, name, Num_Packets, wire_size,
+                   [&] { decoded = DecodeViews(view_reader, wire, packet, mismatched); });
+        if (decoded != Num_Packets || mismatched)
+        {
+            bench::Report(Suite_Name, name,
+                          {
+                              {"decoded", static_cast<double>(decoded)},
+                              {"mismatched", static_cast<double>(mismatched)},
+                          });
+        }
+
+        BytewiseTlvReader bytewise;
+        std::snprintf(name, sizeof(name), "decode_bytewise_%u", len);
+        bench::Run(Suite_Name, name, Num_Packets, wire_size,
+                   [&] { decoded = Decode(bytewise, wire); });
+        if (decoded != Num_Packets)
+        {
+            bench::Report(Suite_Name, name, {{"decoded", static_cast<double>(decoded)}});
+        }
+    }
+
+    // Full round trip through the tx and rx rings
+    {
+        HostSerial serial(HostSink::Loopback);
+        std::snprintf(name, sizeof(name), "loopback_%u", len);
+        bench::Run(Suite_Name, name, Num_Packets, wire_size,
+                   [&]
+                   {
+                       for (uint32_t i = 0; i < Num_Packets; ++i)
+                       {
+                           serial.Write(packet);
+                           while (link_packet_t* rx = serial.Read())
+                           {
+                               bench::DoNotOptimize(rx->length);
+                           }
+                       }
+                   });
+    }
+}
+
+// Frames per second through the tx ring for an audio frame from the net side,
+// a channel id in front of the data. Transmit drops the bytes so only the
+// framing and the ring are timed.
+static void BenchGatherWrite(const uint32_t len)
+{
+    char name[32];
+    std::mt19937 rng(bench::Seed);
+
+    const uint8_t channel_id = 0;
+    std::vector<uint8_t> data(len - 1);
+    for (uint8_t& byte : data)
+    {
+        byte = rng();
+    }
+
+    const uint16_t type = static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame);
+    const uint32_t wire_size = link_packet_t::Sync_Word_Size + link_packet_t::Header_Size + len;
+    HostSerial serial(HostSink::Discard);
+
+    std::snprintf(name, sizeof(name), "tx_gather_%u", len);
+    bench::Run(Suite_Name, name, Num_Packets, wire_size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Packets; ++i)
+                   {
+                       serial.Write(type, {{&channel_id, 1}, data});
+                   }
+               });
+
+    // Staged in a link_packet_t first and written whole
+    std::snprintf(name, sizeof(name), "tx_packet_%u", len);
+    bench::Run(Suite_Name, name, Num_Packets, wire_size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Packets; ++i)
+                   {
+                       link_packet_t packet;
+                       packet.type = type;
+                       packet.length = len;
+                       packet.payload[0] = channel_id;
+                       std::memcpy(packet.payload.data() + 1, data.data(), data.size());
+                       serial.Write(packet);
+                       bench::DoNotOptimize(packet);
+                   }
+               });
+}
+
+// A view must stay intact while the receiver fills every other byte of the
+// ring, the ring must refuse data while it is full of a held view, and the
+// frame's bytes must be handed back on Release.
+static void CheckViewLifetime()
+{
+    std::mt19937 rng(bench::Seed);
+    link_packet_t packet;
+    MakePacket(packet, 167, rng);
+    const std::span<const uint8_t> frame = packet.PacketData();
+
+    HostSerial serial(HostSink::Record);
+    serial.Feed(frame.data(), frame.size());
+    const SerialHandler::PacketView view = serial.ReadView();
+
+    const std::vector<uint8_t> filler(Buff_Size, 0xA5);
+    serial.Feed(filler.data(), filler.size());
+    const uint32_t fed_while_held = serial.Feed(filler.data(), filler.size());
+    const bool second_view_refused = !serial.ReadView();
+
+    const bool intact =
+        view && view.length == packet.length
+        && std::memcmp(view.payload.data(), packet.payload.data(), packet.length) == 0;
+
+    serial.Release();
+    const uint32_t fed_after_release = serial.Feed(filler.data(), filler.size());
+
+    bench::Report(Suite_Name, "view_lifetime",
+                  {
+                      {"intact", intact ? 1.0 : 0.0},
+                      {"fed_while_held", static_cast<double>(fed_while_held)},
+                      {"second_view_refused", second_view_refused ? 1.0 : 0.0},
+                      {"freed_on_release", static_cast<double>(fed_after_release)},
+                      {"frame_size", static_cast<double>(link_packet_t::Header_Size + packet.length)},
+                  });
+}
+
+// A stream of audio frames, a quarter of which carry the sync word and a
+// plausible header in their payload, with one bit flipped in every
+// Fault_Interval bytes on the wire.
+struct FaultyStream
+{
+    static constexpr uint32_t Num_Frames = 4000;
+    static constexpr uint32_t Fault_Interval = 2000;
+
+    FaultyStream(const bool crc)
+    {
+        std::mt19937 rng(bench::Seed);
+        HostSerial sender(HostSink::Record);
+        if (crc)
+        {
+            sender.EnableHeaderCrc();
+        }
+
+        // The sequence number goes after the channel id so every frame is
+        // unique
+        link_packet_t packet;
+        packet.type = static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame);
+        for (uint32_t i = 0; i < Num_Frames; ++i)
+        {
+            packet.length = i % 8 == 7 ? link_packet_t::Payload_Size : 167;
+            for (uint32_t j = 0; j < packet.length; ++j)
+            {
+                packet.payload[j] = rng();
+            }
+            packet.payload[1] = i;
+            packet.payload[2] = i >> 8;
+
+            if (i % 4 == 0)
+            {
+                // A false sync word followed by an audio header claiming most
+                // of a full payload
+                static constexpr uint8_t False_Frame[] = {0x4C, 0x49, 0x4E, 0x4B, 0x61,
+                                                          0x00, 0x00, 0x02, 0x00, 0x00};
+                std::memcpy(packet.payload.data() + 16, False_Frame, sizeof(False_Frame));
+            }
+
+            sent.emplace_back(packet.payload.begin(), packet.payload.begin() + packet.length);
+            sender.Write(packet);
+        }
+
+        wire = sender.wire;
+        for (uint32_t i = rng() % Fault_Interval; i < wire.size(); i += Fault_Interval)
+        {
+            wire[i] ^= 1 << (rng() % 8);
+            ++corrupted;
+        }
+    }
+
+    // Frames that arrive with the right sequence number and length count as
+    // delivered even when the flipped bit is in their payload, what is left
+    // was lost to framing.
+    template <typename Reader>
+    void Receive(const char* name, Reader& reader) const
+    {
+        std::vector<bool> seen(Num_Frames);
+        uint32_t delivered = 0;
+        uint32_t bogus = 0;
+        uint32_t offset = 0;
+        while (offset < wire.size())
+        {
+            const uint32_t piece = std::min<uint32_t>(64, wire.size() - offset);
+            offset += reader.Feed(wire.data() + offset, piece);
+            while (link_packet_t* rx = reader.Read())
+            {
+                const uint32_t seq = rx->length > 2 ? rx->payload[1] | rx->payload[2] << 8 : 0;
+                if (seq < Num_Frames && !seen[seq] && rx->length == sent[seq].size())
+                {
+                    seen[seq] = true;
+                    ++delivered;
+                }
+                else
+                {
+                    ++bogus;
+                }
+            }
+        }
+
+        bench::Report(Suite_Name, name,
+                      {
+                          {"frames", static_cast<double>(Num_Frames)},
+                          {"corrupted_bytes", static_cast<double>(corrupted)},
+                          {"lost", static_cast<double>(Num_Frames - delivered)},
+                          {"lost_per_corrupted_byte",
+                           static_cast<double>(Num_Frames - delivered) / corrupted},
+                          {"bogus", static_cast<double>(bogus)},
+                      });
+    }
+
+    std::vector<std::vector<uint8_t>> sent;
+    std::vector<uint8_t> wire;
+    uint32_t corrupted = 0;
+};
+
+static void BenchFaults()
+{
+    const FaultyStream plain(false);
+    {
+        BytewiseTlvReader reader;
+        plain.Receive("faults_bytewise", reader);
+    }
+    {
+        HostSerial reader(HostSink::Record);
+        plain.Receive("faults_resync", reader);
+    }
+    {
+        HostSerial reader(HostSink::Record);
+        reader.SetTypeLimits(ui_net_link::Type_Limits);
+        plain.Receive("faults_type_limits", reader);
+    }
+
+    const FaultyStream with_crc(true);
+    {
+        HostSerial reader(HostSink::Record);
+        reader.EnableHeaderCrc();
+        reader.SetTypeLimits(ui_net_link::Type_Limits);
+        with_crc.Receive("faults_header_crc", reader);
+    }
+}
+
+void BenchSerialHandler()
+{
+    CheckViewLifetime();
+
+    // Empty control message, a compressed audio frame and a full packet
+    BenchPacketSize(0);
+    BenchPacketSize(167);
+    BenchPacketSize(link_packet_t::Payload_Size);
+
+    BenchGatherWrite(167);
+    BenchGatherWrite(link_packet_t::Payload_Size);
+
+    BenchFaults();
+}
@@ -0,0 +1,427 @@
+#include "bench.hh"
+#include "serial_packet.hh"
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <utility>
+#include <vector>
+
+// SerialPacket round trips through every field width, growth past the inline
+// storage, copies and moves, then building and reading packets against the
+// byte at a time heap packet it replaced.
+static constexpr const char* Suite_Name = "serial_packet";
+static constexpr uint32_t Num_Ops = 200000;
+static constexpr uint32_t Header_Size = 5;
+
+// The packet as it was, kept to compare against. Grows a heap array by
+// doubling, moves fields a byte at a time and copies its whole capacity.
+class BytewiseSerialPacket
+{
+public:
+    BytewiseSerialPacket(const unsigned int, const unsigned int capacity) :
+        capacity(capacity),
+        size(0),
+        data(new unsigned char[capacity]{0})
+    {
+    }
+
+    BytewiseSerialPacket(const BytewiseSerialPacket& other) :
+        capacity(other.capacity),
+        size(other.size),
+        data(new unsigned char[capacity])
+    {
+        for (unsigned int i = 0; i < capacity; ++i)
+        {
+            data[i] = other.data[i];
+        }
+    }
+
+    ~BytewiseSerialPacket()
+    {
+        delete[] data;
+    }
+
+    template <typename T>
+    void SetData(const T val, const unsigned int offset, const int num_bytes)
+    {
+        const unsigned int in_sz = offset + num_bytes;
+        while (in_sz > capacity)
+        {
+            unsigned char* tmp = new unsigned char[capacity * 2]{0};
+            for (unsigned int i = 0; i < capacity; ++i)
+            {
+                tmp[i] = data[i];
+            }
+            delete[] data;
+            data = tmp;
+            capacity *= 2;
+        }
+
+        for (int i = 0; i < num_bytes; ++i)
+        {
+            data[offset + i] = static_cast<unsigned char>(static_cast<uint64_t>(val) >> (i * 8));
+        }
+        size = std::max(size, in_sz);
+    }
+
+    template <typename T>
+    T GetData(const unsigned int offset, const int num_bytes) const
+    {
+        T output = 0;
+        for (int i = 0; i < num_bytes && offset + i < capacity; ++i)
+        {
+            output |= static_cast<T>(static_cast<T>(data[offset + i]) << (i * 8));
+        }
+        return output;
+    }
+
+private:
+    unsigned int capacity;
+    unsigned int size;
+    unsigned char* data;
+};
+
+// Counts the checks that failed and prints the first few
+class PacketCheck
+{
+public:
+    explicit PacketCheck(const char* name) :
+        name(name),
+        checks(0),
+        failed(0)
+    {
+    }
+
+    void operator()(const bool passed, const char* what)
+    {
+        ++checks;
+        if (passed)
+        {
+            return;
+        }
+
+        if (failed++ < 8)
+        {
+            std::printf("serial_packet %s: %s\n", name, what);
+        }
+    }
+
+    void Report() const
+    {
+        bench::Report(Suite_Name, name,
+                      {{"checks", static_cast<double>(checks)},
+                       {"failed", static_cast<double>(failed)},
+                       {"ok", failed == 0 ? 1.0 : 0.0}});
+    }
+
+private:
+    const char* name;
+    uint32_t checks;
+    uint32_t failed;
+};
+
+// The header and message as the legacy packets carry them
+template <typename Packet>
+static void Build(Packet& packet, const uint16_t id, const uint8_t* message, const uint16_t size)
+{
+    packet.SetData(SerialPacket::Types::QMessage, 0, 1);
+    packet.SetData(id, 1, 2);
+    packet.SetData(size, 3, 2);
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        packet.SetData(message[i], Header_Size + i, 1);
+    }
+}
+
+static bool Matches(const SerialPacket& packet,
+                    const uint16_t id,
+                    const uint8_t* message,
+                    const uint16_t size)
+{
+    std::vector<uint8_t> out(size);
+    packet.GetBytes(out.data(), size, Header_Size);
+    return packet.GetData<uint8_t>(0, 1) == static_cast<uint8_t>(SerialPacket::Types::QMessage)
+           && packet.GetData<uint16_t>(1, 2) == id && packet.GetData<uint16_t>(3, 2) == size
+           && packet.NumBytes() == Header_Size + size
+           && std::memcmp(out.data(), message, size) == 0;
+}
+
+// Nothing past the used bytes, which is what lets a copy stop there
+static bool ZeroPastSize(const SerialPacket& packet)
+{
+    for (unsigned int i = packet.NumBytes(); i < packet.Capacity(); ++i)
+    {
+        if (packet.Data()[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void CheckFields(std::mt19937& rng)
+{
+    PacketCheck check("fields");
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        const uint64_t value = (static_cast<uint64_t>(rng()) << 32) | rng();
+        for (int width = 1; width <= 8; ++width)
+        {
+            const uint64_t mask = width == 8 ? ~0ull : (1ull << (width * 8)) - 1;
+            const unsigned int offset = rng() % 16;
+            SerialPacket packet(0, 24, false);
+            packet.SetData(value, offset, width);
+
+            check(packet.GetData<uint64_t>(offset, width) == (value & mask), "uint64 field");
+            check(packet.NumBytes() == offset + width, "size after field");
+
+            // Little endian on the wire whatever the host is
+            bool wire = true;
+            for (int b = 0; b < width; ++b)
+            {
+                wire &= packet.Data()[offset + b] == static_cast<uint8_t>(value >> (b * 8));
+            }
+            check(wire, "wire order");
+        }
+
+        const int32_t negative = -static_cast<int32_t>(rng() >> 1);
+        SerialPacket packet(0, 8);
+        packet.SetData(negative, 0, 4);
+        packet.SetData(static_cast<int16_t>(negative), 4, 2);
+        check(packet.GetData<int32_t>(0, 4) == negative, "int32 field");
+        check(packet.GetData<int16_t>(4, 2) == static_cast<int16_t>(negative), "int16 field");
+    }
+
+    // A whole value when no width is given
+    SerialPacket packet(0, 16);
+    packet.SetData(0x1122334455667788ull, 0, 0);
+    check(packet.GetData<uint64_t>(0, 0) == 0x1122334455667788ull, "full width");
+    check(packet.GetData<uint32_t>(4, 4) == 0x11223344u, "high half");
+
+    // Reads past the capacity come back zero
+    check(packet.GetData<uint32_t>(14, 4) == 0, "read past capacity");
+    check(packet.GetData<uint32_t>(100, 4) == 0, "read far past capacity");
+
+    // Arrays both as they are and narrowed per element
+    const uint16_t words[] = {0x0102, 0x0304, 0xA0B0, 0xFFFF};
+    SerialPacket array(0, 4);
+    unsigned int offset = 1;
+    array.SetData(words, 4, offset, 2);
+    check(offset == 9, "array offset");
+    offset = 9;
+    array.SetData(words, 4, offset, 1);
+    check(offset == 13, "narrowed array offset");
+    for (int i = 0; i < 4; ++i)
+    {
+        check(array.GetData<uint16_t>(1 + i * 2, 2) == words[i], "array element");
+        check(array.GetData<uint8_t>(9 + i, 1) == (words[i] & 0xFF), "narrowed element");
+    }
+
+    // Appends go after the last used byte
+    SerialPacket appended(0, 1);
+    appended.SetData(static_cast<uint8_t>(0xAA), 1);
+    appended.SetData(static_cast<uint16_t>(0xBBCC), 2);
+    check(appended.NumBytes() == 3 && appended.GetData<uint16_t>(1, 2) == 0xBBCC, "append");
+
+    check.Report();
+}
+
+static void CheckGrowth(std::mt19937& rng)
+{
+    PacketCheck check("growth");
+
+    // Byte by byte from one byte of capacity, out of the inline storage and
+    // through a few doublings on the heap
+    std::vector<uint8_t> message(1000);
+    for (auto& byte : message)
+    {
+        byte = rng();
+    }
+
+    SerialPacket packet(0, 1);
+    for (const uint8_t byte : message)
+    {
+        packet.SetData(byte, 1);
+    }
+    check(packet.NumBytes() == message.size(), "grown size");
+    check(packet.Capacity() == 1024, "grown capacity");
+    check(std::memcmp(packet.Data(), message.data(), message.size()) == 0, "grown bytes");
+    check(ZeroPastSize(packet), "zero past grown size");
+
+    // Shrinking keeps the bytes that still fit and comes back inline
+    packet.SetCapacity(64);
+    check(packet.NumBytes() == 64 && packet.Capacity() == 64, "shrunk size");
+    check(std::memcmp(packet.Data(), message.data(), 64) == 0, "shrunk bytes");
+    packet.SetCapacity(96);
+    check(ZeroPastSize(packet), "zero past regrown size");
+
+    // A packet that cannot grow drops what does not fit
+    SerialPacket fixed(0, 8, false);
+    fixed.SetData(static_cast<uint32_t>(0x12345678), 6, 4);
+    check(fixed.NumBytes() == 0 && fixed.Capacity() == 8, "fixed overflow");
+    check(fixed.SetBytes(message.data(), 8, 0) == 8, "fixed fill");
+    check(fixed.SetBytes(message.data(), 1, 8) == 0, "fixed past end");
+
+    check.Report();
+}
+
+static void CheckCopies(std::mt19937& rng)
+{
+    PacketCheck check("copies");
+
+    // Inline and on the heap, with the copies going between both
+    for (const uint16_t size : {16, 100, 400, 2000})
+    {
+        std::vector<uint8_t> message(size);
+        for (auto& byte : message)
+        {
+            byte = rng();
+        }
+        const uint16_t id = rng();
+
+        SerialPacket packet(7, Header_Size + size);
+        Build(packet, id, message.data(), size);
+        packet.IncrementRetry();
+
+        SerialPacket copy(packet);
+        check(Matches(copy, id, message.data(), size), "copy");
+        check(copy.GetCreatedAt() == 7 && copy.GetRetries() == 1, "copy state");
+        check(copy.Data() != packet.Data(), "copy owns its bytes");
+
+        SerialPacket small(0, 4);
+        small.SetData(static_cast<uint32_t>(0xFFFFFFFF), 0, 4);
+        small = packet;
+        check(Matches(small, id, message.data(), size), "copy assign");
+        check(ZeroPastSize(small), "zero past copied size");
+
+        SerialPacket large(0, 3000);
+        large.SetBytes(message.data(), size, 2000);
+        large = copy;
+        check(Matches(large, id, message.data(), size), "copy assign to bigger");
+
+        SerialPacket moved(std::move(copy));
+        check(Matches(moved, id, message.data(), size), "move");
+        check(copy.NumBytes() == 0 && copy.Capacity() == 1, "moved from is empty");
+
+        SerialPacket target(0, 600);
+        target = std::move(moved);
+        check(Matches(target, id, message.data(), size), "move assign");
+        check(moved.NumBytes() == 0, "move assigned from is empty");
+
+        // A moved from packet can be used again
+        moved.SetData(id, 0, 2);
+        check(moved.GetData<uint16_t>(0, 2) == id, "reuse after move");
+
+        SerialPacket& same = target;
+        target = same;
+        check(Matches(target, id, message.data(), size), "self assign");
+    }
+
+    // A packet built with spare capacity copies only what it used
+    SerialPacket spare(0, 640);
+    const uint8_t message[] = {1, 2, 3};
+    Build(spare, 1, message, sizeof(message));
+    SerialPacket copy(spare);
+    check(Matches(copy, 1, message, sizeof(message)) && ZeroPastSize(copy), "spare copy");
+
+    check.Report();
+}
+
+template <typename Packet>
+static void BenchBuild(const char* name, const uint16_t size, const uint8_t* message)
+{
+    bench::Run(Suite_Name, name, Num_Ops, Header_Size + size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       Packet packet(0, Header_Size + size);
+                       Build(packet, i & 0xFFFF, message, size);
+                       uint32_t sum = packet.template GetData<uint16_t>(1, 2);
+                       for (uint32_t j = 0; j < size; ++j)
+                       {
+                           sum += packet.template GetData<uint8_t>(Header_Size + j, 1);
+                       }
+                       bench::DoNotOptimize(sum);
+                   }
+               });
+}
+
+// What the packet path needs, the header fields one at a time and the message
+// in one go
+static void BenchBulk(const char* name, const uint16_t size, const uint8_t* message)
+{
+    std::vector<uint8_t> out(size);
+    bench::Run(Suite_Name, name, Num_Ops, Header_Size + size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       SerialPacket packet(0, Header_Size + size);
+                       packet.SetData(SerialPacket::Types::QMessage, 0, 1);
+                       packet.SetData(static_cast<uint16_t>(i), 1, 2);
+                       packet.SetData(size, 3, 2);
+                       packet.SetBytes(message, size, Header_Size);
+
+                       const uint16_t len = packet.GetData<uint16_t>(3, 2);
+                       packet.GetBytes(out.data(), len, Header_Size);
+                       bench::DoNotOptimize(out.data());
+                   }
+               });
+}
+
+void BenchSerialPacket()
+{
+    std::mt19937 rng(bench::Seed);
+
+    CheckFields(rng);
+    CheckGrowth(rng);
+    CheckCopies(rng);
+
+    std::vector<uint8_t> message(512);
+    for (auto& byte : message)
+    {
+        byte = rng();
+    }
+
+    char name[48];
+    for (const uint16_t size : {32, 512})
+    {
+        std::snprintf(name, sizeof(name), "build_read_bytewise_%u", size);
+        BenchBuild<BytewiseSerialPacket>(name, size, message.data());
+
+        std::snprintf(name, sizeof(name), "build_read_%u", size);
+        BenchBuild<SerialPacket>(name, size, message.data());
+
+        std::snprintf(name, sizeof(name), "build_read_bulk_%u", size);
+        BenchBulk(name, size, message.data());
+    }
+
+    // Copying a short message out of a packet sized for the largest one
+    static constexpr uint16_t Short_Size = 32;
+    static constexpr uint32_t Spare_Capacity = 640;
+    BytewiseSerialPacket bytewise(0, Spare_Capacity);
+    Build(bytewise, 1, message.data(), Short_Size);
+    bench::Run(Suite_Name, "copy_bytewise_32", Num_Ops, Header_Size + Short_Size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       BytewiseSerialPacket copy(bytewise);
+                       bench::DoNotOptimize(copy);
+                   }
+               });
+
+    SerialPacket packet(0, Spare_Capacity);
+    Build(packet, 1, message.data(), Short_Size);
+    bench::Run(Suite_Name, "copy_32", Num_Ops, Header_Size + Short_Size,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Ops; ++i)
+                   {
+                       SerialPacket copy(packet);
+                       bench::DoNotOptimize(copy);
+                   }
+               });
+}
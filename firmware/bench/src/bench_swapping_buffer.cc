@@ -0,0 +1,100 @@
+#include "bench.hh"
+#include "constants.hh"
+#include "swapping_buffer.hh"
+#include <random>
+
+static constexpr const char* Suite_Name = "swapping_buffer";
+static constexpr uint32_t Num_Frames = 50 * 60 * 10; // ten minutes of audio
+static constexpr double Period_ms = constants::Audio_Time_Length_ms;
+
+// Simulates the i2s dma against a main loop whose work per frame varies. The
+// producer rotates every period, the consumer takes the finished buffer as
+// soon as it is idle and holds it for a random amount of time. Reports how
+// many frames were lost for each load and buffer count.
+template <uint16_t Num_Buffs>
+static void Simulate(const double mean_ms, const double jitter_ms)
+{
+    SwappingBuffer<uint16_t, Num_Buffs, constants::Audio_Buffer_Sz> buffers;
+    std::mt19937 rng(bench::Seed);
+    std::normal_distribution<double> work(mean_ms, jitter_ms);
+
+    bool consuming = false;
+    double release_ms = 0;
+    uint32_t consumed = 0;
+
+    // Starts on a ready buffer if there is one, at_ms is when the consumer
+    // became idle
+    const auto try_consume = [&](const double at_ms)
+    {
+        if (!buffers.AcquireRead())
+        {
+            return;
+        }
+        consuming = true;
+        ++consumed;
+        release_ms = at_ms + std::max(0.0, work(rng));
+    };
+
+    buffers.AcquireWrite();
+    for (uint32_t frame = 1; frame <= Num_Frames; ++frame)
+    {
+        const double now_ms = frame * Period_ms;
+
+        // Work the consumer finished since the last tick, it picks up any
+        // backlog straight away
+        while (consuming && release_ms <= now_ms)
+        {
+            buffers.Release();
+            consuming = false;
+            try_consume(release_ms);
+        }
+
+        buffers.Rotate();
+
+        if (!consuming)
+        {
+            try_consume(now_ms);
+        }
+    }
+
+    char name[48];
+    std::snprintf(name, sizeof(name), "skew_%ubuf_%.0fms_%.0fms", Num_Buffs, mean_ms, jitter_ms);
+    bench::Report(Suite_Name, name,
+                  {
+                      {"frames", static_cast<double>(Num_Frames)},
+                      {"consumed", static_cast<double>(consumed)},
+                      {"overruns", static_cast<double>(buffers.Overruns())},
+                      {"late_consumers", static_cast<double>(buffers.LateConsumers())},
+                      {"lost_pct", 100.0 * (buffers.Overruns() + buffers.LateConsumers())
+                                       / Num_Frames},
+                  });
+}
+
+void BenchSwappingBuffer()
+{
+    static constexpr double Loads[][2] = {
+        {5, 1},
+        {15, 3},
+        {18, 4},
+        {22, 2},
+    };
+
+    for (const auto& load : Loads)
+    {
+        Simulate<2>(load[0], load[1]);
+        Simulate<3>(load[0], load[1]);
+    }
+
+    SwappingBuffer<uint16_t, 2, constants::Audio_Buffer_Sz> buffers;
+    buffers.AcquireWrite();
+    bench::Run(Suite_Name, "rotate_acquire_release", Num_Frames, 0,
+               [&]
+               {
+                   for (uint32_t i = 0; i < Num_Frames; ++i)
+                   {
+                       buffers.Rotate();
+                       bench::DoNotOptimize(buffers.AcquireRead());
+                       buffers.Release();
+                   }
+               });
+}
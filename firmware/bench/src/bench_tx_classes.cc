@@ -0,0 +1,461 @@
+#include "bench.hh"
+#include "serial_handler/serial_handler.hh"
+#include "ui_net_link.hh"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Simulated ui to net uart carrying audio mixed with bursts of log lines and ai
+// json chunks. Time only moves in the model, the uart takes Byte_Us per byte,
+// so the delays are what the real link would see and do not depend on the
+// host.
+static constexpr const char* Suite_Name = "tx_classes";
+static constexpr double Baud = 460800;
+static constexpr double Byte_Us = 10 * 1e6 / Baud;
+static constexpr double Duration_Us = 60e6;
+static constexpr uint32_t Tx_Buff_Size = 8192;
+static constexpr uint32_t Realtime_Tx_Buff_Size = 2048;
+static constexpr uint32_t Rx_Buff_Size = 2048;
+
+static constexpr double Audio_Period_Us = 20e3;
+static constexpr uint32_t Audio_Size = 200;
+static constexpr uint16_t Audio_Depth = 4;
+
+// Log lines come in bursts of a few, ai answers as a run of full packets
+static constexpr double Log_Burst_Us = 100e3;
+static constexpr uint32_t Max_Log_Lines = 8;
+static constexpr uint32_t Min_Log_Size = 40;
+static constexpr uint32_t Max_Log_Size = 200;
+static constexpr double Ai_Burst_Us = 2e6;
+static constexpr uint32_t Max_Ai_Chunks = 10;
+
+// Net stalling on wifi and then handing over the audio it held all at once
+static constexpr double Stall_Us = 160e3;
+static constexpr uint32_t Aggregate_Frames = 3;
+
+static constexpr uint16_t Bulk_Type = 0x0062;
+static constexpr uint8_t Audio_Kind = 'A';
+static constexpr uint8_t Bulk_Kind = 'B';
+
+struct SimLinkStorage
+{
+    uint8_t rx_packet_storage[link_packet_t::Packet_Size];
+    uint8_t tx_storage[Tx_Buff_Size];
+    uint8_t realtime_tx_storage[Realtime_Tx_Buff_Size];
+    uint8_t rx_storage[Rx_Buff_Size];
+};
+
+// A link whose transmit takes as long as the uart would. The chunk handed to
+// Transmit stays in flight until Complete is called at done_at. Headers carry
+// a crc like on the ui link.
+class SimLink : private SimLinkStorage, public SerialHandler
+{
+public:
+    SimLink() :
+        SerialHandler(*rx_packet_storage,
+                      sizeof(rx_packet_storage),
+                      *tx_storage,
+                      Tx_Buff_Size,
+                      *realtime_tx_storage,
+                      Realtime_Tx_Buff_Size,
+                      *rx_storage,
+                      Rx_Buff_Size,
+                      Transmit,
+                      this)
+    {
+        EnableHeaderCrc();
+    }
+
+    // Hands the bytes that just went out to the receiving end and starts on
+    // the next chunk
+    void Complete(SimLink& receiver)
+    {
+        receiver.rx_ring.Write(tx_chunk.data(), tx_chunk.size());
+        wire_bytes += tx_chunk.size();
+
+        done_at = std::numeric_limits<double>::infinity();
+        UpdateTx();
+    }
+
+    void Feed(std::span<const uint8_t> bytes)
+    {
+        rx_ring.Write(bytes.data(), bytes.size());
+    }
+
+    double now = 0;
+    double done_at = std::numeric_limits<double>::infinity();
+    uint64_t wire_bytes = 0;
+    uint32_t transmits = 0;
+
+private:
+    static void Transmit(void* arg)
+    {
+        SimLink* self = static_cast<SimLink*>(arg);
+        self->done_at = self->now + self->tx_chunk.size() * Byte_Us;
+        ++self->transmits;
+    }
+};
+
+// A link whose transmit only returns once the bytes are out, like a blocking
+// uart write on net, so UpdateTx runs from inside Transmit. Until blocking is
+// set the first chunk is held so frames can pile up behind it.
+class BlockingLink : private SimLinkStorage, public SerialHandler
+{
+public:
+    explicit BlockingLink(SimLink& receiver) :
+        SerialHandler(*rx_packet_storage,
+                      sizeof(rx_packet_storage),
+                      *tx_storage,
+                      Tx_Buff_Size,
+                      *realtime_tx_storage,
+                      Realtime_Tx_Buff_Size,
+                      *rx_storage,
+                      Rx_Buff_Size,
+                      Transmit,
+                      this),
+        receiver(receiver)
+    {
+        EnableHeaderCrc();
+    }
+
+    void Release()
+    {
+        blocking = true;
+        Deliver();
+    }
+
+    uint32_t depth = 0;
+    uint32_t max_depth = 0;
+    uint32_t received = 0;
+
+private:
+    void Deliver()
+    {
+        receiver.Feed(tx_chunk);
+        while (const SerialHandler::PacketView view = receiver.ReadView())
+        {
+            ++received;
+            receiver.Release();
+        }
+        UpdateTx();
+    }
+
+    static void Transmit(void* arg)
+    {
+        BlockingLink* self = static_cast<BlockingLink*>(arg);
+        self->max_depth = std::max(self->max_depth, ++self->depth);
+        if (self->blocking)
+        {
+            self->Deliver();
+        }
+        --self->depth;
+    }
+
+    SimLink& receiver;
+    bool blocking = false;
+};
+
+// Every frame of both classes goes out from the one call that releases the
+// transmitter, without Transmit being entered again from inside itself
+static void BenchBlockingTransmit()
+{
+    // Both queues full behind the frame held in the transmitter
+    static constexpr uint32_t Frames_Per_Class = SerialHandler::Max_Tx_Frames - 1;
+    static constexpr uint32_t Frame_Size = 24;
+
+    SimLink receiver;
+    BlockingLink sender(receiver);
+    sender.SetTxDepth(SerialHandler::TxClass::Realtime, SerialHandler::Max_Tx_Frames);
+
+    uint8_t payload[Frame_Size] = {Audio_Kind};
+    for (uint32_t i = 0; i <= Frames_Per_Class; ++i)
+    {
+        sender.Write(static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame),
+                     {{payload, Frame_Size}}, SerialHandler::TxClass::Realtime);
+        sender.Write(Bulk_Type, {{payload, Frame_Size}});
+    }
+    sender.Release();
+
+    const uint32_t written = (Frames_Per_Class + 1) * 2;
+    const uint32_t received = sender.received;
+    bench::Report(Suite_Name, "blocking_transmit",
+                  {
+                      {"written", static_cast<double>(written)},
+                      {"received", static_cast<double>(received)},
+                      {"max_depth", static_cast<double>(sender.max_depth)},
+                      {"ok", static_cast<double>(received == written && sender.max_depth == 1)},
+                  });
+}
+
+static double Percentile(std::vector<double>& values, const double pct)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    const size_t idx = std::min(values.size() - 1, static_cast<size_t>(pct / 100 * values.size()));
+    std::nth_element(values.begin(), values.begin() + idx, values.end());
+    return values[idx];
+}
+
+// Runs the same traffic with audio in its own class or queued behind
+// everything else like before, and reports how long audio frames waited for
+// the uart beyond their own time on the wire
+static void Simulate(const char* name, const SerialHandler::TxClass audio_class)
+{
+    std::mt19937 rng(bench::Seed);
+    std::exponential_distribution<double> log_gap(1 / Log_Burst_Us);
+    std::exponential_distribution<double> ai_gap(1 / Ai_Burst_Us);
+
+    SimLink sender;
+    SimLink receiver;
+    sender.SetTxDepth(SerialHandler::TxClass::Realtime, Audio_Depth);
+
+    std::vector<double> sent_at;
+    std::vector<double> delays;
+    uint32_t bulk_received = 0;
+
+    double next_audio = 0;
+    double next_log = log_gap(rng);
+    double next_ai = ai_gap(rng);
+
+    uint8_t payload[link_packet_t::Payload_Size] = {};
+
+    while (true)
+    {
+        const double now = std::min({next_audio, next_log, next_ai, sender.done_at});
+        if (now > Duration_Us)
+        {
+            break;
+        }
+        sender.now = now;
+
+        if (now == sender.done_at)
+        {
+            sender.Complete(receiver);
+            while (const SerialHandler::PacketView view = receiver.ReadView())
+            {
+                if (view.payload[0] == Audio_Kind)
+                {
+                    uint32_t seq;
+                    std::memcpy(&seq, view.payload.data() + 1, sizeof(seq));
+                    const double wire_us =
+                        (link_packet_t::Sync_Word_Size + SerialHandler::Max_Header_Size
+                         + view.length)
+                        * Byte_Us;
+                    delays.push_back(std::max(0.0, now - sent_at[seq] - wire_us) / 1e3);
+                }
+                else
+                {
+                    ++bulk_received;
+                }
+                receiver.Release();
+            }
+        }
+        else if (now == next_audio)
+        {
+            const uint32_t seq = sent_at.size();
+            sent_at.push_back(now);
+            payload[0] = Audio_Kind;
+            std::memcpy(payload + 1, &seq, sizeof(seq));
+            sender.Write(static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame),
+                         {{payload, Audio_Size}}, audio_class);
+            next_audio += Audio_Period_Us;
+        }
+        else if (now == next_log)
+        {
+            payload[0] = Bulk_Kind;
+            const uint32_t lines = 1 + rng() % Max_Log_Lines;
+            for (uint32_t i = 0; i < lines; ++i)
+            {
+                const uint32_t size = Min_Log_Size + rng() % (Max_Log_Size - Min_Log_Size);
+                sender.Write(Bulk_Type, {{payload, size}});
+            }
+            next_log += log_gap(rng);
+        }
+        else
+        {
+            payload[0] = Bulk_Kind;
+            const uint32_t chunks = 1 + rng() % Max_Ai_Chunks;
+            for (uint32_t i = 0; i < chunks; ++i)
+            {
+                sender.Write(Bulk_Type, {{payload, link_packet_t::Payload_Size}});
+            }
+            next_ai += ai_gap(rng);
+        }
+    }
+
+    const double received = delays.size();
+    const uint32_t realtime_drops = sender.TxDrops(SerialHandler::TxClass::Realtime);
+    const uint32_t bulk_drops = sender.TxDrops(SerialHandler::TxClass::Bulk);
+    bench::Report(Suite_Name, name,
+                  {
+                      {"audio_sent", static_cast<double>(sent_at.size())},
+                      {"audio_received", received},
+                      {"bulk_received", static_cast<double>(bulk_received)},
+                      {"realtime_drops", static_cast<double>(realtime_drops)},
+                      {"bulk_drops", static_cast<double>(bulk_drops)},
+                      {"p50_ms", Percentile(delays, 50)},
+                      {"p90_ms", Percentile(delays, 90)},
+                      {"p99_ms", Percentile(delays, 99)},
+                      {"max_ms", Percentile(delays, 100)},
+                  });
+}
+
+// Audio only, held back by a stall and then written as a burst, sent as is
+// or packed into aggregates. Fills in when each frame was received.
+static void SimulateStalls(const char* name,
+                           const uint8_t aggregate_frames,
+                           std::vector<double>& received_at)
+{
+    SimLink sender;
+    SimLink receiver;
+    sender.SetTxDepth(SerialHandler::TxClass::Realtime, SerialHandler::Max_Tx_Frames);
+    sender.EnableAggregation(aggregate_frames);
+    receiver.EnableAggregation(aggregate_frames);
+
+    const uint32_t burst = Stall_Us / Audio_Period_Us;
+    const uint32_t num_frames = Duration_Us / Stall_Us * burst;
+    std::vector<double> sent_at(num_frames);
+    received_at.assign(num_frames, 0);
+
+    uint32_t seq = 0;
+    uint32_t received = 0;
+    double next_burst = 0;
+    uint8_t payload[Audio_Size] = {Audio_Kind};
+
+    while (received < num_frames)
+    {
+        const double now = std::min(next_burst, sender.done_at);
+        if (now == std::numeric_limits<double>::infinity())
+        {
+            // Dropped frames never arrive
+            break;
+        }
+        sender.now = now;
+
+        if (now == sender.done_at)
+        {
+            sender.Complete(receiver);
+            while (const SerialHandler::PacketView view = receiver.ReadView())
+            {
+                uint32_t id;
+                std::memcpy(&id, view.payload.data() + 1, sizeof(id));
+                received_at[id] = now;
+                ++received;
+                receiver.Release();
+            }
+        }
+        else
+        {
+            // Each frame was due a period after the one before it
+            for (uint32_t i = 0; i < burst && seq < num_frames; ++i, ++seq)
+            {
+                sent_at[seq] = now - (burst - 1 - i) * Audio_Period_Us;
+                std::memcpy(payload + 1, &seq, sizeof(seq));
+                sender.Write(static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame),
+                             {{payload, Audio_Size}}, SerialHandler::TxClass::Realtime);
+            }
+            next_burst =
+                seq < num_frames ? now + Stall_Us : std::numeric_limits<double>::infinity();
+        }
+    }
+
+    std::vector<double> delays(num_frames);
+    for (uint32_t i = 0; i < num_frames; ++i)
+    {
+        delays[i] = (received_at[i] - sent_at[i]) / 1e3;
+    }
+
+    const double wire_bytes_per_frame = static_cast<double>(sender.wire_bytes) / num_frames;
+    const uint32_t drops = sender.TxDrops(SerialHandler::TxClass::Realtime);
+    bench::Report(Suite_Name, name,
+                  {
+                      {"frames", static_cast<double>(num_frames)},
+                      {"drops", static_cast<double>(drops)},
+                      {"wire_bytes_per_frame", wire_bytes_per_frame},
+                      {"transmits_per_frame", static_cast<double>(sender.transmits) / num_frames},
+                      {"line_rate_frames_per_s", Baud / 10 / wire_bytes_per_frame},
+                      {"p50_ms", Percentile(delays, 50)},
+                      {"p99_ms", Percentile(delays, 99)},
+                      {"max_ms", Percentile(delays, 100)},
+                  });
+}
+
+// Host time to queue, send and split bursts of frames, with the uart taking
+// no time at all
+static void BenchBursts(const char* name, const uint8_t aggregate_frames)
+{
+    static constexpr uint32_t Num_Bursts = 2000;
+    static constexpr uint32_t Burst = Stall_Us / Audio_Period_Us;
+
+    SimLink sender;
+    SimLink receiver;
+    sender.SetTxDepth(SerialHandler::TxClass::Realtime, SerialHandler::Max_Tx_Frames);
+    sender.EnableAggregation(aggregate_frames);
+    receiver.EnableAggregation(aggregate_frames);
+
+    uint8_t payload[Audio_Size] = {Audio_Kind};
+    uint32_t received = 0;
+    bench::Run(Suite_Name, name, Num_Bursts * Burst, Audio_Size,
+               [&]
+               {
+                   received = 0;
+                   for (uint32_t i = 0; i < Num_Bursts; ++i)
+                   {
+                       // The first frame starts right away, the rest queue
+                       // behind it
+                       for (uint32_t j = 0; j < Burst; ++j)
+                       {
+                           sender.Write(static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame),
+                                        {{payload, Audio_Size}}, SerialHandler::TxClass::Realtime);
+                       }
+
+                       while (sender.done_at != std::numeric_limits<double>::infinity())
+                       {
+                           sender.Complete(receiver);
+                           while (const SerialHandler::PacketView view = receiver.ReadView())
+                           {
+                               bench::DoNotOptimize(view.payload.data());
+                               ++received;
+                               receiver.Release();
+                           }
+                       }
+                   }
+               });
+
+    if (received != Num_Bursts * Burst)
+    {
+        bench::Report(Suite_Name, name, {{"received", static_cast<double>(received)}});
+    }
+}
+
+void BenchTxClasses()
+{
+    Simulate("audio_delay_fifo", SerialHandler::TxClass::Bulk);
+    Simulate("audio_delay_realtime", SerialHandler::TxClass::Realtime);
+
+    std::vector<double> separate;
+    std::vector<double> aggregated;
+    SimulateStalls("stalls_separate", 0, separate);
+    SimulateStalls("stalls_aggregated", Aggregate_Frames, aggregated);
+
+    // How much later any one frame arrived for being packed with others
+    double added_us = 0;
+    for (size_t i = 0; i < separate.size(); ++i)
+    {
+        added_us = std::max(added_us, aggregated[i] - separate[i]);
+    }
+    bench::Report(Suite_Name, "aggregation_added_latency",
+                  {
+                      {"max_frames", static_cast<double>(Aggregate_Frames)},
+                      {"worst_ms", added_us / 1e3},
+                  });
+
+    BenchBlockingTransmit();
+
+    BenchBursts("bursts_separate", 0);
+    BenchBursts("bursts_aggregated", Aggregate_Frames);
+}
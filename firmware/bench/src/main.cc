@@ -0,0 +1,39 @@
+#include "bench.hh"
+#include <cstring>
+
+struct Suite
+{
+    const char* name;
+    void (*Run)();
+};
+
+static constexpr Suite Suites[] = {
+    {"ring_buffer", BenchRingBuffer},       {"serial_handler", BenchSerialHandler},
+    {"link_packets", BenchLinkPackets},     {"block_pool", BenchBlockPool},
+    {"linked_queue", BenchLinkedQueue},     {"swapping_buffer", BenchSwappingBuffer},
+    {"arena_queue", BenchArenaQueue},       {"tx_classes", BenchTxClasses},
+    {"flow_control", BenchFlowControl},     {"link_rate", BenchLinkRate},
+    {"link_stats", BenchLinkStats},         {"link_latency", BenchLinkLatency},
+    {"link_sim", BenchLinkSim},             {"cobs", BenchCobs},
+    {"serial_packet", BenchSerialPacket},   {"link_schema", BenchLinkSchema},
+    {"compact_frames", BenchCompactFrames}, {"audio_codec", BenchAudioCodec},
+    {"adpcm", BenchAdpcm},
+};
+
+// Usage: bench [filter]
+// Runs every suite whose name contains filter, or all of them.
+int main(int argc, char** argv)
+{
+    const char* filter = argc > 1 ? argv[1] : "";
+
+    for (const Suite& suite : Suites)
+    {
+        if (std::strstr(suite.name, filter) == nullptr)
+        {
+            continue;
+        }
+        suite.Run();
+    }
+
+    return 0;
+}
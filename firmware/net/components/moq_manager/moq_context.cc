@@ -109,6 +109,7 @@ void MoqContext::UpdateAITracks(ConfigState& config)
 void MoqContext::UpdateChannelTracks(ConfigState& config)
 {
     const std::string lang = config.language.Load();
+    const std::string codec = config.audio_codec.Load();
 
     if (config.channel_ns.empty() || lang.empty())
     {
@@ -116,12 +117,12 @@ void MoqContext::UpdateChannelTracks(ConfigState& config)
         return;
     }
 
-    if (auto writer = CreateWriteTrack("channel", config.channel_ns, lang, "pcm", config))
+    if (auto writer = CreateWriteTrack("channel", config.channel_ns, lang, codec, config))
     {
         writer->Start();
     }
 
-    if (auto reader = CreateReadTrack("channel", config.channel_ns, lang, "pcm"))
+    if (auto reader = CreateReadTrack("channel", config.channel_ns, lang, codec))
     {
         reader->Start();
     }
@@ -171,7 +172,7 @@ MoqContext::CreateReadTrack(const std::string& channel_name,
 try
 {
     uint32_t offset = 0;
-    if (codec == "pcm")
+    if (ConfigState::IsValidAudioCodec(codec))
     {
         offset = channel_name == "self_ai_audio" ? (uint32_t)ui_net_link::Channel_Id::Ptt_Ai
                                                  : (uint32_t)ui_net_link::Channel_Id::Ptt;
@@ -240,7 +241,7 @@ try
     }
 
     uint32_t offset = 0;
-    if (codec == "pcm")
+    if (ConfigState::IsValidAudioCodec(codec))
     {
         offset = channel_name == "ai_audio" ? (uint32_t)ui_net_link::Channel_Id::Ptt_Ai
                                             : (uint32_t)ui_net_link::Channel_Id::Ptt;
@@ -3,6 +3,7 @@
 
 #include "moq_track_reader.hh"
 #include "chunk.hh"
+#include "config_state.hh"
 #include "link_packet_t.hh"
 #include "logger.hh"
 #include "macros.hh"
@@ -11,9 +12,13 @@
 #include "task_helpers.hh"
 #include "ui_net_link.hh"
 #include "utils.hh"
+#include <atomic>
 
 using namespace moq;
 
+// Audio to the ui is numbered across all tracks, the ui counts the gaps
+static std::atomic<ui_net_link::AudioSeq> ui_audio_seq{0};
+
 TrackReader::TrackReader(const quicr::FullTrackName& full_track_name,
                          Serial& serial,
                          const std::string& codec,
@@ -87,7 +92,8 @@ void TrackReader::ObjectReceived(const quicr::ObjectHeaders& headers,
 {
     ++num_print;
 
-    if ((codec == "pcm" && num_print >= 20) || codec == "ascii" || codec == "ai_cmd_response:json")
+    if ((ConfigState::IsValidAudioCodec(codec) && num_print >= 20) || codec == "ascii"
+        || codec == "ai_cmd_response:json")
     {
         num_recv += num_print;
         num_print = 0;
@@ -199,7 +205,7 @@ void TrackReader::SubscribeTask(void* param)
             NET_LOG_INFO("Subscribe to track %s", reader->track_name.c_str());
         }
 
-        if (reader->codec == "pcm")
+        if (ConfigState::IsValidAudioCodec(reader->codec))
         {
             reader->TransmitAudio();
         }
@@ -222,6 +228,12 @@ void TrackReader::SubscribeTask(void* param)
 void TrackReader::TransmitAudio()
 {
     NET_LOG_INFO("Track reader %s", codec.c_str());
+
+    // Frames go out one audio period apart by our own clock, the link's flow
+    // control keeps them from running over the ui when it falls behind
+    static constexpr int64_t Frame_Period_Us = constants::Audio_Time_Length_ms * 1000;
+    int64_t next_frame_us = 0;
+
     while (GetStatus() == TrackReader::Status::kOk && is_running)
     {
         // TODO use notifies and then drain the entire moq objs
@@ -236,14 +248,21 @@ void TrackReader::TransmitAudio()
 
         if (!AudioPlaying())
         {
+            next_frame_us = 0;
             continue;
         }
 
-        if (!xSemaphoreTake(runtime.audio_req_smpr, 0))
+        const int64_t now_us = esp_timer_get_time();
+        if (now_us < next_frame_us)
         {
             continue;
         }
 
+        // Keep to the period, but start over after a stall instead of sending
+        // the frames that were missed all at once
+        next_frame_us = now_us - next_frame_us < Frame_Period_Us ? next_frame_us + Frame_Period_Us
+                                                                 : now_us + Frame_Period_Us;
+
         auto data = AudioPopFront();
         if (!data.has_value())
         {
@@ -275,11 +294,13 @@ void TrackReader::TransmitText()
 
 void TrackReader::WriteToSerial(std::optional<quicr::Bytes> data)
 {
-    serial.Write(link_packet_t::Sync_Word, sizeof(link_packet_t::Sync_Word));
-    const uint16_t type = static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame);
-    serial.Write((uint8_t*)&type, sizeof(type));
-    const uint32_t len = data->size() + 1;
-    serial.Write((uint8_t*)&len, sizeof(len));
-    serial.Write(0); // todo Channel id
-    serial.Write(data->data(), data->size());
+    // The object is the chunk as the sender laid it out, only the channel id
+    // goes in front of it
+    const auto channel_id = ui_net_link::Channel_Id::Ptt; // todo Channel id
+    const ui_net_link::AudioSeq seq = ui_audio_seq.fetch_add(1, std::memory_order_relaxed);
+    serial.Write(static_cast<uint16_t>(ui_net_link::NetToUi::AudioFrame),
+                 {{reinterpret_cast<const uint8_t*>(&channel_id), ui_net_link::Chunk_Offset},
+                  {data->data(), data->size()},
+                  {reinterpret_cast<const uint8_t*>(&seq), sizeof(seq)}},
+                 Serial::TxClass::Realtime);
 }
@@ -10,6 +10,7 @@
 #include "task_helpers.hh"
 #include "utils.hh"
 #include <cstdint>
+#include <cstring>
 
 using namespace moq;
 
@@ -24,7 +25,8 @@ TrackWriter::TrackWriter(const quicr::FullTrackName& full_track_name,
                + std::string(full_track_name.name.begin(), full_track_name.name.end())),
     config(config),
     runtime(runtime),
-    moq_objs(0),
+    obj_pool(),
+    moq_objs(),
     object_id(0),
     is_running(false),
     task_mutex(),
@@ -123,7 +125,23 @@ void TrackWriter::PushObject(const uint8_t* bytes, const uint32_t len, const uin
     std::lock_guard<std::mutex> _(obj_mux);
     auto user_id_bytes = quicr::AsBytes(config.user_id.stored);
 
-    auto& obj = moq_objs.emplace_back();
+    if (len > ObjectPool::BlockSize())
+    {
+        NET_LOG_ERROR("Object of %u bytes is too large for track %s", (unsigned)len,
+                      track_name.c_str());
+        return;
+    }
+
+    auto data = obj_pool.Acquire();
+    if (!data)
+    {
+        NET_LOG_WARN("Publish queue full on track %s, dropping object", track_name.c_str());
+        return;
+    }
+    std::memcpy(data->data(), bytes, len);
+
+    // The pool and the queue are the same size so this cannot be full here
+    link_data_obj obj;
     obj.headers.group_id = runtime.device_id;
     obj.headers.object_id = object_id++;
     obj.headers.payload_length = len;
@@ -134,7 +152,8 @@ void TrackWriter::PushObject(const uint8_t* bytes, const uint32_t len, const uin
     obj.headers.immutable_extensions.value()[8].emplace_back().assign(user_id_bytes.begin(),
                                                                       user_id_bytes.end());
 
-    obj.data.assign(bytes, bytes + len);
+    obj.data = std::move(data);
+    moq_objs.Write(std::move(obj));
 }
 
 const std::string& TrackWriter::GetTrackName() const noexcept
@@ -181,17 +200,19 @@ void TrackWriter::PublishTask(void* params)
                 // TODO use notifies and then drain the entire moq objs
                 vTaskDelay(2 / portTICK_PERIOD_MS);
 
-                if (writer->moq_objs.size() == 0)
+                if (writer->moq_objs.Unread() == 0)
                 {
                     continue;
                 }
 
                 std::lock_guard<std::mutex> _(writer->obj_mux);
-                const link_data_obj& obj = writer->moq_objs.front();
-                if (auto pub_status = writer->PublishObject(obj.headers, obj.data);
+                const link_data_obj& obj = writer->moq_objs.Peek();
+                if (auto pub_status = writer->PublishObject(
+                        obj.headers, {obj.data->data(), obj.headers.payload_length});
                     pub_status == moq::TrackWriter::PublishObjectStatus::kOk)
                 {
-                    writer->moq_objs.pop_front();
+                    // Moving it out hands the payload block back to the pool
+                    writer->moq_objs.Take();
                 }
             }
             catch (const std::exception& e)
@@ -4,11 +4,15 @@
 #ifndef __MOQ_TRACK_WRITER__
 #define __MOQ_TRACK_WRITER__
 
+#include "block_pool.hh"
 #include "config_state.hh"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "link_packet_t.hh"
 #include "logger.hh"
 #include "net.hh"
+#include "static_ring_buffer.hh"
+#include <array>
 #include <quicr/publish_track_handler.h>
 
 namespace moq
@@ -32,6 +36,11 @@ public:
     void StatusChanged(Status status) override;
     void PushObject(const uint8_t* bytes, const uint32_t len, const uint64_t timestamp);
 
+    // Objects waiting to be published, at 50 frames a second this is 320 ms
+    static constexpr uint16_t Max_Queued_Objects = 16;
+    using ObjectPool =
+        BlockPool<std::array<uint8_t, link_packet_t::Payload_Size>, Max_Queued_Objects>;
+
     struct link_data_obj
     {
         quicr::ObjectHeaders headers = {
@@ -46,7 +55,7 @@ public:
             std::nullopt,
             std::nullopt,
         };
-        std::vector<uint8_t> data;
+        ObjectPool::Handle data;
     };
 
     const std::string& GetTrackName() const noexcept;
@@ -57,7 +66,8 @@ private:
     const ConfigState& config;
     const Runtime& runtime;
 
-    std::deque<moq::TrackWriter::link_data_obj> moq_objs;
+    ObjectPool obj_pool;
+    StaticRingBuffer<link_data_obj, Max_Queued_Objects> moq_objs;
     uint64_t object_id;
 
     bool is_running;
@@ -16,15 +16,26 @@ Serial::Serial(const uart_port_t port,
                const int cts_pin,
                uint8_t& tx_buff,
                const uint32_t tx_buff_sz,
+               uint8_t& realtime_tx_buff,
+               const uint32_t realtime_tx_buff_sz,
                uint8_t& rx_buff,
                const uint32_t rx_buff_sz,
-               const uint32_t rx_rings,
+               uint8_t& rx_packet_buff,
+               const uint32_t rx_packet_buff_sz,
                const uint32_t driver_tx_size,
                const uint32_t driver_rx_size,
                const uint32_t driver_queue_size,
-               const bool use_queue_task,
-               const bool use_slip) :
-    SerialHandler(rx_rings, tx_buff, tx_buff_sz, rx_buff, rx_buff_sz, Transmit, this),
+               const bool use_queue_task) :
+    SerialHandler(rx_packet_buff,
+                  rx_packet_buff_sz,
+                  tx_buff,
+                  tx_buff_sz,
+                  realtime_tx_buff,
+                  realtime_tx_buff_sz,
+                  rx_buff,
+                  rx_buff_sz,
+                  Transmit,
+                  this),
     port(port),
     uart(uart),
     read_handle(nullptr),
@@ -76,17 +87,22 @@ Serial::~Serial()
     }
 }
 
-void Serial::UpdateUnread(const uint16_t update)
+// NOTE- Blocks until what is already queued has gone out at the old rate
+void Serial::SetBaud(const uint32_t baud)
 {
-    unread -= update;
+    uart_wait_tx_done(port, pdMS_TO_TICKS(Tx_Done_Timeout_Ms));
+    ESP_ERROR_CHECK(uart_set_baudrate(port, baud));
 }
 
+// NOTE- uart_write_bytes copies into the driver's tx buffer and returns, so
+// both class queues drain into it as soon as they are written. Realtime frames
+// only go ahead of bulk ones that are still queued here, not of bytes already
+// in the driver, the realtime priority really only holds on the ui's dma path.
 void Serial::Transmit(void* arg)
 {
     // TODO semaphores?
     Serial* serial = static_cast<Serial*>(arg);
-    uart_write_bytes(serial->port, serial->tx_buff + serial->tx_read_idx, serial->num_to_send);
-    serial->tx_free = true;
+    uart_write_bytes(serial->port, serial->tx_chunk.data(), serial->tx_chunk.size());
     serial->UpdateTx();
 }
 
@@ -96,40 +112,24 @@ void Serial::ReadTask(void* arg)
 
     while (true)
     {
-        // Check if buffer is full
-        if (serial->unread >= serial->rx_buff_sz)
+        // Contiguous free space, empty when the buffer is full
+        std::span<uint8_t> space = serial->rx_ring.WriteableSpan();
+        if (space.empty())
         {
             vTaskDelay(1);
             continue;
         }
 
-        // Calculate space to end of buffer (for contiguous write)
-        int space_to_end = serial->rx_buff_sz - serial->rx_write_idx;
-        // Calculate total free space in circular buffer
-        int free_space = serial->rx_buff_sz - serial->unread;
-        // Limit to contiguous space available
-        int bytes_to_read = (space_to_end < free_space) ? space_to_end : free_space;
-
-        if (bytes_to_read <= 0)
-        {
-            vTaskDelay(1);
-            continue;
-        }
-
-        int num_bytes = uart_read_bytes(serial->port, serial->rx_buff + serial->rx_write_idx,
-                                        bytes_to_read, 20 / portTICK_PERIOD_MS);
+        int num_bytes =
+            uart_read_bytes(serial->port, space.data(), space.size(), 20 / portTICK_PERIOD_MS);
 
         if (num_bytes <= 0)
         {
             continue;
         }
 
-        serial->rx_write_idx += num_bytes;
-        if (serial->rx_write_idx >= serial->rx_buff_sz)
-        {
-            serial->rx_write_idx = 0;
-        }
-        serial->unread += num_bytes;
+        serial->rx_ring.CommitWrite(num_bytes);
+        serial->stats.rx_bytes += num_bytes;
         xTaskNotifyGive(*serial->read_handle);
     }
 }
@@ -157,31 +157,22 @@ void Serial::QueueReadTask(void* arg)
 
             while (bytes_remaining > 0)
             {
-                // Check if buffer is full
-                if (serial->unread >= serial->rx_buff_sz)
+                // Contiguous free space, empty when the buffer is full
+                std::span<uint8_t> space = serial->rx_ring.WriteableSpan();
+                if (space.empty())
                 {
                     ESP_LOGW("SerialPort", "RX buffer full, dropping %d bytes", bytes_remaining);
+                    ++serial->stats.rx_overruns;
                     uart_flush_input(serial->port);
                     break;
                 }
 
-                // Calculate space to end of buffer (for contiguous write)
-                int space_to_end = serial->rx_buff_sz - serial->rx_write_idx;
-                // Calculate total free space in circular buffer
-                int free_space = serial->rx_buff_sz - serial->unread;
-                // Limit to contiguous space available
-                int space_available = (space_to_end < free_space) ? space_to_end : free_space;
                 // Don't read more than remaining bytes in event
-                int bytes_to_read =
-                    (space_available < bytes_remaining) ? space_available : bytes_remaining;
+                int bytes_to_read = (static_cast<int>(space.size()) < bytes_remaining)
+                                      ? space.size()
+                                      : bytes_remaining;
 
-                if (bytes_to_read <= 0)
-                {
-                    break;
-                }
-
-                int num_bytes = uart_read_bytes(
-                    serial->port, serial->rx_buff + serial->rx_write_idx, bytes_to_read, 0);
+                int num_bytes = uart_read_bytes(serial->port, space.data(), bytes_to_read, 0);
 
                 if (num_bytes <= 0)
                 {
@@ -190,13 +181,8 @@ void Serial::QueueReadTask(void* arg)
 
                 total_read += num_bytes;
                 bytes_remaining -= num_bytes;
-                serial->unread += num_bytes;
-
-                serial->rx_write_idx += num_bytes;
-                if (serial->rx_write_idx >= serial->rx_buff_sz)
-                {
-                    serial->rx_write_idx = 0;
-                }
+                serial->rx_ring.CommitWrite(num_bytes);
+                serial->stats.rx_bytes += num_bytes;
             }
 
             if (total_read > 0)
@@ -210,6 +196,7 @@ void Serial::QueueReadTask(void* arg)
         {
 
             ESP_LOGW("SerialPort", "FIFO Overflow detected");
+            ++serial->stats.rx_overruns;
             uart_flush_input(serial->port);
             xQueueReset(serial->queue);
             break;
@@ -217,6 +204,7 @@ void Serial::QueueReadTask(void* arg)
         case UART_BUFFER_FULL:
         {
             ESP_LOGW("SerialPort", "Ring buffer full");
+            ++serial->stats.rx_overruns;
             uart_flush_input(serial->port);
             xQueueReset(serial->queue);
             break;
@@ -24,25 +24,27 @@ public:
            const int cts_pin,
            uint8_t& tx_buff,
            const uint32_t tx_buff_sz,
+           uint8_t& realtime_tx_buff,
+           const uint32_t realtime_tx_buff_sz,
            uint8_t& rx_buff,
            const uint32_t rx_buff_sz,
-           const uint32_t rx_rings,
+           uint8_t& rx_packet_buff,
+           const uint32_t rx_packet_buff_sz,
            const uint32_t driver_tx_size = 2048,
            const uint32_t driver_rx_size = 4096,
            const uint32_t driver_queue_size = 20,
-           const bool use_queue_task = true,
-           const bool use_slip = true);
+           const bool use_queue_task = true);
 
     ~Serial();
 
     void BeginEventTask(TaskHandle_t& read_handle);
 
     uint16_t NumReadyRxPackets();
-
-protected:
-    void UpdateUnread(const uint16_t update) override;
+    void SetBaud(const uint32_t baud);
 
 private:
+    static constexpr uint32_t Tx_Done_Timeout_Ms = 100;
+
     static void Transmit(void* arg);
 
     static void ReadTask(void* args);
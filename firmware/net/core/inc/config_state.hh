@@ -18,6 +18,7 @@ public:
     StoredValue<uint64_t> user_id;
     StoredValue<std::string> user_name;
     StoredValue<std::string> language;
+    StoredValue<std::string> audio_codec;
     StoredValue<std::string> channel_ns_json;
     StoredValue<std::string> ai_query_ns_json;
     StoredValue<std::string> ai_audio_response_ns_json;
@@ -34,6 +35,7 @@ public:
         user_id(storage, "config", "user_id"),
         user_name(storage, "config", "user_name"),
         language(storage, "config", "language"),
+        audio_codec(storage, "config", "audio_codec"),
         channel_ns_json(storage, "config", "channel_ns"),
         ai_query_ns_json(storage, "config", "ai_qry_ns"),
         ai_audio_response_ns_json(storage, "config", "ai_aud_ns"),
@@ -57,6 +59,19 @@ public:
             != kSupportedLanguages.end();
     }
 
+    // Codecs a ptt audio track can be advertised as. Net only passes the
+    // frames along, the ui codes them and says which codec in each chunk.
+    static inline constexpr std::array<const char*, 2> kSupportedAudioCodecs = {
+        "pcm",
+        "adpcm",
+    };
+
+    static inline bool IsValidAudioCodec(const std::string& codec)
+    {
+        return std::find(kSupportedAudioCodecs.begin(), kSupportedAudioCodecs.end(), codec)
+            != kSupportedAudioCodecs.end();
+    }
+
     // Parse namespace from JSON string
     // Returns std::nullopt if parsing fails or string is empty
     static inline std::optional<std::vector<std::string>>
@@ -15,6 +15,7 @@
 #include "ui_net_link.hh"
 #include "wifi.hh"
 #include <nlohmann/json.hpp>
+#include <bit>
 #include <cstdint>
 #include <memory>
 
@@ -26,9 +27,10 @@ struct NetTraits
         static constexpr int tx_pin = GPIO_NUM_17;
         static constexpr int rx_pin = GPIO_NUM_18;
         static constexpr uint32_t tx_buffer_size = 8192;
+        static constexpr uint32_t realtime_tx_buffer_size = 2048;
         static constexpr uint32_t rx_buffer_size = 16384;
         static constexpr uint32_t ring_tx_count = 30;
-        static constexpr uint32_t ring_rx_count = 30;
+        static constexpr uint32_t rx_packet_buffer_size = 1024;
         static constexpr uint32_t baud_rate = 460800;
 
         static constexpr uart_config_t config = {
@@ -51,11 +53,33 @@ struct NetTraits
             static uint8_t tx_buff[tx_buffer_size] = {0};
             return *tx_buff;
         }
+        static uint8_t& RealtimeTxBuff()
+        {
+            static uint8_t realtime_tx_buff[realtime_tx_buffer_size] = {0};
+            return *realtime_tx_buff;
+        }
         static uint8_t& RxBuff()
         {
             static uint8_t rx_buff[rx_buffer_size] = {0};
             return *rx_buff;
         }
+        static uint8_t& RxPacketBuff()
+        {
+            static uint8_t rx_packet_buff[rx_packet_buffer_size] = {0};
+            return *rx_packet_buff;
+        }
+
+        // The serial rings mask their indices so every size has to be a power of two
+        static_assert(std::has_single_bit(tx_buffer_size) && std::has_single_bit(rx_buffer_size));
+        static_assert(std::has_single_bit(realtime_tx_buffer_size));
+
+        // A frame is only queued whole, so the ring has to fit a full one
+        static_assert(realtime_tx_buffer_size >= link_packet_t::Packet_Size);
+
+        // Packets are queued at their actual size. The link handlers read views
+        // in place, so only a packet that wraps the rx buffer is queued and
+        // one full packet is enough.
+        static_assert(rx_packet_buffer_size >= link_packet_t::Packet_Size);
     };
 
     struct MgmtUart
@@ -64,9 +88,10 @@ struct NetTraits
         static constexpr gpio_num_t tx_pin = GPIO_NUM_43;
         static constexpr gpio_num_t rx_pin = GPIO_NUM_44;
         static constexpr uint32_t tx_buffer_size = 1024;
+        static constexpr uint32_t realtime_tx_buffer_size = 1024;
         static constexpr uint32_t rx_buffer_size = 1024;
         static constexpr uint32_t ring_tx_count = 3;
-        static constexpr uint32_t ring_rx_count = 3;
+        static constexpr uint32_t rx_packet_buffer_size = 1024;
         static constexpr uint32_t baud_rate = 1000000;
 
         static constexpr uart_config_t config = {
@@ -90,11 +115,33 @@ struct NetTraits
             static uint8_t tx_buff[tx_buffer_size] = {0};
             return *tx_buff;
         }
+        static uint8_t& RealtimeTxBuff()
+        {
+            static uint8_t realtime_tx_buff[realtime_tx_buffer_size] = {0};
+            return *realtime_tx_buff;
+        }
         static uint8_t& RxBuff()
         {
             static uint8_t rx_buff[rx_buffer_size] = {0};
             return *rx_buff;
         }
+        static uint8_t& RxPacketBuff()
+        {
+            static uint8_t rx_packet_buff[rx_packet_buffer_size] = {0};
+            return *rx_packet_buff;
+        }
+
+        // The serial rings mask their indices so every size has to be a power of two
+        static_assert(std::has_single_bit(tx_buffer_size) && std::has_single_bit(rx_buffer_size));
+        static_assert(std::has_single_bit(realtime_tx_buffer_size));
+
+        // A frame is only queued whole, so the ring has to fit a full one
+        static_assert(realtime_tx_buffer_size >= link_packet_t::Packet_Size);
+
+        // Packets are queued at their actual size. The link handlers read views
+        // in place, so only a packet that wraps the rx buffer is queued and
+        // one full packet is enough.
+        static_assert(rx_packet_buffer_size >= link_packet_t::Packet_Size);
     };
 };
 
@@ -104,14 +151,14 @@ struct Diagnostics
     bool logs_disabled = false;
     spdlog::level::level_enum last_spd_log_level =
         static_cast<spdlog::level::level_enum>(SPDLOG_ACTIVE_LEVEL);
+
+    // Audio frames from the ui, only touched by the ui link task
+    ui_net_link::AudioSeqCheck ui_audio;
 };
 
 struct Runtime
 {
     uint64_t device_id;
-    SemaphoreHandle_t audio_req_smpr;
-    uint64_t curr_audio_isr_time;
-    uint64_t last_audio_isr_time;
 };
 
 class MoqContext;
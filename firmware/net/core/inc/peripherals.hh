@@ -15,7 +15,6 @@
 #define NET_DEBUG_2 GPIO_NUM_6
 #define NET_DEBUG_3 GPIO_NUM_7
 #define NET_READY GPIO_NUM_8
-#define UI_READY GPIO_NUM_9
 #define SPI_MOSI GPIO_NUM_11
 #define SPI_CLK GPIO_NUM_12
 #define SPI_MISO GPIO_NUM_13
@@ -29,11 +28,8 @@
 #define NET_STAT_MASK 1ULL << NET_STAT
 #define NET_DEBUG_MASK 1ULL << NET_DEBUG_1 | 1ULL << NET_DEBUG_2 | 1ULL << NET_DEBUG_3
 
-#define UI_READY_MASK 1ULL << UI_READY
-
 void InitializeGPIO();
 void IntitializeLEDs();
 void IntitializePWM();
-void InitializeUIReadyISR(gpio_isr_t isr_handler);
 
 #endif
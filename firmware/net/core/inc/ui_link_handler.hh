@@ -2,6 +2,7 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "link_rate/link_rate.hh"
 #include "moq_context.hh"
 #include "net.hh"
 #include "serial.hh"
@@ -12,7 +13,8 @@ public:
     UiLinkHandler(Serial& ui_layer,
                   Serial& mgmt_layer,
                   MoqContext& moq_context,
-                  const Runtime& runtime);
+                  const Runtime& runtime,
+                  Diagnostics& diagnostics);
 
     ~UiLinkHandler();
 
@@ -21,13 +23,19 @@ public:
 private:
     void CreateLinkPacketTask();
     static void LinkPacketTask(void* arg);
+    static void SendLinkRate(void* arg, std::span<const uint8_t> payload);
+    static void SetLinkBaud(void* arg, const uint32_t baud);
 
     static constexpr size_t Stack_Size = 16184;
+    // The task wakes at least this often so the link rate timers run
+    static constexpr uint32_t Link_Rate_Poll_Ms = 10;
 
     Serial& ui_layer;
     Serial& mgmt_layer;
     MoqContext& moq_context;
     const Runtime& runtime;
+    Diagnostics& diagnostics;
+    LinkRate link_rate;
 
     TaskHandle_t read_handle;
     StaticTask_t read_buffer;
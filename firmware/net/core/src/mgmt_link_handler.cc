@@ -1,7 +1,9 @@
 #include "mgmt_link_handler.hh"
 #include "efuse_burner.hh"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "link_latency/link_latency.hh"
 #include "logger.hh"
 #include "net.hh"
 #include "net_mgmt_link.h"
@@ -98,23 +100,26 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
     {
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-        while (auto packet = handler->serial.Read())
+        while (const Serial::PacketView packet = handler->serial.ReadView())
         {
-            switch (static_cast<CtlToNet>(packet->type))
+            switch (static_cast<CtlToNet>(packet.type))
             {
             case CtlToNet::Ping:
             {
-                handler->serial.Reply(
-                    static_cast<uint16_t>(NetToCtl::Pong),
-                    std::span<const uint8_t>(packet->payload.data(), packet->length));
+                handler->serial.Reply(static_cast<uint16_t>(NetToCtl::Pong), packet.payload);
                 break;
             }
             case CtlToNet::CircularPing:
             {
                 // Forward to UI for circular path: MGMT -> NET -> UI -> MGMT
-                handler->ui_serial.Reply(
-                    static_cast<uint16_t>(ui_net_link::NetToUi::CircularPing),
-                    std::span<const uint8_t>(packet->payload.data(), packet->length));
+                uint8_t stamp[link_latency::Stamp_Size];
+                link_latency::WriteStamp(stamp, link_latency::Hop::Net, esp_timer_get_time());
+                const size_t stamp_size =
+                    packet.payload.size() + sizeof(stamp) <= ui_net_link::Circular_Ping_Size
+                        ? sizeof(stamp)
+                        : 0;
+                handler->ui_serial.Write(static_cast<uint16_t>(ui_net_link::NetToUi::CircularPing),
+                                         {packet.payload, {stamp, stamp_size}});
                 break;
             }
             case CtlToNet::ClearStorage:
@@ -131,6 +136,7 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
                 handler->config.user_id = 0;
                 handler->config.user_name.stored.clear();
                 handler->config.language.stored.clear();
+                handler->config.audio_codec.stored.clear();
                 handler->config.channel_ns_json.stored.clear();
                 handler->config.ai_query_ns_json.stored.clear();
                 handler->config.ai_audio_response_ns_json.stored.clear();
@@ -152,7 +158,7 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             {
                 try
                 {
-                    std::string json_str((char*)packet->payload.data(), packet->length);
+                    std::string json_str((const char*)packet.payload.data(), packet.length);
                     json wifi_json = json::parse(json_str);
 
                     if (!wifi_json.contains("ssid") || !wifi_json.contains("password"))
@@ -203,7 +209,7 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             }
             case CtlToNet::SetRelayUrl:
             {
-                std::string moq_url((char*)packet->payload.data(), packet->length);
+                std::string moq_url((const char*)packet.payload.data(), packet.length);
                 NET_LOG_INFO("Got moq url %d - %s", moq_url.length(), moq_url.c_str());
 
                 if (moq_url.length() == 0)
@@ -235,13 +241,13 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             }
             case CtlToNet::SetLoopback:
             {
-                if (packet->length < 1)
+                if (packet.length < 1)
                 {
                     handler->serial.ReplyError(static_cast<uint16_t>(NetToCtl::Error),
                                                "Missing loopback mode parameter");
                     break;
                 }
-                auto mode = static_cast<NetLoopbackMode>(packet->payload[0]);
+                auto mode = static_cast<NetLoopbackMode>(packet.payload[0]);
                 switch (mode)
                 {
                 case NetLoopbackMode::Off:
@@ -278,13 +284,13 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             }
             case CtlToNet::SetLogsEnabled:
             {
-                if (packet->length < 1)
+                if (packet.length < 1)
                 {
                     handler->serial.ReplyError(static_cast<uint16_t>(NetToCtl::Error),
                                                "Missing logs enabled parameter");
                     break;
                 }
-                uint8_t enabled = packet->payload[0];
+                uint8_t enabled = packet.payload[0];
                 if (enabled)
                 {
                     handler->EnableLogging();
@@ -299,7 +305,7 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             }
             case CtlToNet::SetLanguage:
             {
-                std::string new_lang((char*)packet->payload.data(), packet->length);
+                std::string new_lang((const char*)packet.payload.data(), packet.length);
                 if (!ConfigState::IsValidLanguage(new_lang))
                 {
                     NET_LOG_ERROR("Invalid language: %s", new_lang.c_str());
@@ -321,9 +327,32 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
                 handler->serial.Reply(static_cast<uint16_t>(NetToCtl::Language), lang);
                 break;
             }
+            case CtlToNet::SetAudioCodec:
+            {
+                std::string new_codec((const char*)packet.payload.data(), packet.length);
+                if (!ConfigState::IsValidAudioCodec(new_codec))
+                {
+                    NET_LOG_ERROR("Invalid audio codec: %s", new_codec.c_str());
+                    handler->serial.ReplyError(static_cast<uint16_t>(NetToCtl::Error),
+                                               "Invalid audio codec");
+                    break;
+                }
+                handler->config.audio_codec = new_codec;
+                NET_LOG_INFO("Audio codec set to: %s", new_codec.c_str());
+                handler->serial.Reply(static_cast<uint16_t>(NetToCtl::Ack),
+                                      std::span<const uint8_t>{});
+                handler->moq_context.UpdateChannelTracks(handler->config);
+                break;
+            }
+            case CtlToNet::GetAudioCodec:
+            {
+                std::string codec = handler->config.audio_codec.Load();
+                handler->serial.Reply(static_cast<uint16_t>(NetToCtl::AudioCodec), codec);
+                break;
+            }
             case CtlToNet::SetChannel:
             {
-                std::string json_str((char*)packet->payload.data(), packet->length);
+                std::string json_str((const char*)packet.payload.data(), packet.length);
                 auto parsed = ConfigState::JsonToNamespace(json_str);
                 if (!parsed.has_value())
                 {
@@ -350,7 +379,7 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             }
             case CtlToNet::SetAi:
             {
-                std::string json_str((char*)packet->payload.data(), packet->length);
+                std::string json_str((const char*)packet.payload.data(), packet.length);
                 try
                 {
                     json ai_config = json::parse(json_str);
@@ -435,13 +464,13 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             }
             case CtlToNet::SetUserId:
             {
-                if (packet->length != sizeof(handler->config.user_id.stored))
+                if (packet.length != sizeof(handler->config.user_id.stored))
                 {
                     break;
                 }
 
                 uint64_t user_id = 0;
-                memcpy(&user_id, packet->payload.data(), sizeof(user_id));
+                memcpy(&user_id, packet.payload.data(), sizeof(user_id));
 
                 handler->config.user_id = user_id;
 
@@ -461,7 +490,7 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
             case CtlToNet::SetUserName:
             {
 
-                std::string new_name((char*)packet->payload.data(), packet->length);
+                std::string new_name((const char*)packet.payload.data(), packet.length);
                 handler->config.user_name = new_name;
                 NET_LOG_INFO("Language set to: %s", new_name.c_str());
 
@@ -471,12 +500,28 @@ void MgmtLinkHandler::LinkPacketTask(void* arg)
                 handler->moq_context.UpdateChannelTracks(handler->config);
                 break;
             }
+            case CtlToNet::GetLinkStats:
+            {
+                // Ui link counters followed by the audio sequence counts
+                uint8_t reply[1 + Serial::StatsSchema::Size
+                              + ui_net_link::AudioCountsSchema::Size];
+                reply[0] = ui_net_link::Link_Stats_Version;
+                size_t size = 1;
+                size += Serial::StatsSchema::Write(handler->ui_serial.GetStats(), reply + size);
+                size += ui_net_link::AudioCountsSchema::Write(handler->diagnostics.ui_audio.counts,
+                                                              reply + size);
+                handler->serial.Write(static_cast<uint16_t>(NetToCtl::LinkStats),
+                                      {{reply, size}});
+                break;
+            }
             default:
             {
-                NET_LOG_ERROR("Unknown packet type 0x%04x from mgmt", packet->type);
+                NET_LOG_ERROR("Unknown packet type 0x%04x from mgmt", packet.type);
                 break;
             }
             }
+
+            handler->serial.Release();
         }
     }
 
@@ -29,9 +29,6 @@
 
 static Runtime runtime_ctx{
     .device_id = 0,
-    .audio_req_smpr = xSemaphoreCreateBinary(),
-    .curr_audio_isr_time = 0,
-    .last_audio_isr_time = 0,
 };
 
 // TODO remove me some day
@@ -45,18 +42,6 @@ static Runtime runtime_ctx{
 #include "wifi_creds.hh"
 #endif
 
-static void IRAM_ATTR GpioIsrRisingHandler(void* arg)
-{
-    int gpio_num = (int)arg;
-
-    if (gpio_num == UI_READY)
-    {
-        runtime_ctx.last_audio_isr_time = runtime_ctx.curr_audio_isr_time;
-        runtime_ctx.curr_audio_isr_time = esp_timer_get_time();
-        xSemaphoreGiveFromISR(runtime_ctx.audio_req_smpr, NULL);
-    }
-}
-
 void PrintRAM()
 {
     NET_LOG_ERROR("Internal SRAM available: %d bytes",
@@ -78,7 +63,6 @@ extern "C" void app_main(void)
     PrintRAM();
     InitializeGPIO();
     IntitializeLEDs();
-    InitializeUIReadyISR(GpioIsrRisingHandler);
 
     Diagnostics diagnostics;
     Storage storage;
@@ -87,20 +71,45 @@ extern "C" void app_main(void)
     Serial ui_layer(NetTraits::UiUart::port, NetTraits::UiUart::Uart(), ETS_UART1_INTR_SOURCE,
                     NetTraits::UiUart::config, NetTraits::UiUart::tx_pin, NetTraits::UiUart::rx_pin,
                     UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, NetTraits::UiUart::TxBuff(),
-                    NetTraits::UiUart::tx_buffer_size, NetTraits::UiUart::RxBuff(),
-                    NetTraits::UiUart::rx_buffer_size, NetTraits::UiUart::ring_rx_count, 8192, 8192,
-                    20, true, false);
+                    NetTraits::UiUart::tx_buffer_size, NetTraits::UiUart::RealtimeTxBuff(),
+                    NetTraits::UiUart::realtime_tx_buffer_size, NetTraits::UiUart::RxBuff(),
+                    NetTraits::UiUart::rx_buffer_size, NetTraits::UiUart::RxPacketBuff(),
+                    NetTraits::UiUart::rx_packet_buffer_size, 8192, 8192, 20, true);
 
     Serial mgmt_layer(NetTraits::MgmtUart::port, NetTraits::MgmtUart::Uart(), ETS_UART0_INTR_SOURCE,
                       NetTraits::MgmtUart::config, NetTraits::MgmtUart::tx_pin,
                       NetTraits::MgmtUart::rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE,
                       NetTraits::MgmtUart::TxBuff(), NetTraits::MgmtUart::tx_buffer_size,
+                      NetTraits::MgmtUart::RealtimeTxBuff(),
+                      NetTraits::MgmtUart::realtime_tx_buffer_size,
                       NetTraits::MgmtUart::RxBuff(), NetTraits::MgmtUart::rx_buffer_size,
-                      NetTraits::MgmtUart::ring_rx_count, 0, 256, 2, true, false);
+                      NetTraits::MgmtUart::RxPacketBuff(),
+                      NetTraits::MgmtUart::rx_packet_buffer_size, 0, 256, 2, true);
+
+    // The ui link is between our own chips, so its headers carry a crc and
+    // only known packet types are accepted
+    ui_layer.EnableHeaderCrc();
+    ui_layer.SetTypeLimits(ui_net_link::Type_Limits);
+
+    // Audio goes ahead of text and ai chunks, a few frames of backlog is all
+    // that is worth sending late
+    ui_layer.SetTxDepth(Serial::TxClass::Realtime, 4);
+
+    // Same as the ui side, audio that backs up goes out a few frames per packet
+    ui_layer.EnableAggregation(3);
+
+    // The ui only reads between screen updates, so only send what its rx
+    // buffer has room for
+    ui_layer.EnableFlowControl();
+
+    // Frames to the ui are COBS encoded with compact headers once it says it
+    // reads them too
+    ui_layer.EnableCobs();
+    ui_layer.EnableCompactHeaders(ui_net_link::Seq_Types);
 
     Wifi wifi(storage);
     MoqContext moq_context(ui_layer, runtime_ctx, diagnostics);
-    UiLinkHandler ui_link_handler(ui_layer, mgmt_layer, moq_context, runtime_ctx);
+    UiLinkHandler ui_link_handler(ui_layer, mgmt_layer, moq_context, runtime_ctx, diagnostics);
     MgmtLinkHandler mgmt_link_handler(mgmt_layer, ui_layer, wifi, storage, config, diagnostics,
                                       moq_context);
 
@@ -132,6 +141,12 @@ extern "C" void app_main(void)
         config.language = "en-US";
     }
 
+    // Channel audio is A-law unless it has been set otherwise
+    if (config.audio_codec->empty())
+    {
+        config.audio_codec = "pcm";
+    }
+
     // Load namespaces from storage
     config.LoadNamespacesFromStorage();
 
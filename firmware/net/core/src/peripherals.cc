@@ -33,19 +33,6 @@ void IntitializeLEDs()
     gpio_set_level(NET_LED_B, 1);
 }
 
-void InitializeUIReadyISR(gpio_isr_t isr_handler)
-{
-
-    gpio_config_t io_conf = {.pin_bit_mask = UI_READY_MASK,
-                             .mode = GPIO_MODE_INPUT,
-                             .pull_up_en = GPIO_PULLUP_DISABLE,
-                             .pull_down_en = GPIO_PULLDOWN_DISABLE,
-                             .intr_type = GPIO_INTR_POSEDGE};
-    gpio_config(&io_conf);
-    gpio_install_isr_service(0);
-    gpio_isr_handler_add(UI_READY, isr_handler, (void*)UI_READY);
-}
-
 void IntitializePWM()
 {
     constexpr ledc_timer_t ledc_timer = LEDC_TIMER_0;
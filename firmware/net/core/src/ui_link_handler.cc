@@ -1,15 +1,23 @@
 #include "ui_link_handler.hh"
+#include "esp_timer.h"
+#include "link_latency/link_latency.hh"
 #include "net_mgmt_link.h"
 #include "ui_net_link.hh"
 
+// Both ends boot at the slowest negotiated rate
+static_assert(NetTraits::UiUart::baud_rate == LinkRate::Rates[0]);
+
 UiLinkHandler::UiLinkHandler(Serial& ui_layer,
                              Serial& mgmt_layer,
                              MoqContext& moq_context,
-                             const Runtime& runtime) :
+                             const Runtime& runtime,
+                             Diagnostics& diagnostics) :
     ui_layer(ui_layer),
     mgmt_layer(mgmt_layer),
     moq_context(moq_context),
     runtime(runtime),
+    diagnostics(diagnostics),
+    link_rate(LinkRate::Role::Responder, LinkRate::All_Rates, SendLinkRate, SetLinkBaud, &ui_layer),
     read_handle(nullptr),
     read_buffer(),
     read_stack(),
@@ -81,36 +89,88 @@ void UiLinkHandler::LinkPacketTask(void* arg)
     UiLinkHandler* handler = static_cast<UiLinkHandler*>(arg);
 
     NET_LOG_INFO("Start ui link packet task");
+    uint32_t link_losses = handler->link_rate.Losses();
     while (handler->read_running)
     {
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(Link_Rate_Poll_Ms));
 
-        while (auto packet = handler->ui_layer.Read())
+        // The frames are read in place in the rx ring, the only copy is into
+        // the track writer's object pool
+        while (const Serial::PacketView view = handler->ui_layer.ReadView())
         {
-            if (packet->type == static_cast<uint16_t>(ui_net_link::UiToNet::CircularPing))
+            if (view.type == static_cast<uint16_t>(ui_net_link::UiToNet::LinkRate))
+            {
+                handler->link_rate.Receive(view.payload, esp_timer_get_time() / 1000);
+            }
+            else if (view.type == static_cast<uint16_t>(ui_net_link::UiToNet::LatencyPing))
+            {
+                // Answered from here rather than queued anywhere, so the time
+                // net holds it is only this task getting to it
+                const uint32_t rx_us = esp_timer_get_time();
+                uint8_t pong[link_latency::Pong_Size];
+                if (link_latency::Answer(view.payload, pong, rx_us, esp_timer_get_time()))
+                {
+                    handler->ui_layer.Write(
+                        static_cast<uint16_t>(ui_net_link::NetToUi::LatencyPing), {pong});
+                }
+            }
+            else if (view.type == static_cast<uint16_t>(ui_net_link::UiToNet::CircularPing))
             {
                 // Forward to MGMT for circular path: MGMT -> UI -> NET -> MGMT
-                handler->mgmt_layer.Reply(
-                    static_cast<uint16_t>(NetToCtl::CircularPing),
-                    std::span<const uint8_t>(packet->payload.data(), packet->length));
-                continue;
+                uint8_t stamp[link_latency::Stamp_Size];
+                link_latency::WriteStamp(stamp, link_latency::Hop::Net, esp_timer_get_time());
+                const size_t stamp_size =
+                    view.payload.size() + sizeof(stamp) <= link_packet_t::Payload_Size
+                        ? sizeof(stamp)
+                        : 0;
+                handler->mgmt_layer.Write(static_cast<uint16_t>(NetToCtl::CircularPing),
+                                          {view.payload, {stamp, stamp_size}});
             }
-
-            if (packet->type != static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame))
+            else if (view.type != static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame))
             {
-                NET_LOG_ERROR("Got unexpected packet type %d", (int)packet->type);
-                continue;
+                NET_LOG_ERROR("Got unexpected packet type %d", (int)view.type);
+            }
+            else
+            {
+                std::span<const uint8_t> payload = view.payload;
+                if (handler->diagnostics.ui_audio.Take(payload) && !payload.empty())
+                {
+                    uint8_t channel_id = payload[0];
+                    uint32_t ext_bytes = 1;
+                    uint32_t length = payload.size();
+
+                    // Remove the bytes already read from the payload length (channel_id)
+                    length -= ext_bytes;
+
+                    handler->moq_context.PushAudioFrame(channel_id, payload.data() + 1, length,
+                                                        esp_timer_get_time());
+                }
+                else
+                {
+                    NET_LOG_ERROR("Audio frame too short");
+                }
             }
 
-            uint8_t channel_id = packet->payload[0];
-            uint32_t ext_bytes = 1;
-            uint32_t length = packet->length;
-
-            // Remove the bytes already read from the payload length (channel_id)
-            length -= ext_bytes;
+            handler->ui_layer.Release();
+        }
 
-            handler->moq_context.PushAudioFrame(channel_id, packet->payload.data() + 1, length,
-                                                handler->runtime.curr_audio_isr_time);
+        handler->link_rate.Poll(esp_timer_get_time() / 1000);
+        if (handler->link_rate.Losses() != link_losses)
+        {
+            // The ui may have restarted and be reading TLV again
+            link_losses = handler->link_rate.Losses();
+            handler->ui_layer.ResetFraming();
         }
     }
 }
+
+void UiLinkHandler::SendLinkRate(void* arg, std::span<const uint8_t> payload)
+{
+    static_cast<Serial*>(arg)->Write(static_cast<uint16_t>(ui_net_link::NetToUi::LinkRate),
+                                     {payload});
+}
+
+void UiLinkHandler::SetLinkBaud(void* arg, const uint32_t baud)
+{
+    static_cast<Serial*>(arg)->SetBaud(baud);
+}
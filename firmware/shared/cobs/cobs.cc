@@ -0,0 +1,132 @@
+#include "cobs.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace cobs
+{
+
+// Offset of the first zero byte, or size when there is none. Blocks are
+// copied whole, so finding where they end is most of the work and goes a word
+// at a time.
+static size_t FindZero(const uint8_t* data, const size_t size)
+{
+    size_t i = 0;
+    for (; i < size && (reinterpret_cast<uintptr_t>(data + i) & (sizeof(uint32_t) - 1)); ++i)
+    {
+        if (data[i] == 0)
+        {
+            return i;
+        }
+    }
+
+    for (; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t))
+    {
+        uint32_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        if ((word - 0x01010101u) & ~word & 0x80808080u)
+        {
+            break;
+        }
+    }
+
+    for (; i < size; ++i)
+    {
+        if (data[i] == 0)
+        {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+size_t Encode(std::initializer_list<std::span<const uint8_t>> parts, uint8_t* out)
+{
+    // code is where the current block's code byte goes once its length is
+    // known
+    uint8_t* code = out;
+    uint8_t* at = out + 1;
+    size_t block = 0;
+
+    for (const std::span<const uint8_t> part : parts)
+    {
+        const uint8_t* data = part.data();
+        size_t left = part.size();
+        while (left > 0)
+        {
+            if (block == Max_Block)
+            {
+                *code = Max_Block + 1;
+                code = at++;
+                block = 0;
+            }
+
+            const size_t run = std::min(left, Max_Block - block);
+            const size_t num = FindZero(data, run);
+            std::memcpy(at, data, num);
+            at += num;
+            block += num;
+            data += num;
+            left -= num;
+
+            // Stopped short at a zero, which ends the block
+            if (num < run)
+            {
+                *code = block + 1;
+                code = at++;
+                block = 0;
+                ++data;
+                --left;
+            }
+        }
+    }
+
+    *code = block + 1;
+    return at - out;
+}
+
+size_t Decode(std::initializer_list<std::span<const uint8_t>> parts, uint8_t* out)
+{
+    uint8_t* at = out;
+    size_t block = 0;
+    bool started = false;
+    bool zero = false;
+
+    for (std::span<const uint8_t> part : parts)
+    {
+        while (!part.empty())
+        {
+            if (block == 0)
+            {
+                // The zero ending the last block only goes in once another
+                // block follows it, the last block of a frame has none
+                if (zero)
+                {
+                    *at++ = 0;
+                }
+
+                const uint8_t code = part[0];
+                if (code == Delimiter)
+                {
+                    return Invalid;
+                }
+
+                block = code - 1;
+                zero = code != Max_Block + 1;
+                started = true;
+                part = part.subspan(1);
+                continue;
+            }
+
+            const size_t num = std::min(block, part.size());
+            std::memmove(at, part.data(), num);
+            at += num;
+            block -= num;
+            part = part.subspan(num);
+        }
+    }
+
+    return started && block == 0 ? at - out : Invalid;
+}
+
+} // namespace cobs
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <initializer_list>
+#include <span>
+
+// Consistent overhead byte stuffing. The encoded bytes never contain a zero,
+// so a zero can end every frame on the wire and a receiver that lost its
+// place starts again at the next one without looking inside any payload.
+//
+// The data is cut into blocks at each zero, every block starts with a code
+// byte that is one more than the number of data bytes in it, and the zero is
+// implied by the code. A block that reaches 254 data bytes ends without a
+// zero, which bounds the overhead at one byte in 254.
+namespace cobs
+{
+
+static constexpr uint8_t Delimiter = 0;
+static constexpr size_t Max_Block = 0xFE;
+
+// Returned by Decode for input that is not a valid encoding
+static constexpr size_t Invalid = SIZE_MAX;
+
+// Most bytes size bytes take encoded, the delimiter not included
+constexpr size_t MaxEncodedSize(const size_t size)
+{
+    return size + size / Max_Block + 1;
+}
+
+// Encodes the parts as one run of data into out, which needs
+// MaxEncodedSize of their total, and returns the encoded size. The delimiter
+// is left to the caller.
+size_t Encode(std::initializer_list<std::span<const uint8_t>> parts, uint8_t* out);
+
+// Decodes the parts, the encoded bytes of one frame split wherever, into out
+// and returns the decoded size. The parts must not contain the delimiter.
+// out may be where the first part starts, the output never overtakes the
+// input.
+size_t Decode(std::initializer_list<std::span<const uint8_t>> parts, uint8_t* out);
+
+} // namespace cobs
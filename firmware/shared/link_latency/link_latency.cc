@@ -0,0 +1,223 @@
+#include "link_latency.hh"
+#include <cstring>
+
+namespace link_latency
+{
+
+// Differences of wrapping times, negative when b is after a
+static int32_t Since(const uint32_t a, const uint32_t b)
+{
+    return static_cast<int32_t>(a - b);
+}
+
+static uint32_t NotNegative(const int32_t us)
+{
+    return us > 0 ? us : 0;
+}
+
+void WriteStamp(uint8_t* out, const Hop hop, const uint32_t now_us)
+{
+    out[0] = static_cast<uint8_t>(hop);
+    std::memcpy(out + 1, &now_us, sizeof(now_us));
+}
+
+size_t Histogram::Bucket(const uint32_t us)
+{
+    size_t bucket = 0;
+    uint32_t edge = Bucket_Base_Us;
+    while (bucket < Num_Buckets - 1 && us >= edge)
+    {
+        ++bucket;
+        edge <<= 1;
+    }
+    return bucket;
+}
+
+uint32_t Histogram::BucketEdge(const size_t bucket)
+{
+    return bucket < Num_Buckets - 1 ? Bucket_Base_Us << bucket : UINT32_MAX;
+}
+
+void Histogram::Record(const uint32_t us)
+{
+    if (count == 0 || us < min_us)
+    {
+        min_us = us;
+    }
+    if (us > max_us)
+    {
+        max_us = us;
+    }
+
+    sum_us += us;
+    last_us = us;
+    ++count;
+    ++buckets[Bucket(us)];
+}
+
+uint32_t Histogram::Percentile(const double share) const
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // The top bucket has no edge, the largest sample stands in for it
+    const double target = share * count;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < Num_Buckets; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= target && seen > 0)
+        {
+            return i < Num_Buckets - 1 ? BucketEdge(i) : max_us;
+        }
+    }
+    return max_us;
+}
+
+bool Answer(std::span<const uint8_t> ping,
+            uint8_t (&pong)[Pong_Size],
+            const uint32_t rx_us,
+            const uint32_t tx_us)
+{
+    if (ping.size() < Ping_Size)
+    {
+        return false;
+    }
+
+    std::memcpy(pong, ping.data(), Ping_Size);
+    std::memcpy(pong + Ping_Size, &rx_us, sizeof(rx_us));
+    std::memcpy(pong + Ping_Size + sizeof(rx_us), &tx_us, sizeof(tx_us));
+    return true;
+}
+
+LinkLatency::LinkLatency(void (*Send)(void* arg, std::span<const uint8_t> payload), void* arg) :
+    Send(Send),
+    arg(arg),
+    next_ms(0),
+    seq(0),
+    current(),
+    previous(),
+    oldest(),
+    window_count(0),
+    rate(0),
+    report()
+{
+}
+
+void LinkLatency::SetPeriod(const uint32_t period_ms, const uint32_t now_ms)
+{
+    next_ms = now_ms;
+
+    current = {};
+    previous = {};
+    oldest = {};
+    window_count = 0;
+    rate = 0;
+    report = {};
+    report.period_ms = period_ms;
+}
+
+void LinkLatency::Poll(const uint32_t now_ms, const uint32_t now_us)
+{
+    if (report.period_ms == 0 || Since(now_ms, next_ms) < 0)
+    {
+        return;
+    }
+    // Spread over half to one and a half periods, a ping always sent at the
+    // same point in the 20 ms audio cycle would never find the link idle
+    ++seq;
+    const uint32_t spread = (seq * 2654435761u) >> 16;
+    next_ms = now_ms + report.period_ms / 2 + spread % (report.period_ms + 1);
+
+    // Padded to the size of the answer so both directions take as long on
+    // the wire and the quickest pings split evenly
+    uint8_t ping[Pong_Size] = {};
+    std::memcpy(ping, &seq, sizeof(seq));
+    std::memcpy(ping + sizeof(seq), &now_us, sizeof(now_us));
+    Send(arg, {ping, sizeof(ping)});
+    ++report.sent;
+}
+
+void LinkLatency::Receive(std::span<const uint8_t> pong, const uint32_t now_us)
+{
+    if (pong.size() < Pong_Size)
+    {
+        return;
+    }
+
+    uint16_t pong_seq;
+    uint32_t sent_us;
+    uint32_t net_rx_us;
+    uint32_t net_tx_us;
+    std::memcpy(&pong_seq, pong.data(), sizeof(pong_seq));
+    std::memcpy(&sent_us, pong.data() + sizeof(pong_seq), sizeof(sent_us));
+    std::memcpy(&net_rx_us, pong.data() + Ping_Size, sizeof(net_rx_us));
+    std::memcpy(&net_tx_us, pong.data() + Ping_Size + sizeof(net_rx_us), sizeof(net_tx_us));
+
+    // A late answer would be measured against the clock offset of a later
+    // window, only the latest ping counts
+    if (pong_seq != seq)
+    {
+        ++report.stale;
+        return;
+    }
+    ++report.answered;
+
+    const uint32_t round_trip = NotNegative(Since(now_us, sent_us));
+    const uint32_t held = NotNegative(Since(net_tx_us, net_rx_us));
+    const uint32_t link = round_trip > held ? round_trip - held : 0;
+    report.round_trip.Record(round_trip);
+    report.net_held.Record(held);
+
+    // Net's clock minus ours if the link time was split evenly
+    const int32_t offset = (Since(net_rx_us, sent_us) + Since(net_tx_us, now_us)) / 2;
+    Track(link, sent_us, offset);
+
+    // The directions need a full window behind them to have a good offset
+    if (!previous.valid)
+    {
+        return;
+    }
+
+    const int32_t at = Offset(sent_us);
+    report.up.Record(NotNegative(Since(net_rx_us, sent_us) - at));
+    report.down.Record(NotNegative(Since(now_us, net_tx_us) + at));
+}
+
+void LinkLatency::Track(const uint32_t link_us, const uint32_t at_us, const int32_t offset_us)
+{
+    if (!current.valid || link_us <= current.link_us)
+    {
+        current = {link_us, at_us, offset_us, true};
+    }
+
+    if (++window_count < Window_Pings)
+    {
+        return;
+    }
+
+    oldest = previous;
+    previous = current;
+    current = {};
+    window_count = 0;
+
+    // Each best ping is off by up to its own link time, so the rate between
+    // two of them is noisy and is smoothed over several windows
+    const int32_t span = Since(previous.at_us, oldest.at_us);
+    if (oldest.valid && span > 0)
+    {
+        const float latest = static_cast<float>(previous.offset_us - oldest.offset_us) / span;
+        rate = rate == 0 ? latest : rate + (latest - rate) / Rate_Smoothing;
+    }
+}
+
+// Offset at a time, moving on from the best ping of the last window at the
+// rate the clocks drift apart
+int32_t LinkLatency::Offset(const uint32_t at_us) const
+{
+    return previous.offset_us + static_cast<int32_t>(rate * Since(at_us, previous.at_us));
+}
+
+} // namespace link_latency
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <span>
+
+// Timing of the ui to net link. Times are microseconds on the clock of the
+// chip that took them and wrap, so only differences taken on one chip mean
+// anything.
+namespace link_latency
+{
+
+// Which chip stamped a circular ping as it passed through, each hop appends
+// its id and time to the payload
+enum class Hop : uint8_t
+{
+    Ui = 1,
+    Net = 2,
+};
+
+static constexpr size_t Stamp_Size = sizeof(uint8_t) + sizeof(uint32_t);
+
+// Writes the stamp to out, which needs Stamp_Size bytes
+void WriteStamp(uint8_t* out, const Hop hop, const uint32_t now_us);
+
+// Latency histogram with buckets doubling from Bucket_Base_Us, the last one
+// takes everything over. Stats commands reply with it as is.
+struct Histogram
+{
+    static constexpr size_t Num_Buckets = 16;
+    static constexpr uint32_t Bucket_Base_Us = 125;
+
+    uint64_t sum_us;
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t last_us;
+    uint32_t buckets[Num_Buckets];
+
+    void Record(const uint32_t us);
+
+    // Upper edge of the bucket the given share of the samples falls in
+    uint32_t Percentile(const double share) const;
+
+    static size_t Bucket(const uint32_t us);
+    static uint32_t BucketEdge(const size_t bucket);
+};
+
+// Ping payloads, the ui sends a sequence number and its send time and net
+// answers with the same two followed by its receive and send times
+static constexpr size_t Ping_Size = sizeof(uint16_t) + sizeof(uint32_t);
+static constexpr size_t Pong_Size = Ping_Size + 2 * sizeof(uint32_t);
+
+// Fills pong from ping for net to send back, false when ping is not one
+bool Answer(std::span<const uint8_t> ping,
+            uint8_t (&pong)[Pong_Size],
+            const uint32_t rx_us,
+            const uint32_t tx_us);
+
+// Continuous mode on the ui. Pings net every period and builds histograms of
+// the round trip, the time net held the ping and each direction of the link.
+//
+// The directions need the two clocks lined up. The pings that were quickest
+// to come back were held up least on the link, so each of them gives the
+// offset between the clocks by splitting its link time evenly. The best of
+// the last window gives the offset and the bests of the windows before it how
+// fast it moves, which covers the crystals running at slightly different
+// rates.
+class LinkLatency
+{
+public:
+    static constexpr uint32_t Window_Pings = 32;
+    static constexpr float Rate_Smoothing = 8;
+
+    // Counts then the histograms, what stats commands reply with
+    struct Report
+    {
+        uint32_t period_ms;
+        uint32_t sent;
+        uint32_t answered;
+        // Answers to a ping other than the last one sent
+        uint32_t stale;
+        Histogram round_trip;
+        Histogram net_held;
+        Histogram up;
+        Histogram down;
+    };
+
+    LinkLatency(void (*Send)(void* arg, std::span<const uint8_t> payload), void* arg);
+
+    // A period of zero stops it, starting clears the histograms
+    void SetPeriod(const uint32_t period_ms, const uint32_t now_ms);
+
+    void Poll(const uint32_t now_ms, const uint32_t now_us);
+    void Receive(std::span<const uint8_t> pong, const uint32_t now_us);
+
+    const Report& GetReport() const
+    {
+        return report;
+    }
+
+private:
+    // The quickest ping of a window and the offset it gives
+    struct Best
+    {
+        uint32_t link_us;
+        uint32_t at_us;
+        int32_t offset_us;
+        bool valid;
+    };
+
+    int32_t Offset(const uint32_t at_us) const;
+    void Track(const uint32_t link_us, const uint32_t at_us, const int32_t offset_us);
+
+    void (*Send)(void* arg, std::span<const uint8_t> payload);
+    void* arg;
+
+    uint32_t next_ms;
+    uint16_t seq;
+
+    Best current;
+    Best previous;
+    Best oldest;
+    uint32_t window_count;
+    // Microseconds net's clock gains on ours per microsecond
+    float rate;
+
+    Report report;
+};
+
+static_assert(sizeof(LinkLatency::Report) == 4 * sizeof(uint32_t) + 4 * sizeof(Histogram),
+              "Report is sent as is, it cannot have padding");
+
+} // namespace link_latency
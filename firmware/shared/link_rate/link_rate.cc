@@ -0,0 +1,332 @@
+#include "link_rate.hh"
+#include <bit>
+
+// The clock wraps, so times are compared by their difference
+static bool Reached(const uint32_t now_ms, const uint32_t at_ms)
+{
+    return static_cast<int32_t>(now_ms - at_ms) >= 0;
+}
+
+static uint8_t BurstByte(const uint8_t seq, const size_t i)
+{
+    return static_cast<uint8_t>(seq * 31 + i);
+}
+
+LinkRate::LinkRate(const Role role,
+                   const uint8_t supported,
+                   void (*Send)(void* arg, std::span<const uint8_t> payload),
+                   void (*SetBaud)(void* arg, const uint32_t baud),
+                   void* arg) :
+    role(role),
+    supported(supported | 1),
+    Send(Send),
+    SetBaud(SetBaud),
+    arg(arg),
+    state(role == Role::Initiator ? State::Caps : State::Idle),
+    rate(0),
+    prev_rate(0),
+    common(0),
+    tried(0),
+    candidate(0),
+    echoed(0),
+    burst_sent(false),
+    switched_at(0),
+    next_at(0),
+    heard_at(0),
+    fallbacks(0),
+    losses(0)
+{
+}
+
+void LinkRate::Receive(std::span<const uint8_t> payload, const uint32_t now_ms)
+{
+    if (payload.empty() || payload[0] > static_cast<uint8_t>(Op::Keepalive))
+    {
+        return;
+    }
+
+    heard_at = now_ms;
+    const Op op = static_cast<Op>(payload[0]);
+    const uint8_t value = payload.size() > 1 ? payload[1] : 0;
+
+    switch (op)
+    {
+    case Op::Caps:
+    {
+        if (role == Role::Responder)
+        {
+            SendOp(Op::Caps, supported);
+        }
+        else if (state == State::Caps)
+        {
+            common = supported & value;
+            state = State::Next;
+            next_at = now_ms;
+        }
+        break;
+    }
+    case Op::Switch:
+    {
+        if (role != Role::Responder || value >= Num_Rates || !(supported & (1 << value)))
+        {
+            break;
+        }
+
+        // Acked at the old rate, SetBaud lets it go out before switching
+        SendOp(Op::SwitchAck, value);
+        prev_rate = rate;
+        Switch(value);
+        switched_at = now_ms;
+        state = State::Committing;
+        break;
+    }
+    case Op::SwitchAck:
+    {
+        if (role != Role::Initiator || state != State::Switching || value != candidate)
+        {
+            break;
+        }
+
+        prev_rate = rate;
+        Switch(candidate);
+        switched_at = now_ms;
+        echoed = 0;
+        burst_sent = false;
+        state = State::Verifying;
+        break;
+    }
+    case Op::Verify:
+    {
+        if (role == Role::Responder)
+        {
+            if (state == State::Committing)
+            {
+                Send(arg, payload);
+            }
+        }
+        else if (state == State::Verifying && BurstIntact(payload))
+        {
+            echoed |= 1u << value;
+        }
+        break;
+    }
+    case Op::Commit:
+    {
+        if (role == Role::Responder && state == State::Committing && value == rate)
+        {
+            SendOp(Op::CommitAck, value);
+            state = State::Done;
+        }
+        break;
+    }
+    case Op::CommitAck:
+    {
+        // Rates are tried fastest first, so the first one that holds is it
+        if (role == Role::Initiator && state == State::Committing && value == rate)
+        {
+            state = State::Done;
+            next_at = now_ms + Keepalive_Ms;
+        }
+        break;
+    }
+    case Op::Keepalive:
+    {
+        if (role == Role::Responder)
+        {
+            SendOp(Op::Keepalive, rate);
+        }
+        break;
+    }
+    }
+}
+
+void LinkRate::Poll(const uint32_t now_ms)
+{
+    switch (state)
+    {
+    case State::Caps:
+    {
+        if (Reached(now_ms, next_at))
+        {
+            SendOp(Op::Caps, supported);
+            next_at = now_ms + Retry_Ms;
+        }
+        break;
+    }
+    case State::Idle:
+    {
+        break;
+    }
+    case State::Next:
+    {
+        if (!Reached(now_ms, next_at))
+        {
+            break;
+        }
+
+        // Fastest rate above the current one that is left to try
+        candidate = 0;
+        const uint8_t left = common & ~tried;
+        for (uint8_t i = Num_Rates - 1; i > rate; --i)
+        {
+            if (left & (1 << i))
+            {
+                candidate = i;
+                break;
+            }
+        }
+
+        if (candidate == 0)
+        {
+            state = State::Done;
+            next_at = now_ms;
+            break;
+        }
+
+        SendOp(Op::Switch, candidate);
+        state = State::Switching;
+        next_at = now_ms + Retry_Ms;
+        break;
+    }
+    case State::Switching:
+    {
+        if (Reached(now_ms, next_at))
+        {
+            // The responder may have switched and lost its ack, so wait out
+            // its commit deadline before asking for anything else
+            tried |= 1 << candidate;
+            ++fallbacks;
+            state = State::Next;
+            next_at = now_ms + Commit_Ms;
+        }
+        break;
+    }
+    case State::Verifying:
+    {
+        if (!burst_sent && Reached(now_ms, switched_at + Settle_Ms))
+        {
+            SendBurst();
+            burst_sent = true;
+        }
+
+        if (Reached(now_ms, switched_at + Verify_Ms))
+        {
+            if (Burst_Frames - std::popcount(echoed) <= Max_Bad_Frames)
+            {
+                SendOp(Op::Commit, rate);
+                state = State::Committing;
+            }
+            else
+            {
+                Fail(now_ms);
+            }
+        }
+        break;
+    }
+    case State::Committing:
+    {
+        if (!Reached(now_ms, switched_at + Commit_Ms))
+        {
+            break;
+        }
+
+        if (role == Role::Responder)
+        {
+            Switch(prev_rate);
+            state = State::Idle;
+        }
+        else
+        {
+            Fail(now_ms);
+        }
+        break;
+    }
+    case State::Done:
+    {
+        if (role == Role::Initiator && Reached(now_ms, next_at))
+        {
+            SendOp(Op::Keepalive, rate);
+            next_at = now_ms + Keepalive_Ms;
+        }
+        break;
+    }
+    }
+
+    // The initiator keeps the link talking once it has the responder's
+    // rates, the responder only has to worry when it is off the boot rate
+    const bool watching = role == Role::Initiator ? state != State::Caps : rate != 0;
+    if (watching && Reached(now_ms, heard_at + Lost_Ms))
+    {
+        Lost(now_ms);
+    }
+}
+
+void LinkRate::SendOp(const Op op, const uint8_t value)
+{
+    const uint8_t payload[] = {static_cast<uint8_t>(op), value};
+    Send(arg, {payload, sizeof(payload)});
+}
+
+void LinkRate::SendBurst()
+{
+    uint8_t payload[Burst_Size];
+    payload[0] = static_cast<uint8_t>(Op::Verify);
+    for (uint8_t seq = 0; seq < Burst_Frames; ++seq)
+    {
+        payload[1] = seq;
+        for (size_t i = 2; i < Burst_Size; ++i)
+        {
+            payload[i] = BurstByte(seq, i);
+        }
+        Send(arg, {payload, sizeof(payload)});
+    }
+}
+
+bool LinkRate::BurstIntact(std::span<const uint8_t> payload) const
+{
+    if (payload.size() != Burst_Size || payload[1] >= Burst_Frames)
+    {
+        return false;
+    }
+
+    for (size_t i = 2; i < Burst_Size; ++i)
+    {
+        if (payload[i] != BurstByte(payload[1], i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void LinkRate::Switch(const uint8_t to)
+{
+    rate = to;
+    SetBaud(arg, Rates[to]);
+}
+
+// The rate being tried did not hold, back to the one before it and on to the
+// next slower candidate once the responder has given up on it too
+void LinkRate::Fail(const uint32_t now_ms)
+{
+    Switch(prev_rate);
+    tried |= 1 << candidate;
+    ++fallbacks;
+    state = State::Next;
+    next_at = (Reached(now_ms, switched_at + Commit_Ms) ? now_ms : switched_at + Commit_Ms)
+            + Settle_Ms;
+}
+
+void LinkRate::Lost(const uint32_t now_ms)
+{
+    if (rate != 0)
+    {
+        Switch(0);
+    }
+
+    ++losses;
+    tried = 0;
+    heard_at = now_ms;
+    next_at = now_ms;
+    state = role == Role::Initiator ? State::Caps : State::Idle;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <iterator>
+#include <span>
+
+// Moves a link from the rate both ends boot at up to the fastest rate both
+// support that carries a test burst cleanly, and back down when one end stops
+// hearing the other.
+//
+// The initiator drives it. It swaps supported rates with the responder and
+// asks it to switch to the fastest rate not yet tried. At the new rate it
+// sends a burst that the responder echoes, and commits if nearly all of it
+// came back intact. When anything goes wrong at the new rate, both ends are
+// back on the old one once the commit deadline has passed, and the next
+// slower rate is tried.
+//
+// It only deals in payloads of one packet type, the caller hands those to
+// Receive, polls it with the time and supplies Send and SetBaud. SetBaud has
+// to let everything already queued go out at the old rate before it
+// switches.
+class LinkRate
+{
+public:
+    // Candidate rates, slowest first. Both ends boot at the first.
+    static constexpr uint32_t Rates[] = {460800, 921600, 1000000, 1500000, 2000000};
+    static constexpr size_t Num_Rates = std::size(Rates);
+    static constexpr uint8_t All_Rates = (1 << Num_Rates) - 1;
+
+    enum class Role : uint8_t
+    {
+        Initiator,
+        Responder,
+    };
+
+    // First byte of every payload
+    enum class Op : uint8_t
+    {
+        Caps = 0,
+        Switch,
+        SwitchAck,
+        Verify,
+        Commit,
+        CommitAck,
+        Keepalive,
+    };
+
+    enum class State : uint8_t
+    {
+        Caps,       // Initiator asking for the responder's rates
+        Idle,       // Responder waiting to be asked
+        Next,       // Initiator about to try the next rate
+        Switching,  // Initiator waiting for the switch to be acked
+        Verifying,  // Initiator sending the burst and counting echoes
+        Committing, // Waiting on the commit, or its ack
+        Done,
+    };
+
+    static constexpr uint32_t Retry_Ms = 250;
+    // Time for the responder to switch after sending its ack
+    static constexpr uint32_t Settle_Ms = 10;
+    static constexpr uint32_t Verify_Ms = 150;
+    // From the switch, after this a rate that was not committed is dropped
+    static constexpr uint32_t Commit_Ms = 300;
+    static constexpr uint32_t Keepalive_Ms = 1000;
+    // Without hearing the other end for this long both go back to the boot
+    // rate and start over
+    static constexpr uint32_t Lost_Ms = 3500;
+
+    static constexpr uint8_t Burst_Frames = 16;
+    static constexpr size_t Burst_Size = 64;
+    static constexpr uint8_t Max_Bad_Frames = 1;
+
+    // supported has bit i set for Rates[i]
+    LinkRate(const Role role,
+             const uint8_t supported,
+             void (*Send)(void* arg, std::span<const uint8_t> payload),
+             void (*SetBaud)(void* arg, const uint32_t baud),
+             void* arg);
+
+    void Receive(std::span<const uint8_t> payload, const uint32_t now_ms);
+    void Poll(const uint32_t now_ms);
+
+    uint32_t Baud() const
+    {
+        return Rates[rate];
+    }
+
+    State GetState() const
+    {
+        return state;
+    }
+
+    // Rates that were tried and failed, and times the link was lost
+    uint32_t Fallbacks() const
+    {
+        return fallbacks;
+    }
+
+    uint32_t Losses() const
+    {
+        return losses;
+    }
+
+private:
+    void SendOp(const Op op, const uint8_t value);
+    void SendBurst();
+    bool BurstIntact(std::span<const uint8_t> payload) const;
+    void Switch(const uint8_t to);
+    void Fail(const uint32_t now_ms);
+    void Lost(const uint32_t now_ms);
+
+    Role role;
+    uint8_t supported;
+    void (*Send)(void* arg, std::span<const uint8_t> payload);
+    void (*SetBaud)(void* arg, const uint32_t baud);
+    void* arg;
+
+    State state;
+    uint8_t rate;
+    uint8_t prev_rate;
+
+    // Initiator, rates both ends support, the ones that failed and the one
+    // being tried
+    uint8_t common;
+    uint8_t tried;
+    uint8_t candidate;
+
+    // Burst echoes that came back intact, a bit per frame
+    uint32_t echoed;
+    bool burst_sent;
+
+    uint32_t switched_at;
+    uint32_t next_at;
+    uint32_t heard_at;
+
+    uint32_t fallbacks;
+    uint32_t losses;
+};
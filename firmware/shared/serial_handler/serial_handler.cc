@@ -1,35 +1,191 @@
 #include "serial_handler.hh"
 #include "logger.hh"
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <cstring>
 
-SerialHandler::SerialHandler(const uint16_t num_rx_packets,
+// CRC-16/CCITT-FALSE a byte at a time from a table. The header is only six
+// bytes, which is too short for the STM32 crc unit to pay for itself.
+static constexpr std::array<uint16_t, 256> Crc_Table = []
+{
+    std::array<uint16_t, 256> table{};
+    for (uint32_t i = 0; i < table.size(); ++i)
+    {
+        uint16_t crc = i << 8;
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+static uint16_t Crc16(const uint8_t* data, const size_t size)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc = (crc << 8) ^ Crc_Table[(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+// Crc of the type and length
+static uint16_t HeaderCrc(const uint8_t* header)
+{
+    return Crc16(header, link_packet_t::Header_Size);
+}
+
+// Credit frame flags, granted means the limit in it is valid
+static constexpr uint8_t Credit_Granted = 0x01;
+static constexpr uint8_t Credit_Blocked = 0x02;
+static constexpr size_t Credit_Crc_Offset = SerialHandler::Credit_Payload_Size - sizeof(uint16_t);
+
+// Framing frame flags, the sender can read COBS and the frames it sends after
+// this one are encoded
+static constexpr uint8_t Framing_Cobs = 0x01;
+static constexpr uint8_t Framing_Follows = 0x02;
+
+// The sender can read compact headers, and the encoded frames it sends after
+// this one have them
+static constexpr uint8_t Framing_Compact = 0x04;
+static constexpr uint8_t Framing_Compact_Follows = 0x08;
+
+// Compact header code, the low bits are the type's place in the type limits
+// or the escape, which has the type after it. Elided means the length is left
+// out and seq that the frame ends in a sequence number, only its low byte when
+// the length is left out.
+static constexpr uint8_t Compact_Index_Mask = 0x3F;
+static constexpr uint8_t Compact_Escape = Compact_Index_Mask;
+static constexpr uint8_t Compact_Seq = 0x40;
+static constexpr uint8_t Compact_Elided = 0x80;
+
+// Lengths are at most 21 bits as a varint
+static constexpr size_t Max_Varint_Size = 3;
+
+static_assert(SerialHandler::Max_Compact_Types < Compact_Escape);
+static_assert(SerialHandler::Max_Compact_Header_Size <= link_packet_t::Header_Size);
+
+static size_t WriteVarint(uint8_t* out, uint32_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    out[size++] = static_cast<uint8_t>(value);
+    return size;
+}
+
+// Bytes the varint at the start of in takes, 0 when it runs past the end or
+// is too long
+static size_t ReadVarint(const uint8_t* in, const size_t size, uint32_t& value)
+{
+    value = 0;
+    for (size_t i = 0; i < size && i < Max_Varint_Size; ++i)
+    {
+        value |= static_cast<uint32_t>(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80))
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Most bytes one frame takes on the wire, TLV or COBS encoded with its
+// delimiter
+static constexpr uint32_t Max_Frame_Size = std::max(
+    link_packet_t::Sync_Word_Size + SerialHandler::Max_Header_Size + link_packet_t::Payload_Size,
+    cobs::MaxEncodedSize(SerialHandler::Max_Header_Size + link_packet_t::Payload_Size) + 1);
+
+// Copies len bytes from offset bytes into the unread part of the ring
+static void PeekRing(RingBuffer<uint8_t>& ring, uint32_t offset, uint8_t* out, uint32_t len)
+{
+    while (len > 0)
+    {
+        const std::span<uint8_t> data = ring.ReadableSpan(offset);
+        const uint32_t num = std::min<uint32_t>(data.size(), len);
+        std::memcpy(out, data.data(), num);
+        out += num;
+        offset += num;
+        len -= num;
+    }
+}
+
+SerialHandler::SerialHandler(uint8_t& rx_packet_buff,
+                             const uint32_t rx_packet_buff_sz,
                              uint8_t& tx_buff,
                              const uint32_t tx_buff_sz,
+                             uint8_t& realtime_tx_buff,
+                             const uint32_t realtime_tx_buff_sz,
                              uint8_t& rx_buff,
                              const uint32_t rx_buff_sz,
                              void (*Transmit)(void* arg),
                              void* transmit_arg) :
-    rx_packets(num_rx_packets),
-    tx_buff(&tx_buff),
-    tx_buff_sz(tx_buff_sz),
-    rx_buff(&rx_buff),
-    rx_buff_sz(rx_buff_sz),
-    tx_write_idx(0),
-    tx_read_idx(0),
+    rx_packets(&rx_packet_buff, rx_packet_buff_sz),
+    tx_queues{{{&realtime_tx_buff, realtime_tx_buff_sz}}, {{&tx_buff, tx_buff_sz}}},
+    rx_ring(&rx_buff, rx_buff_sz),
     tx_free(true),
-    unsent(0),
-    num_to_send(0),
-    rx_write_idx(0),
-    rx_read_idx(0),
-    unread(0),
-    update_cache(0),
+    tx_chunk(),
+    tx_in_transmit(false),
+    tx_class(TxClass::Bulk),
+    tx_left(0),
+    tx_aggregate{},
+    tx_credit{},
+    tx_framing{},
+    tx_stage(nullptr),
+    tx_stage_size(0),
+    aggregate_max(0),
+    cobs(false),
+    tx_cobs(false),
+    peer_cobs(false),
+    framing_due(false),
+    tx_encoded{},
+    compact(false),
+    tx_compact(false),
+    peer_compact(false),
+    seq_types(),
+    tx_compact_types{},
+    rx_compact_types{},
+    flow_control(false),
+    credit_window(0),
+    tx_sent(0),
+    peer_limit(0),
+    tx_blocked(false),
+    rx_limit(0),
+    rx_limit_valid(false),
+    credit_due(false),
+    rx_consumed(0),
+    rx_offset(0),
+    rx_advertised(0),
+    rx_synced(false),
+    peer_unsynced(false),
+    peer_blocked(false),
     Transmit(Transmit),
     transmit_arg(transmit_arg),
-    packet(&rx_packets.Write()),
+    packet(),
+    rx_header{},
+    rx_record(nullptr),
+    frame_size(0),
     bytes_read(0),
     sync_matched(0),
-    escaped(false)
+    view_size(0),
+    view_pending(false),
+    frame_held(false),
+    split_rest(),
+    split_type(0),
+    splitting(false),
+    header_size(link_packet_t::Header_Size),
+    header_crc(false),
+    type_limits(),
+    rx_cobs(false),
+    rx_compact(false),
+    rx_scanned(0),
+    stats()
 {
 }
 
@@ -39,258 +195,1706 @@ SerialHandler::~SerialHandler()
     transmit_arg = nullptr;
 }
 
-// TODO optimize our buffers
-
 link_packet_t* SerialHandler::Read()
 {
+    UpdateCredit();
+    UpdateFraming();
     return TLVRead();
 }
 
-void SerialHandler::Write(const uint8_t data, const bool end_frame)
+void SerialHandler::Write(const link_packet_t& packet, const TxClass tx_class)
 {
-    Write(&data, 1, end_frame);
+    Write(packet.type, {{packet.payload.data(), packet.length}}, tx_class);
 }
 
-void SerialHandler::Write(const link_packet_t& packet, const bool end_frame)
+void SerialHandler::Write(const uint16_t type,
+                          std::initializer_list<std::span<const uint8_t>> payload,
+                          const TxClass tx_class)
 {
-    Write(packet.PacketData(), end_frame);
+    uint32_t length = 0;
+    for (const std::span<const uint8_t> part : payload)
+    {
+        length += part.size();
+    }
+
+    if (length > link_packet_t::Payload_Size)
+    {
+        Logger::Log(Logger::Level::Error, "Packet too large to send");
+        return;
+    }
+
+    uint8_t head[link_packet_t::Sync_Word_Size + Max_Header_Size];
+    Send(tx_class, {head, WriteHead(head, type, length)}, payload);
 }
 
-void SerialHandler::Write(std::span<const uint8_t> data, const bool end_frame)
+// Sync word, type, length and the crc when it is enabled, returns the size
+size_t SerialHandler::WriteHead(uint8_t* head, const uint16_t type, const uint32_t length) const
 {
-    Write(data.data(), data.size(), end_frame);
+    uint8_t* header = head + link_packet_t::Sync_Word_Size;
+    std::memcpy(head, link_packet_t::Sync_Word.data(), link_packet_t::Sync_Word_Size);
+    std::memcpy(header, &type, sizeof(type));
+    std::memcpy(header + link_packet_t::Type_Size, &length, sizeof(length));
+    if (header_crc)
+    {
+        const uint16_t crc = HeaderCrc(header);
+        std::memcpy(header + link_packet_t::Header_Size, &crc, Crc_Size);
+    }
+    return link_packet_t::Sync_Word_Size + header_size;
 }
 
-void SerialHandler::Write(const uint8_t* data, const uint16_t size, const bool end_frame)
+void SerialHandler::Send(const TxClass tx_class,
+                         std::span<const uint8_t> head,
+                         std::initializer_list<std::span<const uint8_t>> body)
 {
 #ifdef PLATFORM_ESP
     std::lock_guard<std::mutex> _(write_mux);
 #endif
 
-    TLVWrite(data, size);
-
-    if (unsent > tx_buff_sz)
+    if (!TLVWrite(tx_class, head, body))
     {
-        // TODO ERROR
-        Logger::Log(Logger::Level::Error, "Transmit buffer full");
+        return;
     }
 
-    if (!tx_free)
+    KickTx();
+}
+
+// Starts the transmitter when it is idle
+void SerialHandler::KickTx()
+{
+    if (!tx_free.exchange(false, std::memory_order_acq_rel))
     {
+        // A transmit is in flight, its completion will pick this up
         return;
     }
 
-    // Logger::Log(Logger::Level::Info, "Transmit");
     PrepTransmit();
 }
 
 uint16_t SerialHandler::Unread()
 {
-    return unread;
+    return rx_ring.Unread();
 }
 
 uint16_t SerialHandler::Unsent()
 {
+    uint16_t unsent = 0;
+    for (TxQueue& queue : tx_queues)
+    {
+        unsent += queue.ring.Unread();
+    }
     return unsent;
 }
 
-void SerialHandler::WriteToTxBuff(const uint8_t data)
+void SerialHandler::SetTxDepth(const TxClass tx_class, const uint16_t frames)
 {
-    if (tx_write_idx >= tx_buff_sz)
-    {
-        tx_write_idx = 0;
-    }
-    tx_buff[tx_write_idx++] = data;
+    tx_queues[static_cast<size_t>(tx_class)].depth = std::min(frames, Max_Tx_Frames);
 }
 
-uint8_t SerialHandler::ReadFromRxBuff()
+uint32_t SerialHandler::TxDrops(const TxClass tx_class) const
 {
-    if (rx_read_idx >= rx_buff_sz)
-    {
-        rx_read_idx = 0;
-    }
-    return rx_buff[rx_read_idx++];
+    return stats.tx_drops[static_cast<size_t>(tx_class)];
 }
 
-void SerialHandler::UpdateRx(const uint16_t num_recv)
+const SerialHandler::Stats& SerialHandler::GetStats() const
 {
-    unread += num_recv;
-    rx_write_idx += num_recv;
-    if (rx_write_idx >= rx_buff_sz)
+    return stats;
+}
+
+// Counts a frame against its type's entry, the first unused entry becomes the
+// type's when it has none
+void SerialHandler::CountType(Stats::TypeCount (&types)[Max_Stat_Types], const uint16_t type)
+{
+    for (Stats::TypeCount& entry : types)
     {
-        rx_write_idx = 0;
+        if (entry.frames == 0)
+        {
+            entry.type = type;
+        }
+
+        if (entry.type == type)
+        {
+            ++entry.frames;
+            return;
+        }
     }
+}
+
+void SerialHandler::EnableHeaderCrc()
+{
+    header_crc = true;
+    header_size = Max_Header_Size;
+}
 
-    if (unread > rx_buff_sz)
+void SerialHandler::SetTypeLimits(std::span<const link_type_limit_t> limits)
+{
+    type_limits = limits;
+}
+
+void SerialHandler::EnableAggregation(const uint8_t max_frames)
+{
+    aggregate_max = max_frames;
+}
+
+void SerialHandler::EnableFlowControl()
+{
+    // A frame of the ring is held back for credit frames, which are sent
+    // without credit, and for a frame that is partly in the rx packet queue
+    if (rx_ring.Size() < 2 * Max_Frame_Size)
     {
-        // TODO
-        // Error("SerialStm rx isr", "Overflowed rx buffer");
+        Logger::Log(Logger::Level::Error, "Rx buffer too small for flow control");
+        return;
     }
+
+    credit_window = rx_ring.Size() - Max_Frame_Size;
+    flow_control = true;
+
+    // The other end needs our count before it can hand out any credit, the
+    // first read sends it since the uart may not be running yet
+    credit_due.store(true, std::memory_order_release);
 }
 
-bool SerialHandler::UpdateTx()
+void SerialHandler::EnableCobs()
+{
+    cobs = true;
+    ResetFraming();
+}
+
+void SerialHandler::EnableCompactHeaders(std::span<const uint16_t> seq_types)
 {
-    // TODO esp semaphore of send
-    unsent -= num_to_send;
-    tx_read_idx += num_to_send;
+    this->seq_types = seq_types;
+    compact = true;
+    ResetFraming();
+}
 
-    if (tx_read_idx >= tx_buff_sz)
+void SerialHandler::ResetFraming()
+{
+    if (!cobs)
     {
-        tx_read_idx = 0;
+        return;
     }
 
-    return PrepTransmit();
+    // The next framing frame goes out with only the offer, so our frames are
+    // TLV again until the other end answers with its own switch
+    peer_cobs.store(false, std::memory_order_release);
+    framing_due.store(true, std::memory_order_release);
 }
 
-bool SerialHandler::PrepTransmit()
+bool SerialHandler::UpdateTx()
 {
-    // Nothing to send
-    if (unsent == 0)
+    if (!tx_stage)
     {
-        tx_free = true;
-        return false;
+        tx_queues[static_cast<size_t>(tx_class)].ring.CommitRead(tx_chunk.size());
     }
-    tx_free = false;
-    num_to_send = unsent;
+    tx_left -= tx_chunk.size();
+    tx_chunk = {};
 
-    // Prevent tx buff overflow
-    if (num_to_send + tx_read_idx >= tx_buff_sz)
+    // Finished before Transmit returned, the loop in PrepTransmit that called
+    // it sends the next chunk instead of this going a level deeper
+    if (tx_in_transmit.exchange(false, std::memory_order_acq_rel))
     {
-        num_to_send = tx_buff_sz - tx_read_idx;
+        return true;
     }
 
-    Transmit(transmit_arg);
-    return true;
+    return PrepTransmit();
 }
 
-link_packet_t* SerialHandler::TLVRead()
+bool SerialHandler::PrepTransmit()
 {
-    uint16_t total_bytes_read = 0;
-    auto packet_data = packet->WriteableData();
-
-    while (total_bytes_read + update_cache < unread)
+    // Only called by the side that owns the transmitter, i.e. tx_free is false
+    while (true)
     {
-        uint8_t byte = ReadFromRxBuff();
-        ++total_bytes_read;
-
-        if (sync_matched < link_packet_t::Sync_Word_Size)
+        // Send the contiguous run up to the end of the frame or the buffer,
+        // the rest goes out on the next completion
+        if (tx_left > 0 || NextTxFrame())
         {
-            if (byte == packet->sync_word[sync_matched])
+            if (tx_stage)
             {
-                ++sync_matched;
+                // Only ever read by the transmit side
+                tx_chunk = {const_cast<uint8_t*>(tx_stage) + tx_stage_size - tx_left, tx_left};
             }
             else
             {
-                sync_matched = byte == packet->sync_word[0];
-                packet->is_ready = false;
-
-                Logger::Log(Logger::Level::Info, "TLV error in sync word");
+                RingBuffer<uint8_t>& ring = tx_queues[static_cast<size_t>(tx_class)].ring;
+                const std::span<uint8_t> data = ring.ReadableSpan();
+                tx_chunk = data.first(std::min<size_t>(data.size(), tx_left));
             }
+            stats.tx_bytes += tx_chunk.size();
+            tx_in_transmit.store(true, std::memory_order_release);
+            Transmit(transmit_arg);
 
-            continue;
+            // Whoever clears the flag owns what comes next. If the completion
+            // already did, the chunk is gone and this loop goes on to the next.
+            if (!tx_in_transmit.exchange(false, std::memory_order_acq_rel))
+            {
+                continue;
+            }
+            return true;
         }
 
-        packet_data[bytes_read++] = byte;
-        if (bytes_read < link_packet_t::Header_Size)
+        tx_free.store(true, std::memory_order_release);
+
+        // A writer may have added a frame after the check above but seen
+        // tx_free as false, so take it back if nobody else has.
+        if (!TxPending() || !tx_free.exchange(false, std::memory_order_acq_rel))
         {
-            continue;
+            return false;
         }
+    }
+}
+
+// Whether NextTxFrame has something to start, the two have to agree or the
+// transmitter would spin
+bool SerialHandler::TxPending()
+{
+    if ((flow_control && credit_due.load(std::memory_order_acquire))
+        || framing_due.load(std::memory_order_acquire))
+    {
+        return true;
+    }
 
-        if (bytes_read >= packet->length + link_packet_t::Header_Size)
+    for (TxQueue& queue : tx_queues)
+    {
+        if (queue.frames.Unread() > 0)
         {
-            bytes_read = 0;
-            sync_matched = 0;
+            return !tx_blocked.load(std::memory_order_relaxed)
+                || WireSize(queue.frames.ReadableSpan()[0]) <= TxCredit();
+        }
+    }
+    return false;
+}
+
+// Starts on the oldest frame of the highest priority class that has one. Only
+// called between frames, so a class never cuts into a frame of another.
+bool SerialHandler::NextTxFrame()
+{
+    // Credit frames never wait for credit, otherwise two ends that are both
+    // out of it could never tell each other about more
+    if (flow_control && credit_due.exchange(false, std::memory_order_acq_rel))
+    {
+        StageCredit();
+        ++stats.tx_frames;
+        return true;
+    }
+
+    // Framing frames go out ahead of data too, the switch has to be between
+    // frames and the sooner the better
+    if (framing_due.exchange(false, std::memory_order_acq_rel))
+    {
+        StageFraming();
+        ++stats.tx_frames;
+        return true;
+    }
 
-            packet->is_ready = true;
-            packet = &rx_packets.Write();
-            packet_data = packet->WriteableData();
+    for (size_t i = 0; i < Num_Tx_Classes; ++i)
+    {
+        TxQueue& queue = tx_queues[i];
+        if (queue.frames.Unread() == 0)
+        {
             continue;
         }
-        else if (bytes_read >= link_packet_t::Packet_Size)
+
+        const uint16_t size = queue.frames.ReadableSpan()[0];
+        const uint32_t credit = TxCredit();
+        if (WireSize(size) > credit)
         {
-            Logger::Log(Logger::Level::Info, "TLV frame size error");
+            // The frame waits for the other end to free up room, tell it once
+            // that we are waiting so it answers as soon as it does
+            if (tx_blocked.exchange(true, std::memory_order_relaxed))
+            {
+                return false;
+            }
+            StageCredit();
+            ++stats.tx_stalls;
+            ++stats.tx_frames;
+            return true;
+        }
 
-            packet->is_ready = false;
-            bytes_read = 0;
-            sync_matched = 0;
-            continue;
+        tx_blocked.store(false, std::memory_order_relaxed);
+        queue.frames.CommitRead(1);
+        tx_class = static_cast<TxClass>(i);
+        tx_left = size;
+        tx_stage = nullptr;
+        if (tx_class == TxClass::Realtime && aggregate_max > 1)
+        {
+            Aggregate(size, credit);
+        }
+        if (tx_cobs)
+        {
+            if (tx_stage)
+            {
+                EncodeStage({tx_stage, tx_stage_size});
+            }
+            else if (size >= link_packet_t::Sync_Word_Size)
+            {
+                EncodeQueued(queue.ring, size);
+            }
         }
+        tx_sent.store(tx_sent.load(std::memory_order_relaxed) + tx_left,
+                      std::memory_order_relaxed);
+        ++stats.tx_frames;
+        return true;
     }
+    return false;
+}
 
-    if (total_bytes_read > 0 || update_cache > 0)
+// Bytes the other end has room for, no limit without flow control
+uint32_t SerialHandler::TxCredit() const
+{
+    if (!flow_control)
     {
-        UpdateUnread(total_bytes_read);
+        return UINT32_MAX;
     }
 
-    return GetReadyPacket();
+    const int32_t credit = static_cast<int32_t>(peer_limit.load(std::memory_order_acquire)
+                                                - tx_sent.load(std::memory_order_relaxed));
+    return credit > 0 ? credit : 0;
 }
 
-link_packet_t* SerialHandler::GetReadyPacket()
+// Builds a credit frame stamped with what this end has sent so far, so the
+// other end can line its count up with ours
+void SerialHandler::StageCredit()
 {
-    if (!rx_packets.Peek().is_ready)
+    const size_t head_size = WriteHead(tx_credit, Credit_Type, Credit_Payload_Size);
+
+    const uint32_t sent = tx_sent.load(std::memory_order_relaxed);
+    const bool granted = rx_limit_valid.load(std::memory_order_acquire);
+    const uint32_t limit = granted ? rx_limit.load(std::memory_order_relaxed) : 0;
+    const uint8_t flags = (granted ? Credit_Granted : 0)
+                        | (tx_blocked.load(std::memory_order_relaxed) ? Credit_Blocked : 0);
+
+    uint8_t* payload = tx_credit + head_size;
+    std::memcpy(payload, &sent, sizeof(sent));
+    std::memcpy(payload + sizeof(sent), &limit, sizeof(limit));
+    std::memcpy(payload + sizeof(sent) + sizeof(limit), &flags, sizeof(flags));
+    const uint16_t crc = Crc16(payload, Credit_Crc_Offset);
+    std::memcpy(payload + Credit_Crc_Offset, &crc, sizeof(crc));
+
+    tx_stage = tx_credit;
+    tx_stage_size = head_size + Credit_Payload_Size;
+    tx_left = tx_stage_size;
+    if (tx_cobs)
+    {
+        EncodeStage({tx_credit, tx_stage_size});
+    }
+    tx_sent.store(sent + tx_stage_size, std::memory_order_relaxed);
+}
+
+// Each end only sends credit when something changes, so a credit frame lost
+// to line damage can leave both ends waiting on the other. Any damage seen on
+// the way in sends our count and limit again.
+void SerialHandler::ResendCredit()
+{
+    if (flow_control)
     {
-        return nullptr;
+        credit_due.store(true, std::memory_order_release);
     }
+}
 
-    link_packet_t* p = &rx_packets.Read();
-    p->is_ready = false;
-    return p;
+bool SerialHandler::IsCredit(const uint16_t type) const
+{
+    return flow_control && type == Credit_Type;
 }
 
-void SerialHandler::TLVWrite(const uint8_t* data, const uint16_t size)
+// A credit frame from the other end, frame bytes on the wire which ended at
+// end in our rx count
+void SerialHandler::TakeCredit(std::span<const uint8_t> payload,
+                               const uint32_t end,
+                               const uint32_t frame)
 {
-    for (uint16_t i = 0; i < size; ++i)
+    if (payload.size() != Credit_Payload_Size)
+    {
+        return;
+    }
+
+    uint16_t crc;
+    std::memcpy(&crc, payload.data() + Credit_Crc_Offset, sizeof(crc));
+    if (crc != Crc16(payload.data(), Credit_Crc_Offset))
+    {
+        Logger::Log(Logger::Level::Info, "Credit crc error");
+        return;
+    }
+
+    uint32_t sent;
+    uint32_t limit;
+    uint8_t flags;
+    std::memcpy(&sent, payload.data(), sizeof(sent));
+    std::memcpy(&limit, payload.data() + sizeof(sent), sizeof(limit));
+    std::memcpy(&flags, payload.data() + sizeof(sent) + sizeof(limit), sizeof(flags));
+
+    rx_offset = sent + frame - end;
+    rx_synced = true;
+
+    // Without a limit the other end has just started and has no count of
+    // ours to grant against, so it needs a credit frame from us
+    if (flags & Credit_Granted)
     {
-        WriteToTxBuff(data[i]);
+        peer_limit.store(limit, std::memory_order_release);
+        KickTx();
+    }
+    else
+    {
+        peer_unsynced = true;
     }
 
-    unsent += size;
+    if (flags & Credit_Blocked)
+    {
+        peer_blocked = true;
+    }
 }
 
-void SerialHandler::ReplyAck()
+// Hands the other end more credit once enough of the rx ring has been freed,
+// or straight away when it is waiting on us. Called on every read.
+void SerialHandler::UpdateCredit()
 {
-    link_packet_t packet;
-    packet.type = Response_Ack;
-    packet.length = 0;
-    Write(packet);
+    if (!flow_control)
+    {
+        return;
+    }
+
+    if (rx_synced)
+    {
+        // Bytes still in the ring or in the rx packet queue count against the
+        // window
+        const uint32_t limit = rx_consumed - rx_packets.Used() + rx_offset + credit_window;
+        const int32_t moved = static_cast<int32_t>(limit - rx_advertised);
+        if (!rx_limit_valid.load(std::memory_order_relaxed) || peer_unsynced
+            || (peer_blocked && moved > 0) || moved >= static_cast<int32_t>(credit_window / 2))
+        {
+            rx_limit.store(limit, std::memory_order_relaxed);
+            rx_limit_valid.store(true, std::memory_order_release);
+            rx_advertised = limit;
+            peer_unsynced = false;
+            peer_blocked = false;
+            credit_due.store(true, std::memory_order_release);
+        }
+    }
+
+    if (credit_due.load(std::memory_order_acquire))
+    {
+        KickTx();
+    }
 }
 
-void SerialHandler::ReplyError()
+void SerialHandler::ConsumeRx(const size_t count)
 {
-    link_packet_t packet;
-    packet.type = Response_Error;
-    packet.length = 0;
-    Write(packet);
+    rx_ring.CommitRead(count);
+    rx_consumed += count;
 }
 
-void SerialHandler::ReplyError(uint16_t type, const char* msg)
+// Builds a framing frame, which is always TLV. It offers COBS when it is
+// enabled and marks the switch once the other end has offered it too, the
+// frames after it are encoded from then on.
+void SerialHandler::StageFraming()
 {
-    Reply(type, std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(msg), strlen(msg)));
+    const bool follows = cobs && peer_cobs.load(std::memory_order_acquire);
+    const bool compact_follows = follows && compact && peer_compact.load(std::memory_order_acquire);
+    const size_t head_size = WriteHead(tx_framing, Framing_Type, Framing_Payload_Size);
+    tx_framing[head_size] = (cobs ? Framing_Cobs : 0) | (follows ? Framing_Follows : 0)
+                          | (compact ? Framing_Compact : 0)
+                          | (compact_follows ? Framing_Compact_Follows : 0);
+
+    tx_stage = tx_framing;
+    tx_stage_size = head_size + Framing_Payload_Size;
+    tx_left = tx_stage_size;
+    tx_sent.store(tx_sent.load(std::memory_order_relaxed) + tx_stage_size,
+                  std::memory_order_relaxed);
+    tx_cobs = follows;
+
+    // The other end starts over on its side when it reads this frame
+    tx_compact = compact_follows;
+    std::memset(tx_compact_types, 0, sizeof(tx_compact_types));
 }
 
-void SerialHandler::Reply(uint16_t type)
+// Sends a staged frame encoded instead, all of it but the sync word and with
+// the delimiter after it
+void SerialHandler::EncodeStage(std::span<const uint8_t> frame)
+{
+    size_t size;
+    if (tx_compact)
+    {
+        uint16_t type;
+        uint32_t length;
+        std::memcpy(&type, frame.data() + link_packet_t::Sync_Word_Size, sizeof(type));
+        std::memcpy(&length,
+                    frame.data() + link_packet_t::Sync_Word_Size + link_packet_t::Type_Size,
+                    sizeof(length));
+
+        uint8_t head[Max_Compact_Header_Size];
+        const size_t head_size = CompactHead(head, type, length);
+        const std::span<const uint8_t> payload =
+            frame.subspan(link_packet_t::Sync_Word_Size + header_size, length);
+        size = cobs::Encode({{head, head_size}, payload}, tx_encoded);
+    }
+    else
+    {
+        size = cobs::Encode({frame.subspan(link_packet_t::Sync_Word_Size)}, tx_encoded);
+    }
+    tx_encoded[size] = cobs::Delimiter;
+
+    tx_stage = tx_encoded;
+    tx_stage_size = size + 1;
+    tx_left = tx_stage_size;
+}
+
+// Sends the frame at the front of a tx queue encoded instead. It is encoded
+// from where it is, in one or two runs, and the queue is done with it.
+void SerialHandler::EncodeQueued(RingBuffer<uint8_t>& ring, const uint16_t size)
 {
-    link_packet_t packet;
-    packet.type = type;
-    packet.length = 0;
-    Write(packet);
+    uint32_t start = link_packet_t::Sync_Word_Size;
+    uint32_t length = size - start;
+
+    // A frame written whole gets a compact header in place of its own, raw
+    // writes have no header of ours to replace
+    uint8_t compact_head[Max_Compact_Header_Size];
+    size_t compact_size = 0;
+    if (tx_compact && length >= header_size)
+    {
+        uint8_t header[link_packet_t::Header_Size];
+        PeekRing(ring, start, header, sizeof(header));
+
+        uint16_t type;
+        uint32_t payload_size;
+        std::memcpy(&type, header, sizeof(type));
+        std::memcpy(&payload_size, header + link_packet_t::Type_Size, sizeof(payload_size));
+        if (payload_size == length - header_size)
+        {
+            compact_size = CompactHead(compact_head, type, payload_size);
+            start += header_size;
+            length = payload_size;
+        }
+    }
+
+    const std::span<const uint8_t> first = ring.ReadableSpan(start);
+    const std::span<const uint8_t> head = first.first(std::min<size_t>(first.size(), length));
+    const std::span<const uint8_t> rest =
+        ring.ReadableSpan(start + head.size()).first(length - head.size());
+
+    const size_t encoded = cobs::Encode({{compact_head, compact_size}, head, rest}, tx_encoded);
+    tx_encoded[encoded] = cobs::Delimiter;
+    ring.CommitRead(size);
+
+    tx_stage = tx_encoded;
+    tx_stage_size = encoded + 1;
+    tx_left = tx_stage_size;
 }
 
-void SerialHandler::Reply(uint16_t type, const std::string& data)
+// Most bytes a frame queued at size can take on the wire as it is sent now,
+// for checking it against the credit before it is encoded. Raw writes too
+// short for a sync word go out as they are.
+uint32_t SerialHandler::WireSize(const uint32_t size) const
 {
-    Reply(type,
-          std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+    if (!tx_cobs || size < link_packet_t::Sync_Word_Size)
+    {
+        return size;
+    }
+    return cobs::MaxEncodedSize(size - link_packet_t::Sync_Word_Size) + 1;
 }
 
-void SerialHandler::Reply(uint16_t type, std::span<const uint8_t> data)
+// A framing frame from the other end. Its frames after this one are encoded
+// when it says so. Its offer is answered with a switch of our own, unless we
+// already sent one and it has switched too. An offer on its own means it is
+// reading TLV, it may have restarted since we switched.
+void SerialHandler::TakeFraming(std::span<const uint8_t> payload)
+{
+    if (payload.size() != Framing_Payload_Size)
+    {
+        return;
+    }
+
+    const uint8_t flags = payload[0];
+    rx_cobs = flags & Framing_Follows;
+    rx_compact = rx_cobs && (flags & Framing_Compact_Follows);
+    rx_scanned = 0;
+    std::memset(rx_compact_types, 0, sizeof(rx_compact_types));
+
+    if (!cobs || !(flags & Framing_Cobs))
+    {
+        return;
+    }
+
+    // A change in whether it can read compact headers needs a new switch too
+    const bool peer_reads_compact = compact && (flags & Framing_Compact);
+    if (!(flags & Framing_Follows) || !peer_cobs.load(std::memory_order_relaxed)
+        || peer_compact.load(std::memory_order_relaxed) != peer_reads_compact)
+    {
+        peer_compact.store(peer_reads_compact, std::memory_order_release);
+        peer_cobs.store(true, std::memory_order_release);
+        framing_due.store(true, std::memory_order_release);
+        KickTx();
+    }
+}
+
+// Sends a framing frame that is waiting, the first read sends the offer since
+// the uart may not be running when it is enabled
+void SerialHandler::UpdateFraming()
 {
-    link_packet_t packet;
-    packet.type = type;
-    packet.length = data.size();
-    if (!data.empty())
+    if (framing_due.load(std::memory_order_acquire))
     {
-        std::memcpy(packet.payload.data(), data.data(),
-                    std::min(data.size(), packet.payload.size()));
+        KickTx();
     }
-    Write(packet);
+}
+
+// Packs the realtime frame about to go out with the frames of the same type
+// queued right behind it, as many as the credit covers. They are copied out of
+// the ring, which the transmit side is the only reader of, so the writers are
+// not held up.
+bool SerialHandler::Aggregate(const uint16_t first_size, const uint32_t credit)
+{
+    TxQueue& queue = tx_queues[static_cast<size_t>(TxClass::Realtime)];
+    const size_t head_size = link_packet_t::Sync_Word_Size + header_size;
+
+    uint16_t type;
+    PeekRing(queue.ring, link_packet_t::Sync_Word_Size, reinterpret_cast<uint8_t*>(&type),
+             sizeof(type));
+
+    // Count the frames that fit, offset ends up past the last of them
+    uint32_t length = link_packet_t::Type_Size + Aggregate_Len_Size + first_size - head_size;
+    uint32_t offset = first_size;
+    uint16_t num = 1;
+    while (num < aggregate_max && num <= queue.frames.Unread())
+    {
+        const uint16_t size = queue.frames.ReadableSpan(num - 1)[0];
+
+        uint16_t next_type;
+        PeekRing(queue.ring, offset + link_packet_t::Sync_Word_Size,
+                 reinterpret_cast<uint8_t*>(&next_type), sizeof(next_type));
+
+        const uint32_t next_length = length + Aggregate_Len_Size + size - head_size;
+        if (next_type != type || next_length > link_packet_t::Payload_Size
+            || WireSize(head_size + next_length) > credit)
+        {
+            break;
+        }
+
+        length = next_length;
+        offset += size;
+        ++num;
+    }
+
+    if (num == 1)
+    {
+        return false;
+    }
+
+    WriteHead(tx_aggregate, Aggregate_Type, length);
+
+    uint8_t* out = tx_aggregate + head_size;
+    std::memcpy(out, &type, sizeof(type));
+    out += sizeof(type);
+
+    uint32_t at = 0;
+    for (uint16_t i = 0; i < num; ++i)
+    {
+        const uint16_t size = i == 0 ? first_size : queue.frames.ReadableSpan(i - 1)[0];
+        const uint16_t frame_length = size - head_size;
+        std::memcpy(out, &frame_length, Aggregate_Len_Size);
+        PeekRing(queue.ring, at + head_size, out + Aggregate_Len_Size, frame_length);
+        out += Aggregate_Len_Size + frame_length;
+        at += size;
+    }
+
+    queue.ring.CommitRead(offset);
+    queue.frames.CommitRead(num - 1);
+
+    tx_stage = tx_aggregate;
+    tx_stage_size = head_size + length;
+    tx_left = tx_stage_size;
+    return true;
+}
+
+// Offset of the first byte equal to value, or size when there is none. Checks
+// a word at a time since newlib nano's memchr goes byte by byte.
+static size_t FindByte(const uint8_t* data, const size_t size, const uint8_t value)
+{
+    size_t i = 0;
+    for (; i < size && (reinterpret_cast<uintptr_t>(data + i) & (sizeof(uint32_t) - 1)); ++i)
+    {
+        if (data[i] == value)
+        {
+            return i;
+        }
+    }
+
+    // A byte of word ^ pattern is zero where the value is, the classic
+    // has-zero-byte test flags the word without checking each byte
+    const uint32_t pattern = 0x01010101u * value;
+    for (; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t))
+    {
+        uint32_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        const uint32_t diff = word ^ pattern;
+        if ((diff - 0x01010101u) & ~diff & 0x80808080u)
+        {
+            break;
+        }
+    }
+
+    for (; i < size; ++i)
+    {
+        if (data[i] == value)
+        {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+size_t SerialHandler::MatchSync(std::span<const uint8_t> data)
+{
+    size_t used = 0;
+    while (used < data.size() && sync_matched < link_packet_t::Sync_Word_Size)
+    {
+        if (sync_matched == 0)
+        {
+            const size_t skip = FindByte(data.data() + used, data.size() - used,
+                                         link_packet_t::Sync_Word[0]);
+            if (skip > 0)
+            {
+                ++stats.sync_losses;
+                Logger::Log(Logger::Level::Info, "TLV error in sync word");
+                ResendCredit();
+            }
+
+            used += skip;
+            if (used == data.size())
+            {
+                break;
+            }
+
+            sync_matched = 1;
+            ++used;
+            continue;
+        }
+
+        if (data[used] == link_packet_t::Sync_Word[sync_matched])
+        {
+            ++sync_matched;
+            ++used;
+            continue;
+        }
+
+        // Start over, the mismatched byte is checked again as a possible start
+        sync_matched = 0;
+    }
+
+    return used;
+}
+
+bool SerialHandler::HeaderValid(const uint8_t* header)
+{
+    if (header_crc)
+    {
+        uint16_t crc;
+        std::memcpy(&crc, header + link_packet_t::Header_Size, Crc_Size);
+        if (crc != HeaderCrc(header))
+        {
+            ++stats.header_errors;
+            Logger::Log(Logger::Level::Info, "TLV header crc error");
+            ResendCredit();
+            return false;
+        }
+    }
+
+    uint16_t type;
+    uint32_t length;
+    std::memcpy(&type, header, sizeof(type));
+    std::memcpy(&length, header + link_packet_t::Type_Size, sizeof(length));
+
+    if (!LengthValid(type, length))
+    {
+        ++stats.header_errors;
+        Logger::Log(Logger::Level::Info, "TLV frame size error");
+        ResendCredit();
+        return false;
+    }
+
+    return true;
+}
+
+bool SerialHandler::LengthValid(const uint16_t type, const uint32_t length) const
+{
+    // The frames in an aggregate are checked against the limits as they are
+    // split out
+    uint32_t max_length =
+        type_limits.empty() || IsAggregate(type) || IsCredit(type) || type == Framing_Type
+            ? link_packet_t::Payload_Size
+            : 0;
+    for (const link_type_limit_t& limit : type_limits)
+    {
+        if (limit.type == type)
+        {
+            max_length = limit.max_length;
+            break;
+        }
+    }
+
+    return length <= max_length && length <= link_packet_t::Payload_Size;
+}
+
+void SerialHandler::Resync()
+{
+    // The sync word was a false match or the header is corrupt. Look for the
+    // next sync word in the rejected header instead of skipping past it, a
+    // real frame may start there. Those bytes are fewer than a sync word and
+    // header, so the CopyFrame below can never come back here, nor finish a
+    // frame and need to know where it ended.
+    uint8_t header[Max_Header_Size];
+    const size_t size = header_size;
+    std::memcpy(header, rx_header, size);
+
+    bytes_read = 0;
+    sync_matched = 0;
+
+    size_t used = 0;
+    while (used < size)
+    {
+        if (sync_matched < link_packet_t::Sync_Word_Size)
+        {
+            used += MatchSync({header + used, size - used});
+            continue;
+        }
+
+        used += CopyFrame({header + used, size - used}, rx_consumed);
+    }
+}
+
+// Takes the next COBS frame out of the rx ring, false when there is no
+// complete one yet. A frame that is contiguous in the ring is decoded where
+// it is and, when in_place, handed back as a view holding its bytes there.
+// Any other frame is decoded into the rx packet queue, and internal frames
+// are taken here either way.
+bool SerialHandler::ReadCobs(PacketView& view, const bool in_place)
+{
+    uint32_t encoded;
+    if (!FindDelimiter(encoded))
+    {
+        return false;
+    }
+
+    const uint32_t wire = encoded + 1;
+    const std::span<uint8_t> chunk = rx_ring.ReadableSpan();
+
+    // Nothing between two delimiters, which is not a frame but not an error
+    if (encoded == 0)
+    {
+        ConsumeRx(wire);
+        return true;
+    }
+
+    // The other end went back to TLV. A TLV header has a zero in its length
+    // long before the block the first sync byte would start as a code, so
+    // this is never a valid COBS frame.
+    if (encoded >= link_packet_t::Sync_Word_Size && encoded < link_packet_t::Sync_Word[0])
+    {
+        uint8_t sync[link_packet_t::Sync_Word_Size];
+        PeekRing(rx_ring, 0, sync, sizeof(sync));
+        if (std::memcmp(sync, link_packet_t::Sync_Word.data(), sizeof(sync)) == 0)
+        {
+            rx_cobs = false;
+            return true;
+        }
+    }
+
+    // The encoded bytes are always more than the decoded ones, so a frame can
+    // be decoded over itself in the ring. One that wraps is decoded far enough
+    // into its record to leave room for the record header, which can be
+    // longer than a compact one.
+    const bool wraps = chunk.size() < encoded;
+    uint8_t* record = wraps ? rx_packets.Reserve(link_packet_t::Header_Size + encoded) : nullptr;
+    uint8_t* frame = wraps ? record : chunk.data();
+    if (wraps && record)
+    {
+        frame += link_packet_t::Header_Size;
+    }
+    if (!frame)
+    {
+        ++stats.rx_drops;
+        Logger::Log(Logger::Level::Error, "Rx packet queue full, dropping packet");
+        ConsumeRx(wire);
+        return true;
+    }
+
+    const std::span<const uint8_t> first = chunk.first(std::min<size_t>(chunk.size(), encoded));
+    const std::span<const uint8_t> rest =
+        rx_ring.ReadableSpan(first.size()).first(encoded - first.size());
+    const size_t size = cobs::Decode({first, rest}, frame);
+    uint16_t type;
+    std::span<const uint8_t> payload;
+    if (!CobsFrameValid(frame, size, type, payload))
+    {
+        ConsumeRx(wire);
+        return true;
+    }
+
+    if (IsCredit(type) || type == Framing_Type)
+    {
+        if (IsCredit(type))
+        {
+            TakeCredit(payload, rx_consumed + wire, wire);
+        }
+        else
+        {
+            TakeFraming(payload);
+        }
+        ConsumeRx(wire);
+        return true;
+    }
+
+    if (in_place && !wraps)
+    {
+        // Left unread until Release like any other view
+        frame_held = true;
+        view_size = wire;
+        view.type = type;
+        view.length = payload.size();
+        view.payload = payload;
+        return true;
+    }
+
+    // Queued records have no crc after the header
+    if (!wraps)
+    {
+        record = rx_packets.Reserve(link_packet_t::Header_Size + payload.size());
+    }
+    if (!record)
+    {
+        ++stats.rx_drops;
+        Logger::Log(Logger::Level::Error, "Rx packet queue full, dropping packet");
+        ConsumeRx(wire);
+        return true;
+    }
+
+    const uint32_t length = payload.size();
+    std::memmove(record + link_packet_t::Header_Size, payload.data(), payload.size());
+    std::memcpy(record, &type, sizeof(type));
+    std::memcpy(record + link_packet_t::Type_Size, &length, sizeof(length));
+    rx_packets.Commit(link_packet_t::Header_Size + payload.size());
+    ConsumeRx(wire);
+    return true;
+}
+
+// Offset of the delimiter that ends the next frame in the unread bytes. The
+// bytes searched are not searched again as more come in, and a run longer
+// than any frame with no delimiter in it is thrown away.
+bool SerialHandler::FindDelimiter(uint32_t& at)
+{
+    std::span<uint8_t> data;
+    while (!(data = rx_ring.ReadableSpan(rx_scanned)).empty())
+    {
+        const size_t found = FindByte(data.data(), data.size(), cobs::Delimiter);
+        if (found < data.size())
+        {
+            at = rx_scanned + found;
+            rx_scanned = 0;
+            return true;
+        }
+        rx_scanned += data.size();
+    }
+
+    if (rx_scanned > Max_Frame_Size)
+    {
+        ++stats.sync_losses;
+        Logger::Log(Logger::Level::Info, "COBS frame without delimiter");
+        ResendCredit();
+        ConsumeRx(rx_scanned);
+        rx_scanned = 0;
+    }
+    return false;
+}
+
+// A decoded frame is a header and exactly the payload it has the length of
+bool SerialHandler::CobsFrameValid(uint8_t* frame,
+                                   const size_t size,
+                                   uint16_t& type,
+                                   std::span<const uint8_t>& payload)
+{
+    if (rx_compact)
+    {
+        return CompactFrameValid(frame, size, type, payload);
+    }
+
+    if (size == cobs::Invalid || size < header_size)
+    {
+        ++stats.header_errors;
+        Logger::Log(Logger::Level::Info, "COBS frame error");
+        ResendCredit();
+        return false;
+    }
+
+    if (!HeaderValid(frame))
+    {
+        return false;
+    }
+
+    uint32_t length;
+    std::memcpy(&length, frame + link_packet_t::Type_Size, sizeof(length));
+    if (length != size - header_size)
+    {
+        ++stats.header_errors;
+        Logger::Log(Logger::Level::Info, "COBS frame size error");
+        ResendCredit();
+        return false;
+    }
+
+    std::memcpy(&type, frame, sizeof(type));
+    payload = {frame + header_size, length};
+    return true;
+}
+
+// Writes the compact header for a frame of type and length and returns its
+// size. The length is cut to what goes on the wire when the sequence number
+// at the end goes as its low byte.
+size_t SerialHandler::CompactHead(uint8_t* head, const uint16_t type, uint32_t& length)
+{
+    size_t index = 0;
+    while (index < type_limits.size() && type_limits[index].type != type)
+    {
+        ++index;
+    }
+
+    if (index == type_limits.size() || index >= Compact_Escape)
+    {
+        head[0] = Compact_Escape;
+        std::memcpy(head + 1, &type, sizeof(type));
+        return 1 + sizeof(type) + WriteVarint(head + 1 + sizeof(type), length);
+    }
+
+    uint8_t code = index;
+    if (index < Max_Compact_Types)
+    {
+        CompactType& sent = tx_compact_types[index];
+        if (IsSeqType(type) && length >= sizeof(uint16_t))
+        {
+            code |= Compact_Seq;
+        }
+
+        if (sent.left > 0 && sent.length == length)
+        {
+            --sent.left;
+            if (code & Compact_Seq)
+            {
+                --length;
+            }
+            head[0] = code | Compact_Elided;
+            return 1;
+        }
+
+        sent.length = length;
+        sent.left = Compact_Refresh;
+    }
+
+    head[0] = code;
+    return 1 + WriteVarint(head + 1, length);
+}
+
+// A decoded frame with a compact header. The length is checked against the
+// size of the frame, and a narrowed sequence number is written back out in
+// full after it, the frame always has a byte to spare for it.
+bool SerialHandler::CompactFrameValid(uint8_t* frame,
+                                      const size_t size,
+                                      uint16_t& type,
+                                      std::span<const uint8_t>& payload)
+{
+    if (size == cobs::Invalid || size == 0)
+    {
+        ++stats.header_errors;
+        Logger::Log(Logger::Level::Info, "COBS frame error");
+        ResendCredit();
+        return false;
+    }
+
+    const uint8_t code = frame[0];
+    const size_t index = code & Compact_Index_Mask;
+    const bool tracked = index < Max_Compact_Types;
+    size_t at = 1;
+    bool valid = true;
+    if (index == Compact_Escape)
+    {
+        valid = !(code & (Compact_Seq | Compact_Elided)) && size >= at + sizeof(type);
+        if (valid)
+        {
+            std::memcpy(&type, frame + at, sizeof(type));
+            at += sizeof(type);
+        }
+    }
+    else
+    {
+        valid = index < type_limits.size() && (tracked || !(code & (Compact_Seq | Compact_Elided)));
+        if (valid)
+        {
+            type = type_limits[index].type;
+        }
+    }
+
+    uint32_t length = 0;
+    if (valid && (code & Compact_Elided))
+    {
+        // Only the low byte of the sequence number came
+        length = size - at + (code & Compact_Seq ? 1 : 0);
+        CompactType& last = rx_compact_types[index];
+        valid = last.length == 0 || last.length == length;
+        if (valid)
+        {
+            last.length = length;
+        }
+    }
+    else if (valid)
+    {
+        const size_t varint = ReadVarint(frame + at, size - at, length);
+        at += varint;
+        valid = varint > 0 && length == size - at;
+        if (valid && tracked)
+        {
+            rx_compact_types[index].length = length;
+        }
+    }
+
+    if (!valid || !LengthValid(type, length)
+        || ((code & Compact_Seq) && length < sizeof(uint16_t)))
+    {
+        ++stats.header_errors;
+        Logger::Log(Logger::Level::Info, "Compact header error");
+        ResendCredit();
+        return false;
+    }
+
+    if (code & Compact_Seq)
+    {
+        CompactType& last = rx_compact_types[index];
+        uint8_t* const seq_at = frame + at + length - sizeof(uint16_t);
+        if (code & Compact_Elided)
+        {
+            const int8_t ahead = static_cast<int8_t>(seq_at[0] - static_cast<uint8_t>(last.seq));
+            last.seq += ahead;
+            std::memcpy(seq_at, &last.seq, sizeof(last.seq));
+        }
+        else
+        {
+            std::memcpy(&last.seq, seq_at, sizeof(last.seq));
+        }
+    }
+
+    payload = {frame + at, length};
+    return true;
+}
+
+bool SerialHandler::IsSeqType(const uint16_t type) const
+{
+    return std::find(seq_types.begin(), seq_types.end(), type) != seq_types.end();
+}
+
+// Copies what data holds of the frame into the rx packet queue. at is where
+// data starts in our rx count, which places a credit frame on the wire.
+size_t SerialHandler::CopyFrame(std::span<const uint8_t> data, const uint32_t at)
+{
+    size_t used = 0;
+
+    if (bytes_read < header_size)
+    {
+        used = std::min<size_t>(header_size - bytes_read, data.size());
+        std::memcpy(rx_header + bytes_read, data.data(), used);
+        bytes_read += used;
+
+        if (bytes_read < header_size)
+        {
+            return used;
+        }
+
+        if (!HeaderValid(rx_header))
+        {
+            Resync();
+            return used;
+        }
+
+        // Now the size is known the payload can go straight into the queue,
+        // when it is full the frame is read and thrown away
+        uint32_t length;
+        std::memcpy(&length, rx_header + link_packet_t::Type_Size, sizeof(length));
+        frame_size = header_size + length;
+
+        rx_record = rx_packets.Reserve(link_packet_t::Header_Size + length);
+        if (rx_record)
+        {
+            std::memcpy(rx_record, rx_header, link_packet_t::Header_Size);
+        }
+        else
+        {
+            ++stats.rx_drops;
+            Logger::Log(Logger::Level::Error, "Rx packet queue full, dropping packet");
+        }
+    }
+
+    const size_t num = std::min<size_t>(frame_size - bytes_read, data.size() - used);
+    if (rx_record)
+    {
+        std::memcpy(rx_record + link_packet_t::Header_Size + bytes_read - header_size,
+                    data.data() + used, num);
+    }
+    bytes_read += num;
+    used += num;
+
+    if (bytes_read < frame_size)
+    {
+        return used;
+    }
+
+    if (rx_record)
+    {
+        // A framing frame is taken here, the frames right after it may be
+        // framed differently. So is a credit frame, only now is it known
+        // where it ended.
+        uint16_t type;
+        std::memcpy(&type, rx_record, sizeof(type));
+        if (type == Framing_Type)
+        {
+            TakeFraming({rx_record + link_packet_t::Header_Size, frame_size - header_size});
+        }
+        else if (IsCredit(type))
+        {
+            TakeCredit({rx_record + link_packet_t::Header_Size, frame_size - header_size},
+                       at + used, link_packet_t::Sync_Word_Size + frame_size);
+        }
+        else
+        {
+            rx_packets.Commit();
+        }
+        rx_record = nullptr;
+    }
+
+    bytes_read = 0;
+    sync_matched = 0;
+    return used;
+}
+
+link_packet_t* SerialHandler::TLVRead()
+{
+    // Walk the contiguous runs of unread bytes in place, normally one run or
+    // two when the data wraps the end of the buffer. After the sync word the
+    // header and the payload are each copied in one go per run.
+    std::span<uint8_t> chunk;
+    while (!(chunk = rx_ring.ReadableSpan()).empty())
+    {
+        if (rx_cobs)
+        {
+            PacketView frame;
+            if (!ReadCobs(frame, false))
+            {
+                break;
+            }
+            continue;
+        }
+
+        // Stops short when a framing frame switches the rest to COBS
+        size_t used = 0;
+        while (used < chunk.size() && !rx_cobs)
+        {
+            if (sync_matched < link_packet_t::Sync_Word_Size)
+            {
+                used += MatchSync(chunk.subspan(used));
+                continue;
+            }
+
+            used += CopyFrame(chunk.subspan(used), rx_consumed + used);
+        }
+
+        ConsumeRx(used);
+    }
+
+    return GetReadyPacket();
+}
+
+SerialHandler::PacketView SerialHandler::ReadView()
+{
+    if (view_pending)
+    {
+        Logger::Log(Logger::Level::Error, "Packet view read before the last one was released");
+        return {};
+    }
+
+    UpdateCredit();
+    UpdateFraming();
+
+    while (true)
+    {
+        if (!frame_held)
+        {
+            const PacketView frame = ReadFrame();
+            if (!frame || !IsAggregate(frame.type))
+            {
+                view_pending = static_cast<bool>(frame);
+                if (frame)
+                {
+                    ++stats.rx_frames;
+                    CountType(stats.rx_types, frame.type);
+                }
+                return frame;
+            }
+            StartSplit(frame.payload);
+        }
+
+        const PacketView view = NextSplit();
+        if (view)
+        {
+            view_pending = true;
+            ++stats.rx_frames;
+            CountType(stats.rx_types, view.type);
+            return view;
+        }
+
+        // Nothing left in the aggregate
+        ReleaseFrame();
+    }
+}
+
+// The next frame in the rx queue or in place in the rx ring, which stays held
+// until ReleaseFrame
+SerialHandler::PacketView SerialHandler::ReadFrame()
+{
+    while (true)
+    {
+        // Frames that wrapped the end of the ring were copied into the queue
+        // and are always older than anything still in the ring
+        if (!rx_packets.Empty())
+        {
+            frame_held = true;
+            view_size = 0;
+            const std::span<const uint8_t> record = rx_packets.Front();
+            return ViewOf(record.data(), record.subspan(link_packet_t::Header_Size));
+        }
+
+        if (rx_cobs)
+        {
+            PacketView view;
+            if (!ReadCobs(view, true))
+            {
+                return {};
+            }
+
+            if (view)
+            {
+                return view;
+            }
+            continue;
+        }
+
+        std::span<uint8_t> chunk = rx_ring.ReadableSpan();
+        if (chunk.empty())
+        {
+            return {};
+        }
+
+        if (sync_matched < link_packet_t::Sync_Word_Size)
+        {
+            ConsumeRx(MatchSync(chunk));
+            continue;
+        }
+
+        // Partway through copying a wrapped frame, finish it
+        if (bytes_read > 0)
+        {
+            ConsumeRx(CopyFrame(chunk, rx_consumed));
+            continue;
+        }
+
+        // More unread bytes than the run holds means the frame continues
+        // past the end of the buffer
+        const bool wraps = chunk.size() < rx_ring.Unread();
+        if (chunk.size() < header_size)
+        {
+            if (wraps)
+            {
+                ConsumeRx(CopyFrame(chunk, rx_consumed));
+                continue;
+            }
+            return {};
+        }
+
+        if (!HeaderValid(chunk.data()))
+        {
+            // Nothing past the sync word has been consumed, so the search for
+            // the next sync word starts right after it
+            sync_matched = 0;
+            continue;
+        }
+
+        uint32_t length;
+        std::memcpy(&length, chunk.data() + link_packet_t::Type_Size, sizeof(length));
+
+        const uint32_t frame_size = header_size + length;
+        if (chunk.size() >= frame_size)
+        {
+            sync_matched = 0;
+
+            uint16_t type;
+            std::memcpy(&type, chunk.data(), sizeof(type));
+            if (type == Framing_Type)
+            {
+                TakeFraming(chunk.subspan(header_size, length));
+                ConsumeRx(frame_size);
+                continue;
+            }
+
+            if (IsCredit(type))
+            {
+                TakeCredit(chunk.subspan(header_size, length), rx_consumed + frame_size,
+                           link_packet_t::Sync_Word_Size + frame_size);
+                ConsumeRx(frame_size);
+                continue;
+            }
+
+            // Leave the bytes unread so the producer cannot reuse them until
+            // Release
+            frame_held = true;
+            view_size = frame_size;
+            return ViewOf(chunk.data(), chunk.subspan(header_size, length));
+        }
+
+        if (!wraps)
+        {
+            return {};
+        }
+
+        ConsumeRx(CopyFrame(chunk, rx_consumed));
+    }
+}
+
+void SerialHandler::Release()
+{
+    if (!view_pending)
+    {
+        return;
+    }
+
+    view_pending = false;
+
+    // The rest of an aggregate is handed out of the same held frame
+    if (splitting && !split_rest.empty())
+    {
+        return;
+    }
+
+    ReleaseFrame();
+}
+
+void SerialHandler::ReleaseFrame()
+{
+    // A frame in the ring has its frame size, one in the queue is the oldest
+    // record
+    if (view_size > 0)
+    {
+        ConsumeRx(view_size);
+    }
+    else
+    {
+        rx_packets.Pop();
+    }
+
+    view_size = 0;
+    frame_held = false;
+    split_rest = {};
+    splitting = false;
+}
+
+bool SerialHandler::IsAggregate(const uint16_t type) const
+{
+    return aggregate_max > 0 && type == Aggregate_Type;
+}
+
+void SerialHandler::StartSplit(std::span<const uint8_t> payload)
+{
+    splitting = true;
+    split_rest = {};
+    if (payload.size() < link_packet_t::Type_Size)
+    {
+        return;
+    }
+
+    std::memcpy(&split_type, payload.data(), sizeof(split_type));
+    if (!IsAggregate(split_type))
+    {
+        split_rest = payload.subspan(link_packet_t::Type_Size);
+    }
+}
+
+// The next frame packed in the aggregate being split, a frame that does not
+// fit in what is left or is over the limit for its type ends the aggregate
+SerialHandler::PacketView SerialHandler::NextSplit()
+{
+    if (split_rest.size() < Aggregate_Len_Size)
+    {
+        split_rest = {};
+        return {};
+    }
+
+    uint16_t length;
+    std::memcpy(&length, split_rest.data(), sizeof(length));
+    if (length > split_rest.size() - Aggregate_Len_Size || !LengthValid(split_type, length))
+    {
+        Logger::Log(Logger::Level::Info, "Aggregate frame size error");
+        split_rest = {};
+        return {};
+    }
+
+    PacketView view;
+    view.type = split_type;
+    view.length = length;
+    view.payload = split_rest.subspan(Aggregate_Len_Size, length);
+    split_rest = split_rest.subspan(Aggregate_Len_Size + length);
+    return view;
+}
+
+void SerialHandler::ResetRx()
+{
+    rx_packets.Clear();
+    rx_record = nullptr;
+
+    bytes_read = 0;
+    sync_matched = 0;
+    rx_scanned = 0;
+    view_size = 0;
+    view_pending = false;
+    frame_held = false;
+    split_rest = {};
+    splitting = false;
+}
+
+link_packet_t* SerialHandler::GetReadyPacket()
+{
+    while (!rx_packets.Empty())
+    {
+        const std::span<const uint8_t> record = rx_packets.Front();
+
+        uint16_t type;
+        std::memcpy(&type, record.data(), sizeof(type));
+        if (!IsAggregate(type))
+        {
+            // The queue only holds each packet at its actual size, give the
+            // caller a full sized packet it is free to write into
+            std::memcpy(packet.WriteableData().data(), record.data(), record.size());
+            rx_packets.Pop();
+            ++stats.rx_frames;
+            CountType(stats.rx_types, packet.type);
+            return &packet;
+        }
+
+        // An aggregate is handed out a frame per call and stays queued until
+        // the last one
+        if (!splitting)
+        {
+            StartSplit(record.subspan(link_packet_t::Header_Size));
+        }
+
+        const PacketView view = NextSplit();
+        if (view)
+        {
+            packet.type = view.type;
+            packet.length = view.length;
+            std::memcpy(packet.payload.data(), view.payload.data(), view.length);
+        }
+
+        if (split_rest.empty())
+        {
+            rx_packets.Pop();
+            splitting = false;
+        }
+
+        if (view)
+        {
+            ++stats.rx_frames;
+            CountType(stats.rx_types, packet.type);
+            return &packet;
+        }
+    }
+
+    return nullptr;
+}
+
+SerialHandler::PacketView SerialHandler::ViewOf(const uint8_t* header,
+                                               std::span<const uint8_t> payload)
+{
+    PacketView view;
+    std::memcpy(&view.type, header, sizeof(view.type));
+    view.length = payload.size();
+    view.payload = payload;
+    return view;
+}
+
+bool SerialHandler::TLVWrite(const TxClass tx_class,
+                             std::span<const uint8_t> head,
+                             std::initializer_list<std::span<const uint8_t>> body)
+{
+    TxQueue& queue = tx_queues[static_cast<size_t>(tx_class)];
+
+    size_t size = head.size();
+    for (const std::span<const uint8_t> part : body)
+    {
+        size += part.size();
+    }
+
+    if (queue.frames.Unread() >= queue.depth)
+    {
+        ++stats.tx_drops[static_cast<size_t>(tx_class)];
+        return false;
+    }
+
+    // Never overwrite bytes that are still queued or being sent by DMA, drop
+    // the whole write instead so the receiver only has to resync once.
+    if (size > queue.ring.Free())
+    {
+        ++stats.tx_drops[static_cast<size_t>(tx_class)];
+        Logger::Log(Logger::Level::Error, "Transmit buffer full");
+        return false;
+    }
+
+    queue.ring.Write(head.data(), head.size());
+    for (const std::span<const uint8_t> part : body)
+    {
+        queue.ring.Write(part.data(), part.size());
+    }
+
+    // Published after the bytes so the transmitter never starts a frame that
+    // is not all there
+    queue.frames.Write(size);
+
+    // Raw writes may not start with a header
+    if (head.size() >= link_packet_t::Sync_Word_Size + link_packet_t::Type_Size)
+    {
+        uint16_t type;
+        std::memcpy(&type, head.data() + link_packet_t::Sync_Word_Size, sizeof(type));
+        CountType(stats.tx_types, type);
+    }
+    return true;
+}
+
+void SerialHandler::ReplyAck()
+{
+    Reply(Response_Ack);
+}
+
+void SerialHandler::ReplyError()
+{
+    Reply(Response_Error);
+}
+
+void SerialHandler::ReplyError(uint16_t type, const char* msg)
+{
+    Reply(type, std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(msg), strlen(msg)));
+}
+
+void SerialHandler::Reply(uint16_t type)
+{
+    Write(type, {});
+}
+
+void SerialHandler::Reply(uint16_t type, const std::string& data)
+{
+    Reply(type,
+          std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(data.data()), data.size()));
+}
+
+void SerialHandler::Reply(uint16_t type, std::span<const uint8_t> data)
+{
+    // Long replies such as log lines are cut to one packet
+    Write(type, {data.first(std::min(data.size(), link_packet_t::Payload_Size))});
 }
@@ -1,7 +1,13 @@
 #pragma once
 
+#include "../../shared_inc/arena_queue.hh"
 #include "../../shared_inc/link_packet_t.hh"
+#include "../../shared_inc/link_schema.hh"
 #include "../../shared_inc/ring_buffer.hh"
+#include "../../shared_inc/static_ring_buffer.hh"
+#include "../cobs/cobs.hh"
+#include <atomic>
+#include <initializer_list>
 #include <string>
 
 #ifdef PLATFORM_ESP
@@ -19,14 +25,126 @@ public:
     static constexpr uint16_t Response_Ack = 0x8000;
     static constexpr uint16_t Response_Error = 0x8001;
 
-    static constexpr uint8_t END = 0xC0;
-    static constexpr uint8_t ESC = 0xDB;
-    static constexpr uint8_t ESC_END = 0xDC;
-    static constexpr uint8_t ESC_ESC = 0xDD;
+    // Several frames of one type sent as one packet, see EnableAggregation.
+    // The payload is the type of the frames followed by each frame's 16 bit
+    // length and payload.
+    static constexpr uint16_t Aggregate_Type = 0x8002;
+    static constexpr size_t Aggregate_Len_Size = sizeof(uint16_t);
 
-    SerialHandler(const uint16_t num_rx_packets,
+    // Flow control credit, see EnableFlowControl. The payload is the bytes
+    // the sender had sent before it, how far the receiver lets the sender go
+    // in those same bytes, flags and a crc of the three.
+    static constexpr uint16_t Credit_Type = 0x8003;
+    static constexpr size_t Credit_Payload_Size =
+        sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t);
+
+    // Framing offer or switch, see EnableCobs. Always sent as a TLV frame so
+    // it is understood whatever the other end is reading. The payload is one
+    // byte of flags.
+    static constexpr uint16_t Framing_Type = 0x8004;
+    static constexpr size_t Framing_Payload_Size = sizeof(uint8_t);
+
+    // Compact headers, see EnableCompactHeaders. The first types in the type
+    // limits each have state of their own, and an explicit header goes out
+    // for each of them at least this often.
+    static constexpr size_t Max_Compact_Types = 16;
+    static constexpr uint8_t Compact_Refresh = 50;
+
+    // A code byte, a 16 bit type when the code is escaped and a varint length
+    static constexpr size_t Max_Compact_Header_Size = 1 + sizeof(uint16_t) + 3;
+
+    // Optional crc appended to the type and length, see EnableHeaderCrc
+    static constexpr size_t Crc_Size = sizeof(uint16_t);
+    static constexpr size_t Max_Header_Size = link_packet_t::Header_Size + Crc_Size;
+
+    // Transmit classes in priority order. A queued realtime frame goes out as
+    // soon as the frame being sent finishes, ahead of any queued bulk frames.
+    enum class TxClass : uint8_t
+    {
+        Realtime = 0,
+        Bulk,
+    };
+    static constexpr size_t Num_Tx_Classes = 2;
+
+    // Most frames each transmit class can hold, see SetTxDepth
+    static constexpr uint16_t Max_Tx_Frames = 32;
+
+    // Packet types counted separately in each direction, see Stats
+    static constexpr size_t Max_Stat_Types = 8;
+
+    // Link counters, they all wrap. Stats commands reply with it as is, so
+    // the layout is part of the mgmt protocol.
+    struct Stats
+    {
+        // Bytes and frames started on the wire, credit frames included and an
+        // aggregate counted once
+        uint32_t tx_bytes;
+        uint32_t tx_frames;
+        // Frames refused by each transmit class, see SetTxDepth
+        uint32_t tx_drops[Num_Tx_Classes];
+        // Times a frame had to wait for flow control credit
+        uint32_t tx_stalls;
+
+        // Bytes in from the uart, and times it lost some because the rx
+        // ring was full
+        uint32_t rx_bytes;
+        uint32_t rx_overruns;
+        // Times bytes were skipped looking for a sync word, headers rejected
+        // and frames dropped because the rx packet queue was full
+        uint32_t sync_losses;
+        uint32_t header_errors;
+        uint32_t rx_drops;
+        // Frames handed to the reader, the frames of an aggregate each count
+        uint32_t rx_frames;
+
+        // Frames queued and frames read for each of the first types seen in
+        // that direction, unused entries have no frames
+        struct TypeCount
+        {
+            uint32_t type;
+            uint32_t frames;
+        };
+        TypeCount tx_types[Max_Stat_Types];
+        TypeCount rx_types[Max_Stat_Types];
+    };
+
+    // Stats as they go to the mgmt tools, every field at a fixed offset.
+    // New counters go on the end, along with a bump of the reply version.
+    static_assert(sizeof(Stats::TypeCount) == 2 * sizeof(uint32_t));
+    using StatsSchema = link_schema::Message<&Stats::tx_bytes,
+                                             &Stats::tx_frames,
+                                             &Stats::tx_drops,
+                                             &Stats::tx_stalls,
+                                             &Stats::rx_bytes,
+                                             &Stats::rx_overruns,
+                                             &Stats::sync_losses,
+                                             &Stats::header_errors,
+                                             &Stats::rx_drops,
+                                             &Stats::rx_frames,
+                                             &Stats::tx_types,
+                                             &Stats::rx_types>;
+
+    // A received frame, read only. The payload points into the rx ring when
+    // the frame was contiguous there, or into the rx packet queue when it
+    // wrapped the end of the ring. Valid until Release().
+    struct PacketView
+    {
+        uint16_t type = 0;
+        uint32_t length = 0;
+        std::span<const uint8_t> payload;
+
+        explicit operator bool() const
+        {
+            return payload.data() != nullptr;
+        }
+    };
+
+    SerialHandler(uint8_t& rx_packet_buff,
+                  const uint32_t rx_packet_buff_sz,
                   uint8_t& tx_buff,
                   const uint32_t tx_buff_sz,
+                  uint8_t& realtime_tx_buff,
+                  const uint32_t realtime_tx_buff_sz,
                   uint8_t& rx_buff,
                   const uint32_t rx_buff_sz,
                   void (*Transmit)(void* self),
@@ -35,10 +153,20 @@ public:
 
     link_packet_t* Read();
 
-    void Write(const uint8_t data, const bool end_frame = true);
-    void Write(const link_packet_t& packet, const bool end_frame = true);
-    void Write(std::span<const uint8_t> data, const bool end_frame = true);
-    void Write(const uint8_t* data, const uint16_t size, const bool end_frame = true);
+    // Zero copy alternative to Read, only one view can be out at a time and
+    // its bytes stay unavailable to the receiver until it is released. Do not
+    // mix with Read on the same link.
+    PacketView ReadView();
+    void Release();
+
+    void Write(const link_packet_t& packet, const TxClass tx_class = TxClass::Bulk);
+
+    // Frames the payload parts back to back as one packet of the given type.
+    // The whole frame is queued under one lock and transmit is started once,
+    // a frame over the payload size is dropped.
+    void Write(const uint16_t type,
+               std::initializer_list<std::span<const uint8_t>> payload,
+               const TxClass tx_class = TxClass::Bulk);
 
     void ReplyAck();
     void ReplyError();
@@ -54,56 +182,279 @@ public:
     uint16_t Unread();
     uint16_t Unsent();
 
-    // TODO DELETEME
-    uint16_t RxBuffWriteIdx()
-    {
-        return rx_write_idx;
-    }
-    uint16_t RxBuffReadIdx()
-    {
-        return rx_read_idx;
-    }
+    // Limits how many frames of a class can wait to be sent, a frame written
+    // past the limit or past the free space of its class is dropped. Keeps
+    // realtime frames from going stale behind each other.
+    void SetTxDepth(const TxClass tx_class, const uint16_t frames);
+    uint32_t TxDrops(const TxClass tx_class) const;
 
-protected:
-    inline __attribute__((always_inline)) void WriteToTxBuff(const uint8_t data);
-    inline __attribute__((always_inline)) uint8_t ReadFromRxBuff();
-    virtual void UpdateUnread(const uint16_t update) = 0;
+    const Stats& GetStats() const;
+
+    // Follows every header with a crc of the type and length and rejects
+    // headers whose crc does not match. Both ends of the link have to agree,
+    // so it is only for links where both sides are this firmware.
+    void EnableHeaderCrc();
+
+    // Rejects headers whose type is not in limits or whose length is over the
+    // limit for the type. Without limits any length up to the payload size is
+    // accepted. limits has to outlive the handler.
+    void SetTypeLimits(std::span<const link_type_limit_t> limits);
+
+    // Realtime frames of one type that are queued behind each other when the
+    // transmitter gets to them go out as one packet of up to max_frames, and
+    // are split back into the original frames by Read and ReadView on the
+    // other end. Only frames that are already waiting are packed, but the
+    // first one is only complete once the rest have been sent, so max_frames
+    // caps the added latency. Both ends of the link have to enable it.
+    void EnableAggregation(const uint8_t max_frames);
+
+    // Only sends as far as the other end has said it has room for in its rx
+    // ring, so the receiver never overruns. Each end tells the other how many
+    // bytes it may send in small credit frames that go out ahead of anything
+    // queued. Frames without credit wait in their tx queue, where the depth
+    // limits drop them instead. Both ends of the link have to enable it, and
+    // the rx ring has to hold at least two full frames.
+    void EnableFlowControl();
 
-    void UpdateRx(const uint16_t num_recv);
+    // Sends frames COBS encoded and ended by a zero instead of behind a sync
+    // word, once the other end has said it can read them. A receiver that
+    // lost its place picks up at the next zero instead of searching payloads
+    // for the sync word. Each end offers it to the other when enabled, and
+    // switches with a framing frame that marks where its encoded frames
+    // start, so both ends agree at boot and an end that never enables it
+    // stays on TLV. The receive side always follows the other end.
+    void EnableCobs();
+
+    // Goes back to TLV and offers COBS again, for when the other end may have
+    // restarted and lost track of the framing
+    void ResetFraming();
+
+    // Sends COBS frames with a compact header in place of the type and
+    // length, once the other end has said it can read them. It is offered and
+    // switched on with the framing frames of EnableCobs, which it needs.
+    //
+    // The header is a code byte holding the type's place in the type limits,
+    // or an escape and the type, then the length as a varint. A frame of a
+    // type whose length has not changed since the last explicit header leaves
+    // the length out, the receiver knows it from where the frame ends. Frames
+    // of seq_types end in a 16 bit sequence number, which goes out as its low
+    // byte when the length is left out and is rebuilt on the other end from
+    // the last one. There is no header crc, the length is checked against the
+    // size of the decoded frame instead. seq_types has to outlive the
+    // handler.
+    void EnableCompactHeaders(std::span<const uint16_t> seq_types);
+
+protected:
     bool UpdateTx();
     bool PrepTransmit();
 
     link_packet_t* TLVRead();
+    size_t MatchSync(std::span<const uint8_t> data);
+    size_t CopyFrame(std::span<const uint8_t> data, const uint32_t at);
+    bool HeaderValid(const uint8_t* header);
+    bool LengthValid(const uint16_t type, const uint32_t length) const;
+    void Resync();
 
     link_packet_t* GetReadyPacket();
+    static PacketView ViewOf(const uint8_t* header, std::span<const uint8_t> payload);
+
+    PacketView ReadFrame();
+    void ReleaseFrame();
+
+    // Received aggregates are handed out a frame at a time
+    bool IsAggregate(const uint16_t type) const;
+    void StartSplit(std::span<const uint8_t> payload);
+    PacketView NextSplit();
+
+    // Drops any partial frame and outstanding view, for when the receiver is
+    // restarted on an empty rx ring
+    void ResetRx();
 
-    void TLVWrite(const uint8_t* data, const uint16_t size);
+    void Send(const TxClass tx_class,
+              std::span<const uint8_t> head,
+              std::initializer_list<std::span<const uint8_t>> body);
+    bool TLVWrite(const TxClass tx_class,
+                  std::span<const uint8_t> head,
+                  std::initializer_list<std::span<const uint8_t>> body);
+    bool NextTxFrame();
+    bool TxPending();
+    bool Aggregate(const uint16_t first_size, const uint32_t credit);
+    size_t WriteHead(uint8_t* head, const uint16_t type, const uint32_t length) const;
+    void KickTx();
 
-    RingBuffer<link_packet_t> rx_packets;
+    // Flow control, the transmit side stages credit frames and checks what it
+    // may send, the receive side takes credit frames in and decides when to
+    // hand out more
+    uint32_t TxCredit() const;
+    void StageCredit();
+    void ResendCredit();
+    bool IsCredit(const uint16_t type) const;
+    void TakeCredit(std::span<const uint8_t> payload, const uint32_t end, const uint32_t frame);
+    void UpdateCredit();
+    void ConsumeRx(const size_t count);
+
+    // COBS framing, the transmit side stages framing frames and encodes each
+    // frame as it starts, the receive side reads encoded frames and follows
+    // the framing frames of the other end
+    void StageFraming();
+    void EncodeStage(std::span<const uint8_t> frame);
+    void EncodeQueued(RingBuffer<uint8_t>& ring, const uint16_t size);
+    uint32_t WireSize(const uint32_t size) const;
+    void TakeFraming(std::span<const uint8_t> payload);
+    void UpdateFraming();
+    bool ReadCobs(PacketView& view, const bool in_place);
+    bool FindDelimiter(uint32_t& at);
+    bool CobsFrameValid(uint8_t* frame,
+                        const size_t size,
+                        uint16_t& type,
+                        std::span<const uint8_t>& payload);
+
+    // Compact headers, written as each frame is encoded and read back out of
+    // each decoded frame
+    size_t CompactHead(uint8_t* head, const uint16_t type, uint32_t& length);
+    bool CompactFrameValid(uint8_t* frame,
+                           const size_t size,
+                           uint16_t& type,
+                           std::span<const uint8_t>& payload);
+    bool IsSeqType(const uint16_t type) const;
+
+    static void CountType(Stats::TypeCount (&types)[Max_Stat_Types], const uint16_t type);
+
+    // Completed frames, header and payload, each at its actual length. Only
+    // frames that wrap the end of the rx ring land here when reading views.
+    ArenaQueue rx_packets;
+
+    // Frames waiting to be sent in one class, the bytes and the size of each
+    // frame so the transmitter knows where it can switch classes. Writers
+    // append under the write lock, the transmit complete path drains.
+    struct TxQueue
+    {
+        RingBuffer<uint8_t> ring;
+        StaticRingBuffer<uint16_t, Max_Tx_Frames> frames{};
+        uint16_t depth = Max_Tx_Frames;
+    };
 
-    uint8_t* tx_buff;
-    uint32_t tx_buff_sz;
-    uint8_t* rx_buff;
-    uint32_t rx_buff_sz;
+    // The rings sit on the caller's buffers, the rx producer is the ISR or
+    // uart task and the tx consumer is the transmit complete path.
+    TxQueue tx_queues[Num_Tx_Classes];
+    RingBuffer<uint8_t> rx_ring;
 
-    uint16_t tx_write_idx;
-    uint16_t tx_read_idx;
-    bool tx_free;
-    uint16_t unsent;
-    uint16_t num_to_send;
+    // Owned by whoever swaps it from true to false, that side starts the next
+    // transmit. tx_chunk is the span currently handed to Transmit, it comes
+    // from the tx_class queue which has tx_left bytes of its frame to go.
+    std::atomic<bool> tx_free;
+    std::span<uint8_t> tx_chunk;
 
-    uint16_t rx_write_idx;
-    uint16_t rx_read_idx;
-    volatile uint16_t unread;
-    volatile uint16_t update_cache;
+    // Set while Transmit runs. A transmitter that finishes before returning,
+    // like a blocking uart write, calls UpdateTx from inside it, which then
+    // leaves the next chunk to PrepTransmit's loop so the stack stays flat.
+    std::atomic<bool> tx_in_transmit;
+    TxClass tx_class;
+    uint32_t tx_left;
+
+    // A frame built by the transmit side instead of taken from a ring, either
+    // realtime frames copied into one aggregate or a credit frame. When
+    // tx_stage is set the frame being sent is tx_stage_size bytes there.
+    uint8_t tx_aggregate[link_packet_t::Sync_Word_Size + Max_Header_Size
+                         + link_packet_t::Payload_Size];
+    uint8_t tx_credit[link_packet_t::Sync_Word_Size + Max_Header_Size + Credit_Payload_Size];
+    uint8_t tx_framing[link_packet_t::Sync_Word_Size + Max_Header_Size + Framing_Payload_Size];
+    const uint8_t* tx_stage;
+    uint32_t tx_stage_size;
+    uint8_t aggregate_max;
+
+    // COBS framing. tx_cobs is whether the transmit side encodes, it only
+    // changes as a framing frame is staged. peer_cobs is whether the other
+    // end has offered it, and framing_due asks the transmitter to send a
+    // framing frame. tx_encoded holds the frame being sent when encoding.
+    bool cobs;
+    bool tx_cobs;
+    std::atomic<bool> peer_cobs;
+    std::atomic<bool> framing_due;
+    uint8_t tx_encoded[cobs::MaxEncodedSize(Max_Header_Size + link_packet_t::Payload_Size) + 1];
+
+    // Compact headers, tx_compact and rx_compact are whether each side uses
+    // them and follow the framing frames like tx_cobs and rx_cobs. Each side
+    // keeps the last explicit length of the first types, the transmit side
+    // counts down to the next explicit header and the receive side keeps the
+    // last sequence number.
+    struct CompactType
+    {
+        uint16_t length;
+        uint16_t seq;
+        uint8_t left;
+    };
+    bool compact;
+    bool tx_compact;
+    std::atomic<bool> peer_compact;
+    std::span<const uint16_t> seq_types;
+    CompactType tx_compact_types[Max_Compact_Types];
+    CompactType rx_compact_types[Max_Compact_Types];
+
+    // Flow control counts are bytes on the wire and wrap. tx_sent is what
+    // this end has started sending and peer_limit is how far the other end
+    // lets it go. rx_limit is the limit handed out the other way, in the
+    // other end's count, and credit_due asks the transmitter to send it.
+    bool flow_control;
+    uint32_t credit_window;
+    std::atomic<uint32_t> tx_sent;
+    std::atomic<uint32_t> peer_limit;
+    std::atomic<bool> tx_blocked;
+    std::atomic<uint32_t> rx_limit;
+    std::atomic<bool> rx_limit_valid;
+    std::atomic<bool> credit_due;
+
+    // Receive side of flow control. rx_consumed counts bytes freed from the
+    // rx ring and rx_offset turns it into the other end's count, it is set
+    // again by every credit frame that comes in.
+    uint32_t rx_consumed;
+    uint32_t rx_offset;
+    uint32_t rx_advertised;
+    bool rx_synced;
+    bool peer_unsynced;
+    bool peer_blocked;
 
     void (*Transmit)(void* self);
     void* transmit_arg;
 
-    link_packet_t* packet;
+    // Handed out by Read, valid until the next call
+    link_packet_t packet;
+
+    // The frame being copied out of the rx ring, rx_record is its space in
+    // the queue or nullptr when it is being dropped
+    uint8_t rx_header[Max_Header_Size];
+    uint8_t* rx_record;
+    uint32_t frame_size;
     uint32_t bytes_read;
     size_t sync_matched;
-    bool escaped;
+
+    // Bytes of the held frame still in the rx ring, zero when it is in the
+    // queue. A frame stays held while a view of it or of any frame packed in
+    // it is out.
+    uint32_t view_size;
+    bool view_pending;
+    bool frame_held;
+
+    // Frames of the held aggregate that have not been handed out yet
+    std::span<const uint8_t> split_rest;
+    uint16_t split_type;
+    bool splitting;
+
+    // Bytes between the sync word and the payload, the header plus the crc
+    // when it is enabled
+    size_t header_size;
+    bool header_crc;
+    std::span<const link_type_limit_t> type_limits;
+
+    // Whether the other end's frames are COBS encoded, and how far into the
+    // unread bytes is known to have no delimiter
+    bool rx_cobs;
+    bool rx_compact;
+    uint32_t rx_scanned;
+
+    // Written by whichever side the counter belongs to, the rx producer adds
+    // rx_bytes and rx_overruns
+    Stats stats;
 
 #ifdef PLATFORM_ESP
     std::mutex write_mux;
@@ -1,7 +0,0 @@
-#pragma once
-
-namespace Slip
-{
-void Encode();
-void Decode();
-}; // namespace Slip
\ No newline at end of file
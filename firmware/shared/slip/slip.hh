@@ -1,5 +0,0 @@
-#pragma once
-
-class Slip
-{
-};
\ No newline at end of file
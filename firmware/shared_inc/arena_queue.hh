@@ -0,0 +1,221 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <span>
+
+// FIFO of variable sized records packed into one block of caller memory.
+//
+// Each record takes its actual size plus a 16 bit length in front, so a short
+// control message costs a few bytes instead of a whole max sized slot. A
+// record is always contiguous, when it does not fit before the end of the
+// block the rest of the block is skipped and it goes at the start instead.
+//
+// Records are reserved, filled in place and then committed, so a producer can
+// copy straight into the queue once it knows how big the record is. When the
+// queue is full the reservation fails and nothing already queued is touched.
+//
+// NOTE- Not thread safe, the serial handler fills and drains it from the same
+// task.
+class ArenaQueue
+{
+public:
+    static constexpr uint32_t Len_Size = sizeof(uint16_t);
+    static constexpr uint32_t Max_Record_Size = 0xFFFE;
+
+    ArenaQueue(uint8_t* storage, const uint32_t storage_size) :
+        buffer(storage),
+        size(storage_size),
+        read_idx(0),
+        write_idx(0),
+        used(0),
+        count(0),
+        reserved_idx(0),
+        reserved_pad(0),
+        reserved_len(0)
+    {
+    }
+
+    ArenaQueue(const ArenaQueue&) = delete;
+    ArenaQueue& operator=(const ArenaQueue&) = delete;
+
+    // Space for the next record, nullptr when it does not fit. Only the last
+    // reservation counts, it is not queued until Commit.
+    uint8_t* Reserve(const uint32_t len) noexcept
+    {
+        if (len > Max_Record_Size)
+        {
+            return nullptr;
+        }
+
+        if (used == 0)
+        {
+            // Start over at the front so the whole block is contiguous
+            read_idx = 0;
+            write_idx = 0;
+        }
+
+        const uint32_t need = Len_Size + len;
+        uint32_t pad = 0;
+        uint32_t at = write_idx;
+
+        if (used == 0 || write_idx > read_idx)
+        {
+            const uint32_t tail = size - write_idx;
+            if (need > tail)
+            {
+                // Skip the tail and use the free space at the front
+                if (need > read_idx)
+                {
+                    return nullptr;
+                }
+                pad = tail;
+                at = 0;
+            }
+        }
+        else if (need > read_idx - write_idx)
+        {
+            return nullptr;
+        }
+
+        reserved_idx = at;
+        reserved_pad = pad;
+        reserved_len = len;
+        return buffer + at + Len_Size;
+    }
+
+    // Queues the record from the last Reserve.
+    void Commit() noexcept
+    {
+        if (reserved_pad >= Len_Size)
+        {
+            std::memcpy(buffer + write_idx, &Skip, Len_Size);
+        }
+
+        const uint16_t len = reserved_len;
+        std::memcpy(buffer + reserved_idx, &len, Len_Size);
+
+        write_idx = reserved_idx + Len_Size + reserved_len;
+        if (write_idx == size)
+        {
+            write_idx = 0;
+        }
+
+        used += reserved_pad + Len_Size + reserved_len;
+        ++count;
+        reserved_pad = 0;
+    }
+
+    // Queues the record from the last Reserve cut to its first len bytes, for
+    // a producer that only knows the size once it has filled it.
+    void Commit(const uint32_t len) noexcept
+    {
+        if (len < reserved_len)
+        {
+            reserved_len = len;
+        }
+        Commit();
+    }
+
+    // The oldest record, empty when there is none.
+    std::span<uint8_t> Front() noexcept
+    {
+        if (count == 0)
+        {
+            return {};
+        }
+
+        SkipPadding();
+
+        uint16_t len;
+        std::memcpy(&len, buffer + read_idx, Len_Size);
+        return {buffer + read_idx + Len_Size, len};
+    }
+
+    // Drops the oldest record.
+    void Pop() noexcept
+    {
+        if (count == 0)
+        {
+            return;
+        }
+
+        SkipPadding();
+
+        uint16_t len;
+        std::memcpy(&len, buffer + read_idx, Len_Size);
+
+        read_idx += Len_Size + len;
+        if (read_idx == size)
+        {
+            read_idx = 0;
+        }
+
+        used -= Len_Size + len;
+        --count;
+    }
+
+    void Clear() noexcept
+    {
+        read_idx = 0;
+        write_idx = 0;
+        used = 0;
+        count = 0;
+        reserved_pad = 0;
+    }
+
+    bool Empty() const noexcept
+    {
+        return count == 0;
+    }
+
+    uint16_t Count() const noexcept
+    {
+        return count;
+    }
+
+    // Bytes taken by queued records, their lengths and any skipped tail
+    uint32_t Used() const noexcept
+    {
+        return used;
+    }
+
+    uint32_t Size() const noexcept
+    {
+        return size;
+    }
+
+private:
+    static constexpr uint16_t Skip = 0xFFFF;
+
+    // Moves past a skipped tail, which is either marked or too short to hold
+    // a length.
+    void SkipPadding() noexcept
+    {
+        const uint32_t tail = size - read_idx;
+        if (tail >= Len_Size)
+        {
+            uint16_t len;
+            std::memcpy(&len, buffer + read_idx, Len_Size);
+            if (len != Skip)
+            {
+                return;
+            }
+        }
+
+        used -= tail;
+        read_idx = 0;
+    }
+
+    uint8_t* buffer;
+    uint32_t size;
+    uint32_t read_idx;
+    uint32_t write_idx;
+    uint32_t used;
+    uint16_t count;
+
+    uint32_t reserved_idx;
+    uint32_t reserved_pad;
+    uint32_t reserved_len;
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Fixed number of fixed size blocks with O(1) acquire and release.
+//
+// The free blocks form a singly linked list threaded through a parallel index
+// array, so acquiring is popping the head and releasing is pushing it back.
+// Blocks are handed out as move only handles that destroy the object and give
+// the block back when they go out of scope.
+//
+// With Isr_Safe the head is swapped with a compare and exchange, which lets an
+// ISR and the main loop (or two tasks on different cores) share the pool
+// without masking interrupts. The head carries a tag that changes on every
+// swap so a block that is released and acquired again between the load and
+// the exchange cannot corrupt the list.
+template <typename T, uint16_t Num_Blocks, bool Isr_Safe = false>
+class BlockPool
+{
+    static_assert(Num_Blocks > 0 && Num_Blocks < 0xFFFF, "Block count must fit in the index");
+
+public:
+    class Handle
+    {
+    public:
+        Handle() noexcept :
+            pool(nullptr),
+            block(nullptr)
+        {
+        }
+
+        Handle(Handle&& other) noexcept :
+            pool(std::exchange(other.pool, nullptr)),
+            block(std::exchange(other.block, nullptr))
+        {
+        }
+
+        Handle& operator=(Handle&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Reset();
+                pool = std::exchange(other.pool, nullptr);
+                block = std::exchange(other.block, nullptr);
+            }
+            return *this;
+        }
+
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+
+        ~Handle()
+        {
+            Reset();
+        }
+
+        void Reset() noexcept
+        {
+            if (block)
+            {
+                pool->Release(block);
+            }
+            pool = nullptr;
+            block = nullptr;
+        }
+
+        T* Get() const noexcept
+        {
+            return block;
+        }
+
+        T* operator->() const noexcept
+        {
+            return block;
+        }
+
+        T& operator*() const noexcept
+        {
+            return *block;
+        }
+
+        explicit operator bool() const noexcept
+        {
+            return block != nullptr;
+        }
+
+    private:
+        friend class BlockPool;
+
+        Handle(BlockPool* pool, T* block) noexcept :
+            pool(pool),
+            block(block)
+        {
+        }
+
+        BlockPool* pool;
+        T* block;
+    };
+
+    BlockPool() :
+        head(0),
+        available(Num_Blocks)
+    {
+        for (uint16_t i = 0; i < Num_Blocks; ++i)
+        {
+            next[i].store(i + 1 < Num_Blocks ? i + 1 : Null_Idx, std::memory_order_relaxed);
+        }
+    }
+
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+
+    // NOTE- Every handle has to be gone before the pool is destroyed
+    ~BlockPool() = default;
+
+    // Constructs a T in a free block, the handle is empty when the pool is
+    // exhausted.
+    template <typename... Args>
+    Handle Acquire(Args&&... args)
+    {
+        const uint16_t idx = Pop();
+        if (idx == Null_Idx)
+        {
+            return Handle();
+        }
+
+        T* block = new (Block(idx)) T(std::forward<Args>(args)...);
+        return Handle(this, block);
+    }
+
+    uint16_t Available() const noexcept
+    {
+        return available.load(std::memory_order_relaxed);
+    }
+
+    static constexpr uint16_t Capacity() noexcept
+    {
+        return Num_Blocks;
+    }
+
+    static constexpr size_t BlockSize() noexcept
+    {
+        return sizeof(T);
+    }
+
+    bool Owns(const T* block) const noexcept
+    {
+        const auto* ptr = reinterpret_cast<const uint8_t*>(block);
+        return ptr >= storage && ptr < storage + sizeof(storage);
+    }
+
+private:
+    static constexpr uint16_t Null_Idx = 0xFFFF;
+
+    static constexpr uint32_t Pack(const uint16_t tag, const uint16_t idx)
+    {
+        return (static_cast<uint32_t>(tag) << 16) | idx;
+    }
+
+    void* Block(const uint16_t idx) noexcept
+    {
+        return storage + static_cast<size_t>(idx) * sizeof(T);
+    }
+
+    void Release(T* block) noexcept
+    {
+        const uint16_t idx = (reinterpret_cast<uint8_t*>(block) - storage) / sizeof(T);
+        block->~T();
+        Push(idx);
+    }
+
+    uint16_t Pop() noexcept
+    {
+        uint32_t old_head = head.load(std::memory_order_acquire);
+        while (true)
+        {
+            const uint16_t idx = old_head & 0xFFFF;
+            if (idx == Null_Idx)
+            {
+                return Null_Idx;
+            }
+
+            const uint32_t new_head =
+                Pack((old_head >> 16) + 1, next[idx].load(std::memory_order_relaxed));
+
+            if constexpr (Isr_Safe)
+            {
+                if (!head.compare_exchange_weak(old_head, new_head, std::memory_order_acq_rel,
+                                                std::memory_order_acquire))
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                head.store(new_head, std::memory_order_relaxed);
+            }
+
+            available.fetch_sub(1, std::memory_order_relaxed);
+            return idx;
+        }
+    }
+
+    void Push(const uint16_t idx) noexcept
+    {
+        uint32_t old_head = head.load(std::memory_order_acquire);
+        while (true)
+        {
+            next[idx].store(old_head & 0xFFFF, std::memory_order_relaxed);
+            const uint32_t new_head = Pack((old_head >> 16) + 1, idx);
+
+            if constexpr (Isr_Safe)
+            {
+                if (!head.compare_exchange_weak(old_head, new_head, std::memory_order_acq_rel,
+                                                std::memory_order_acquire))
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                head.store(new_head, std::memory_order_relaxed);
+            }
+
+            available.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    alignas(T) uint8_t storage[sizeof(T) * Num_Blocks];
+    std::atomic<uint16_t> next[Num_Blocks];
+    std::atomic<uint32_t> head; // tag << 16 | index of the first free block
+    std::atomic<uint16_t> available;
+};
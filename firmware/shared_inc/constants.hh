@@ -20,4 +20,8 @@ static constexpr uint16_t Total_Audio_Buffer_Sz =
 static constexpr uint16_t Audio_Buffer_Sz = Total_Audio_Buffer_Sz / 2;
 // Note- Expanded and Companded have the same amount of elements, but half the bytes
 static constexpr uint16_t Audio_Phonic_Sz = Stereo > 0 ? Audio_Buffer_Sz : Audio_Buffer_Sz / 2;
+// An ADPCM frame starts with the predictor and step index it was encoded from, so it decodes
+// on its own, then packs two 4 bit codes to the byte
+static constexpr uint16_t Adpcm_Header_Sz = 3;
+static constexpr uint16_t Audio_Adpcm_Sz = Adpcm_Header_Sz + Audio_Phonic_Sz / 2;
 } // namespace constants
\ No newline at end of file
@@ -77,6 +77,14 @@ struct link_packet_t
 } __attribute__((packed));
 
 static_assert(sizeof(link_packet_t) == link_packet_t::Packet_Size + sizeof(bool));
+
+// Largest payload a receiver accepts for a packet type, see
+// SerialHandler::SetTypeLimits
+struct link_type_limit_t
+{
+    uint16_t type;
+    uint16_t max_length;
+};
 static_assert(link_packet_t::Packet_Size == 650 /* sync + header + 640 value */);
 
 #endif
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+// Wire layouts of link messages, declared once from the members of the struct
+// that holds the decoded fields:
+//
+//   struct Chunk { MessageType type; uint8_t last_chunk; uint32_t chunk_length; };
+//   using ChunkSchema = link_schema::Message<&Chunk::type, &Chunk::last_chunk,
+//                                            &Chunk::chunk_length>;
+//
+// The fields go on the wire in the order given, with no padding between them.
+// Their offsets and the message size are worked out at compile time, so
+// writing or reading a message is one fixed size copy per field.
+//
+// Fields are copied in host order, which is little endian on every chip on
+// the link.
+namespace link_schema
+{
+
+static_assert(std::endian::native == std::endian::little);
+
+template <auto Member>
+struct MemberOf;
+
+template <typename C, typename T, T C::* Member>
+struct MemberOf<Member>
+{
+    using Class = C;
+    using Type = T;
+};
+
+template <auto First, auto...>
+struct Front : MemberOf<First>
+{
+};
+
+template <auto Member>
+struct Tag
+{
+};
+
+// Where Member is in Members
+template <auto Member, auto... Members>
+constexpr size_t IndexOf()
+{
+    static_assert((std::is_same_v<Tag<Member>, Tag<Members>> || ...),
+                  "not a field of this message");
+
+    constexpr std::array<bool, sizeof...(Members)> matches = {
+        std::is_same_v<Tag<Member>, Tag<Members>>...};
+
+    size_t index = 0;
+    while (!matches[index])
+    {
+        ++index;
+    }
+    return index;
+}
+
+template <auto... Members>
+class Message
+{
+public:
+    using Class = typename Front<Members...>::Class;
+
+    static_assert((std::is_same_v<Class, typename MemberOf<Members>::Class> && ...),
+                  "every field must be a member of the same struct");
+    static_assert((std::is_trivially_copyable_v<typename MemberOf<Members>::Type> && ...),
+                  "fields are copied as their bytes");
+
+    static constexpr size_t Num_Fields = sizeof...(Members);
+
+    template <auto Member>
+    using Type = typename MemberOf<Member>::Type;
+
+    // Sizes and offsets of the fields in order
+    static constexpr std::array<size_t, Num_Fields> Sizes = {sizeof(Type<Members>)...};
+
+    static constexpr std::array<size_t, Num_Fields> Offsets = []
+    {
+        std::array<size_t, Num_Fields> offsets{};
+        for (size_t i = 1; i < Num_Fields; ++i)
+        {
+            offsets[i] = offsets[i - 1] + Sizes[i - 1];
+        }
+        return offsets;
+    }();
+
+    template <auto Member>
+    static constexpr size_t Offset = Offsets[IndexOf<Member, Members...>()];
+
+    // Bytes the whole message takes on the wire
+    static constexpr size_t Size = (sizeof(Type<Members>) + ...);
+
+    // Writes every field into out, which needs Size bytes, and returns Size
+    static size_t Write(const Class& value, uint8_t* out)
+    {
+        WriteFields(value, out, std::make_index_sequence<Num_Fields>{});
+        return Size;
+    }
+
+    // Reads every field, false and nothing read when in is too short
+    static bool Read(std::span<const uint8_t> in, Class& value)
+    {
+        if (in.size() < Size)
+        {
+            return false;
+        }
+
+        ReadFields(in.data(), value, std::make_index_sequence<Num_Fields>{});
+        return true;
+    }
+
+    // One field of a message in, which needs Size bytes
+    template <auto Member>
+    static Type<Member> Get(const uint8_t* in)
+    {
+        Type<Member> field;
+        std::memcpy(&field, in + Offset<Member>, sizeof(field));
+        return field;
+    }
+
+    template <auto Member>
+    static void Set(uint8_t* out, const Type<Member>& field)
+    {
+        std::memcpy(out + Offset<Member>, &field, sizeof(field));
+    }
+
+private:
+    template <size_t... I>
+    static void WriteFields(const Class& value, uint8_t* out, std::index_sequence<I...>)
+    {
+        (std::memcpy(out + Offsets[I], &(value.*Members), Sizes[I]), ...);
+    }
+
+    template <size_t... I>
+    static void ReadFields(const uint8_t* in, Class& value, std::index_sequence<I...>)
+    {
+        (std::memcpy(&(value.*Members), in + Offsets[I], Sizes[I]), ...);
+    }
+};
+
+} // namespace link_schema
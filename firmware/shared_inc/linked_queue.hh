@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <utility>
+
 template <typename T>
 struct LinkedQueueItem
 {
@@ -107,4 +110,133 @@ private:
 
     LinkedQueueItem<T>* head;
     LinkedQueueItem<T>* tail;
-};
\ No newline at end of file
+};
+
+// Same queue with a fixed budget of nodes and no allocation after
+// construction, so it can be used on the audio path or from an ISR.
+//
+// The nodes live inline and are linked by index, unused nodes form a free
+// list so every operation is O(1). When all nodes are in use Enqueue returns
+// false and the overflow is counted.
+// NOTE- Like LinkedQueue this is not thread safe, only one context may use it.
+template <typename T, uint16_t Max_Nodes>
+class StaticLinkedQueue
+{
+    static_assert(Max_Nodes > 0 && Max_Nodes < 0xFFFF, "Node count must fit in the index");
+
+public:
+    StaticLinkedQueue() :
+        head(Null_Idx),
+        tail(Null_Idx),
+        free_head(0),
+        size(0),
+        overflows(0)
+    {
+        for (uint16_t i = 0; i < Max_Nodes; ++i)
+        {
+            nodes[i].next = i + 1 < Max_Nodes ? i + 1 : Null_Idx;
+        }
+    }
+
+    StaticLinkedQueue(const StaticLinkedQueue&) = delete;
+    StaticLinkedQueue& operator=(const StaticLinkedQueue&) = delete;
+
+    bool Enqueue(T data)
+    {
+        if (free_head == Null_Idx)
+        {
+            ++overflows;
+            return false;
+        }
+
+        const uint16_t idx = free_head;
+        free_head = nodes[idx].next;
+
+        nodes[idx].data = std::move(data);
+        nodes[idx].next = Null_Idx;
+
+        if (tail == Null_Idx)
+        {
+            head = idx;
+        }
+        else
+        {
+            nodes[tail].next = idx;
+        }
+        tail = idx;
+
+        ++size;
+        return true;
+    }
+
+    // The caller must check Empty() first
+    T& Front()
+    {
+        return nodes[head].data;
+    }
+
+    void Pop()
+    {
+        if (head == Null_Idx)
+            return;
+
+        const uint16_t idx = head;
+        head = nodes[idx].next;
+        if (head == Null_Idx)
+        {
+            tail = Null_Idx;
+        }
+
+        // Drop whatever the node owns now rather than when it is reused
+        nodes[idx].data = T();
+        nodes[idx].next = free_head;
+        free_head = idx;
+
+        --size;
+    }
+
+    bool Empty() const
+    {
+        return size == 0;
+    }
+
+    uint16_t Size() const
+    {
+        return size;
+    }
+
+    static constexpr uint16_t Capacity()
+    {
+        return Max_Nodes;
+    }
+
+    // Number of Enqueue calls that were rejected because every node was used
+    uint32_t Overflows() const
+    {
+        return overflows;
+    }
+
+    void Clear()
+    {
+        while (!Empty())
+        {
+            Pop();
+        }
+    }
+
+private:
+    static constexpr uint16_t Null_Idx = 0xFFFF;
+
+    struct Node
+    {
+        T data;
+        uint16_t next;
+    };
+
+    Node nodes[Max_Nodes];
+    uint16_t head;
+    uint16_t tail;
+    uint16_t free_head;
+    uint16_t size;
+    uint32_t overflows;
+};
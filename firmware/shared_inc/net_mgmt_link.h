@@ -31,6 +31,9 @@ enum struct CtlToNet : uint16_t
     SetUserId,
     GetUserName,
     SetUserName,
+    GetLinkStats,
+    GetAudioCodec,
+    SetAudioCodec,
 };
 
 // NET Chip Responses (NET to MGMT)
@@ -50,6 +53,8 @@ enum struct NetToCtl : uint16_t
     Blaster,
     UserId,
     UserName,
+    LinkStats,
+    AudioCodec,
 };
 
 enum struct NetLoopbackMode : uint8_t
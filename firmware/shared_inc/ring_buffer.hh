@@ -1,155 +1,249 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <span>
 #include <utility>
 
 #define DEFAULT_BUFFER_SIZE 32
 
+// Single producer, single consumer ring buffer.
+//
+// The producer is the only one that stores write_idx and the consumer is the
+// only one that stores read_idx, so an ISR or DMA callback can write while the
+// main loop or a task reads without any locking or interrupt masking.
+//
+// Both indices are free running and are masked on access, so the size is
+// always rounded up to a power of two. Unread() is just the difference of the
+// two indices, which is why the size is capped at half the index range.
+//
+// The span functions hand out the largest contiguous region that can be
+// written or read in place, which lets memcpy, DMA and driver reads work
+// straight into the ring and then commit however many elements they used.
 template <typename T>
 class RingBuffer
 {
 public:
-    // TODO constructor that takes a bucket space of type T
+    static constexpr uint16_t Max_Size = 0x8000;
+
     RingBuffer(const uint16_t size = DEFAULT_BUFFER_SIZE) :
-        size(size),
+        size(RoundUpPow2(size)),
+        mask(this->size - 1),
         read_idx(0),
         write_idx(0),
-        buffer(nullptr),
-        busy(false)
+        buffer(new T[this->size]{}),
+        owns_buffer(true)
     {
-        // Don't allow a zero for buffer size
-        if (this->size == 0)
-        {
-            this->size = 1;
-        }
+    }
 
-        buffer = new T[this->size]{};
+    // Uses the given storage instead of allocating, when the storage is not a
+    // power of two only the largest power of two that fits is used.
+    RingBuffer(T* storage, const uint32_t storage_size) :
+        size(RoundDownPow2(storage_size)),
+        mask(this->size - 1),
+        read_idx(0),
+        write_idx(0),
+        buffer(storage),
+        owns_buffer(false)
+    {
     }
 
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
     ~RingBuffer()
     {
-        delete[] buffer;
+        if (owns_buffer)
+        {
+            delete[] buffer;
+        }
     }
 
+    // Producer, claims the next slot and publishes it immediately.
+    // NOTE- Does not check for space, when the ring is full the oldest slot is
+    // handed out again. Only use this when the slots carry their own ready
+    // flag.
     T& Write() noexcept
     {
-        BusySet();
-        if (write_idx >= size)
+        const uint16_t idx = write_idx.load(std::memory_order_relaxed);
+        T& out = buffer[idx & mask];
+        write_idx.store(idx + 1, std::memory_order_release);
+        return out;
+    }
+
+    // Producer, returns false and drops the value when the ring is full.
+    bool Write(T d_in) noexcept
+    {
+        const uint16_t idx = write_idx.load(std::memory_order_relaxed);
+        if (static_cast<uint16_t>(idx - read_idx.load(std::memory_order_acquire)) >= size)
         {
-            write_idx = 0;
+            return false;
         }
 
-        T& out = buffer[write_idx++];
-
-        BusyReset();
-        return out;
+        buffer[idx & mask] = std::move(d_in);
+        write_idx.store(idx + 1, std::memory_order_release);
+        return true;
     }
 
-    void Write(T d_in) noexcept
+    // Producer, copies as many of the values as fit and returns the count.
+    uint16_t Write(const T* input, const uint16_t count)
     {
-        BusySet();
-        buffer[write_idx++] = std::move(d_in);
+        const uint16_t free = Free();
+        const uint16_t num = count < free ? count : free;
 
-        if (write_idx >= size)
-            write_idx = 0;
+        uint16_t copied = 0;
+        while (copied < num)
+        {
+            std::span<T> space = WriteableSpan(copied);
+            const uint16_t chunk = std::min<uint16_t>(space.size(), num - copied);
+            std::copy(input + copied, input + copied + chunk, space.data());
+            copied += chunk;
+        }
 
-        BusyReset();
+        CommitWrite(num);
+        return num;
     }
 
-    void Write(T* input, const uint16_t count)
+    // Producer, the largest contiguous free region starting offset elements
+    // past the write index. Nothing is visible to the consumer until it is
+    // committed, so a producer can fill several regions then commit once.
+    std::span<T> WriteableSpan(const uint16_t offset = 0) noexcept
     {
-        BusySet();
-
-        size_t input_off = 0;
-
-        // Buffer is nearly full so we need to wrap around to the front
-        if (write_idx + count >= size)
+        const uint16_t free = Free();
+        if (offset >= free)
         {
-            const uint16_t write_space = size - write_idx;
-            const uint16_t remaining = write_space < count ? write_space : count;
+            return {};
+        }
 
-            while (input_off < remaining)
-            {
-                buffer[write_idx++] = std::move(input[input_off++]);
-            }
+        const uint16_t start = (write_idx.load(std::memory_order_relaxed) + offset) & mask;
+        const uint16_t to_end = size - start;
+        const uint16_t len = free - offset;
+        return {buffer + start, static_cast<size_t>(len < to_end ? len : to_end)};
+    }
 
-            write_idx = 0;
-        }
+    // Producer, publishes count elements written through WriteableSpan.
+    // NOTE- A DMA producer that does not wait for space can commit past the
+    // read index, in that case the unread data has already been overwritten.
+    void CommitWrite(const uint16_t count) noexcept
+    {
+        const uint16_t idx = write_idx.load(std::memory_order_relaxed);
+        write_idx.store(idx + count, std::memory_order_release);
+    }
 
-        for (uint16_t i = input_off; i < count; ++i)
+    // Consumer, the largest contiguous readable region starting offset
+    // elements past the read index.
+    std::span<T> ReadableSpan(const uint16_t offset = 0) noexcept
+    {
+        const uint16_t unread = Unread();
+        if (offset >= unread)
         {
-            buffer[write_idx++] = std::move(input[i]);
+            return {};
         }
 
-        BusyReset();
+        const uint16_t start = (read_idx.load(std::memory_order_relaxed) + offset) & mask;
+        const uint16_t to_end = size - start;
+        const uint16_t len = unread - offset;
+        return {buffer + start, static_cast<size_t>(len < to_end ? len : to_end)};
     }
 
-    T Take() noexcept
+    // Consumer, releases count elements back to the producer.
+    void CommitRead(const uint16_t count) noexcept
     {
-        BusySet();
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        read_idx.store(idx + count, std::memory_order_release);
+    }
 
-        T d_out = std::move(buffer[read_idx++]);
+    // Consumer, moves as many values as are available into output and returns
+    // the count.
+    uint16_t Read(T* output, const uint16_t count)
+    {
+        const uint16_t unread = Unread();
+        const uint16_t num = count < unread ? count : unread;
 
-        if (read_idx >= size)
+        uint16_t copied = 0;
+        while (copied < num)
         {
-            read_idx = 0;
+            std::span<T> data = ReadableSpan(copied);
+            const uint16_t chunk = std::min<uint16_t>(data.size(), num - copied);
+            std::move(data.data(), data.data() + chunk, output + copied);
+            copied += chunk;
         }
 
-        BusyReset();
-        return d_out;
+        CommitRead(num);
+        return num;
     }
 
-    T& Read() noexcept
+    // Consumer, returns false when there is nothing to read.
+    bool TryRead(T& d_out) noexcept
     {
-        BusySet();
-
-        T& d_out = buffer[read_idx++];
-
-        if (read_idx >= size)
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        if (idx == write_idx.load(std::memory_order_acquire))
         {
-            read_idx = 0;
+            return false;
         }
 
-        BusyReset();
-        return d_out;
+        d_out = std::move(buffer[idx & mask]);
+        read_idx.store(idx + 1, std::memory_order_release);
+        return true;
     }
 
-    void Read(T& d_out, bool& is_end)
+    // Consumer, the caller must check Unread() first.
+    T Take() noexcept
     {
-        BusySet();
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        T d_out = std::move(buffer[idx & mask]);
+        read_idx.store(idx + 1, std::memory_order_release);
+        return d_out;
+    }
 
-        d_out = buffer[read_idx++];
+    // Consumer, the caller must check Unread() first.
+    T& Read() noexcept
+    {
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        T& d_out = buffer[idx & mask];
+        read_idx.store(idx + 1, std::memory_order_release);
+        return d_out;
+    }
 
-        if (read_idx >= size)
-        {
-            read_idx = 0;
-        }
+    void Read(T& d_out, bool& is_end)
+    {
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        d_out = buffer[idx & mask];
+        read_idx.store(idx + 1, std::memory_order_release);
 
-        is_end = read_idx == write_idx;
-        BusyReset();
+        is_end = static_cast<uint16_t>(idx + 1) == write_idx.load(std::memory_order_acquire);
     }
 
     const T& Peek() const
     {
-        return buffer[read_idx];
+        return buffer[read_idx.load(std::memory_order_relaxed) & mask];
     }
 
     uint16_t Unread() const
     {
-        if (write_idx >= read_idx)
-        {
-            return write_idx - read_idx;
-        }
-        else
-        {
-            return size - read_idx + write_idx;
-        }
+        return write_idx.load(std::memory_order_acquire)
+             - read_idx.load(std::memory_order_acquire);
+    }
+
+    uint16_t Free() const
+    {
+        const uint16_t unread = Unread();
+        return unread < size ? size - unread : 0;
     }
 
     bool IsFull() const
     {
-        return size == Unread();
+        return Unread() >= size;
+    }
+
+    // Drops everything, only safe while neither side is running, e.g. when
+    // the receiving DMA has been stopped.
+    void Reset() noexcept
+    {
+        read_idx.store(0, std::memory_order_relaxed);
+        write_idx.store(0, std::memory_order_release);
     }
 
     T* Buffer()
@@ -159,7 +253,12 @@ public:
 
     uint16_t WriteIdx() const
     {
-        return write_idx;
+        return write_idx.load(std::memory_order_relaxed) & mask;
+    }
+
+    uint16_t ReadIdx() const
+    {
+        return read_idx.load(std::memory_order_relaxed) & mask;
     }
 
     inline uint16_t Size() const
@@ -168,25 +267,30 @@ public:
     }
 
 private:
-    inline void BusySet()
+    static constexpr uint16_t RoundUpPow2(const uint16_t size)
     {
-        if (busy)
+        uint16_t pow2 = 1;
+        while (pow2 < size && pow2 < Max_Size)
         {
-            while (true)
-            {
-            }
+            pow2 <<= 1;
         }
-        busy = true;
+        return pow2;
     }
 
-    inline void BusyReset()
+    static constexpr uint16_t RoundDownPow2(const uint32_t size)
     {
-        busy = false;
+        uint16_t pow2 = 1;
+        while (static_cast<uint32_t>(pow2) * 2 <= size && pow2 < Max_Size)
+        {
+            pow2 <<= 1;
+        }
+        return pow2;
     }
 
-    uint16_t size;
-    uint16_t read_idx;  // start
-    uint16_t write_idx; // end
+    const uint16_t size;
+    const uint16_t mask;
+    std::atomic<uint16_t> read_idx;  // start, only stored by the consumer
+    std::atomic<uint16_t> write_idx; // end, only stored by the producer
     T* buffer;
-    bool busy;
-};
\ No newline at end of file
+    const bool owns_buffer;
+};
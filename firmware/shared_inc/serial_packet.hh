@@ -1,5 +1,12 @@
 #pragma once
-#include <utility>
+
+#include <stdint.h>
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
 // TODO function for is network, or is debug
 // TODO Make a inherited class that generally knows the data and type positions
 // TODO flip a bit in type to determine if the message is main or net?
@@ -36,10 +43,19 @@ creation_time = 6 bytes
 
 // TODO move all other enum classes into appropriate classes
 
-// @note This is assumed to be little endian architectures
+// Builds a packet a field at a time. Packets up to Inline_Capacity bytes
+// live in the object itself, only a bigger one takes memory from the heap,
+// once for its requested capacity or as it doubles when dynamic. Multi byte
+// fields are little endian on the wire whatever the host is, and are copied
+// in one go rather than a byte at a time.
+//
+// Bytes past NumBytes up to the capacity are always zero, so a copy only has
+// to copy the bytes that are used.
 class SerialPacket
 {
 public:
+    static constexpr unsigned int Inline_Capacity = 128;
+
     enum class Types
     {
         LocalDebug = 1,
@@ -96,90 +112,89 @@ public:
                  const unsigned int capacity = 1,
                  const bool dynamic = true) :
         created_at(created_at),
-        capacity(capacity),
+        capacity(std::max(capacity, 1u)),
         dynamic(dynamic),
         size(0),
         retries(0),
-        data(new unsigned char[capacity]{0})
+        data(Allocate(this->capacity))
     {
+        std::memset(data, 0, this->capacity);
     }
 
-    // Copy
     SerialPacket(const SerialPacket& other) :
         created_at(other.created_at),
         capacity(other.capacity),
         dynamic(other.dynamic),
         size(other.size),
         retries(other.retries),
-        data(new unsigned char[capacity]{0})
+        data(Allocate(capacity))
     {
-        for (unsigned int i = 0; i < capacity; ++i)
-        {
-            data[i] = other.data[i];
-        }
+        CopyBytes(other);
     }
 
-    // Move
+    // A packet on the heap hands its memory over, an inline one copies its
+    // used bytes
     SerialPacket(SerialPacket&& other) noexcept :
         created_at(other.created_at),
         capacity(other.capacity),
         dynamic(other.dynamic),
         size(other.size),
         retries(other.retries),
-        data(other.data)
-    {
-        other.created_at = 0;
-        other.capacity = 0;
-        other.dynamic = 0;
-        other.size = 0;
-        other.retries = 0;
-        other.data = nullptr;
+        data(other.IsInline() ? inline_data : other.data)
+    {
+        if (IsInline())
+        {
+            CopyBytes(other);
+        }
+        other.Reset();
     }
 
     ~SerialPacket()
     {
-        delete[] data;
+        Free();
     }
 
     SerialPacket& operator=(const SerialPacket& other)
     {
-        if (data)
+        if (this == &other)
         {
-            delete[] data;
+            return *this;
         }
-        created_at = other.created_at;
-        capacity = other.capacity;
-        size = other.size;
-        dynamic = other.dynamic;
-        retries = other.retries;
 
-        data = new unsigned char[capacity];
-
-        // Copy over the the data
-        for (unsigned int i = 0; i < capacity; i++)
+        if (capacity != other.capacity)
         {
-            data[i] = other.data[i];
+            Free();
+            data = Allocate(other.capacity);
         }
 
+        created_at = other.created_at;
+        capacity = other.capacity;
+        dynamic = other.dynamic;
+        size = other.size;
+        retries = other.retries;
+        CopyBytes(other);
         return *this;
     }
 
-    SerialPacket& operator=(SerialPacket&& other)
+    SerialPacket& operator=(SerialPacket&& other) noexcept
     {
-        // Move operator
-        if (data)
+        if (this == &other)
         {
-            delete[] data;
+            return *this;
         }
 
+        Free();
         created_at = other.created_at;
         capacity = other.capacity;
-        size = other.size;
         dynamic = other.dynamic;
+        size = other.size;
         retries = other.retries;
-
-        data = other.data;
-        other.data = nullptr;
+        data = other.IsInline() ? inline_data : other.data;
+        if (IsInline())
+        {
+            CopyBytes(other);
+        }
+        other.Reset();
         return *this;
     }
 
@@ -188,27 +203,17 @@ public:
         return data[idx];
     }
 
-    // template<typename T, bool = std::is_arithmetic<T>::value>
-    // inline void SetData(const T val)
-    // {
-    //     UpdateData(val, size, -1);
-    // }
-
-    template <typename T, bool = std::is_arithmetic<T>::value>
-    inline void SetData(const T val, unsigned int num_bytes)
+    // Appends the low num_bytes of val
+    template <typename T>
+    void SetData(const T val, const unsigned int num_bytes)
     {
         UpdateData(val, size, num_bytes);
     }
 
-    template <typename T, bool = std::is_arithmetic<T>::value>
-    inline void SetData(const T val, unsigned int offset, const int num_bytes)
-    {
-        UpdateData(val, offset, num_bytes);
-    }
-
-    template <typename T, typename K, bool = std::is_integral<K>::value>
-    typename std::enable_if<!std::is_lvalue_reference<K>::value, void>::type
-    SetData(const T val, K offset, const int num_bytes)
+    // Writes the low num_bytes of val at offset, all of it when num_bytes is
+    // not positive
+    template <typename T>
+    void SetData(const T val, const unsigned int offset, const int num_bytes)
     {
         UpdateData(val, offset, num_bytes);
     }
@@ -221,58 +226,74 @@ public:
     void
     SetData(const T* val, const unsigned int sz, unsigned int& offset, const unsigned int num_bytes)
     {
+        // Whole elements in host order are already the wire bytes
+        if (std::endian::native == std::endian::little && num_bytes == sizeof(T))
+        {
+            offset += SetBytes(reinterpret_cast<const unsigned char*>(val), sz * num_bytes, offset);
+            return;
+        }
+
         for (unsigned int i = 0; i < sz; ++i)
         {
             offset += UpdateData(val[i], offset, num_bytes);
         }
     }
 
-    template <typename T, typename std::enable_if<std::is_fundamental<T>::value, T>::type = 0>
-    T GetData(const unsigned int offset, const int num_bytes) const
+    // Copies len bytes in at offset, returns how many were written, none when
+    // they do not fit in a packet that cannot grow
+    unsigned int
+    SetBytes(const unsigned char* bytes, const unsigned int len, const unsigned int offset)
     {
-        size_t byte_width = sizeof(T);
-        if (num_bytes > 0)
+        if (!Reserve(offset + len))
         {
-            byte_width = num_bytes;
+            return 0;
         }
 
-        T output = 0;
-        GetData(output, offset, byte_width);
+        std::memcpy(data + offset, bytes, len);
+        size = std::max(size, offset + len);
+        return len;
+    }
 
+    // Copies up to len bytes out from offset, the bytes past the capacity
+    // read as zero
+    void GetBytes(unsigned char* out, const unsigned int len, const unsigned int offset) const
+    {
+        const unsigned int num = offset < capacity ? std::min(len, capacity - offset) : 0;
+        std::memcpy(out, data + offset, num);
+        std::memset(out + num, 0, len - num);
+    }
+
+    template <typename T, typename std::enable_if<std::is_fundamental<T>::value, T>::type = 0>
+    T GetData(const unsigned int offset, const int num_bytes) const
+    {
+        T output = 0;
+        GetData(output, offset, num_bytes);
         return output;
     }
 
+    // Reads num_bytes little endian bytes into the low bytes of output, all
+    // of it when num_bytes is not positive
     template <typename T>
     void GetData(T& output, const unsigned int offset, const int num_bytes) const
     {
-        output = 0;
+        static_assert(std::is_trivially_copyable<T>::value);
 
-        size_t byte_width = sizeof(output);
-        if (num_bytes > 0)
+        unsigned char bytes[sizeof(T)] = {};
+        const unsigned int width = Width<T>(num_bytes);
+        if (width == sizeof(T) && offset + sizeof(T) <= capacity)
         {
-            byte_width = num_bytes;
+            // A whole field is a copy the compiler knows the size of
+            std::memcpy(bytes, data + offset, sizeof(T));
         }
-
-        unsigned char* output_ptr = (unsigned char*)(void*)&output;
-        unsigned char* data_ptr = data + offset;
-
-        for (unsigned int i = 0; i < byte_width && i < capacity; ++i)
+        else
         {
-            *output_ptr = *data_ptr;
-            output_ptr++;
-            data_ptr++;
+            GetBytes(bytes, width, offset);
         }
-    }
-
-    unsigned char* Buffer() const
-    {
-        unsigned char* buffer = new unsigned char[capacity];
-
-        for (unsigned int i = 0; i < capacity; ++i)
+        if constexpr (std::endian::native == std::endian::big)
         {
-            buffer[i] = data[i];
+            std::reverse(bytes, bytes + sizeof(T));
         }
-        return buffer;
+        std::memcpy(&output, bytes, sizeof(T));
     }
 
     unsigned char* Data() const
@@ -280,25 +301,33 @@ public:
         return data;
     }
 
+    // Grows or shrinks the packet, keeping the bytes that still fit
     void SetCapacity(unsigned int new_capacity)
     {
-        if (new_capacity == 0)
-            new_capacity = 1;
+        new_capacity = std::max(new_capacity, 1u);
+        if (new_capacity == capacity)
+        {
+            return;
+        }
 
-        // Make new data
-        unsigned char* new_data = new unsigned char[new_capacity]{0};
+        unsigned char* new_data = IsInline() && new_capacity <= Inline_Capacity
+                                    ? inline_data
+                                    : Allocate(new_capacity);
+        const unsigned int kept = std::min(capacity, new_capacity);
+        if (new_data != data)
+        {
+            std::memcpy(new_data, data, kept);
+            Free();
+        }
 
-        // Copy the data
-        unsigned int iter = 0;
-        while (iter < new_capacity && iter < capacity)
+        if (new_capacity > kept)
         {
-            new_data[iter] = data[iter];
-            iter++;
+            std::memset(new_data + kept, 0, new_capacity - kept);
         }
 
-        delete[] data;
         data = new_data;
         capacity = new_capacity;
+        size = std::min(size, capacity);
     }
 
     unsigned int Capacity() const
@@ -338,51 +367,94 @@ public:
 
 protected:
     template <typename T>
-    unsigned int inline UpdateData(const T val, unsigned int offset, const int num_bytes)
+    static unsigned int Width(const int num_bytes)
+    {
+        return num_bytes > 0 ? std::min<unsigned int>(num_bytes, sizeof(T)) : sizeof(T);
+    }
+
+    template <typename T>
+    unsigned int UpdateData(const T val, const unsigned int offset, const int num_bytes)
     {
-        unsigned int in_sz = sizeof(T);
-        if (num_bytes > 0)
+        static_assert(std::is_trivially_copyable<T>::value);
+
+        unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, &val, sizeof(T));
+        if constexpr (std::endian::native == std::endian::big)
         {
-            in_sz = num_bytes;
+            std::reverse(bytes, bytes + sizeof(T));
         }
 
-        if (offset + in_sz > capacity)
+        const unsigned int width = Width<T>(num_bytes);
+        if (width == sizeof(T) && offset + sizeof(T) <= capacity)
         {
-            // Resize
-            if (!dynamic)
-                return 0;
-            while (offset + in_sz >= capacity)
-            {
-                // Double the size lazily
-                DoubleCapacity();
-            }
+            std::memcpy(data + offset, bytes, sizeof(T));
+            size = std::max<unsigned int>(size, offset + sizeof(T));
+            return sizeof(T);
         }
+        return SetBytes(bytes, width, offset);
+    }
 
-        unsigned char* input_ptr = (unsigned char*)(void*)&val;
-        unsigned char* data_ptr = data + offset;
-        for (unsigned int i = 0; i < in_sz && i < capacity; ++i)
+    // Makes room for needed bytes, doubling a dynamic packet
+    bool Reserve(const unsigned int needed)
+    {
+        if (needed <= capacity)
+        {
+            return true;
+        }
+
+        if (!dynamic)
+        {
+            return false;
+        }
+
+        unsigned int new_capacity = capacity;
+        while (new_capacity < needed)
         {
-            *data_ptr = *input_ptr;
-            data_ptr++;
-            input_ptr++;
+            new_capacity *= 2;
         }
+        SetCapacity(new_capacity);
+        return true;
+    }
+
+    unsigned char* Allocate(const unsigned int bytes)
+    {
+        return bytes <= Inline_Capacity ? inline_data : new unsigned char[bytes];
+    }
 
-        // Only update the size if the offset bytes are greater than
-        // the current size. 3 Scenarios
-        // 1. You set a byte where: offset + 1 > size
-        // 2. You set a byte where: offset + 1 <= size and nothing happens
-        // 3. Append data where size + 1 > size
-        if (offset + num_bytes > size)
+    void Free()
+    {
+        if (!IsInline())
         {
-            size = offset + num_bytes;
+            delete[] data;
         }
+        data = inline_data;
+    }
+
+    bool IsInline() const
+    {
+        return data == inline_data;
+    }
 
-        return in_sz;
+    // The used bytes of other, and zeros for the rest of the capacity
+    void CopyBytes(const SerialPacket& other)
+    {
+        std::memcpy(data, other.data, size);
+        std::memset(data + size, 0, capacity - size);
     }
 
-    void inline DoubleCapacity()
+    // Leaves a moved from packet empty and inline
+    void Reset()
     {
-        SetCapacity(capacity * 2);
+        if (!IsInline())
+        {
+            data = inline_data;
+        }
+        created_at = 0;
+        capacity = 1;
+        dynamic = true;
+        size = 0;
+        retries = 0;
+        inline_data[0] = 0;
     }
 
     // TODO rename created_at
@@ -392,4 +464,5 @@ protected:
     unsigned int size; // last byte used
     unsigned int retries;
     unsigned char* data;
-};
\ No newline at end of file
+    unsigned char inline_data[Inline_Capacity];
+};
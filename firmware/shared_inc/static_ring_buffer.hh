@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <span>
+#include <utility>
+
+// Single producer, single consumer ring buffer with the capacity fixed at
+// compile time.
+//
+// Same index scheme as RingBuffer, but the storage is inline so the whole ring
+// can be a global in .bss or placed in a specific section, and the mask is a
+// constant so the compiler can fold the index math. Use RingBuffer when the
+// size is only known at runtime.
+template <typename T, uint16_t N>
+class StaticRingBuffer
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity must be a power of two");
+    static_assert(N <= 0x8000, "Capacity must be at most half the index range");
+
+public:
+    static constexpr uint16_t Capacity = N;
+
+    StaticRingBuffer() :
+        read_idx(0),
+        write_idx(0),
+        buffer{}
+    {
+    }
+
+    StaticRingBuffer(const StaticRingBuffer&) = delete;
+    StaticRingBuffer& operator=(const StaticRingBuffer&) = delete;
+
+    // Producer, returns false and drops the value when the ring is full.
+    bool Write(T d_in) noexcept
+    {
+        const uint16_t idx = write_idx.load(std::memory_order_relaxed);
+        if (static_cast<uint16_t>(idx - read_idx.load(std::memory_order_acquire)) >= N)
+        {
+            return false;
+        }
+
+        buffer[idx & Mask] = std::move(d_in);
+        write_idx.store(idx + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer, copies as many of the values as fit and returns the count.
+    uint16_t Write(const T* input, const uint16_t count)
+    {
+        const uint16_t free = Free();
+        const uint16_t num = count < free ? count : free;
+
+        uint16_t copied = 0;
+        while (copied < num)
+        {
+            std::span<T> space = WriteableSpan(copied);
+            const uint16_t chunk = std::min<uint16_t>(space.size(), num - copied);
+            std::copy(input + copied, input + copied + chunk, space.data());
+            copied += chunk;
+        }
+
+        CommitWrite(num);
+        return num;
+    }
+
+    // Producer, the largest contiguous free region starting offset elements
+    // past the write index.
+    std::span<T> WriteableSpan(const uint16_t offset = 0) noexcept
+    {
+        const uint16_t free = Free();
+        if (offset >= free)
+        {
+            return {};
+        }
+
+        const uint16_t start = (write_idx.load(std::memory_order_relaxed) + offset) & Mask;
+        const uint16_t to_end = N - start;
+        const uint16_t len = free - offset;
+        return {buffer + start, static_cast<size_t>(len < to_end ? len : to_end)};
+    }
+
+    void CommitWrite(const uint16_t count) noexcept
+    {
+        const uint16_t idx = write_idx.load(std::memory_order_relaxed);
+        write_idx.store(idx + count, std::memory_order_release);
+    }
+
+    // Consumer, the largest contiguous readable region starting offset
+    // elements past the read index.
+    std::span<T> ReadableSpan(const uint16_t offset = 0) noexcept
+    {
+        const uint16_t unread = Unread();
+        if (offset >= unread)
+        {
+            return {};
+        }
+
+        const uint16_t start = (read_idx.load(std::memory_order_relaxed) + offset) & Mask;
+        const uint16_t to_end = N - start;
+        const uint16_t len = unread - offset;
+        return {buffer + start, static_cast<size_t>(len < to_end ? len : to_end)};
+    }
+
+    void CommitRead(const uint16_t count) noexcept
+    {
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        read_idx.store(idx + count, std::memory_order_release);
+    }
+
+    // Consumer, returns false when there is nothing to read.
+    bool TryRead(T& d_out) noexcept
+    {
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        if (idx == write_idx.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        d_out = std::move(buffer[idx & Mask]);
+        read_idx.store(idx + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer, moves the oldest value out so the slot does not keep holding
+    // on to whatever it owns. The caller must check Unread() first.
+    T Take() noexcept
+    {
+        const uint16_t idx = read_idx.load(std::memory_order_relaxed);
+        T d_out = std::move(buffer[idx & Mask]);
+        read_idx.store(idx + 1, std::memory_order_release);
+        return d_out;
+    }
+
+    // Consumer, the caller must check Unread() first.
+    T& Peek() noexcept
+    {
+        return buffer[read_idx.load(std::memory_order_relaxed) & Mask];
+    }
+
+    uint16_t Unread() const noexcept
+    {
+        return write_idx.load(std::memory_order_acquire)
+             - read_idx.load(std::memory_order_acquire);
+    }
+
+    uint16_t Free() const noexcept
+    {
+        const uint16_t unread = Unread();
+        return unread < N ? N - unread : 0;
+    }
+
+    bool IsFull() const noexcept
+    {
+        return Unread() >= N;
+    }
+
+    // Drops everything, only safe while neither side is running.
+    void Reset() noexcept
+    {
+        read_idx.store(0, std::memory_order_relaxed);
+        write_idx.store(0, std::memory_order_release);
+    }
+
+    T* Buffer() noexcept
+    {
+        return buffer;
+    }
+
+    static constexpr uint16_t Size() noexcept
+    {
+        return N;
+    }
+
+private:
+    static constexpr uint16_t Mask = N - 1;
+
+    std::atomic<uint16_t> read_idx;  // start, only stored by the consumer
+    std::atomic<uint16_t> write_idx; // end, only stored by the producer
+    T buffer[N];
+};
@@ -1,77 +1,176 @@
 #pragma once
 
-template <typename T>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+// N buffers in one contiguous block that are handed between a producer and a
+// consumer without copying.
+//
+// The producer always moves round robin through the buffers, which matches a
+// circular DMA working through halves (or thirds) of one block, so Data() can
+// be handed straight to the DMA. Each buffer is in one of four states and only
+// the side that owns it touches the contents:
+//
+//   Free -> Producing -> Ready -> Consuming -> Free
+//
+// The producer never waits. When it moves onto a buffer that is still Ready
+// the frame was never consumed and is counted as an overrun, when it moves
+// onto a buffer that is still Consuming the consumer is late and it is
+// counted as such. Either way the producer takes the buffer back.
+//
+// For I2S both directions follow the same rotation: the DMA owns the half it
+// is transferring and the main loop owns the other one, whether it is reading
+// the mic samples out or writing the speaker samples in.
+template <typename T, uint16_t Num_Buffs, size_t Buffer_Size>
 class SwappingBuffer
 {
+    static_assert(Num_Buffs >= 2, "Swapping needs at least two buffers");
+
 public:
-    struct swap_buffer_t
+    enum class State : uint8_t
     {
-        bool is_ready;
-        size_t len;
-        T* data;
+        Free = 0,
+        Producing,
+        Ready,
+        Consuming
     };
 
-    SwappingBuffer(const size_t num_buffs, const size_t buffer_size) :
-        num_buffs(num_buffs),
-        buffer_size(buffer_size),
-        dual_buffers{swap_buffer_t{0, 0, new T[buffer_size]},
-                     swap_buffer_t{0, 0, new T[buffer_size]}},
-        back_buff(&dual_buffers[0]),
-        front_buff(&dual_buffers[1])
+    SwappingBuffer() :
+        data{},
+        states{},
+        produce_idx(Num_Buffs - 1),
+        consume_idx(0),
+        overruns(0),
+        late_consumers(0)
+    {
+    }
+
+    SwappingBuffer(const SwappingBuffer&) = delete;
+    SwappingBuffer& operator=(const SwappingBuffer&) = delete;
+
+    // Producer, takes the next buffer in the rotation.
+    T* AcquireWrite()
+    {
+        produce_idx = produce_idx + 1 < Num_Buffs ? produce_idx + 1 : 0;
+
+        switch (states[produce_idx].exchange(State::Producing, std::memory_order_acq_rel))
+        {
+        case State::Ready:
+            overruns.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case State::Consuming:
+            late_consumers.fetch_add(1, std::memory_order_relaxed);
+            break;
+        default:
+            break;
+        }
+
+        return Buffer(produce_idx);
+    }
+
+    // Producer, hands the buffer being produced to the consumer.
+    void Publish()
     {
+        states[produce_idx].store(State::Ready, std::memory_order_release);
     }
 
-    ~SwappingBuffer()
+    // Producer, publishes the current buffer and takes the next one, which is
+    // what a DMA half or full transfer callback does.
+    T* Rotate()
     {
-        back_buff = nullptr;
-        front_buff = nullptr;
-        delete[] dual_buffers[0].data;
-        delete[] dual_buffers[1].data;
+        Publish();
+        return AcquireWrite();
     }
 
-    bool Write(T* data, const size_t count, const bool is_ready)
+    // Producer, copies a full frame into the next buffer and publishes it.
+    bool Write(const T* src, const size_t count)
     {
-        if (count > buffer_size)
+        if (count > Buffer_Size)
         {
             return false;
         }
 
+        std::copy(src, src + count, AcquireWrite());
+        Publish();
         return true;
     }
 
-    swap_buffer_t* Swap()
+    // Producer, the buffer currently being produced.
+    T* Producing()
+    {
+        return Buffer(produce_idx);
+    }
+
+    // Consumer, takes the oldest ready buffer or returns nullptr when there
+    // is none.
+    T* AcquireRead()
+    {
+        for (uint16_t i = 0; i < Num_Buffs; ++i)
+        {
+            const uint16_t idx = (consume_idx + i) % Num_Buffs;
+
+            State expected = State::Ready;
+            if (states[idx].compare_exchange_strong(expected, State::Consuming,
+                                                    std::memory_order_acq_rel))
+            {
+                consume_idx = idx;
+                return Buffer(idx);
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Consumer, gives the buffer from AcquireRead back. If the producer has
+    // already taken it back the buffer is left alone.
+    void Release()
     {
-        swap_buffer_t* tmp = back_buff;
-        back_buff = front_buff;
-        front_buff = tmp;
+        State expected = State::Consuming;
+        states[consume_idx].compare_exchange_strong(expected, State::Free,
+                                                    std::memory_order_acq_rel);
+        consume_idx = consume_idx + 1 < Num_Buffs ? consume_idx + 1 : 0;
+    }
 
-        return front_buff;
+    // The whole block, for handing to a circular DMA.
+    T* Data()
+    {
+        return data;
     }
 
-    swap_buffer_t* GetFront()
+    static constexpr size_t BufferSize()
     {
-        return front_buff;
+        return Buffer_Size;
     }
 
-    swap_buffer_t* GetBack()
+    static constexpr size_t TotalSize()
     {
-        return back_buff;
+        return Buffer_Size * Num_Buffs;
     }
 
-    bool BackIsReady() const
+    // Frames the producer overwrote before they were consumed
+    uint32_t Overruns() const
     {
-        return back_buff->is_ready;
+        return overruns.load(std::memory_order_relaxed);
     }
 
-    size_t BufferSize() const
+    // Times the producer took a buffer back while it was still being consumed
+    uint32_t LateConsumers() const
     {
-        return buffer_size;
+        return late_consumers.load(std::memory_order_relaxed);
     }
 
 private:
-    size_t num_buffs;
-    size_t buffer_size;
-    swap_buffer_t dual_buffers[2];
-    swap_buffer_t* back_buff;
-    swap_buffer_t* front_buff;
-};
\ No newline at end of file
+    T* Buffer(const uint16_t idx)
+    {
+        return data + idx * Buffer_Size;
+    }
+
+    T data[Num_Buffs * Buffer_Size];
+    std::atomic<State> states[Num_Buffs];
+    uint16_t produce_idx; // only touched by the producer
+    uint16_t consume_idx; // only touched by the consumer
+    std::atomic<uint32_t> overruns;
+    std::atomic<uint32_t> late_consumers;
+};
@@ -29,7 +29,12 @@ enum class CtlToUi : uint16_t
     SetAudioReceiveMode,
     AudioFrame,
     AudioStart,
-    AudioEnd
+    AudioEnd,
+    GetLinkStats,
+    SetLatencyPing,
+    GetLatency,
+    GetAudioCodec,
+    SetAudioCodec,
 };
 
 enum class UiToCtl : uint16_t
@@ -52,6 +57,9 @@ enum class UiToCtl : uint16_t
     AudioEnd,
     AudioFrame,
     AudioFrameUnprotected,
+    LinkStats,
+    Latency,
+    AudioCodec,
 };
 
 enum class AudioTransmitMode : uint8_t
@@ -69,6 +77,13 @@ enum class AudioReceiveMode : uint8_t
     Both,
 };
 
+// How ptt audio is coded on its way to net, ai requests are always A-law
+enum class AudioCodecMode : uint8_t
+{
+    Alaw = 0,
+    Adpcm,
+};
+
 enum class UiLoopbackMode : uint8_t
 {
     Off = 0,
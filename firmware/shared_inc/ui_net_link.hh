@@ -2,6 +2,7 @@
 
 #include "constants.hh"
 #include "link_packet_t.hh"
+#include "link_schema.hh"
 #include <cstdint>
 #include <cstring>
 #include <span>
@@ -14,6 +15,8 @@ enum struct UiToNet : uint16_t
 {
     CircularPing = 0x0060,
     AudioFrame = 0x0061,
+    LinkRate = 0x0062,
+    LatencyPing = 0x0063,
 };
 
 // NET to UI packet types
@@ -21,8 +24,118 @@ enum struct NetToUi : uint16_t
 {
     CircularPing = 0x0070,
     AudioFrame = 0x0071,
+    LinkRate = 0x0072,
+    LatencyPing = 0x0073,
 };
 
+// Circular pings pass through each chip, which adds its stamp when the ping
+// still fits
+inline constexpr size_t Circular_Ping_Size = 128;
+
+// Every packet type on the link and its largest payload, anything else in a
+// header is treated as corruption
+inline constexpr link_type_limit_t Type_Limits[] = {
+    {static_cast<uint16_t>(UiToNet::CircularPing), Circular_Ping_Size},
+    {static_cast<uint16_t>(UiToNet::AudioFrame), link_packet_t::Payload_Size},
+    {static_cast<uint16_t>(UiToNet::LinkRate), 64},
+    {static_cast<uint16_t>(UiToNet::LatencyPing), 16},
+    {static_cast<uint16_t>(NetToUi::CircularPing), Circular_Ping_Size},
+    {static_cast<uint16_t>(NetToUi::AudioFrame), link_packet_t::Payload_Size},
+    {static_cast<uint16_t>(NetToUi::LinkRate), 64},
+    {static_cast<uint16_t>(NetToUi::LatencyPing), 16},
+};
+
+// Audio frames on the link end in a sequence number, so frames lost on the
+// link can be told apart from gaps in the audio itself
+using AudioSeq = uint16_t;
+inline constexpr size_t Audio_Seq_Size = sizeof(AudioSeq);
+
+// Types whose frames end in an AudioSeq, which compact headers send as its
+// low byte
+inline constexpr uint16_t Seq_Types[] = {
+    static_cast<uint16_t>(UiToNet::AudioFrame),
+    static_cast<uint16_t>(NetToUi::AudioFrame),
+};
+
+// What the sequence numbers of the audio frames coming in say about the link
+struct AudioSeqCheck
+{
+    // Most frames a gap can be and still be counted as missing. That is more
+    // than a full tx queue and rx ring can lose at once. A number further
+    // off than that is either misread, from a frame put together from the
+    // wrong bytes, or the other end restarting, and is only believed once
+    // the next frame follows on from it.
+    static constexpr int16_t Max_Gap = 64;
+
+    // Stats commands reply with these, see Link_Stats_Version
+    struct Counts
+    {
+        uint32_t frames;
+        // Frames that never arrived, times the other end restarted, and
+        // numbers that were too far off to trust and were passed over
+        uint32_t missing;
+        uint32_t restarts;
+        uint32_t misreads;
+    };
+
+    Counts counts{};
+    AudioSeq next = 0;
+    bool started = false;
+
+    // A number too far off, waiting for the frame after it
+    AudioSeq suspect = 0;
+    bool has_suspect = false;
+
+    // Takes the sequence number off the end of the payload and counts it,
+    // false when the payload is too short to have one
+    bool Take(std::span<const uint8_t>& payload)
+    {
+        if (payload.size() < Audio_Seq_Size)
+        {
+            return false;
+        }
+
+        AudioSeq seq;
+        std::memcpy(&seq, payload.data() + payload.size() - Audio_Seq_Size, sizeof(seq));
+        payload = payload.first(payload.size() - Audio_Seq_Size);
+        ++counts.frames;
+
+        const int16_t ahead = static_cast<int16_t>(seq - next);
+        if (!started || (ahead >= 0 && ahead <= Max_Gap))
+        {
+            counts.missing += started ? ahead : 0;
+        }
+        else if (has_suspect && seq == static_cast<AudioSeq>(suspect + 1))
+        {
+            // The last one was right after all, the other end restarted
+            --counts.misreads;
+            ++counts.restarts;
+        }
+        else
+        {
+            ++counts.misreads;
+            suspect = seq;
+            has_suspect = true;
+            return true;
+        }
+
+        started = true;
+        has_suspect = false;
+        next = seq + 1;
+        return true;
+    }
+};
+
+using AudioCountsSchema = link_schema::Message<&AudioSeqCheck::Counts::frames,
+                                               &AudioSeqCheck::Counts::missing,
+                                               &AudioSeqCheck::Counts::restarts,
+                                               &AudioSeqCheck::Counts::misreads>;
+
+// The LinkStats reply from either chip is this version byte, the link's
+// SerialHandler::StatsSchema and then AudioCountsSchema. Bump it whenever
+// either schema changes.
+static constexpr uint8_t Link_Stats_Version = 1;
+
 enum class Channel_Id : uint8_t
 {
     Ptt = 0,
@@ -44,6 +157,8 @@ enum class MessageType : uint8_t
     AIRequest,
     AIResponse,
     Chat,
+    // A media chunk holding an ADPCM frame in place of A-law
+    MediaAdpcm,
 };
 
 enum class ContentType : uint8_t
@@ -52,92 +167,140 @@ enum class ContentType : uint8_t
     Json,
 };
 
-struct __attribute__((packed)) Chunk
+// The chunks audio frames carry after the channel id. Each is a header laid
+// out by its schema and then chunk_length bytes of data. Fields that are read
+// off the wire are plain bytes, a bool could be handed any value.
+struct Chunk
 {
-    const MessageType type = MessageType::Media;
-    uint8_t last_chunk;
-    std::uint32_t chunk_length;
+    MessageType type = MessageType::Media;
+    uint8_t last_chunk = 0;
+    uint32_t chunk_length = 0;
+};
 
-    static constexpr uint32_t Type_Size = sizeof(type);
-    static constexpr uint32_t Last_Chunk_Size = sizeof(last_chunk);
-    static constexpr uint32_t Chunk_Length_Size = sizeof(chunk_length);
+using ChunkSchema =
+    link_schema::Message<&Chunk::type, &Chunk::last_chunk, &Chunk::chunk_length>;
 
-    static constexpr uint32_t Total_Offset = Type_Size + Last_Chunk_Size + Chunk_Length_Size;
-    static constexpr uint32_t Chunk_Size = link_packet_t::Payload_Size - Total_Offset;
+struct AIRequestChunk
+{
+    MessageType type = MessageType::AIRequest;
+    uint32_t request_id = 0;
+    uint8_t last_chunk = 0;
+    uint32_t chunk_length = 0;
+};
 
-    static constexpr uint32_t ExpectedSize = Total_Offset + constants::Audio_Phonic_Sz;
+using AIRequestSchema = link_schema::Message<&AIRequestChunk::type,
+                                             &AIRequestChunk::request_id,
+                                             &AIRequestChunk::last_chunk,
+                                             &AIRequestChunk::chunk_length>;
 
-    std::uint8_t chunk_data[Chunk_Size];
+struct AIResponseChunk
+{
+    MessageType type = MessageType::AIResponse;
+    uint32_t request_id = 0;
+    ContentType content_type = ContentType::Audio;
+    uint8_t last_chunk = 0;
+    uint32_t chunk_length = 0;
 };
 
-struct __attribute__((packed)) AIRequestChunk
+using AIResponseSchema = link_schema::Message<&AIResponseChunk::type,
+                                              &AIResponseChunk::request_id,
+                                              &AIResponseChunk::content_type,
+                                              &AIResponseChunk::last_chunk,
+                                              &AIResponseChunk::chunk_length>;
+
+struct ChatChunk
 {
-    const MessageType type = MessageType::AIRequest;
-    std::uint32_t request_id;
-    bool last_chunk;
-    std::uint32_t chunk_length;
-    std::uint8_t chunk_data[constants::Audio_Phonic_Sz];
+    MessageType type = MessageType::Chat;
+    uint32_t chunk_length = 0;
 };
 
-struct __attribute__((packed)) AIResponseChunk
-{
-    const MessageType type = MessageType::AIResponse;
-    std::uint32_t request_id;
-    ContentType content_type;
-    bool last_chunk;
-    std::uint32_t chunk_length;
-
-    static constexpr uint32_t Type_Size = sizeof(type);
-    static constexpr uint32_t Response_Id_Size = sizeof(request_id);
-    static constexpr uint32_t Content_Type_Size = sizeof(content_type);
-    static constexpr uint32_t Last_Chunk_Size = sizeof(last_chunk);
-    static constexpr uint32_t Chunk_Length_Size = sizeof(chunk_length);
-    static constexpr uint32_t Channel_Id_Size = sizeof(Channel_Id);
-
-    static constexpr uint32_t Chunk_Size =
-        link_packet_t::Payload_Size
-        - (Type_Size + Response_Id_Size + Content_Type_Size + Last_Chunk_Size + Chunk_Length_Size
-           + Channel_Id_Size);
-    std::uint8_t chunk_data[Chunk_Size];
-};
+using ChatSchema = link_schema::Message<&ChatChunk::type, &ChatChunk::chunk_length>;
 
-[[maybe_unused]] static void
-Serialize(const AudioObject& talk_frame, bool is_last, link_packet_t& packet)
-{
-    packet.type = static_cast<uint16_t>(UiToNet::AudioFrame);
-    packet.payload[0] = (uint8_t)talk_frame.channel_id;
+// Chunks start after the channel id, their type is the byte after it
+inline constexpr size_t Chunk_Offset = sizeof(Channel_Id);
 
-    uint32_t offset = 1;
+// Most data a chunk laid out by Schema has room for in a payload
+template <typename Schema>
+inline constexpr size_t Max_Chunk_Data = link_packet_t::Payload_Size - Chunk_Offset - Schema::Size;
 
-    static constexpr std::uint32_t audio_size = constants::Audio_Phonic_Sz;
-    if (talk_frame.channel_id == Channel_Id::Ptt)
-    {
-        packet.payload[offset] = static_cast<uint8_t>(MessageType::Media);
-        offset += sizeof(Chunk::type);
+static_assert(Max_Chunk_Data<AIResponseSchema> >= constants::Audio_Phonic_Sz);
 
-        packet.payload[offset] = static_cast<uint8_t>(is_last);
-        offset += sizeof(bool);
+[[maybe_unused]] static MessageType ChunkType(std::span<const uint8_t> payload)
+{
+    return payload.size() > Chunk_Offset ? static_cast<MessageType>(payload[Chunk_Offset])
+                                         : MessageType{};
+}
 
-        memcpy(packet.payload.data() + offset, &audio_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+// Reads the chunk at the start of a payload and finds its data, false when
+// the payload is too short for the header or for the data it says follows
+template <typename Schema, typename Data>
+bool ReadChunk(std::span<Data> payload, typename Schema::Class& chunk, std::span<Data>& data)
+{
+    if (payload.size() < Chunk_Offset || !Schema::Read(payload.subspan(Chunk_Offset), chunk))
+    {
+        return false;
     }
-    else if (talk_frame.channel_id == Channel_Id::Ptt_Ai)
+
+    const size_t start = Chunk_Offset + Schema::Size;
+    if (chunk.chunk_length > payload.size() - start)
     {
-        packet.payload[offset] = static_cast<uint8_t>(MessageType::AIRequest);
-        offset += sizeof(Chunk::type);
+        return false;
+    }
 
-        uint32_t request_id = 0;
-        memcpy(packet.payload.data() + offset, &request_id, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+    data = payload.subspan(start, chunk.chunk_length);
+    return true;
+}
+
+// Bytes of audio in a media chunk of the type
+[[maybe_unused]] static constexpr uint32_t AudioSize(const MessageType media)
+{
+    return media == MessageType::MediaAdpcm ? constants::Audio_Adpcm_Sz
+                                            : constants::Audio_Phonic_Sz;
+}
 
-        packet.payload[offset] = static_cast<uint8_t>(is_last);
-        offset += sizeof(bool);
+// Writes the channel id and the chunk header for an audio frame on that
+// channel and returns where the audio goes, 0 for a channel that carries no
+// audio. Ptt frames are sent as the media type, ai requests are always A-law.
+[[maybe_unused]] static uint32_t WriteAudioHeader(const Channel_Id channel_id,
+                                                  const bool is_last,
+                                                  link_packet_t& packet,
+                                                  const MessageType media = MessageType::Media)
+{
+    packet.type = static_cast<uint16_t>(UiToNet::AudioFrame);
+    packet.payload[0] = static_cast<uint8_t>(channel_id);
 
-        memcpy(packet.payload.data() + offset, &audio_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+    uint8_t* const chunk = packet.payload.data() + Chunk_Offset;
+    uint32_t offset = Chunk_Offset;
+    uint32_t audio_size = constants::Audio_Phonic_Sz;
+    if (channel_id == Channel_Id::Ptt)
+    {
+        audio_size = AudioSize(media);
+        offset += ChunkSchema::Write({media, is_last, audio_size}, chunk);
+    }
+    else if (channel_id == Channel_Id::Ptt_Ai)
+    {
+        offset += AIRequestSchema::Write(
+            {MessageType::AIRequest, 0, is_last, constants::Audio_Phonic_Sz}, chunk);
+    }
+    else
+    {
+        return 0;
     }
 
-    packet.length = offset + constants::Audio_Phonic_Sz;
+    packet.length = offset + audio_size;
+    return offset;
+}
+
+[[maybe_unused]] static void
+Serialize(const AudioObject& talk_frame, bool is_last, link_packet_t& packet)
+{
+    uint32_t offset = WriteAudioHeader(talk_frame.channel_id, is_last, packet);
+    if (offset == 0)
+    {
+        // Other channels carry the audio straight after the channel id
+        offset = Chunk_Offset;
+        packet.length = offset + constants::Audio_Phonic_Sz;
+    }
 
     memcpy(packet.payload.data() + offset, talk_frame.data, constants::Audio_Phonic_Sz);
 
@@ -147,33 +310,65 @@ Serialize(const AudioObject& talk_frame, bool is_last, link_packet_t& packet)
 [[maybe_unused]] static void
 Serialize(const Channel_Id channel_id, const char* text, const uint32_t len, link_packet_t& packet)
 {
-    packet.type = static_cast<uint16_t>(UiToNet::AudioFrame);
-    packet.payload[0] = (uint8_t)channel_id;
+    const uint32_t text_len = len < Max_Chunk_Data<ChatSchema> ? len : Max_Chunk_Data<ChatSchema>;
 
-    uint32_t offset = 1;
-    packet.payload[offset] = static_cast<uint8_t>(MessageType::Chat);
-    offset += sizeof(MessageType);
+    packet.type = static_cast<uint16_t>(UiToNet::AudioFrame);
+    packet.payload[0] = static_cast<uint8_t>(channel_id);
 
-    memcpy(packet.payload.data() + offset, &len, sizeof(uint32_t));
-    offset += sizeof(uint32_t);
+    uint32_t offset = Chunk_Offset;
+    offset += ChatSchema::Write({MessageType::Chat, text_len}, packet.payload.data() + offset);
 
-    memcpy(packet.payload.data() + offset, text, len);
+    memcpy(packet.payload.data() + offset, text, text_len);
 
-    packet.length = offset + len;
+    packet.length = offset + text_len;
     packet.is_ready = true;
 }
 
-[[maybe_unused]] static void Deserialize(const link_packet_t& packet, AudioObject& audio_object)
+// Takes the audio out of a media or ai chunk, false when the packet holds no
+// chunk with a whole frame of audio
+[[maybe_unused]] static bool Deserialize(const link_packet_t& packet, AudioObject& audio_object)
 {
-    audio_object.channel_id = (Channel_Id)packet.payload[0];
+    const std::span<const uint8_t> payload(packet.payload.data(),
+                                           packet.length < packet.payload.size()
+                                               ? packet.length
+                                               : packet.payload.size());
+    audio_object.channel_id = static_cast<Channel_Id>(payload.empty() ? 0 : payload[0]);
+
+    std::span<const uint8_t> data;
+    bool read = false;
+    switch (ChunkType(payload))
+    {
+    case MessageType::Media:
+    {
+        Chunk chunk;
+        read = ReadChunk<ChunkSchema>(payload, chunk, data);
+        break;
+    }
+    case MessageType::AIRequest:
+    {
+        AIRequestChunk chunk;
+        read = ReadChunk<AIRequestSchema>(payload, chunk, data);
+        break;
+    }
+    case MessageType::AIResponse:
+    {
+        AIResponseChunk chunk;
+        read = ReadChunk<AIResponseSchema>(payload, chunk, data);
+        break;
+    }
+    default:
+    {
+        break;
+    }
+    }
 
-    uint32_t payload_offset = 1 + sizeof(Chunk) - constants::Audio_Phonic_Sz;
-    if (static_cast<MessageType>(packet.payload[1]) == MessageType::AIResponse)
+    if (!read || data.size() < constants::Audio_Phonic_Sz)
     {
-        payload_offset = 1 + sizeof(AIResponseChunk) - constants::Audio_Phonic_Sz;
+        return false;
     }
 
-    memcpy(audio_object.data, packet.payload.data() + payload_offset, constants::Audio_Phonic_Sz);
+    memcpy(audio_object.data, data.data(), constants::Audio_Phonic_Sz);
+    return true;
 }
 
 } // namespace ui_net_link
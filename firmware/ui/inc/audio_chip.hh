@@ -1,6 +1,7 @@
 #pragma once
 
 #include "constants.hh"
+#include "swapping_buffer.hh"
 #include "stm32.h"
 #include "stm32f4xx_hal_i2c.h"
 #include "stm32f4xx_hal_i2s.h"
@@ -62,6 +63,14 @@ public:
 
     void ISRCallback();
 
+    // Takes the halves the DMA just finished, returns false when there is no
+    // new frame. Release them before the next audio interrupt.
+    bool AcquireBuffers();
+    void ReleaseBuffers();
+
+    // Frames where the main loop still held a half when the DMA needed it
+    uint32_t LateFrames() const;
+
     void ClearTxBuffer();
 
     uint16_t* TxBuffer();
@@ -116,11 +125,14 @@ private:
     I2S_HandleTypeDef* i2s;
     I2C_HandleTypeDef* i2c;
 
-    uint16_t tx_buffer[constants::Total_Audio_Buffer_Sz];
+    using AudioBuffers =
+        SwappingBuffer<uint16_t, constants::Num_Buffers, constants::Audio_Buffer_Sz>;
+    static_assert(AudioBuffers::TotalSize() == constants::Total_Audio_Buffer_Sz);
+
+    AudioBuffers tx_buffers;
     uint16_t* tx_ptr;
-    uint16_t rx_buffer[constants::Total_Audio_Buffer_Sz];
+    AudioBuffers rx_buffers;
     uint16_t* rx_ptr;
-    uint32_t buff_mod;
 
     uint16_t flags;
 
@@ -28,7 +28,38 @@ public:
     static void ALawExpand(const uint8_t* input, uint16_t* output, const size_t len);
 
     static uint8_t ALawCompand(const uint16_t sample);
-    static uint16_t ALawExpand(uint8_t sample);
+    static uint16_t ALawExpand(const uint8_t sample);
+
+    // The two ways of companding a sample, ALawCompand uses clz on cores
+    // that have it and the table anywhere else
+    static uint8_t ALawCompandClz(const uint16_t sample);
+    static uint8_t ALawCompandLut(const uint16_t sample);
+
+    // IMA ADPCM, 4 bits a sample. The encoder carries its state from frame to
+    // frame and writes it at the front of each one, so a frame decodes without
+    // the ones before it.
+    struct AdpcmState
+    {
+        int16_t predictor = 0;
+        uint8_t step_index = 0;
+    };
+
+    // Encodes as many samples as input has and output has room for after the
+    // header, returns the bytes written
+    static size_t AdpcmEncode(const uint16_t* input,
+                              const size_t input_len,
+                              uint8_t* output,
+                              const size_t output_len,
+                              const bool input_stereo,
+                              AdpcmState& state);
+
+    // Decodes a frame, false when it is too short for its header or its step
+    // index is out of range
+    static bool AdpcmDecode(const uint8_t* input,
+                            const size_t input_len,
+                            uint16_t* output,
+                            const size_t output_len,
+                            const bool output_stereo);
 
 private:
 };
\ No newline at end of file
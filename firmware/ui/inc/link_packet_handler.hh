@@ -2,22 +2,32 @@
 
 #include "audio_chip.hh"
 #include "config_storage.hh"
+#include "link_latency/link_latency.hh"
+#include "link_rate/link_rate.hh"
 #include "protector.hh"
 #include "screen.hh"
 #include "serial.hh"
 #include "ui_mgmt_link.h"
 
 extern "C" {
+// Audio frames to net go through here to get their sequence number
+void WriteNetAudio(Serial& net_serial,
+                   const link_packet_t& packet,
+                   const Serial::TxClass tx_class = Serial::TxClass::Realtime);
 void HandleNetLinkPackets(Serial& net_serial,
                           Serial& mgmt_serial,
                           Protector& protector,
                           AudioChip& audio,
-                          const AudioReceiveMode audio_receive_mode);
+                          const AudioReceiveMode audio_receive_mode,
+                          LinkRate& link_rate,
+                          link_latency::LinkLatency& link_latency);
 void HandleMgmtLinkPackets(Serial& mgmt_serial,
                            Serial& net_serial,
                            ConfigStorage& storage,
                            AudioChip& audio,
                            UiLoopbackMode& loopback,
                            AudioTransmitMode& audio_transmit_mode,
-                           AudioReceiveMode& audio_receive_mode);
+                           AudioReceiveMode& audio_receive_mode,
+                           AudioCodecMode& audio_codec_mode,
+                           link_latency::LinkLatency& link_latency);
 };
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+// Microsecond clock off the core's cycle counter, for timing the net link
+// where HAL_GetTick is too coarse. Wraps like any other 32 bit time.
+extern "C" {
+void StartMicros();
+
+// Main loop only, and at least every 25 s so the cycle counter does not wrap
+// twice between calls
+uint32_t Micros();
+}
@@ -3,6 +3,7 @@
 #include "config_storage.hh"
 #include "link_packet_t.hh"
 #include <sframe/sframe.h>
+#include <span>
 
 class Protector
 {
@@ -12,6 +13,7 @@ public:
 
     bool TryProtect(link_packet_t* link_packet) noexcept;
     bool TryUnprotect(link_packet_t* link_packet) noexcept;
+    bool TryUnprotect(std::span<const uint8_t> payload, link_packet_t* link_packet) noexcept;
 
     bool SaveMLSKey();
     bool LoadMLSKey();
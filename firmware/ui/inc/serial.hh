@@ -6,18 +6,21 @@ class Serial : public SerialHandler
 {
 public:
     Serial(UART_HandleTypeDef* uart,
-           const uint16_t num_rx_packets,
+           uint8_t& rx_packet_buff,
+           const uint32_t rx_packet_buff_sz,
            uint8_t& tx_buff,
            const uint32_t tx_buff_sz,
+           uint8_t& realtime_tx_buff,
+           const uint32_t realtime_tx_buff_sz,
            uint8_t& rx_buff,
-           const uint32_t rx_buff_sz,
-           const bool use_slip = true);
+           const uint32_t rx_buff_sz);
     ~Serial();
 
     void StartReceive();
     void Reset();
     void Stop();
     void ResetRecv();
+    void SetBaud(const uint32_t baud);
 
     static const UART_HandleTypeDef* UART(Serial* serial);
 
@@ -25,8 +28,12 @@ public:
     static void TxISR(Serial* serial);
 
 protected:
-    void UpdateUnread(const uint16_t update) override;
     static void Transmit(void* arg);
 
     UART_HandleTypeDef* uart;
+
+    // Where the DMA was at the last rx callback, and bytes it has written
+    // past the ring's write index that did not fit in the ring yet
+    uint16_t dma_idx;
+    uint16_t rx_pending;
 };
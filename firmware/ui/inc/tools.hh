@@ -2,6 +2,7 @@
 
 // #include "app_main.hh"
 #include "audio_chip.hh"
+#include "audio_codec.hh"
 #include "logger.hh"
 #include "stm32.h"
 
@@ -58,6 +59,40 @@ static uint32_t CountNumAudioInterrupts(const AudioChip& audio, volatile bool& s
     return actual_interrupt_count;
 }
 
+// Needs StartMicros to have started the cycle counter. Times the audio codec
+// on one frame, the way audio is companded to send and expanded to play, after
+// a pass to warm the flash cache. Runs at startup in a build with
+// COUNT_AUDIO_CODEC_CYCLES.
+static void CountAudioCodecCycles()
+{
+    static uint16_t pcm[constants::Audio_Buffer_Sz];
+    static uint8_t alaw[constants::Audio_Phonic_Sz];
+
+    // A ramp that passes through every segment both ways
+    for (uint32_t i = 0; i < constants::Audio_Buffer_Sz; ++i)
+    {
+        pcm[i] = i * 397;
+    }
+
+    uint32_t compand_cycles = 0;
+    uint32_t expand_cycles = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        const uint32_t compand_start = DWT->CYCCNT;
+        AudioCodec::ALawCompand(pcm, constants::Audio_Buffer_Sz, alaw, constants::Audio_Phonic_Sz,
+                                true, constants::Stereo);
+        compand_cycles = DWT->CYCCNT - compand_start;
+
+        const uint32_t expand_start = DWT->CYCCNT;
+        AudioCodec::ALawExpand(alaw, constants::Audio_Phonic_Sz, pcm, constants::Audio_Buffer_Sz,
+                               constants::Stereo, true);
+        expand_cycles = DWT->CYCCNT - expand_start;
+    }
+
+    UI_LOG_INFO("Audio codec cycles per frame - compand: %lu, expand: %lu", compand_cycles,
+                expand_cycles);
+}
+
 static void Heartbeat(GPIO_TypeDef* port, const uint16_t pin)
 {
     static uint32_t blinky = 0;
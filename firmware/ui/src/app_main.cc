@@ -7,10 +7,13 @@
 #include "keyboard.hh"
 #include "keyboard_display.hh"
 #include "led_control.hh"
+#include "link_latency/link_latency.hh"
 #include "link_packet_handler.hh"
 #include "link_packet_t.hh"
+#include "link_rate/link_rate.hh"
 #include "logger.hh"
 #include "main.h"
+#include "micros.hh"
 #include "protector.hh"
 #include "renderer.hh"
 #include "screen.hh"
@@ -24,6 +27,7 @@
 #include <cmox_low_level.h>
 #include <sframe/sframe.h>
 #include <stm32f4xx_hal.h>
+#include <bit>
 #include <cstdint>
 #include <cstring>
 #include <random>
@@ -47,7 +51,6 @@ extern SPI_HandleTypeDef hspi1;
 extern I2C_HandleTypeDef hi2c1;
 extern I2S_HandleTypeDef hi2s3;
 extern TIM_HandleTypeDef htim2;
-extern TIM_HandleTypeDef htim3;
 extern TIM_HandleTypeDef htim4;
 extern TIM_HandleTypeDef htim5;
 extern RNG_HandleTypeDef hrng;
@@ -56,36 +59,98 @@ extern RNG_HandleTypeDef hrng;
 UiLoopbackMode loopback_mode = UiLoopbackMode::Off;
 AudioTransmitMode audio_transmit_mode = AudioTransmitMode::Net;
 AudioReceiveMode audio_receive_mode = AudioReceiveMode::Headphones;
+AudioCodecMode audio_codec_mode = AudioCodecMode::Alaw;
+AudioCodec::AdpcmState adpcm_state;
 
 // Buffer allocations
 static constexpr uint16_t net_ui_serial_tx_buff_sz = 2048;
 uint8_t net_ui_serial_tx_buff[net_ui_serial_tx_buff_sz] = {0};
+static constexpr uint16_t net_ui_serial_realtime_tx_buff_sz = 2048;
+uint8_t net_ui_serial_realtime_tx_buff[net_ui_serial_realtime_tx_buff_sz] = {0};
 static constexpr uint16_t net_ui_serial_rx_buff_sz = 2048;
 uint8_t net_ui_serial_rx_buff[net_ui_serial_rx_buff_sz] = {0};
-static constexpr uint16_t net_ui_serial_num_rx_packets = 7;
+static constexpr uint16_t net_ui_serial_rx_packet_buff_sz = 1024;
+uint8_t net_ui_serial_rx_packet_buff[net_ui_serial_rx_packet_buff_sz] = {0};
 
 static constexpr uint16_t mgmt_ui_serial_tx_buff_sz = 1024;
 uint8_t mgmt_ui_serial_tx_buff[mgmt_ui_serial_tx_buff_sz] = {0};
+// Only audio forwarded to ctl goes realtime on mgmt, one packet's worth is enough
+static constexpr uint16_t mgmt_ui_serial_realtime_tx_buff_sz =
+    std::bit_ceil<uint16_t>(link_packet_t::Packet_Size);
+uint8_t mgmt_ui_serial_realtime_tx_buff[mgmt_ui_serial_realtime_tx_buff_sz] = {0};
 static constexpr uint16_t mgmt_ui_serial_rx_buff_sz = 1024;
 uint8_t mgmt_ui_serial_rx_buff[mgmt_ui_serial_rx_buff_sz] = {0};
-static constexpr uint16_t mgmt_ui_serial_num_rx_packets = 1;
+static constexpr uint16_t mgmt_ui_serial_rx_packet_buff_sz = 2048;
+uint8_t mgmt_ui_serial_rx_packet_buff[mgmt_ui_serial_rx_packet_buff_sz] = {0};
+
+// The serial rings mask their indices so every size has to be a power of two
+static_assert(std::has_single_bit(net_ui_serial_tx_buff_sz)
+              && std::has_single_bit(net_ui_serial_rx_buff_sz));
+static_assert(std::has_single_bit(mgmt_ui_serial_tx_buff_sz)
+              && std::has_single_bit(mgmt_ui_serial_rx_buff_sz));
+static_assert(std::has_single_bit(net_ui_serial_realtime_tx_buff_sz)
+              && std::has_single_bit(mgmt_ui_serial_realtime_tx_buff_sz));
+
+// Audio frames are only queued whole, so each realtime ring has to fit a full
+// packet
+static_assert(net_ui_serial_realtime_tx_buff_sz >= link_packet_t::Packet_Size);
+static_assert(mgmt_ui_serial_realtime_tx_buff_sz >= link_packet_t::Packet_Size);
+
+// The rx packet queues hold packets at their actual size. The net link is read
+// in place so its queue only ever holds one packet that wrapped the rx buffer.
+// The mgmt link is read with copies, so its queue needs room for a full packet
+// wherever the one before it landed.
+static_assert(net_ui_serial_rx_packet_buff_sz >= link_packet_t::Packet_Size);
+static_assert(mgmt_ui_serial_rx_packet_buff_sz >= 3 * link_packet_t::Packet_Size);
+
+// Flow control holds a full frame of the net rx buffer back and hands out the
+// rest as credit
+static_assert(net_ui_serial_rx_buff_sz >= 2 * (link_packet_t::Packet_Size + Serial::Crc_Size));
 
 static AudioChip audio_chip(hi2s3, hi2c1);
 
 static Serial net_serial(&huart2,
-                         net_ui_serial_num_rx_packets,
+                         *net_ui_serial_rx_packet_buff,
+                         net_ui_serial_rx_packet_buff_sz,
                          *net_ui_serial_tx_buff,
                          net_ui_serial_tx_buff_sz,
+                         *net_ui_serial_realtime_tx_buff,
+                         net_ui_serial_realtime_tx_buff_sz,
                          *net_ui_serial_rx_buff,
-                         net_ui_serial_rx_buff_sz,
-                         false);
+                         net_ui_serial_rx_buff_sz);
 static Serial mgmt_serial(&huart1,
-                          mgmt_ui_serial_num_rx_packets,
+                          *mgmt_ui_serial_rx_packet_buff,
+                          mgmt_ui_serial_rx_packet_buff_sz,
                           *mgmt_ui_serial_tx_buff,
                           mgmt_ui_serial_tx_buff_sz,
+                          *mgmt_ui_serial_realtime_tx_buff,
+                          mgmt_ui_serial_realtime_tx_buff_sz,
                           *mgmt_ui_serial_rx_buff,
-                          mgmt_ui_serial_rx_buff_sz,
-                          false);
+                          mgmt_ui_serial_rx_buff_sz);
+
+// Net link rate, raised from the boot rate once net has checked it can keep up
+static_assert(LinkRate::Burst_Size <= link_packet_t::Payload_Size);
+static void SendLinkRate(void* arg, std::span<const uint8_t> payload)
+{
+    static_cast<Serial*>(arg)->Write(static_cast<uint16_t>(ui_net_link::UiToNet::LinkRate),
+                                     {payload});
+}
+static void SetLinkBaud(void* arg, const uint32_t baud)
+{
+    static_cast<Serial*>(arg)->SetBaud(baud);
+}
+static LinkRate net_link_rate(
+    LinkRate::Role::Initiator, LinkRate::All_Rates, SendLinkRate, SetLinkBaud, &net_serial);
+
+// Net link latency, pings net while a period is set over mgmt. The pings
+// queue behind audio like any other bulk packet, which is what they measure.
+static_assert(sizeof(link_latency::LinkLatency::Report) <= link_packet_t::Payload_Size);
+static void SendLatencyPing(void* arg, std::span<const uint8_t> payload)
+{
+    static_cast<Serial*>(arg)->Write(static_cast<uint16_t>(ui_net_link::UiToNet::LatencyPing),
+                                     {payload});
+}
+static link_latency::LinkLatency net_link_latency(SendLatencyPing, &net_serial);
 
 #if 0
 // Screen screen(hspi1,
@@ -151,6 +216,7 @@ Button
 int app_main()
 {
     HAL_TIM_Base_Start_IT(&htim2);
+    StartMicros();
 
     uint32_t ticks_ms = 0;
     ConfigStorage config_storage(hi2c1);
@@ -165,8 +231,40 @@ int app_main()
     // Test in case the audio chip settings change and something looks suspicious
     // CountNumAudioInterrupts(audio_chip, sleeping);
 
+#ifdef COUNT_AUDIO_CODEC_CYCLES
+    // For checking the codec still fits in the audio deadline
+    CountAudioCodecCycles();
+#endif
+
     // InitScreen(screen);
     Leds(HIGH, HIGH, HIGH);
+
+    // Both ends of the net link are this firmware, so its headers carry a crc
+    // and only known packet types are accepted. The mgmt link has to stay as
+    // is for the host tools.
+    net_serial.EnableHeaderCrc();
+    net_serial.SetTypeLimits(ui_net_link::Type_Limits);
+
+    // Audio goes ahead of logs and replies on both links, a few frames of
+    // backlog is all that is worth sending late
+    net_serial.SetTxDepth(Serial::TxClass::Realtime, 4);
+    mgmt_serial.SetTxDepth(Serial::TxClass::Realtime, 4);
+
+    // Audio that backs up towards net goes out a few frames per packet, which
+    // holds the first of them back by at most two frames on the wire
+    net_serial.EnableAggregation(3);
+
+    // Net only sends what the net rx buffer has room for, it paces audio off
+    // its own clock and the credits keep it from running over unread bytes
+    net_serial.EnableFlowControl();
+
+    // Frames end in a zero instead of starting with a sync word once net
+    // agrees, a corrupt length can no longer hide the next frame
+    net_serial.EnableCobs();
+
+    // Audio frames keep their type and length for the whole call, so most go
+    // out with a one byte header and a one byte sequence number
+    net_serial.EnableCompactHeaders(ui_net_link::Seq_Types);
     net_serial.StartReceive();
     mgmt_serial.StartReceive();
 
@@ -183,6 +281,8 @@ int app_main()
 
     uint32_t volume_button_press_ms = 0;
     constexpr uint32_t Volume_Button_Debounce_ms = 200;
+    uint32_t late_audio_frames = 0;
+    uint32_t net_link_losses = 0;
 
     while (1)
     {
@@ -202,6 +302,9 @@ int app_main()
 
         ticks_ms = HAL_GetTick();
 
+        // Owns this frame's audio halves until the end of the loop
+        const bool have_audio = audio_chip.AcquireBuffers();
+
         if (error)
         {
             // Error("Main loop", "Flags did not match expected");
@@ -234,9 +337,19 @@ int app_main()
 
         // HandleKeypress(screen, keyboard, net_serial, protector);
 
-        HandleNetLinkPackets(net_serial, mgmt_serial, protector, audio_chip, audio_receive_mode);
+        HandleNetLinkPackets(net_serial, mgmt_serial, protector, audio_chip, audio_receive_mode,
+                             net_link_rate, net_link_latency);
+        net_link_rate.Poll(HAL_GetTick());
+        if (net_link_rate.Losses() != net_link_losses)
+        {
+            // Net may have restarted and be reading TLV again
+            net_link_losses = net_link_rate.Losses();
+            net_serial.ResetFraming();
+        }
+        net_link_latency.Poll(HAL_GetTick(), Micros());
         HandleMgmtLinkPackets(mgmt_serial, net_serial, config_storage, audio_chip, loopback_mode,
-                              audio_transmit_mode, audio_receive_mode);
+                              audio_transmit_mode, audio_receive_mode, audio_codec_mode,
+                              net_link_latency);
 
         // renderer.Render(ticks_ms);
         // TODO remove?
@@ -244,6 +357,17 @@ int app_main()
         RaiseFlag(Rx_Audio_Transmitted);
         RaiseFlag(Draw_Complete);
 
+        if (have_audio)
+        {
+            audio_chip.ReleaseBuffers();
+        }
+
+        if (audio_chip.LateFrames() != late_audio_frames)
+        {
+            late_audio_frames = audio_chip.LateFrames();
+            UI_LOG_WARN("Main loop missed audio frames, total %lu", late_audio_frames);
+        }
+
         sleeping = true;
     }
 
@@ -295,9 +419,6 @@ inline void AudioCallback()
     CheckFlags();
     WakeUp();
 
-    HAL_GPIO_WritePin(UI_READY_GPIO_Port, UI_READY_Pin, HIGH);
-    HAL_TIM_Base_Start_IT(&htim3);
-
     RaiseFlag(Audio_Interrupt);
 }
 
@@ -363,17 +484,33 @@ void SendAudioToMgmt(link_packet_t& packet, const bool last)
     if (first)
     {
         first = false;
-        mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::AudioStart), std::span<const uint8_t>{});
+        // Same class as the frames so it cannot be overtaken by them
+        mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::AudioStart), {},
+                          Serial::TxClass::Realtime);
     }
 
     packet.type = static_cast<uint16_t>(UiToCtl::AudioFrame);
-    mgmt_serial.Write(packet);
+    mgmt_serial.Write(packet, Serial::TxClass::Realtime);
 
     if (last)
     {
         first = true;
-        mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::AudioEnd), std::span<const uint8_t>{});
+        mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::AudioEnd), {}, Serial::TxClass::Realtime);
+    }
+}
+
+// Plays a frame as it was coded for net, for the loopbacks
+static void PlayCoded(const uint8_t* coded, const bool adpcm)
+{
+    if (adpcm)
+    {
+        AudioCodec::AdpcmDecode(coded, constants::Audio_Adpcm_Sz, audio_chip.TxBuffer(),
+                                constants::Audio_Buffer_Sz, true);
+        return;
     }
+
+    AudioCodec::ALawExpand(coded, constants::Audio_Phonic_Sz, audio_chip.TxBuffer(),
+                           constants::Audio_Buffer_Sz, constants::Stereo, true);
 }
 
 void SendAudio(Protector& protector,
@@ -394,55 +531,34 @@ void SendAudio(Protector& protector,
 
     link_packet_t audio_packet;
 
-    uint32_t offset = 0;
-    audio_packet.payload[offset] = static_cast<uint8_t>(channel_id);
-    offset += sizeof(uint8_t);
-    // UI_LOG_INFO("Channel id %d", (int)audio_packet.payload[0]);
-
-    static constexpr uint32_t audio_size = constants::Audio_Phonic_Sz;
-    if (channel_id == ui_net_link::Channel_Id::Ptt)
+    // Only ptt audio goes as ADPCM, ai requests stay A-law
+    const bool adpcm =
+        channel_id == ui_net_link::Channel_Id::Ptt && audio_codec_mode == AudioCodecMode::Adpcm;
+    const uint32_t offset = ui_net_link::WriteAudioHeader(
+        channel_id, last, audio_packet,
+        adpcm ? ui_net_link::MessageType::MediaAdpcm : ui_net_link::MessageType::Media);
+    if (offset == 0)
     {
-        audio_packet.payload[offset] = static_cast<uint8_t>(ui_net_link::MessageType::Media);
-        offset += sizeof(uint8_t);
-
-        audio_packet.payload[offset] = static_cast<uint8_t>(last);
-        offset += sizeof(uint8_t);
-
-        memcpy(audio_packet.payload.data() + offset, &audio_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        UI_LOG_ERROR("Channel Id %d does not exist", static_cast<int>(channel_id));
+        return;
     }
-    else if (channel_id == ui_net_link::Channel_Id::Ptt_Ai)
-    {
-        audio_packet.payload[offset] = static_cast<uint8_t>(ui_net_link::MessageType::AIRequest);
-        offset += sizeof(uint8_t);
-
-        uint32_t request_id = 0;
-        memcpy(audio_packet.payload.data() + offset, &request_id, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
 
-        audio_packet.payload[offset] = static_cast<uint8_t>(last);
-        offset += sizeof(uint8_t);
-
-        memcpy(audio_packet.payload.data() + offset, &audio_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+    if (adpcm)
+    {
+        AudioCodec::AdpcmEncode(rx_buff, constants::Audio_Buffer_Sz,
+                                audio_packet.payload.data() + offset, constants::Audio_Adpcm_Sz,
+                                true, adpcm_state);
     }
     else
     {
-        UI_LOG_ERROR("Channel Id %d does not exist", static_cast<int>(channel_id));
-        return;
+        AudioCodec::ALawCompand(rx_buff, constants::Audio_Buffer_Sz,
+                                audio_packet.payload.data() + offset, constants::Audio_Phonic_Sz,
+                                true, constants::Stereo);
     }
 
-    audio_packet.length = offset + constants::Audio_Phonic_Sz;
-
-    AudioCodec::ALawCompand(rx_buff, constants::Audio_Buffer_Sz,
-                            audio_packet.payload.data() + offset, constants::Audio_Phonic_Sz, true,
-                            constants::Stereo);
-
     if (loopback_mode == UiLoopbackMode::Alaw)
     {
-        AudioCodec::ALawExpand(audio_packet.payload.data() + offset, constants::Audio_Phonic_Sz,
-                               audio_chip.TxBuffer(), constants::Audio_Buffer_Sz, constants::Stereo,
-                               true);
+        PlayCoded(audio_packet.payload.data() + offset, adpcm);
     }
 
     if (!protector.TryProtect(&audio_packet))
@@ -455,9 +571,7 @@ void SendAudio(Protector& protector,
     {
     case AudioTransmitMode::Net:
     {
-        audio_packet.type = static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame);
-
-        net_serial.Write(audio_packet);
+        WriteNetAudio(net_serial, audio_packet);
         break;
     }
     case AudioTransmitMode::Mgmt:
@@ -470,8 +584,7 @@ void SendAudio(Protector& protector,
     {
         SendAudioToMgmt(audio_packet, last);
 
-        audio_packet.type = static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame);
-        net_serial.Write(audio_packet);
+        WriteNetAudio(net_serial, audio_packet);
         break;
     }
     }
@@ -484,9 +597,7 @@ void SendAudio(Protector& protector,
             return;
         }
 
-        AudioCodec::ALawExpand(audio_packet.payload.data() + offset, constants::Audio_Phonic_Sz,
-                               audio_chip.TxBuffer(), constants::Audio_Buffer_Sz, constants::Stereo,
-                               true);
+        PlayCoded(audio_packet.payload.data() + offset, adpcm);
     }
 }
 
@@ -562,12 +673,6 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef* htim)
         volume_up.Update(HAL_GetTick());
         volume_down.Update(HAL_GetTick());
     }
-    else if (htim->Instance == TIM3)
-    {
-        // LedBToggle();
-        HAL_GPIO_WritePin(UI_READY_GPIO_Port, UI_READY_Pin, LOW);
-        HAL_TIM_Base_Stop_IT(&htim3);
-    }
     else if (htim->Instance == TIM4)
     {
         // Turn off ptt
@@ -9,11 +9,10 @@ extern UART_HandleTypeDef huart1;
 AudioChip::AudioChip(I2S_HandleTypeDef& hi2s, I2C_HandleTypeDef& hi2c) :
     i2s(&hi2s),
     i2c(&hi2c),
-    tx_buffer{0},
-    tx_ptr{tx_buffer},
-    rx_buffer{0},
-    rx_ptr{rx_buffer},
-    buff_mod(0),
+    tx_buffers(),
+    tx_ptr{tx_buffers.Data()},
+    rx_buffers(),
+    rx_ptr{rx_buffers.Data()},
     flags(0),
     volume(Default_Volume),
     mic_preamp(Default_Mic_Preamp)
@@ -504,8 +503,13 @@ void AudioChip::StartI2S()
 {
     // NOTE- Do not remove delay the audio chip needs time to stabilize
     HAL_Delay(20);
-    auto output =
-        HAL_I2SEx_TransmitReceive_DMA(i2s, tx_buffer, rx_buffer, constants::Total_Audio_Buffer_Sz);
+
+    // The DMA starts on the first half
+    tx_buffers.AcquireWrite();
+    rx_buffers.AcquireWrite();
+
+    auto output = HAL_I2SEx_TransmitReceive_DMA(i2s, tx_buffers.Data(), rx_buffers.Data(),
+                                                constants::Total_Audio_Buffer_Sz);
 
     if (output == HAL_OK)
     {
@@ -532,23 +536,58 @@ const uint16_t* AudioChip::RxBuffer()
 
 void AudioChip::ISRCallback()
 {
-    const uint16_t offset = buff_mod * constants::Audio_Buffer_Sz;
-    tx_ptr = tx_buffer + offset;
-    rx_ptr = rx_buffer + offset;
-    buff_mod = !buff_mod;
-
-    // Clear the transmission buffer
+    // Clear the half that just finished playing so it is silent unless
+    // the main loop writes to it
+    uint16_t* played = tx_buffers.Producing();
     for (uint16_t i = 0; i < constants::Audio_Buffer_Sz; ++i)
     {
-        tx_ptr[i] = 0;
+        played[i] = 0;
     }
 
+    // Hand the finished halves to the main loop, the DMA has moved on
+    tx_buffers.Rotate();
+    rx_buffers.Rotate();
+
     RaiseFlag(AudioFlag::Rx_Ready);
     RaiseFlag(AudioFlag::Tx_Ready);
 }
 
+bool AudioChip::AcquireBuffers()
+{
+    uint16_t* tx = tx_buffers.AcquireRead();
+    uint16_t* rx = rx_buffers.AcquireRead();
+    if (!tx || !rx)
+    {
+        if (tx)
+        {
+            tx_buffers.Release();
+        }
+        if (rx)
+        {
+            rx_buffers.Release();
+        }
+        return false;
+    }
+
+    tx_ptr = tx;
+    rx_ptr = rx;
+    return true;
+}
+
+void AudioChip::ReleaseBuffers()
+{
+    tx_buffers.Release();
+    rx_buffers.Release();
+}
+
+uint32_t AudioChip::LateFrames() const
+{
+    return rx_buffers.LateConsumers() + rx_buffers.Overruns();
+}
+
 void AudioChip::ClearTxBuffer()
 {
+    uint16_t* tx_buffer = tx_buffers.Data();
     for (uint16_t i = 0; i < constants::Total_Audio_Buffer_Sz; ++i)
     {
         tx_buffer[i] = 0;
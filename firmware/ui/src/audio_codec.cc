@@ -1,5 +1,99 @@
 #include "audio_codec.hh"
-#include <math.h>
+#include "constants.hh"
+#include <algorithm>
+#include <array>
+
+// G.711 A-law, bit exact with the ITU-T G.191 reference. Expanding is a table
+// lookup. Companding needs the segment of the sample, which is the position of
+// its top bit, from clz where the core has it and from a table of the top bits
+// where it does not.
+//
+// Heavily influenced from
+// https://en.wikipedia.org/wiki/G.711
+// https://www.ti.com/lit/an/spra634/spra634.pdf
+// https://www.cs.columbia.edu/~hgs/research/projects/NetworkAudioLibrary/nal_spring/
+
+// Every code expanded, the code has its even bits and sign inverted, then the
+// mantissa gets its leading one when the segment is above 0 and half a step
+// added, and is shifted up by the segment
+static constexpr std::array<uint16_t, 256> Expand_Table = []
+{
+    std::array<uint16_t, 256> table{};
+    for (uint32_t code = 0; code < table.size(); ++code)
+    {
+        const uint32_t bits = code ^ 0x55;
+        const uint32_t exponent = (bits & 0x70) >> 4;
+        uint32_t mantissa = bits & 0x0F;
+        if (exponent > 0)
+        {
+            mantissa += 0x10;
+        }
+        mantissa = (mantissa << 4) + 0x08;
+        if (exponent > 1)
+        {
+            mantissa <<= exponent - 1;
+        }
+        table[code] = bits & 0x80 ? mantissa : -mantissa;
+    }
+    return table;
+}();
+
+// Segment of a magnitude by its top 7 bits, below 256 is segment 0
+static constexpr std::array<uint8_t, 128> Segment_Table = []
+{
+    std::array<uint8_t, 128> table{};
+    for (uint32_t top = 1; top < table.size(); ++top)
+    {
+        uint8_t segment = 1;
+        while (top >> segment)
+        {
+            ++segment;
+        }
+        table[top] = segment;
+    }
+    return table;
+}();
+
+// Puts the code together from the sign and magnitude of a sample, negative
+// samples are taken as their one's complement like the reference does
+static inline uint8_t
+Compand(const int32_t sample, const uint32_t magnitude, const uint32_t segment)
+{
+    const uint32_t sign = sample < 0 ? 0 : 0x80;
+    const uint32_t mantissa = (magnitude >> (std::max<uint32_t>(segment, 1) + 3)) & 0x0F;
+    return (sign | (segment << 4) | mantissa) ^ 0x55;
+}
+
+uint8_t AudioCodec::ALawCompandClz(const uint16_t u_sample)
+{
+    const int32_t sample = static_cast<int16_t>(u_sample);
+    const uint32_t magnitude = sample ^ (sample >> 31);
+
+    // The top bit is at 7 or above once the low byte is filled in, which is
+    // segment 0
+    return Compand(sample, magnitude, 24 - __builtin_clz(magnitude | 0xFF));
+}
+
+uint8_t AudioCodec::ALawCompandLut(const uint16_t u_sample)
+{
+    const int32_t sample = static_cast<int16_t>(u_sample);
+    const uint32_t magnitude = sample ^ (sample >> 31);
+    return Compand(sample, magnitude, Segment_Table[magnitude >> 8]);
+}
+
+uint8_t AudioCodec::ALawCompand(const uint16_t sample)
+{
+#if defined(__ARM_FEATURE_CLZ)
+    return ALawCompandClz(sample);
+#else
+    return ALawCompandLut(sample);
+#endif
+}
+
+uint16_t AudioCodec::ALawExpand(const uint8_t sample)
+{
+    return Expand_Table[sample];
+}
 
 void AudioCodec::ALawCompand(const uint16_t* input,
                              const size_t input_len,
@@ -109,97 +203,148 @@ void AudioCodec::ALawExpand(const uint8_t* input, uint16_t* output, const size_t
     }
 }
 
-inline uint8_t AudioCodec::ALawCompand(const uint16_t u_sample)
-{
-    // Heavily influenced from
-    // https://en.wikipedia.org/wiki/G.711
-    // https://www.ti.com/lit/an/spra634/spra634.pdf
-    // https://www.cs.columbia.edu/~hgs/research/projects/NetworkAudioLibrary/nal_spring/
-
-    int16_t sample = u_sample;
+// IMA ADPCM, from the IMA Digital Audio Focus and Technical Working Groups
+// recommended practices. Each code is the difference from the last sample in
+// steps that grow while the codes are large and shrink while they are small.
+static constexpr std::array<int16_t, 89> Step_Table = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
 
-    int16_t exponent = 0;
-    uint16_t mantissa = 0;
-    uint16_t sign = 0;
+static constexpr std::array<int8_t, 8> Index_Table = {-1, -1, -1, -1, 2, 4, 6, 8};
 
-    // Get the sign
-    if (sample >= 0)
+// Moves the state on by one code. The encoder runs the same step the decoder
+// does, so it predicts from what the far end hears and not from the input.
+static inline int16_t AdpcmStep(AudioCodec::AdpcmState& state, const uint8_t code)
+{
+    const int32_t step = Step_Table[state.step_index];
+    int32_t diff = step >> 3;
+    if (code & 4)
     {
-        // Sample is positive
-        // put the sign in the 8th bit
-        sign = 0x80;
+        diff += step;
     }
-    else
+    if (code & 2)
     {
-        // Sample is negative
-        // Get the abs of the val
-        sample = -(sample + 1);
+        diff += step >> 1;
     }
-
-    // Find the first bit set in our 13 bits
-    int i = 0;
-    for (; i < 7; ++i)
+    if (code & 1)
     {
-        if ((sample << i) & 0x4000)
-        {
-            break;
-        }
+        diff += step >> 2;
     }
 
-    exponent = 7 - i;
+    const int32_t predictor = state.predictor + (code & 8 ? -diff : diff);
+    state.predictor = std::clamp<int32_t>(predictor, INT16_MIN, INT16_MAX);
+    state.step_index = std::clamp<int32_t>(state.step_index + Index_Table[code & 7], 0,
+                                           Step_Table.size() - 1);
+    return state.predictor;
+}
 
-    // Get our mantissa (abcd)
-    if (exponent == 0)
+static inline uint8_t AdpcmCode(AudioCodec::AdpcmState& state, const int16_t sample)
+{
+    int32_t diff = sample - state.predictor;
+    uint8_t code = 0;
+    if (diff < 0)
     {
-        mantissa = (sample >> 4) & 0x0F;
+        code = 8;
+        diff = -diff;
     }
-    else
+
+    int32_t step = Step_Table[state.step_index];
+    if (diff >= step)
+    {
+        code |= 4;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step)
     {
-        mantissa = (sample >> (exponent + 3)) & 0x0F;
-        // Shift the exponent to the front of output since the last 4 bits are
-        // for our bit values
-        exponent <<= 4;
+        code |= 2;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step)
+    {
+        code |= 1;
     }
 
-    // Put together and xor by 0x55;
-    return (sign + exponent + mantissa) ^ 0x55;
+    AdpcmStep(state, code);
+    return code;
 }
 
-inline uint16_t AudioCodec::ALawExpand(uint8_t sample)
+size_t AudioCodec::AdpcmEncode(const uint16_t* input,
+                               const size_t input_len,
+                               uint8_t* output,
+                               const size_t output_len,
+                               const bool input_stereo,
+                               AdpcmState& state)
 {
-    // Heavily influenced from
-    // https://en.wikipedia.org/wiki/G.711
-    // https://www.ti.com/lit/an/spra634/spra634.pdf
-    // https://www.cs.columbia.edu/~hgs/research/projects/NetworkAudioLibrary/nal_spring/
-
-    // Restore the value and invert the sign
-    sample ^= 0xD5;
-
-    // Get the first bit of the sample
-    const uint16_t sign = (sample & 0x80);
-
-    // Get bits [6:4]
-    const uint8_t exponent = (sample & 0x70) >> 4;
-
-    // Gets bits [3:0]
-    uint16_t mantissa = (sample & 0x0F) << 1;
-
-    // Some spooky m̸̹̫̅͑́a̷̺̪͑̔g̷̛͈̩̪͋͗ī̴̹c̷̲͔̈̓ ȃ̵̘͙d̶̮͘d̵̮͐͠i̷͇̔t̵̡͌̀ͅì̸̥̊o̸͈̬̾̈́n̵̤̤̈́ here that is not explained anywhere
-    if (exponent == 0)
+    if (output_len < constants::Adpcm_Header_Sz)
     {
-        mantissa = (mantissa + 0x0001) << 3;
+        return 0;
     }
-    else
+
+    // Little endian predictor then the step index
+    const uint16_t predictor = state.predictor;
+    output[0] = predictor & 0xFF;
+    output[1] = predictor >> 8;
+    output[2] = state.step_index;
+
+    // Stereo input is mixed down to mono the same as A-law does it, the
+    // first of each pair of samples goes in the low nibble
+    const size_t stride = input_stereo ? 2 : 1;
+    const size_t samples =
+        std::min(input_len / stride, (output_len - constants::Adpcm_Header_Sz) * 2);
+    uint8_t* codes = output + constants::Adpcm_Header_Sz;
+    for (size_t i = 0; i < samples; ++i)
     {
-        mantissa = (mantissa + 0x0021) << (exponent + 2);
+        const uint16_t sample = input_stereo ? input[i * 2] + input[i * 2 + 1] : input[i];
+        const uint8_t code = AdpcmCode(state, static_cast<int16_t>(sample));
+        if (i & 1)
+        {
+            codes[i / 2] |= code << 4;
+        }
+        else
+        {
+            codes[i / 2] = code;
+        }
     }
 
-    if (sign)
+    return constants::Adpcm_Header_Sz + (samples + 1) / 2;
+}
+
+bool AudioCodec::AdpcmDecode(const uint8_t* input,
+                             const size_t input_len,
+                             uint16_t* output,
+                             const size_t output_len,
+                             const bool output_stereo)
+{
+    if (input_len < constants::Adpcm_Header_Sz || input[2] >= Step_Table.size())
     {
-        return -mantissa;
+        return false;
     }
-    else
+
+    AdpcmState state;
+    state.predictor = static_cast<int16_t>(input[0] | input[1] << 8);
+    state.step_index = input[2];
+
+    const size_t stride = output_stereo ? 2 : 1;
+    const size_t samples =
+        std::min((input_len - constants::Adpcm_Header_Sz) * 2, output_len / stride);
+    const uint8_t* codes = input + constants::Adpcm_Header_Sz;
+    for (size_t i = 0; i < samples; ++i)
     {
-        return mantissa;
+        const uint8_t code = (codes[i / 2] >> ((i & 1) * 4)) & 0x0F;
+        const uint16_t sample = AdpcmStep(state, code);
+        output[i * stride] = sample;
+        if (output_stereo)
+        {
+            output[i * stride + 1] = sample;
+        }
     }
-}
\ No newline at end of file
+
+    return true;
+}
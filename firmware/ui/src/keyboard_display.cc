@@ -1,4 +1,5 @@
 #include "keyboard_display.hh"
+#include "link_packet_handler.hh"
 #include "main.h"
 #include "ui_net_link.hh"
 #include <cstring>
@@ -50,7 +51,7 @@ void HandleKeypress(Screen& screen, Keyboard& keyboard, Serial& serial, Protecto
             }
 
             UI_LOG_INFO("Transmit text message");
-            serial.Write(packet);
+            WriteNetAudio(serial, packet, Serial::TxClass::Bulk);
 
             screen.CommitText(screen.UserText(), screen.UserTextLength());
             screen.ClearUserText();
@@ -4,39 +4,68 @@
 #include "keyboard_display.hh"
 #include "link_packet_t.hh"
 #include "logger.hh"
+#include "micros.hh"
 #include "stack_debug.hh"
 #include "ui_mgmt_link.h"
 #include "ui_net_link.hh"
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <span>
 
+// Audio frames each way on the net link, see ui_net_link::AudioSeq
+static ui_net_link::AudioSeq net_audio_tx_seq = 0;
+static ui_net_link::AudioSeqCheck net_audio_rx;
+
 static void HandleAiResponse(link_packet_t* packet, AudioChip& audio)
 {
-    auto* response =
-        static_cast<ui_net_link::AIResponseChunk*>(static_cast<void*>(packet->payload.data() + 1));
+    ui_net_link::AIResponseChunk response;
+    std::span<const uint8_t> data;
+    if (!ui_net_link::ReadChunk<ui_net_link::AIResponseSchema>(
+            std::span<const uint8_t>(packet->payload.data(), packet->length), response, data))
+    {
+        UI_LOG_ERROR("AI response is the wrong size");
+        return;
+    }
 
-    switch (response->content_type)
+    switch (response.content_type)
     {
     case ui_net_link::ContentType::Audio:
     {
-        const uint16_t len = constants::Audio_Phonic_Sz < response->chunk_length
-                               ? constants::Audio_Phonic_Sz
-                               : response->chunk_length;
+        const uint16_t len =
+            constants::Audio_Phonic_Sz < data.size() ? constants::Audio_Phonic_Sz : data.size();
 
-        AudioCodec::ALawExpand(response->chunk_data, len, audio.TxBuffer(),
-                               constants::Audio_Buffer_Sz, constants::Stereo, true);
+        AudioCodec::ALawExpand(data.data(), len, audio.TxBuffer(), constants::Audio_Buffer_Sz,
+                               constants::Stereo, true);
         break;
     }
     case ui_net_link::ContentType::Json:
     {
-        response->chunk_data[response->chunk_length] = 0;
-        UI_LOG_INFO("[AI] %s", response->chunk_data);
+        UI_LOG_INFO("[AI] %.*s", static_cast<int>(data.size()),
+                    reinterpret_cast<const char*>(data.data()));
         break;
     }
     }
 }
 
+// Plays a whole frame of media audio in the codec its chunk type says
+static void
+PlayMedia(const ui_net_link::MessageType media, std::span<const uint8_t> data, AudioChip& audio)
+{
+    if (media == ui_net_link::MessageType::MediaAdpcm)
+    {
+        if (!AudioCodec::AdpcmDecode(data.data(), constants::Audio_Adpcm_Sz, audio.TxBuffer(),
+                                     constants::Audio_Buffer_Sz, true))
+        {
+            UI_LOG_ERROR("ADPCM frame has a bad header");
+        }
+        return;
+    }
+
+    AudioCodec::ALawExpand(data.data(), constants::Audio_Phonic_Sz, audio.TxBuffer(),
+                           constants::Audio_Buffer_Sz, constants::Stereo, true);
+}
+
 void ForwardToMgmt(Serial& mgmt_serial, link_packet_t* packet, const bool last)
 {
     static bool first = true;
@@ -44,17 +73,19 @@ void ForwardToMgmt(Serial& mgmt_serial, link_packet_t* packet, const bool last)
     if (first)
     {
         first = false;
-        mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::AudioStart), std::span<const uint8_t>{});
+        // Same class as the frames so it cannot be overtaken by them
+        mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::AudioStart), {},
+                          Serial::TxClass::Realtime);
     }
 
     packet->type = static_cast<uint16_t>(UiToCtl::AudioFrameUnprotected);
 
-    mgmt_serial.Write(*packet);
+    mgmt_serial.Write(*packet, Serial::TxClass::Realtime);
 
     if (last)
     {
         first = true;
-        mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::AudioEnd), std::span<const uint8_t>{});
+        mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::AudioEnd), {}, Serial::TxClass::Realtime);
     }
 }
 
@@ -62,44 +93,52 @@ void HandleQuicrPackets(Serial& mgmt_serial,
                         Protector& protector,
                         AudioChip& audio,
                         const AudioReceiveMode audio_receive_mode,
-                        link_packet_t* packet)
+                        const Serial::PacketView& view)
 {
+    // Decrypt straight out of the rx ring, the plain text is the only copy
+    static link_packet_t plain;
+    link_packet_t* packet = &plain;
+
     // Send to mgmt, and then handle locally
-    if (!protector.TryUnprotect(packet))
+    if (!protector.TryUnprotect(view.payload, packet))
     {
         UI_LOG_ERROR("Failed to decrypt ptt object");
         return;
     }
 
-    const auto message_type = static_cast<ui_net_link::MessageType>(packet->payload[1]);
+    const std::span<const uint8_t> payload(packet->payload.data(), packet->length);
+    const auto message_type = ui_net_link::ChunkType(payload);
 
     switch (message_type)
     {
     case ui_net_link::MessageType::Media:
+    case ui_net_link::MessageType::MediaAdpcm:
     {
-        ui_net_link::Chunk* audio_chunk =
-            static_cast<ui_net_link::Chunk*>(static_cast<void*>(packet->payload.data() + 1));
+        ui_net_link::Chunk chunk;
+        std::span<const uint8_t> data;
+        if (!ui_net_link::ReadChunk<ui_net_link::ChunkSchema>(payload, chunk, data)
+            || data.size() < ui_net_link::AudioSize(message_type))
+        {
+            UI_LOG_ERROR("Media chunk is the wrong size");
+            return;
+        }
 
         switch (audio_receive_mode)
         {
         case AudioReceiveMode::Ctl:
         {
-            ForwardToMgmt(mgmt_serial, packet, audio_chunk->last_chunk);
+            ForwardToMgmt(mgmt_serial, packet, chunk.last_chunk);
             break;
         }
         case AudioReceiveMode::Both:
         {
-            ForwardToMgmt(mgmt_serial, packet, audio_chunk->last_chunk);
-            AudioCodec::ALawExpand(audio_chunk->chunk_data, constants::Audio_Phonic_Sz,
-                                   audio.TxBuffer(), constants::Audio_Buffer_Sz, constants::Stereo,
-                                   true);
+            ForwardToMgmt(mgmt_serial, packet, chunk.last_chunk);
+            PlayMedia(message_type, data, audio);
             break;
         }
         case AudioReceiveMode::Headphones:
         {
-            AudioCodec::ALawExpand(audio_chunk->chunk_data, constants::Audio_Phonic_Sz,
-                                   audio.TxBuffer(), constants::Audio_Buffer_Sz, constants::Stereo,
-                                   true);
+            PlayMedia(message_type, data, audio);
             break;
         }
         default:
@@ -131,40 +170,76 @@ void HandleQuicrPackets(Serial& mgmt_serial,
     }
 }
 
+void WriteNetAudio(Serial& net_serial, const link_packet_t& packet, const Serial::TxClass tx_class)
+{
+    const ui_net_link::AudioSeq seq = net_audio_tx_seq++;
+    net_serial.Write(static_cast<uint16_t>(ui_net_link::UiToNet::AudioFrame),
+                     {{packet.payload.data(), packet.length},
+                      {reinterpret_cast<const uint8_t*>(&seq), sizeof(seq)}},
+                     tx_class);
+}
+
 void HandleNetLinkPackets(Serial& net_serial,
                           Serial& mgmt_serial,
                           Protector& protector,
                           AudioChip& audio,
-                          const AudioReceiveMode audio_receive_mode)
+                          const AudioReceiveMode audio_receive_mode,
+                          LinkRate& link_rate,
+                          link_latency::LinkLatency& link_latency)
 {
     while (true)
     {
-        link_packet_t* packet = net_serial.Read();
-        if (!packet)
+        const Serial::PacketView view = net_serial.ReadView();
+        if (!view)
         {
             return;
         }
 
-        switch (static_cast<ui_net_link::NetToUi>(packet->type))
+        switch (static_cast<ui_net_link::NetToUi>(view.type))
         {
         case ui_net_link::NetToUi::CircularPing:
         {
             // Forward to MGMT for circular path: MGMT -> NET -> UI -> MGMT
-            mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::CircularPing),
-                              std::span<const uint8_t>(packet->payload.data(), packet->length));
+            uint8_t stamp[link_latency::Stamp_Size];
+            link_latency::WriteStamp(stamp, link_latency::Hop::Ui, Micros());
+            const size_t stamp_size =
+                view.payload.size() + sizeof(stamp) <= link_packet_t::Payload_Size ? sizeof(stamp)
+                                                                                    : 0;
+            mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::CircularPing),
+                              {view.payload, {stamp, stamp_size}});
             break;
         }
         case ui_net_link::NetToUi::AudioFrame:
         {
-            HandleQuicrPackets(mgmt_serial, protector, audio, audio_receive_mode, packet);
+            Serial::PacketView audio_view = view;
+            if (!net_audio_rx.Take(audio_view.payload))
+            {
+                UI_LOG_ERROR("Audio frame too short for a sequence number");
+                break;
+            }
+            audio_view.length = audio_view.payload.size();
+
+            HandleQuicrPackets(mgmt_serial, protector, audio, audio_receive_mode, audio_view);
+            break;
+        }
+        case ui_net_link::NetToUi::LinkRate:
+        {
+            link_rate.Receive(view.payload, HAL_GetTick());
+            break;
+        }
+        case ui_net_link::NetToUi::LatencyPing:
+        {
+            link_latency.Receive(view.payload, Micros());
             break;
         }
         default:
         {
-            UI_LOG_ERROR("Unhandled packet type %d", (int)packet->type);
+            UI_LOG_ERROR("Unhandled packet type %d", (int)view.type);
             break;
         }
         }
+
+        net_serial.Release();
     }
 }
 
@@ -174,7 +249,9 @@ void HandleMgmtLinkPackets(Serial& mgmt_serial,
                            AudioChip& audio_chip,
                            UiLoopbackMode& loopback,
                            AudioTransmitMode& audio_transmit_mode,
-                           AudioReceiveMode& audio_receive_mode)
+                           AudioReceiveMode& audio_receive_mode,
+                           AudioCodecMode& audio_codec_mode,
+                           link_latency::LinkLatency& link_latency)
 {
     while (true)
     {
@@ -202,8 +279,13 @@ void HandleMgmtLinkPackets(Serial& mgmt_serial,
         case CtlToUi::CircularPing:
         {
             // Forward to NET for circular path: MGMT -> UI -> NET -> MGMT
-            net_serial.Reply(static_cast<uint16_t>(ui_net_link::UiToNet::CircularPing),
-                             std::span<const uint8_t>(packet->payload.data(), packet->length));
+            uint8_t stamp[link_latency::Stamp_Size];
+            link_latency::WriteStamp(stamp, link_latency::Hop::Ui, Micros());
+            const size_t stamp_size =
+                packet->length + sizeof(stamp) <= ui_net_link::Circular_Ping_Size ? sizeof(stamp)
+                                                                                   : 0;
+            net_serial.Write(static_cast<uint16_t>(ui_net_link::UiToNet::CircularPing),
+                             {{packet->payload.data(), packet->length}, {stamp, stamp_size}});
             break;
         }
         case CtlToUi::GetVersion:
@@ -544,26 +626,89 @@ void HandleMgmtLinkPackets(Serial& mgmt_serial,
 
             break;
         }
+        case CtlToUi::GetAudioCodec:
+        {
+            UI_LOG_INFO("Mgmt requested audio codec");
+            const uint8_t tmp = static_cast<const uint8_t>(audio_codec_mode);
+            mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::AudioCodec),
+                              std::span<const uint8_t>(&tmp, 1));
+            break;
+        }
+        case CtlToUi::SetAudioCodec:
+        {
+            if (packet->length < 1)
+            {
+                mgmt_serial.ReplyError(static_cast<uint16_t>(UiToCtl::Error),
+                                       "Missing set audio codec parameter");
+                break;
+            }
+
+            const auto mode = static_cast<AudioCodecMode>(packet->payload[0]);
+            if (mode != AudioCodecMode::Alaw && mode != AudioCodecMode::Adpcm)
+            {
+                mgmt_serial.ReplyError(static_cast<uint16_t>(UiToCtl::Error),
+                                       "Unknown audio codec");
+                break;
+            }
+
+            audio_codec_mode = mode;
+            mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::Ack), std::span<const uint8_t>{});
+            break;
+        }
         case CtlToUi::AudioFrame:
         {
-            if (packet->length < sizeof(ui_net_link::Chunk::ExpectedSize))
+            ui_net_link::Chunk chunk;
+            std::span<const uint8_t> data;
+            if (!ui_net_link::ReadChunk<ui_net_link::ChunkSchema>(
+                    std::span<const uint8_t>(packet->payload.data(), packet->length), chunk, data)
+                || data.size() < ui_net_link::AudioSize(chunk.type))
             {
                 mgmt_serial.ReplyError(static_cast<uint16_t>(UiToCtl::Error),
                                        "Audio frame is the wrong size");
                 break;
             }
 
-            ui_net_link::Chunk* audio_chunk =
-                static_cast<ui_net_link::Chunk*>(static_cast<void*>(packet->payload.data() + 1));
-            AudioCodec::ALawExpand(audio_chunk->chunk_data, constants::Audio_Phonic_Sz,
-                                   audio_chip.TxBuffer(), constants::Audio_Buffer_Sz,
-                                   constants::Stereo, true);
+            PlayMedia(chunk.type, data, audio_chip);
             break;
         }
         case CtlToUi::AudioStart:
         {
             break;
         }
+        case CtlToUi::GetLinkStats:
+        {
+            // Net link counters followed by the audio sequence counts
+            uint8_t reply[1 + Serial::StatsSchema::Size + ui_net_link::AudioCountsSchema::Size];
+            reply[0] = ui_net_link::Link_Stats_Version;
+            size_t size = 1;
+            size += Serial::StatsSchema::Write(net_serial.GetStats(), reply + size);
+            size += ui_net_link::AudioCountsSchema::Write(net_audio_rx.counts, reply + size);
+            mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::LinkStats), {{reply, size}});
+            break;
+        }
+        case CtlToUi::SetLatencyPing:
+        {
+            // Ping period in ms, 0 stops it. Starting clears the histograms.
+            if (packet->length < sizeof(uint16_t))
+            {
+                mgmt_serial.ReplyError(static_cast<uint16_t>(UiToCtl::Error),
+                                       "Missing latency ping period");
+                break;
+            }
+
+            uint16_t period_ms;
+            std::memcpy(&period_ms, packet->payload.data(), sizeof(period_ms));
+            link_latency.SetPeriod(period_ms, HAL_GetTick());
+            mgmt_serial.Reply(static_cast<uint16_t>(UiToCtl::Ack), std::span<const uint8_t>{});
+            break;
+        }
+        case CtlToUi::GetLatency:
+        {
+            const link_latency::LinkLatency::Report& report = link_latency.GetReport();
+            mgmt_serial.Write(static_cast<uint16_t>(UiToCtl::Latency),
+                              {{reinterpret_cast<const uint8_t*>(&report), sizeof(report)}});
+            break;
+        }
         default:
         {
             UI_LOG_ERROR("ERR. No handler for packet type 0x%04x", packet->type);
@@ -0,0 +1,27 @@
+#include "micros.hh"
+#include "main.h"
+
+static uint32_t last_cycles = 0;
+static uint32_t spare_cycles = 0;
+static uint32_t micros = 0;
+
+void StartMicros()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t Micros()
+{
+    // Carries the cycles left over from each call into the next, so the
+    // count does not fall behind however often it is read
+    const uint32_t cycles_per_us = SystemCoreClock / 1'000'000;
+    const uint32_t cycles = DWT->CYCCNT;
+    spare_cycles += cycles - last_cycles;
+    last_cycles = cycles;
+
+    micros += spare_cycles / cycles_per_us;
+    spare_cycles %= cycles_per_us;
+    return micros;
+}
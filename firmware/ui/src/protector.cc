@@ -57,12 +57,27 @@ catch (const std::exception& e)
 }
 
 bool Protector::TryUnprotect(link_packet_t* packet) noexcept
+{
+    return TryUnprotect({packet->payload.data(), packet->length}, packet);
+}
+
+// Decrypts payload into packet, the first byte is not encrypted and is copied
+// over as is. payload may be the packet's own payload. An empty payload has no
+// channel byte and is refused.
+bool Protector::TryUnprotect(std::span<const uint8_t> payload, link_packet_t* packet) noexcept
 try
 {
-    auto payload = mls_ctx.unprotect(
+    if (payload.empty())
+    {
+        UI_LOG_ERROR("Nothing to unprotect");
+        return false;
+    }
+
+    packet->payload[0] = payload[0];
+    auto plain = mls_ctx.unprotect(
         sframe::output_bytes{packet->payload.data(), link_packet_t::Payload_Size}.subspan(1),
-        sframe::input_bytes{packet->payload.data(), packet->length}.subspan(1), {});
-    packet->length = payload.size() + 1;
+        sframe::input_bytes{payload.data(), payload.size()}.subspan(1), {});
+    packet->length = plain.size() + 1;
     return true;
 }
 catch (const std::exception& e)
@@ -5,14 +5,27 @@
 // TODO unify into ui and net
 
 Serial::Serial(UART_HandleTypeDef* uart,
-               const uint16_t num_rx_packets,
+               uint8_t& rx_packet_buff,
+               const uint32_t rx_packet_buff_sz,
                uint8_t& tx_buff,
                const uint32_t tx_buff_sz,
+               uint8_t& realtime_tx_buff,
+               const uint32_t realtime_tx_buff_sz,
                uint8_t& rx_buff,
-               const uint32_t rx_buff_sz,
-               const bool use_slip) :
-    SerialHandler(num_rx_packets, tx_buff, tx_buff_sz, rx_buff, rx_buff_sz, Transmit, this),
-    uart(uart)
+               const uint32_t rx_buff_sz) :
+    SerialHandler(rx_packet_buff,
+                  rx_packet_buff_sz,
+                  tx_buff,
+                  tx_buff_sz,
+                  realtime_tx_buff,
+                  realtime_tx_buff_sz,
+                  rx_buff,
+                  rx_buff_sz,
+                  Transmit,
+                  this),
+    uart(uart),
+    dma_idx(0),
+    rx_pending(0)
 {
 }
 
@@ -23,7 +36,10 @@ Serial::~Serial()
 
 void Serial::StartReceive()
 {
-    HAL_UARTEx_ReceiveToIdle_DMA(uart, rx_buff, rx_buff_sz);
+    // NOTE- The DMA wraps at the ring size so the rx buffer size has to be a
+    // power of two, otherwise the ring only covers part of it.
+    dma_idx = 0;
+    HAL_UARTEx_ReceiveToIdle_DMA(uart, rx_ring.Buffer(), rx_ring.Size());
 }
 
 void Serial::Stop()
@@ -33,17 +49,9 @@ void Serial::Stop()
 
 void Serial::Reset()
 {
-    rx_write_idx = 0;
-    rx_read_idx = 0;
-
-    link_packet_t* packets = rx_packets.Buffer();
-    for (int i = 0; i < rx_packets.Size(); ++i)
-    {
-        packets[i].is_ready = false;
-    }
-
-    packet = nullptr;
-    bytes_read = 0;
+    rx_ring.Reset();
+    rx_pending = 0;
+    ResetRx();
 
     StartReceive();
 }
@@ -57,19 +65,23 @@ void Serial::ResetRecv()
     Reset();
 }
 
-void Serial::UpdateUnread(const uint16_t update)
+// NOTE- Blocks until what is already queued has gone out at the old rate
+void Serial::SetBaud(const uint32_t baud)
 {
-    // UI_LOG_INFO("unread %d, update %d", (int)unread, (int)update);
-    __disable_irq();
-    unread -= update;
-    __enable_irq();
-    // UI_LOG_INFO("unread %d", (int)unread);
+    while (!tx_free.load(std::memory_order_acquire) || !__HAL_UART_GET_FLAG(uart, UART_FLAG_TC))
+    {
+    }
+
+    Stop();
+    uart->Init.BaudRate = baud;
+    HAL_UART_Init(uart);
+    Reset();
 }
 
 void Serial::Transmit(void* arg)
 {
     Serial* self = static_cast<Serial*>(arg);
-    HAL_UART_Transmit_DMA(self->uart, self->tx_buff + self->tx_read_idx, self->num_to_send);
+    HAL_UART_Transmit_DMA(self->uart, self->tx_chunk.data(), self->tx_chunk.size());
 }
 
 const UART_HandleTypeDef* Serial::UART(Serial* serial)
@@ -84,20 +96,33 @@ void Serial::RxISR(Serial* serial, const uint16_t fifo_idx)
     // callback on your breakpoint will throw off the values and then
     // will cause the value to be at the wrong idx and everything will go
     // ka-boom, crash, plop. Overflow errors and stuff.
-    const uint16_t num_recv = fifo_idx - serial->rx_write_idx;
-    // serial->UpdateRx(num_recv);
-    serial->unread += num_recv;
-    serial->rx_write_idx += num_recv;
-    if (serial->rx_write_idx >= serial->rx_buff_sz)
+    // The DMA has already written the bytes in place, so just publish them.
+    // It calls back at half way and at the end of the buffer, so its index
+    // never passes the one from the last call.
+    const uint16_t size = serial->rx_ring.Size();
+    const uint16_t num_recv = fifo_idx - serial->dma_idx;
+    serial->dma_idx = fifo_idx & (size - 1);
+    serial->stats.rx_bytes += num_recv;
+
+    // The DMA writes over whatever is there, read or not. More bytes than the
+    // ring has free means it ran over the oldest unread ones. Only what fits
+    // is published, the rest waits so the ring's write index stays on the
+    // DMA's, and the reader resyncs past the damage.
+    uint32_t pending = serial->rx_pending + num_recv;
+    if (pending > size)
     {
-        serial->rx_write_idx = 0;
+        // Lapped the write index, only the position still matters
+        pending %= size;
     }
-
-    if (serial->unread > serial->rx_buff_sz)
+    const uint16_t free = serial->rx_ring.Free();
+    if (num_recv > 0 && serial->rx_pending + num_recv > free)
     {
-        // TODO
-        // Error("SerialStm rx isr", "Overflowed rx buffer");
+        ++serial->stats.rx_overruns;
     }
+
+    const uint16_t commit = pending < free ? pending : free;
+    serial->rx_ring.CommitWrite(commit);
+    serial->rx_pending = pending - commit;
 }
 
 void Serial::TxISR(Serial* serial)